@@ -0,0 +1,282 @@
+﻿// ImageFilters.h: общее ядро обработки изображений для LAB3 и SimplePaint
+//
+// Фильтры работают прямо по памяти изображения через ImageView (указатель, размеры,
+// шаг строки, число каналов), поэтому LAB3 передаёт память cv::Mat, а SimplePaint -
+// прямоугольник растра слоя без копирования через файлы. Порядок каналов BGR(A)
+// совпадает у обоих: cv::Mat хранит BGRA, пиксель PARGB в памяти - тоже B, G, R, A.
+//
+// Строки делятся на полосы, и полосы обрабатываются параллельно. Фильтры с окрестностью
+// (размытие, резкость) идут в два-три прохода через промежуточный буфер: полоса
+// каждого прохода читает только результат предыдущего, так что запись на место
+// не портит соседние полосы. Границы отражаются как BORDER_REFLECT_101 в OpenCV, ядра
+// Гаусса те же, что у getGaussianKernel, поэтому результаты LAB3 отличаются от прежних
+// (GaussianBlur, Laplacian, addWeighted) не больше чем на единицу округления.
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+struct ImageView {
+    uint8_t* data;
+    int width, height;
+    size_t stride;            // байт на строку
+    int channels;             // 1, 3 или 4 (B, G, R[, A])
+    bool premultiplied;       // цвет умножен на альфу: после фильтра каналы не больше альфы
+
+    uint8_t* Row(int y) const { return data + static_cast<size_t>(y) * stride; }
+};
+
+// Число потоков обработки по умолчанию
+inline int FilterThreadCount()
+{
+    unsigned count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : (count > 16 ? 16 : static_cast<int>(count));
+}
+
+// Обработка строк [0, height) полосами: process(y0, y1) в threads потоках
+template <typename Process>
+void ParallelRows(int height, int threads, Process process)
+{
+    if (threads > height) threads = height;
+    if (threads <= 1) {
+        if (height > 0) process(0, height);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (int i = 1; i < threads; i++) {
+        int y0 = static_cast<int>(static_cast<int64_t>(height) * i / threads);
+        int y1 = static_cast<int>(static_cast<int64_t>(height) * (i + 1) / threads);
+        workers.emplace_back([=]() { process(y0, y1); });
+    }
+    process(0, static_cast<int>(static_cast<int64_t>(height) / threads));
+    for (auto& worker : workers) worker.join();
+}
+
+// Индекс с отражением без повтора края (BORDER_REFLECT_101): -1 -> 1, n -> n - 2
+inline int ReflectIndex(int i, int n)
+{
+    if (n == 1) return 0;
+    int period = 2 * n - 2;
+    i %= period;
+    if (i < 0) i += period;
+    return i < n ? i : period - i;
+}
+
+// Ядро Гаусса в фиксированной точке (сумма весов - 4096), как getGaussianKernel(size, 0)
+inline std::vector<int> GaussianKernel(int size)
+{
+    static const double small[4][7] = {
+        { 1 },
+        { 0.25, 0.5, 0.25 },
+        { 0.0625, 0.25, 0.375, 0.25, 0.0625 },
+        { 0.03125, 0.109375, 0.21875, 0.28125, 0.21875, 0.109375, 0.03125 }
+    };
+
+    std::vector<double> weights(size);
+    if (size <= 7) {
+        for (int i = 0; i < size; i++) weights[i] = small[size / 2][i];
+    }
+    else {
+        double sigma = 0.3 * ((size - 1) * 0.5 - 1) + 0.8;
+        double sum = 0;
+        for (int i = 0; i < size; i++) {
+            double x = i - (size - 1) * 0.5;
+            weights[i] = std::exp(-x * x / (2 * sigma * sigma));
+            sum += weights[i];
+        }
+        for (double& weight : weights) weight /= sum;
+    }
+
+    // Остаток округления уходит в центральный вес, чтобы сумма была точной
+    std::vector<int> kernel(size);
+    int total = 0;
+    for (int i = 0; i < size; i++) {
+        kernel[i] = static_cast<int>(std::lround(weights[i] * 4096));
+        total += kernel[i];
+    }
+    kernel[size / 2] += 4096 - total;
+    return kernel;
+}
+
+// Строки изображения - в 16-битный буфер (значение * 256) после горизонтального ядра.
+// Середина строки считается сдвигами целой строки (векторизуется компилятором), края
+// с отражением - по таблице столбцов.
+inline void ConvolveRows(const ImageView& image, const std::vector<int>& kernel, uint16_t* out, int y0, int y1)
+{
+    int radius = static_cast<int>(kernel.size()) / 2;
+    int channels = image.channels;
+    int rowLength = image.width * channels;
+
+    // Смещения столбцов с отражением для окна каждого пикселя
+    std::vector<int> columns(image.width + 2 * radius);
+    for (int x = -radius; x < image.width + radius; x++) {
+        columns[x + radius] = ReflectIndex(x, image.width) * channels;
+    }
+
+    int innerLeft = radius < image.width ? radius : image.width;
+    int innerRight = image.width - radius > innerLeft ? image.width - radius : innerLeft;
+    std::vector<uint32_t> sums(rowLength);
+
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* src = image.Row(y);
+        uint16_t* dst = out + static_cast<size_t>(y) * rowLength;
+
+        int begin = innerLeft * channels, end = innerRight * channels;
+        std::fill(sums.begin() + begin, sums.begin() + end, 0u);
+        for (int k = 0; k <= 2 * radius; k++) {
+            const uint8_t* shifted = src + (k - radius) * channels;
+            uint32_t weight = kernel[k];
+            for (int i = begin; i < end; i++) sums[i] += weight * shifted[i];
+        }
+        for (int i = begin; i < end; i++) dst[i] = static_cast<uint16_t>((sums[i] + 8) >> 4);
+
+        for (int x = 0; x < image.width; x++) {
+            if (x == innerLeft) x = innerRight;
+            if (x >= image.width) break;
+            for (int c = 0; c < channels; c++) {
+                uint32_t sum = 0;
+                for (int k = 0; k <= 2 * radius; k++) {
+                    sum += kernel[k] * src[columns[x + k] + c];
+                }
+                dst[x * channels + c] = static_cast<uint16_t>((sum + 8) >> 4);
+            }
+        }
+    }
+}
+
+// Столбцы 16-битного буфера после вертикального ядра - снова в 8 бит
+inline void ConvolveColumns(const uint16_t* in, const std::vector<int>& kernel, int width, int height,
+    int channels, uint8_t* out, size_t outStride, int y0, int y1)
+{
+    int radius = static_cast<int>(kernel.size()) / 2;
+    int rowLength = width * channels;
+    std::vector<uint32_t> sums(rowLength);
+
+    for (int y = y0; y < y1; y++) {
+        std::fill(sums.begin(), sums.end(), 0u);
+        for (int k = 0; k <= 2 * radius; k++) {
+            const uint16_t* row = in + static_cast<size_t>(ReflectIndex(y + k - radius, height)) * rowLength;
+            uint32_t weight = kernel[k];
+            for (int i = 0; i < rowLength; i++) sums[i] += weight * row[i];
+        }
+
+        uint8_t* dst = out + static_cast<size_t>(y) * outStride;
+        for (int i = 0; i < rowLength; i++) {
+            uint32_t value = (sums[i] + (1u << 19)) >> 20;
+            dst[i] = static_cast<uint8_t>(value > 255 ? 255 : value);
+        }
+    }
+}
+
+// Цветовые каналы не больше альфы (premultiplied после фильтра с окрестностью)
+inline void ClampToAlpha(const ImageView& image, int y0, int y1)
+{
+    if (!image.premultiplied || image.channels != 4) return;
+    for (int y = y0; y < y1; y++) {
+        uint8_t* row = image.Row(y);
+        for (int x = 0; x < image.width; x++) {
+            uint8_t* pixel = row + x * 4;
+            for (int c = 0; c < 3; c++) {
+                if (pixel[c] > pixel[3]) pixel[c] = pixel[3];
+            }
+        }
+    }
+}
+
+// Размытие по Гауссу с ядром size x size (size нечётное) на месте
+inline void GaussianBlurImage(const ImageView& image, int size, int threads = FilterThreadCount())
+{
+    if (image.width <= 0 || image.height <= 0 || size <= 1) return;
+    if (size % 2 == 0) size++;
+
+    std::vector<int> kernel = GaussianKernel(size);
+    std::vector<uint16_t> rows(static_cast<size_t>(image.width) * image.height * image.channels);
+
+    ParallelRows(image.height, threads, [&](int y0, int y1) {
+        ConvolveRows(image, kernel, rows.data(), y0, y1);
+    });
+    ParallelRows(image.height, threads, [&](int y0, int y1) {
+        ConvolveColumns(rows.data(), kernel, image.width, image.height, image.channels, image.data, image.stride, y0, y1);
+        ClampToAlpha(image, y0, y1);
+    });
+}
+
+// Резкость по Лапласу на месте: размытие 3x3, лапласиан [2 0 2; 0 -8 0; 2 0 2]
+// размытого изображения, результат = 1.5 * исходное - 0.5 * |лапласиан|
+inline void SharpenLaplacianImage(const ImageView& image, int threads = FilterThreadCount())
+{
+    if (image.width <= 0 || image.height <= 0) return;
+
+    int channels = image.channels;
+    int rowLength = image.width * channels;
+    std::vector<int> kernel = GaussianKernel(3);
+    std::vector<uint16_t> rows(static_cast<size_t>(rowLength) * image.height);
+    std::vector<uint8_t> blurred(static_cast<size_t>(rowLength) * image.height);
+
+    ParallelRows(image.height, threads, [&](int y0, int y1) {
+        ConvolveRows(image, kernel, rows.data(), y0, y1);
+    });
+    ParallelRows(image.height, threads, [&](int y0, int y1) {
+        ConvolveColumns(rows.data(), kernel, image.width, image.height, channels, blurred.data(), rowLength, y0, y1);
+    });
+
+    // Каждый пиксель результата зависит только от своего исходного пикселя и размытого буфера
+    ParallelRows(image.height, threads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint8_t* above = &blurred[static_cast<size_t>(ReflectIndex(y - 1, image.height)) * rowLength];
+            const uint8_t* center = &blurred[static_cast<size_t>(y) * rowLength];
+            const uint8_t* below = &blurred[static_cast<size_t>(ReflectIndex(y + 1, image.height)) * rowLength];
+            uint8_t* dst = image.Row(y);
+
+            for (int x = 0; x < image.width; x++) {
+                int left = ReflectIndex(x - 1, image.width) * channels;
+                int right = ReflectIndex(x + 1, image.width) * channels;
+                for (int c = 0; c < channels; c++) {
+                    int laplacian = 2 * (above[left + c] + above[right + c] + below[left + c] + below[right + c]) -
+                        8 * center[x * channels + c];
+                    int edge = laplacian < 0 ? -laplacian : laplacian;
+                    if (edge > 255) edge = 255;
+
+                    // (3 * исходное - край) / 2 с округлением
+                    int value = 3 * dst[x * channels + c] - edge;
+                    value = value <= 0 ? 0 : (value + 1) / 2;
+                    dst[x * channels + c] = static_cast<uint8_t>(value > 255 ? 255 : value);
+                }
+            }
+        }
+        ClampToAlpha(image, y0, y1);
+    });
+}
+
+// Оттенки серого (Y = 0.299 R + 0.587 G + 0.114 B, как COLOR_BGR2GRAY) из source в target.
+// target - одноканальное изображение тех же размеров или сам source (запись на место,
+// альфа сохраняется)
+inline void GrayscaleImage(const ImageView& source, const ImageView& target, int threads = FilterThreadCount())
+{
+    if (source.width <= 0 || source.height <= 0 || source.channels < 3) return;
+
+    ParallelRows(source.height, threads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint8_t* src = source.Row(y);
+            uint8_t* dst = target.Row(y);
+            for (int x = 0; x < source.width; x++) {
+                const uint8_t* pixel = src + x * source.channels;
+                uint8_t luma = static_cast<uint8_t>((pixel[0] * 1868 + pixel[1] * 9617 + pixel[2] * 4899 + 8192) >> 14);
+                uint8_t* out = dst + x * target.channels;
+                if (target.channels == 1) {
+                    out[0] = luma;
+                }
+                else {
+                    out[0] = out[1] = out[2] = luma;
+                }
+            }
+        }
+    });
+}
@@ -1,22 +1,623 @@
-﻿#define WIN32_LEAN_AND_MEAN
+﻿// LAB2: сравнение скорости рисования GDI, GDI+ и программного растеризатора
+//
+// Одни и те же нагрузки (линии, рамки, окружности, заливки, полная переигровка
+// списка объектов) прогоняются через сменные бэкенды, и для каждой пары печатается
+// число операций в секунду и наносекунды на пиксель. Пиксели операции - её габарит
+// с учётом толщины, обрезанный по холсту: мера одна для всех бэкендов, поэтому ns/px
+// сравнимы между ними. По этим цифрам выбирается бэкенд для редакторов.
+//
+// Программный бэкенд - тот же код, что в SimplePaint: закрашенные фигуры выводятся
+// отрезками строк (ScanlineFill.h), линии и контуры - проверкой пикселей габарита
+// (SoftRaster.h). На Windows к нему добавляются GDI и GDI+ (со сглаживанием, как
+// в редакторах, и без), которые рисуют в 32-битную DIB-секцию того же размера.
+//
+// Сборка:
+//   Windows: cl /O2 /EHsc /std:c++17 LAB2.cpp
+//   Linux:   g++ -O2 -std=c++17 -pthread LAB2.cpp -o lab2-bench (только программный бэкенд)
+//
+// Использование:
+//   lab2-bench [--size WxH] [--ops N] [--min-ms M] [--seed S]
+//              [--backend NAME]... [--workload NAME]... [--csv]
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <gdiplus.h>
-#include <iostream>
-
-using namespace Gdiplus;
+#pragma comment(lib, "gdi32.lib")
 #pragma comment(lib, "gdiplus.lib")
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include "../../SimplePaint/SimplePaint/SoftRaster.h"
+#include "../../SimplePaint/SimplePaint/ScanlineFill.h"
+#include "../../SimplePaint/SimplePaintRender/BenchRandom.h"
+
+// Нагрузка: список объектов; replay - холст очищается перед каждым проходом
+struct Workload {
+    const char* name;
+    std::vector<DocObject> objects;
+    bool replay;
+    double pixels;            // сумма габаритов операций за проход
+};
+
+// Бэкенд рисует объекты в свой холст width x height
+class Backend {
+public:
+    virtual ~Backend() {}
+    virtual const char* Name() const = 0;
+    virtual bool Create(int width, int height) = 0;
+    virtual void Clear() = 0;                       // белый холст
+    virtual void Draw(const DocObject& obj) = 0;
+    virtual void Flush() {}                         // дождаться конца рисования
+    virtual const uint32_t* Pixels() const = 0;     // после Flush, строки сверху вниз
+};
+
+// Программный бэкенд: код рисования SimplePaint без GDI
+class SoftwareBackend : public Backend {
+public:
+    const char* Name() const override { return "software"; }
+
+    bool Create(int canvasWidth, int canvasHeight) override
+    {
+        width = canvasWidth;
+        height = canvasHeight;
+        pixels.assign(static_cast<size_t>(width) * height, 0xFFFFFFFF);
+        return true;
+    }
+
+    void Clear() override
+    {
+        std::fill(pixels.begin(), pixels.end(), 0xFFFFFFFFu);
+    }
+
+    void Draw(const DocObject& obj) override
+    {
+        MaskRect clip = { 0, 0, width, height };
+        int left = obj.startX < obj.endX ? obj.startX : obj.endX;
+        int top = obj.startY < obj.endY ? obj.startY : obj.endY;
+        int right = obj.startX < obj.endX ? obj.endX : obj.startX;
+        int bottom = obj.startY < obj.endY ? obj.endY : obj.startY;
+        uint32_t color = DocColorToPixel(obj.color);
+        auto span = [&](int y, int spanLeft, int spanRight) {
+            FillSpan(&pixels[static_cast<size_t>(y) * width], spanLeft, spanRight, color);
+        };
+
+        if (obj.type == DOC_FILLED_RECT) {
+            ScanRectangle(left, top, right, bottom, clip, span);
+            return;
+        }
+        if (obj.type == DOC_FILLED_ELLIPSE) {
+            ScanEllipse(left, top, right, bottom, clip, span);
+            return;
+        }
+
+        // Линии и контуры: центр каждого пикселя габарита проверяется на попадание в фигуру
+        RasterShape shape = PrepareShape(document, obj);
+        int x0 = static_cast<int>(std::floor(shape.left)), y0 = static_cast<int>(std::floor(shape.top));
+        int x1 = static_cast<int>(std::ceil(shape.right)), y1 = static_cast<int>(std::ceil(shape.bottom));
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > width) x1 = width;
+        if (y1 > height) y1 = height;
+        for (int y = y0; y < y1; y++) {
+            uint32_t* row = &pixels[static_cast<size_t>(y) * width];
+            for (int x = x0; x < x1; x++) {
+                uint32_t value;
+                if (SampleShape(shape, x + 0.5, y + 0.5, value)) row[x] = value;
+            }
+        }
+    }
+
+    const uint32_t* Pixels() const override { return pixels.data(); }
+
+private:
+    int width = 0, height = 0;
+    std::vector<uint32_t> pixels;
+    PaintDocument document;           // пустой: нагрузки не ссылаются на маски и фрагменты
+};
+
+#ifdef _WIN32
+
+// Холст GDI и GDI+ - 32-битная DIB-секция (строки сверху вниз)
+class DibBackend : public Backend {
+public:
+    ~DibBackend() override
+    {
+        if (dc) DeleteDC(dc);
+        if (bitmap) DeleteObject(bitmap);
+    }
+
+    bool Create(int canvasWidth, int canvasHeight) override
+    {
+        width = canvasWidth;
+        height = canvasHeight;
+
+        BITMAPINFO bmi = {};
+        bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        bmi.bmiHeader.biWidth = width;
+        bmi.bmiHeader.biHeight = -height;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+
+        void* data = NULL;
+        bitmap = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, &data, NULL, 0);
+        if (!bitmap) return false;
+        dc = CreateCompatibleDC(NULL);
+        SelectObject(dc, bitmap);
+        bits = static_cast<uint32_t*>(data);
+        return true;
+    }
+
+    void Clear() override
+    {
+        GdiFlush();
+        std::fill(bits, bits + static_cast<size_t>(width) * height, 0xFFFFFFFFu);
+    }
+
+    void Flush() override { GdiFlush(); }
+    const uint32_t* Pixels() const override { return bits; }
+
+protected:
+    int width = 0, height = 0;
+    HBITMAP bitmap = NULL;
+    HDC dc = NULL;
+    uint32_t* bits = NULL;
+};
+
+// GDI: перо и кисть создаются на каждую операцию, как в обработчиках рисования редакторов
+class GdiBackend : public DibBackend {
+public:
+    const char* Name() const override { return "gdi"; }
+
+    void Draw(const DocObject& obj) override
+    {
+        int left = obj.startX < obj.endX ? obj.startX : obj.endX;
+        int top = obj.startY < obj.endY ? obj.startY : obj.endY;
+        int right = obj.startX < obj.endX ? obj.endX : obj.startX;
+        int bottom = obj.startY < obj.endY ? obj.endY : obj.startY;
+
+        switch (obj.type) {
+        case DOC_PENCIL:
+        case DOC_RECTANGLE:
+        case DOC_CIRCLE:
+        {
+            HPEN pen = CreatePen(PS_SOLID, obj.thickness, obj.color);
+            HGDIOBJ oldPen = SelectObject(dc, pen);
+            HGDIOBJ oldBrush = SelectObject(dc, GetStockObject(NULL_BRUSH));
+            if (obj.type == DOC_PENCIL) {
+                MoveToEx(dc, obj.startX, obj.startY, NULL);
+                LineTo(dc, obj.endX, obj.endY);
+            }
+            else if (obj.type == DOC_RECTANGLE) {
+                Rectangle(dc, left, top, right, bottom);
+            }
+            else {
+                int size = right - left < bottom - top ? right - left : bottom - top;
+                Ellipse(dc, left, top, left + size, top + size);
+            }
+            SelectObject(dc, oldBrush);
+            SelectObject(dc, oldPen);
+            DeleteObject(pen);
+        }
+        break;
+
+        case DOC_FILLED_RECT:
+        {
+            HBRUSH brush = CreateSolidBrush(obj.color);
+            RECT rect = { left, top, right, bottom };
+            FillRect(dc, &rect, brush);
+            DeleteObject(brush);
+        }
+        break;
+
+        case DOC_FILLED_ELLIPSE:
+        {
+            HBRUSH brush = CreateSolidBrush(obj.color);
+            HGDIOBJ oldBrush = SelectObject(dc, brush);
+            HGDIOBJ oldPen = SelectObject(dc, GetStockObject(NULL_PEN));
+            // Без пера Ellipse не закрашивает правый и нижний край рамки
+            Ellipse(dc, left, top, right + 1, bottom + 1);
+            SelectObject(dc, oldPen);
+            SelectObject(dc, oldBrush);
+            DeleteObject(brush);
+        }
+        break;
+        }
+    }
+};
+
+// GDI+: один Graphics на весь прогон поверх памяти DIB-секции (PARGB, как растры
+// слоёв SimplePaint); перья и кисти - на каждую операцию, как в DrawPrimitive
+class GdiPlusBackend : public DibBackend {
+public:
+    explicit GdiPlusBackend(bool antiAlias) : smooth(antiAlias) {}
+
+    const char* Name() const override { return smooth ? "gdiplus-aa" : "gdiplus"; }
+
+    bool Create(int canvasWidth, int canvasHeight) override
+    {
+        if (!DibBackend::Create(canvasWidth, canvasHeight)) return false;
+        image.reset(new Gdiplus::Bitmap(width, height, width * static_cast<INT>(sizeof(uint32_t)),
+            PixelFormat32bppPARGB, reinterpret_cast<BYTE*>(bits)));
+        graphics.reset(new Gdiplus::Graphics(image.get()));
+        graphics->SetSmoothingMode(smooth ? Gdiplus::SmoothingModeAntiAlias : Gdiplus::SmoothingModeNone);
+        return true;
+    }
+
+    ~GdiPlusBackend() override
+    {
+        graphics.reset();
+        image.reset();
+    }
+
+    void Clear() override
+    {
+        graphics->Flush(Gdiplus::FlushIntentionSync);
+        DibBackend::Clear();
+    }
+
+    void Draw(const DocObject& obj) override
+    {
+        int left = obj.startX < obj.endX ? obj.startX : obj.endX;
+        int top = obj.startY < obj.endY ? obj.startY : obj.endY;
+        int width = (obj.startX < obj.endX ? obj.endX : obj.startX) - left;
+        int height = (obj.startY < obj.endY ? obj.endY : obj.startY) - top;
+        Gdiplus::Color color(static_cast<BYTE>(obj.color & 0xFF), static_cast<BYTE>((obj.color >> 8) & 0xFF),
+            static_cast<BYTE>((obj.color >> 16) & 0xFF));
+
+        switch (obj.type) {
+        case DOC_PENCIL:
+        {
+            Gdiplus::Pen pen(color, static_cast<Gdiplus::REAL>(obj.thickness));
+            pen.SetLineCap(Gdiplus::LineCapRound, Gdiplus::LineCapRound, Gdiplus::DashCapRound);
+            graphics->DrawLine(&pen, obj.startX, obj.startY, obj.endX, obj.endY);
+        }
+        break;
+
+        case DOC_RECTANGLE:
+        {
+            Gdiplus::Pen pen(color, static_cast<Gdiplus::REAL>(obj.thickness));
+            graphics->DrawRectangle(&pen, left, top, width, height);
+        }
+        break;
+
+        case DOC_CIRCLE:
+        {
+            Gdiplus::Pen pen(color, static_cast<Gdiplus::REAL>(obj.thickness));
+            int size = width < height ? width : height;
+            graphics->DrawEllipse(&pen, left, top, size, size);
+        }
+        break;
+
+        case DOC_FILLED_RECT:
+        {
+            Gdiplus::SolidBrush brush(color);
+            graphics->FillRectangle(&brush, left, top, width, height);
+        }
+        break;
+
+        case DOC_FILLED_ELLIPSE:
+        {
+            Gdiplus::SolidBrush brush(color);
+            graphics->FillEllipse(&brush, left, top, width, height);
+        }
+        break;
+        }
+    }
 
-int main()
+    void Flush() override
+    {
+        graphics->Flush(Gdiplus::FlushIntentionSync);
+        DibBackend::Flush();
+    }
+
+private:
+    bool smooth;
+    std::unique_ptr<Gdiplus::Bitmap> image;
+    std::unique_ptr<Gdiplus::Graphics> graphics;
+};
+
+#endif
+
+// Пиксели операции: габарит с половиной толщины, обрезанный по холсту
+double OperationPixels(const DocObject& obj, int width, int height)
+{
+    int half = obj.type == DOC_FILLED_RECT || obj.type == DOC_FILLED_ELLIPSE ? 0 : (obj.thickness + 1) / 2;
+    int left = (obj.startX < obj.endX ? obj.startX : obj.endX) - half;
+    int top = (obj.startY < obj.endY ? obj.startY : obj.endY) - half;
+    int right = (obj.startX < obj.endX ? obj.endX : obj.startX) + half + 1;
+    int bottom = (obj.startY < obj.endY ? obj.endY : obj.startY) + half + 1;
+    if (left < 0) left = 0;
+    if (top < 0) top = 0;
+    if (right > width) right = width;
+    if (bottom > height) bottom = height;
+    return right > left && bottom > top ? static_cast<double>(right - left) * (bottom - top) : 0.0;
+}
+
+DocObject MakeObject(int type, int sx, int sy, int ex, int ey, int thickness, uint32_t color)
 {
-    // Инициализация GDI+
-    GdiplusStartupInput gdiplusStartupInput;
+    DocObject obj = {};
+    obj.type = type;
+    obj.startX = sx;
+    obj.startY = sy;
+    obj.endX = ex;
+    obj.endY = ey;
+    obj.thickness = thickness;
+    obj.color = color;
+    return obj;
+}
+
+// Фигура в рамке случайного размера [8, maxSize] внутри холста
+DocObject RandomShape(BenchRandom& random, int type, int width, int height, int maxSize)
+{
+    int w = random.Range(8, maxSize), h = random.Range(8, maxSize);
+    int x = random.Range(0, width > w ? width - w : 0);
+    int y = random.Range(0, height > h ? height - h : 0);
+    return MakeObject(type, x, y, x + w, y + h, random.Range(1, 8), random.Next() & 0xFFFFFF);
+}
+
+// Нагрузки: count операций каждая; переигровка похожа на рисунок - в основном
+// штрихи карандаша из коротких отрезков, немного рамок, окружностей и заливок
+std::vector<Workload> BuildWorkloads(int width, int height, int count, uint32_t seed)
+{
+    std::vector<Workload> workloads;
+    BenchRandom random(seed);
+
+    Workload lines = { "lines", {}, false, 0 };
+    for (int i = 0; i < count; i++) {
+        int x = random.Range(0, width - 1), y = random.Range(0, height - 1);
+        lines.objects.push_back(MakeObject(DOC_PENCIL, x, y, x + random.Range(-64, 64), y + random.Range(-64, 64),
+            random.Range(1, 8), random.Next() & 0xFFFFFF));
+    }
+    workloads.push_back(lines);
+
+    Workload rectangles = { "rectangles", {}, false, 0 };
+    for (int i = 0; i < count; i++) rectangles.objects.push_back(RandomShape(random, DOC_RECTANGLE, width, height, 256));
+    workloads.push_back(rectangles);
+
+    Workload ellipses = { "ellipses", {}, false, 0 };
+    for (int i = 0; i < count; i++) ellipses.objects.push_back(RandomShape(random, DOC_CIRCLE, width, height, 256));
+    workloads.push_back(ellipses);
+
+    Workload fills = { "fills", {}, false, 0 };
+    for (int i = 0; i < count; i++) {
+        fills.objects.push_back(RandomShape(random, i % 2 ? DOC_FILLED_ELLIPSE : DOC_FILLED_RECT, width, height, 256));
+    }
+    workloads.push_back(fills);
+
+    Workload replay = { "replay", {}, true, 0 };
+    int x = width / 2, y = height / 2, thickness = 2;
+    uint32_t color = 0;
+    for (int i = 0; i < count; i++) {
+        int kind = random.Range(0, 9);
+        if (kind < 7) {
+            // Новый штрих примерно каждые 50 отрезков
+            if (random.Range(0, 49) == 0) {
+                x = random.Range(0, width - 1);
+                y = random.Range(0, height - 1);
+                thickness = random.Range(1, 8);
+                color = random.Next() & 0xFFFFFF;
+            }
+            int nx = x + random.Range(-6, 6), ny = y + random.Range(-6, 6);
+            nx = nx < 0 ? 0 : (nx >= width ? width - 1 : nx);
+            ny = ny < 0 ? 0 : (ny >= height ? height - 1 : ny);
+            replay.objects.push_back(MakeObject(DOC_PENCIL, x, y, nx, ny, thickness, color));
+            x = nx;
+            y = ny;
+        }
+        else {
+            static const int types[3] = { DOC_RECTANGLE, DOC_CIRCLE, DOC_FILLED_RECT };
+            replay.objects.push_back(RandomShape(random, types[kind - 7], width, height, 192));
+        }
+    }
+    workloads.push_back(replay);
+
+    for (auto& workload : workloads) {
+        for (const auto& obj : workload.objects) workload.pixels += OperationPixels(obj, width, height);
+    }
+    return workloads;
+}
+
+struct BenchResult {
+    int passes = 0;
+    double seconds = 0;
+    double coverage = 0;      // доля закрашенных пикселей холста после прогона
+};
+
+// Прогревочный проход, затем проходы, пока не наберётся minMs
+BenchResult RunWorkload(Backend& backend, const Workload& workload, double minMs, int width, int height)
+{
+    backend.Clear();
+    for (const auto& obj : workload.objects) backend.Draw(obj);
+    backend.Flush();
+
+    BenchResult result;
+    auto start = std::chrono::steady_clock::now();
+    do {
+        if (workload.replay) backend.Clear();
+        for (const auto& obj : workload.objects) backend.Draw(obj);
+        backend.Flush();
+        result.passes++;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (result.seconds * 1000.0 < minMs);
+
+    // Альфа GDI не учитывается: белый - любой пиксель 0x??FFFFFF
+    const uint32_t* pixels = backend.Pixels();
+    size_t painted = 0, total = static_cast<size_t>(width) * height;
+    for (size_t i = 0; i < total; i++) {
+        if ((pixels[i] & 0xFFFFFF) != 0xFFFFFF) painted++;
+    }
+    result.coverage = total ? static_cast<double>(painted) / total : 0;
+    return result;
+}
+
+std::vector<std::unique_ptr<Backend>> CreateBackends()
+{
+    std::vector<std::unique_ptr<Backend>> backends;
+    backends.emplace_back(new SoftwareBackend());
+#ifdef _WIN32
+    backends.emplace_back(new GdiBackend());
+    backends.emplace_back(new GdiPlusBackend(false));
+    backends.emplace_back(new GdiPlusBackend(true));
+#endif
+    return backends;
+}
+
+bool Selected(const std::vector<std::string>& names, const char* name)
+{
+    if (names.empty()) return true;
+    for (const auto& selected : names) {
+        if (selected == name) return true;
+    }
+    return false;
+}
+
+// Первое имя из names, которого нет среди known (nullptr - все имена известны)
+const char* UnknownName(const std::vector<std::string>& names, const std::vector<const char*>& known)
+{
+    for (const auto& name : names) {
+        bool found = false;
+        for (const char* candidate : known) {
+            if (name == candidate) found = true;
+        }
+        if (!found) return name.c_str();
+    }
+    return NULL;
+}
+
+void PrintUsage()
+{
+    std::fprintf(stderr,
+        "usage: lab2-bench [options]\n"
+        "  --size WxH       canvas size (default 1024x768)\n"
+        "  --ops N          operations per workload pass (default 2000)\n"
+        "  --min-ms M       minimum measured time per backend and workload (default 300)\n"
+        "  --seed S         workload generator seed (default 1)\n"
+        "  --backend NAME   run only this backend (repeatable): software"
+#ifdef _WIN32
+        ", gdi, gdiplus, gdiplus-aa"
+#endif
+        "\n"
+        "  --workload NAME  run only this workload (repeatable): lines, rectangles, ellipses, fills, replay\n"
+        "  --csv            comma-separated output\n");
+}
+
+int main(int argc, char** argv)
+{
+    int width = 1024, height = 768, count = 2000;
+    double minMs = 300;
+    uint32_t seed = 1;
+    bool csv = false;
+    std::vector<std::string> backendNames, workloadNames;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--size") == 0 && hasValue) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2) width = 0;
+        }
+        else if (std::strcmp(argv[i], "--ops") == 0 && hasValue) {
+            count = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--min-ms") == 0 && hasValue) {
+            minMs = std::atof(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--seed") == 0 && hasValue) {
+            seed = static_cast<uint32_t>(std::strtoul(argv[++i], NULL, 10));
+        }
+        else if (std::strcmp(argv[i], "--backend") == 0 && hasValue) {
+            backendNames.push_back(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--workload") == 0 && hasValue) {
+            workloadNames.push_back(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        }
+        else {
+            PrintUsage();
+            return 2;
+        }
+    }
+    if (width <= 0 || height <= 0 || count <= 0) {
+        PrintUsage();
+        return 2;
+    }
+
+    // Опечатка в имени или бэкенд другой платформы (gdi на Linux) - ошибка, а не пустой отчёт
+    std::vector<Workload> workloads = BuildWorkloads(width, height, count, seed);
+    std::vector<const char*> knownBackends, knownWorkloads;
+    for (const auto& backend : CreateBackends()) knownBackends.push_back(backend->Name());
+    for (const auto& workload : workloads) knownWorkloads.push_back(workload.name);
+
+    if (const char* name = UnknownName(backendNames, knownBackends)) {
+        std::fprintf(stderr, "unknown or unavailable backend: %s\n", name);
+        PrintUsage();
+        return 2;
+    }
+    if (const char* name = UnknownName(workloadNames, knownWorkloads)) {
+        std::fprintf(stderr, "unknown workload: %s\n", name);
+        PrintUsage();
+        return 2;
+    }
+
+#ifdef _WIN32
+    Gdiplus::GdiplusStartupInput gdiplusStartupInput;
     ULONG_PTR gdiplusToken;
-    GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
+    Gdiplus::GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
+#endif
+
+    int status = 0;
+    {
+        std::vector<std::unique_ptr<Backend>> backends = CreateBackends();
+
+        if (csv) {
+            std::printf("backend,workload,ops,passes,ops_per_s,ns_per_pixel,coverage\n");
+        }
+        else {
+            std::printf("canvas %dx%d, %d ops per pass, at least %.0f ms per measurement\n", width, height, count, minMs);
+            std::printf("%-11s %-11s %8s %14s %10s %9s\n", "backend", "workload", "passes", "ops/s", "ns/px", "coverage");
+        }
+
+        for (auto& backend : backends) {
+            if (!Selected(backendNames, backend->Name())) continue;
+            if (!backend->Create(width, height)) {
+                std::fprintf(stderr, "%s: cannot create a %dx%d canvas\n", backend->Name(), width, height);
+                status = 1;
+                continue;
+            }
 
-    std::cout << "GDI+ успешно инициализирован!" << std::endl;
+            for (const auto& workload : workloads) {
+                if (!Selected(workloadNames, workload.name)) continue;
 
-    // Здесь можно тестировать функции GDI+
+                BenchResult result = RunWorkload(*backend, workload, minMs, width, height);
+                double ops = static_cast<double>(workload.objects.size()) * result.passes;
+                double opsPerSecond = ops / result.seconds;
+                double nsPerPixel = result.seconds * 1e9 / (workload.pixels * result.passes);
+                if (csv) {
+                    std::printf("%s,%s,%zu,%d,%.0f,%.3f,%.4f\n", backend->Name(), workload.name,
+                        workload.objects.size(), result.passes, opsPerSecond, nsPerPixel, result.coverage);
+                }
+                else {
+                    std::printf("%-11s %-11s %8d %14.0f %10.3f %8.1f%%\n", backend->Name(), workload.name,
+                        result.passes, opsPerSecond, nsPerPixel, result.coverage * 100);
+                }
+                std::fflush(stdout);
+            }
+        }
+    }
 
-    GdiplusShutdown(gdiplusToken);
-    return 0;
-}
\ No newline at end of file
+#ifdef _WIN32
+    Gdiplus::GdiplusShutdown(gdiplusToken);
+#endif
+    return status;
+}
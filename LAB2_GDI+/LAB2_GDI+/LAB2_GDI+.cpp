@@ -6,6 +6,9 @@
 #include <windowsx.h>
 #include <commdlg.h>
 #include <vector>
+#include <string>
+#include <utility>
+#include <cstdint>
 
 // Минимальное подключение GDI+ - только то, что нужно
 #include <gdiplus.h>
@@ -41,13 +44,37 @@ int currentThickness = 2;
 COLORREF currentColor = RGB(0, 0, 0);
 int startX, startY, prevX, prevY;
 
+// Буфер рисунка: завершённые объекты уже нарисованы в нём, поэтому WM_PAINT только
+// копирует повреждённую область. Отрезки карандаша и ластика рисуются в буфер по одному,
+// а резиновая рамка прямоугольника и эллипса - только при выводе, в буфер композиции
+// поверх копии рисунка. Буферы не меньше клиентской области и при уменьшении окна
+// не сжимаются, чтобы скрытая часть рисунка сохранилась.
+// Буфер рисунка - 32-битная DIB-секция (строки сверху вниз): экспорт кодирует прямо
+// её память, без повторной отрисовки и без копии в HBITMAP.
+HDC hBackDC = NULL;
+HBITMAP hBackBitmap = NULL;
+uint32_t* backBits = NULL;
+HDC hComposeDC = NULL;
+HBITMAP hComposeBitmap = NULL;
+int backWidth = 0, backHeight = 0;
+
+// Рамка прямоугольника или эллипса, пока её тянут мышью
+DrawingObject previewObject;
+bool hasPreview = false;
+
 // Прототипы функций
 ATOM MyRegisterClass(HINSTANCE hInstance);
 BOOL InitInstance(HINSTANCE, int);
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 INT_PTR CALLBACK About(HWND, UINT, WPARAM, LPARAM);
-void DrawObject(HDC hdc, const DrawingObject& obj);
+void DrawObject(Gdiplus::Graphics& graphics, const DrawingObject& obj);
 void AddDrawingObject(int type, int sx, int sy, int ex, int ey);
+RECT GetObjectBounds(const DrawingObject& obj);
+void ResizeBackBuffer(HWND hWnd);
+void DestroyBackBuffer();
+void DrawToBackBuffer(HWND hWnd, const DrawingObject& obj);
+void SetPreview(HWND hWnd, const DrawingObject* obj);
+bool ExportBackBuffer(HWND hWnd, const WCHAR* filename, const WCHAR* format);
 int GetEncoderClsid(const WCHAR* format, CLSID* pClsid);
 
 // Точка входа
@@ -97,7 +124,8 @@ ATOM MyRegisterClass(HINSTANCE hInstance)
 {
     WNDCLASSEXW wcex;
     wcex.cbSize = sizeof(WNDCLASSEX);
-    wcex.style = CS_HREDRAW | CS_VREDRAW;
+    // Рисунок хранится в буфере: при растяжении окна обновляются только открывшиеся полосы
+    wcex.style = 0;
     wcex.lpfnWndProc = WndProc;
     wcex.cbClsExtra = 0;
     wcex.cbWndExtra = 0;
@@ -186,42 +214,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             ofn.Flags = OFN_EXPLORER | OFN_PATHMUSTEXIST | OFN_HIDEREADONLY | OFN_OVERWRITEPROMPT;
             ofn.lpstrDefExt = L"bmp";
 
-            if (GetSaveFileName(&ofn))
+            if (GetSaveFileName(&ofn) && !ExportBackBuffer(hWnd, filename, L"image/bmp"))
             {
-                // Получаем контекст устройства
-                HDC hdc = GetDC(hWnd);
-                RECT rect;
-                GetClientRect(hWnd, &rect);
-
-                // Создаем bitmap в памяти
-                HDC memDC = CreateCompatibleDC(hdc);
-                HBITMAP hBitmap = CreateCompatibleBitmap(hdc, rect.right, rect.bottom);
-                HBITMAP hOldBitmap = (HBITMAP)SelectObject(memDC, hBitmap);
-
-                // Заливаем белым
-                HBRUSH whiteBrush = CreateSolidBrush(RGB(255, 255, 255));
-                FillRect(memDC, &rect, whiteBrush);
-                DeleteObject(whiteBrush);
-
-                // Рисуем все объекты
-                for (const auto& obj : drawings)
-                {
-                    DrawObject(memDC, obj);
-                }
-
-                // Сохраняем через GDI+
-                Gdiplus::Bitmap bitmap(hBitmap, NULL);
-                CLSID clsidBmp;
-                if (GetEncoderClsid(L"image/bmp", &clsidBmp) != -1)
-                {
-                    bitmap.Save(filename, &clsidBmp, NULL);
-                }
-
-                // Очистка
-                SelectObject(memDC, hOldBitmap);
-                DeleteObject(hBitmap);
-                DeleteDC(memDC);
-                ReleaseDC(hWnd, hdc);
+                MessageBox(hWnd, L"Не удалось сохранить файл", L"Ошибка", MB_OK | MB_ICONERROR);
             }
         }
         break;
@@ -242,6 +237,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         if (currentTool == 3) // Ластик
         {
             AddDrawingObject(0, startX, startY, startX, startY);
+            DrawToBackBuffer(hWnd, drawings.back());
         }
         break;
 
@@ -251,10 +247,12 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             int currentX = GET_X_LPARAM(lParam);
             int currentY = GET_Y_LPARAM(lParam);
 
+            // Новый отрезок рисуется в буфер один раз и повреждает только свою область
             switch (currentTool)
             {
             case 0: // Карандаш
                 AddDrawingObject(0, prevX, prevY, currentX, currentY);
+                DrawToBackBuffer(hWnd, drawings.back());
                 prevX = currentX;
                 prevY = currentY;
                 break;
@@ -263,6 +261,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             {
                 DrawingObject eraser = { 0, prevX, prevY, currentX, currentY, currentThickness * 2, RGB(255, 255, 255) };
                 drawings.push_back(eraser);
+                DrawToBackBuffer(hWnd, eraser);
                 prevX = currentX;
                 prevY = currentY;
             }
@@ -270,35 +269,26 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
             case 1: // Прямоугольник
             case 2: // Эллипс
-                if (!drawings.empty() && drawings.back().type == currentTool)
-                {
-                    drawings.back().endX = currentX;
-                    drawings.back().endY = currentY;
-                }
-                else
-                {
-                    AddDrawingObject(currentTool, startX, startY, currentX, currentY);
-                }
-                break;
+            {
+                DrawingObject preview = { currentTool, startX, startY, currentX, currentY, currentThickness, currentColor };
+                SetPreview(hWnd, &preview);
+            }
+            break;
             }
-
-            InvalidateRect(hWnd, NULL, TRUE);
         }
         break;
 
     case WM_LBUTTONUP:
-        isDrawing = false;
-        if (currentTool == 1 || currentTool == 2)
+        if (isDrawing && (currentTool == 1 || currentTool == 2))
         {
             int endX = GET_X_LPARAM(lParam);
             int endY = GET_Y_LPARAM(lParam);
 
-            if (!drawings.empty() && drawings.back().type == currentTool)
-            {
-                drawings.pop_back();
-            }
+            SetPreview(hWnd, NULL);
             AddDrawingObject(currentTool, startX, startY, endX, endY);
+            DrawToBackBuffer(hWnd, drawings.back());
         }
+        isDrawing = false;
         break;
 
     case WM_PAINT:
@@ -306,25 +296,41 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         PAINTSTRUCT ps;
         HDC hdc = BeginPaint(hWnd, &ps);
 
-        // Создаем Graphics объект
-        Gdiplus::Graphics graphics(hdc);
-
-        // Белый фон
-        Gdiplus::SolidBrush whiteBrush(Gdiplus::Color(255, 255, 255, 255));
-        RECT rect;
-        GetClientRect(hWnd, &rect);
-        graphics.FillRectangle(&whiteBrush, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top);
-
-        // Рисуем все объекты
-        for (const auto& obj : drawings)
+        // Копируем из буфера только область обновления; рамка предпросмотра
+        // дорисовывается в буфере композиции, чтобы на экран попал готовый кадр
+        const RECT& rect = ps.rcPaint;
+        int width = rect.right - rect.left;
+        int height = rect.bottom - rect.top;
+        if (hBackDC && width > 0 && height > 0)
         {
-            DrawObject(hdc, obj);
+            if (hasPreview)
+            {
+                BitBlt(hComposeDC, rect.left, rect.top, width, height, hBackDC, rect.left, rect.top, SRCCOPY);
+                {
+                    Gdiplus::Graphics graphics(hComposeDC);
+                    graphics.SetClip(Gdiplus::Rect(rect.left, rect.top, width, height));
+                    DrawObject(graphics, previewObject);
+                }
+                BitBlt(hdc, rect.left, rect.top, width, height, hComposeDC, rect.left, rect.top, SRCCOPY);
+            }
+            else
+            {
+                BitBlt(hdc, rect.left, rect.top, width, height, hBackDC, rect.left, rect.top, SRCCOPY);
+            }
         }
 
         EndPaint(hWnd, &ps);
     }
     break;
 
+    case WM_ERASEBKGND:
+        // Фон не стираем: WM_PAINT закрывает всю область обновления копией буфера
+        return 1;
+
+    case WM_SIZE:
+        ResizeBackBuffer(hWnd);
+        break;
+
     case WM_CREATE:
     {
         // Создаем меню
@@ -362,6 +368,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     break;
 
     case WM_DESTROY:
+        DestroyBackBuffer();
         PostQuitMessage(0);
         break;
 
@@ -371,13 +378,11 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     return 0;
 }
 
-// Функция рисования объекта
-void DrawObject(HDC hdc, const DrawingObject& obj)
+// Функция рисования объекта (Graphics создаётся вызывающим - один на все объекты)
+void DrawObject(Gdiplus::Graphics& graphics, const DrawingObject& obj)
 {
-    Gdiplus::Graphics graphics(hdc);
-
-    // Создаем перо
-    Gdiplus::Color penColor(obj.color);
+    // Создаем перо (COLORREF - это 0x00BBGGRR, а не ARGB)
+    Gdiplus::Color penColor(GetRValue(obj.color), GetGValue(obj.color), GetBValue(obj.color));
     Gdiplus::Pen pen(penColor, (Gdiplus::REAL)obj.thickness);
 
     switch (obj.type)
@@ -399,7 +404,7 @@ void DrawObject(HDC hdc, const DrawingObject& obj)
     case 2: // Эллипс
     {
         int x = min(obj.startX, obj.endX);
-        int y = min(obj.startY, obj.startY);
+        int y = min(obj.startY, obj.endY);
         int width = abs(obj.endX - obj.startX);
         int height = abs(obj.endY - obj.startY);
         graphics.DrawEllipse(&pen, x, y, width, height);
@@ -416,31 +421,179 @@ void AddDrawingObject(int type, int sx, int sy, int ex, int ey)
     drawings.push_back(newObj);
 }
 
-// Функция для получения CLSID кодера
-int GetEncoderClsid(const WCHAR* format, CLSID* pClsid)
+// Область, которую объект может закрасить: рамка точек с запасом на толщину пера
+RECT GetObjectBounds(const DrawingObject& obj)
+{
+    int margin = obj.thickness / 2 + 2;
+    RECT rect = {
+        min(obj.startX, obj.endX) - margin, min(obj.startY, obj.endY) - margin,
+        max(obj.startX, obj.endX) + margin + 1, max(obj.startY, obj.endY) + margin + 1
+    };
+    return rect;
+}
+
+// Буферы под клиентскую область. При увеличении окна старый рисунок копируется,
+// а объекты дорисовываются только в открывшейся части
+void ResizeBackBuffer(HWND hWnd)
+{
+    RECT client;
+    GetClientRect(hWnd, &client);
+    if (client.right <= backWidth && client.bottom <= backHeight) return;
+
+    int oldWidth = backWidth, oldHeight = backHeight;
+    int newWidth = max(static_cast<int>(client.right), oldWidth);
+    int newHeight = max(static_cast<int>(client.bottom), oldHeight);
+    newWidth = max(newWidth, 1);
+    newHeight = max(newHeight, 1);
+
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = newWidth;
+    bmi.bmiHeader.biHeight = -newHeight;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    HDC hdc = GetDC(hWnd);
+    void* bits = NULL;
+    HBITMAP backBitmap = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!backBitmap)
+    {
+        ReleaseDC(hWnd, hdc);
+        return;
+    }
+    HDC backDC = CreateCompatibleDC(hdc);
+    SelectObject(backDC, backBitmap);
+
+    RECT fullRect = { 0, 0, newWidth, newHeight };
+    FillRect(backDC, &fullRect, (HBRUSH)GetStockObject(WHITE_BRUSH));
+    if (hBackDC)
+    {
+        BitBlt(backDC, 0, 0, oldWidth, oldHeight, hBackDC, 0, 0, SRCCOPY);
+    }
+
+    if (!drawings.empty())
+    {
+        Gdiplus::Graphics graphics(backDC);
+        Gdiplus::Region region(Gdiplus::Rect(0, 0, newWidth, newHeight));
+        region.Exclude(Gdiplus::Rect(0, 0, oldWidth, oldHeight));
+        graphics.SetClip(&region);
+        for (const auto& obj : drawings)
+        {
+            DrawObject(graphics, obj);
+        }
+    }
+
+    DestroyBackBuffer();
+    hBackDC = backDC;
+    hBackBitmap = backBitmap;
+    backBits = static_cast<uint32_t*>(bits);
+    hComposeDC = CreateCompatibleDC(hdc);
+    hComposeBitmap = CreateCompatibleBitmap(hdc, newWidth, newHeight);
+    SelectObject(hComposeDC, hComposeBitmap);
+    backWidth = newWidth;
+    backHeight = newHeight;
+
+    ReleaseDC(hWnd, hdc);
+}
+
+void DestroyBackBuffer()
 {
-    UINT num = 0;
-    UINT size = 0;
+    if (hBackDC) DeleteDC(hBackDC);
+    if (hBackBitmap) DeleteObject(hBackBitmap);
+    if (hComposeDC) DeleteDC(hComposeDC);
+    if (hComposeBitmap) DeleteObject(hComposeBitmap);
+    hBackDC = hComposeDC = NULL;
+    hBackBitmap = hComposeBitmap = NULL;
+    backBits = NULL;
+}
 
-    Gdiplus::GetImageEncodersSize(&num, &size);
-    if (size == 0) return -1;
+// Завершённый объект рисуется в буфер один раз; на экран выводится только его область
+void DrawToBackBuffer(HWND hWnd, const DrawingObject& obj)
+{
+    if (!hBackDC) return;
 
-    Gdiplus::ImageCodecInfo* pImageCodecInfo = (Gdiplus::ImageCodecInfo*)malloc(size);
-    if (pImageCodecInfo == NULL) return -1;
+    {
+        Gdiplus::Graphics graphics(hBackDC);
+        DrawObject(graphics, obj);
+    }
+    RECT bounds = GetObjectBounds(obj);
+    InvalidateRect(hWnd, &bounds, FALSE);
+}
 
-    Gdiplus::GetImageEncoders(num, size, pImageCodecInfo);
+// Смена рамки предпросмотра: повреждены старая и новая рамки (NULL - убрать рамку)
+void SetPreview(HWND hWnd, const DrawingObject* obj)
+{
+    if (hasPreview)
+    {
+        RECT bounds = GetObjectBounds(previewObject);
+        InvalidateRect(hWnd, &bounds, FALSE);
+    }
 
-    for (UINT j = 0; j < num; ++j)
+    hasPreview = obj != NULL;
+    if (hasPreview)
     {
-        if (wcscmp(pImageCodecInfo[j].MimeType, format) == 0)
+        previewObject = *obj;
+        RECT bounds = GetObjectBounds(previewObject);
+        InvalidateRect(hWnd, &bounds, FALSE);
+    }
+}
+
+// Экспорт видимой части рисунка: Bitmap GDI+ смотрит прямо в память DIB-секции
+// (шаг строки - ширина буфера), кодировщик читает пиксели оттуда же
+bool ExportBackBuffer(HWND hWnd, const WCHAR* filename, const WCHAR* format)
+{
+    RECT client;
+    GetClientRect(hWnd, &client);
+    int width = min(static_cast<int>(client.right), backWidth);
+    int height = min(static_cast<int>(client.bottom), backHeight);
+    if (!backBits || width <= 0 || height <= 0) return false;
+
+    CLSID encoder;
+    if (GetEncoderClsid(format, &encoder) == -1) return false;
+
+    // Отложенные вызовы GDI должны дойти до памяти буфера
+    GdiFlush();
+    Gdiplus::Bitmap bitmap(width, height, backWidth * static_cast<INT>(sizeof(uint32_t)),
+        PixelFormat32bppRGB, reinterpret_cast<BYTE*>(backBits));
+    return bitmap.Save(filename, &encoder, NULL) == Gdiplus::Ok;
+}
+
+// Функция для получения CLSID кодера. Список кодировщиков GDI+ не меняется за время
+// работы, поэтому запрашивается один раз, при первом вызове
+int GetEncoderClsid(const WCHAR* format, CLSID* pClsid)
+{
+    static std::vector<std::pair<std::wstring, CLSID>> encoders;
+    static bool loaded = false;
+
+    if (!loaded)
+    {
+        UINT num = 0;
+        UINT size = 0;
+
+        Gdiplus::GetImageEncodersSize(&num, &size);
+        if (size == 0) return -1;
+
+        Gdiplus::ImageCodecInfo* pImageCodecInfo = (Gdiplus::ImageCodecInfo*)malloc(size);
+        if (pImageCodecInfo == NULL) return -1;
+
+        Gdiplus::GetImageEncoders(num, size, pImageCodecInfo);
+        for (UINT j = 0; j < num; ++j)
         {
-            *pClsid = pImageCodecInfo[j].Clsid;
-            free(pImageCodecInfo);
-            return j;
+            encoders.push_back({ pImageCodecInfo[j].MimeType, pImageCodecInfo[j].Clsid });
         }
+        free(pImageCodecInfo);
+        loaded = true;
     }
 
-    free(pImageCodecInfo);
+    for (size_t j = 0; j < encoders.size(); ++j)
+    {
+        if (encoders[j].first == format)
+        {
+            *pClsid = encoders[j].second;
+            return static_cast<int>(j);
+        }
+    }
     return -1;
 }
 
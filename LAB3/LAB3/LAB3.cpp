@@ -3,12 +3,41 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <set>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+
+#include "../../ImageCore/ImageFilters.h"
 
 using namespace cv;
 using namespace std;
 
+// Память 8-битного изображения для общего ядра фильтров (ImageCore) без копирования
+bool makeImageView(Mat& image, ImageView& view) {
+    if (image.depth() != CV_8U || image.channels() > 4 || image.channels() == 2) {
+        return false;
+    }
+    view = { image.data, image.cols, image.rows, image.step[0], image.channels(), false };
+    return true;
+}
+
 // Функция для увеличения резкости на основе алгоритма Лапласа
-void sharpenImageLaplacian(const Mat& input, Mat& output) {
+void sharpenImageLaplacian(const Mat& input, Mat& output, int threads = FilterThreadCount()) {
+    // Обычные 8-битные изображения обрабатываются общим ядром параллельно по полосам строк
+    Mat result = input.clone();
+    ImageView view;
+    if (makeImageView(result, view)) {
+        SharpenLaplacianImage(view, threads);
+        output = result;
+        return;
+    }
+
     Mat blurred, laplacian;
 
     // Сначала немного размываем изображение чтобы убрать шум
@@ -25,7 +54,15 @@ void sharpenImageLaplacian(const Mat& input, Mat& output) {
 }
 
 // Функция для сглаживания GaussianBlur
-void applyGaussianBlur(const Mat& input, Mat& output, int kernelSize) {
+void applyGaussianBlur(const Mat& input, Mat& output, int kernelSize, int threads = FilterThreadCount()) {
+    Mat result = input.clone();
+    ImageView view;
+    if (makeImageView(result, view)) {
+        GaussianBlurImage(view, kernelSize, threads);
+        output = result;
+        return;
+    }
+
     // Применяем размытие по Гауссу с заданным размером ядра
     GaussianBlur(input, output, Size(kernelSize, kernelSize), 0);
 }
@@ -133,7 +170,18 @@ void combineImages(const vector<Mat>& images, Mat& output) {
 }
 
 // Функция для преобразования в оттенки серого
-void convertToGrayscale(const Mat& input, Mat& output) {
+void convertToGrayscale(const Mat& input, Mat& output, int threads = FilterThreadCount()) {
+    // Цветное 8-битное изображение переводится общим ядром сразу в одноканальное
+    Mat source = input;
+    ImageView sourceView;
+    if (input.channels() >= 3 && makeImageView(source, sourceView)) {
+        Mat gray(input.rows, input.cols, CV_8UC1);
+        ImageView grayView = { gray.data, gray.cols, gray.rows, gray.step[0], 1, false };
+        GrayscaleImage(sourceView, grayView, threads);
+        output = gray;
+        return;
+    }
+
     // Преобразуем цветное изображение в черно-белое
     if (input.channels() == 3) {
         cvtColor(input, output, COLOR_BGR2GRAY);
@@ -148,12 +196,297 @@ void convertToGrayscale(const Mat& input, Mat& output) {
     }
 }
 
-int main() {
+// Пакетный режим: LAB3 <входы...> --op <операция> [--op ...] --out <папка>
+//
+// Входы - файлы, папки (все изображения в папке) и шаблоны с * и ? в имени файла.
+// Каждое изображение - отдельное задание: загрузка, цепочка операций по порядку и
+// сохранение в выходную папку под тем же именем. Задания разбирают потоки пула по
+// одному, пока список не кончится; фильтры внутри задания однопоточные, чтобы потоки
+// пула не делили ядра с полосами ParallelRows.
+
+// Операция пакетного режима и её параметр (размер ядра для размытия)
+struct BatchOperation {
+    string name;
+    int parameter;
+};
+
+struct BatchJob {
+    string input;
+    string output;
+};
+
+// Расширения, которые берутся из папок и шаблонов
+bool isImageFile(const filesystem::path& path) {
+    static const char* extensions[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".webp" };
+    string extension = path.extension().string();
+    for (auto& c : extension) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    for (const char* known : extensions) {
+        if (extension == known) return true;
+    }
+    return false;
+}
+
+// Разбор операции: sharpen, blur[=размер], add-alpha, remove-alpha, gray
+bool parseOperation(const string& text, BatchOperation& operation) {
+    size_t equals = text.find('=');
+    operation.name = text.substr(0, equals);
+    operation.parameter = 0;
+
+    if (operation.name == "blur") {
+        operation.parameter = equals == string::npos ? 5 : atoi(text.c_str() + equals + 1);
+        if (operation.parameter <= 0) return false;
+        // Ядро должно быть нечетным
+        if (operation.parameter % 2 == 0) operation.parameter++;
+        return true;
+    }
+    return equals == string::npos && (operation.name == "sharpen" || operation.name == "add-alpha" ||
+        operation.name == "remove-alpha" || operation.name == "gray");
+}
+
+// Путь без "..", "." и ссылок, чтобы один и тот же файл сравнивался как одна строка
+string canonicalPath(const filesystem::path& path) {
+    error_code error;
+    filesystem::path canonical = filesystem::weakly_canonical(path, error);
+    return (error ? path : canonical).string();
+}
+
+// Файлы по входам командной строки без повторов; ошибки входов - в errors
+vector<string> collectInputs(const vector<string>& inputs, vector<string>& errors) {
+    vector<string> files;
+    set<string> seen;
+    auto add = [&](const filesystem::path& path) {
+        if (seen.insert(canonicalPath(path)).second) {
+            files.push_back(path.string());
+        }
+    };
+
+    for (const auto& input : inputs) {
+        error_code error;
+        if (input.find_first_of("*?") != string::npos) {
+            // Шаблон в имени файла; glob OpenCV бросает исключение, если папки нет
+            vector<String> matches;
+            try {
+                cv::glob(input, matches, false);
+            }
+            catch (const cv::Exception&) {
+                matches.clear();
+            }
+            size_t before = files.size();
+            for (const auto& match : matches) {
+                if (isImageFile(match)) add(filesystem::path(match));
+            }
+            if (files.size() == before) errors.push_back(input + ": нет подходящих файлов");
+        }
+        else if (filesystem::is_directory(input, error)) {
+            vector<filesystem::path> entries;
+            for (const auto& entry : filesystem::directory_iterator(input, error)) {
+                if (entry.is_regular_file(error) && isImageFile(entry.path())) entries.push_back(entry.path());
+            }
+            // Порядок обхода папки не определен - сортируем для повторяемости
+            sort(entries.begin(), entries.end());
+            for (const auto& entry : entries) add(entry);
+        }
+        else if (filesystem::is_regular_file(input, error)) {
+            add(filesystem::path(input));
+        }
+        else {
+            errors.push_back(input + ": файл не найден");
+        }
+    }
+    return files;
+}
+
+// Цепочка операций над изображением; false - операция неприменима
+bool applyOperations(Mat& image, const vector<BatchOperation>& operations, string& error) {
+    for (const auto& operation : operations) {
+        Mat result;
+        if (operation.name == "sharpen") {
+            sharpenImageLaplacian(image, result, 1);
+        }
+        else if (operation.name == "blur") {
+            applyGaussianBlur(image, result, operation.parameter, 1);
+        }
+        else if (operation.name == "add-alpha") {
+            addAlphaChannel(image, result);
+        }
+        else if (operation.name == "remove-alpha") {
+            removeAlphaChannel(image, result);
+        }
+        else if (operation.name == "gray") {
+            convertToGrayscale(image, result, 1);
+        }
+        if (result.empty()) {
+            error = operation.name + ": пустой результат";
+            return false;
+        }
+        image = result;
+    }
+    return true;
+}
+
+void printBatchUsage() {
+    cerr << "Использование: LAB3 <файл|папка|шаблон>... --op <операция> [--op ...] --out <папка>\n"
+        << "  [--threads N] [--format расширение]\n"
+        << "Операции выполняются по порядку:\n"
+        << "  sharpen        увеличение резкости (алгоритм Лапласа)\n"
+        << "  blur[=N]       сглаживание GaussianBlur с ядром N (по умолчанию 5)\n"
+        << "  add-alpha      добавление альфа канала\n"
+        << "  remove-alpha   удаление альфа канала\n"
+        << "  gray           преобразование в оттенки серого\n"
+        << "Без аргументов запускается интерактивное меню." << endl;
+}
+
+int runBatch(int argc, char** argv) {
+    vector<string> inputs;
+    vector<BatchOperation> operations;
+    string outputFolder, format;
+    int threads = static_cast<int>(thread::hardware_concurrency());
+    if (threads <= 0) threads = 1;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--op") == 0 && hasValue) {
+            BatchOperation operation;
+            if (!parseOperation(argv[++i], operation)) {
+                cerr << "Неизвестная операция: " << argv[i] << endl;
+                printBatchUsage();
+                return 2;
+            }
+            operations.push_back(operation);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && hasValue) {
+            outputFolder = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && hasValue) {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--format") == 0 && hasValue) {
+            format = argv[++i];
+            if (!format.empty() && format[0] != '.') format = "." + format;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            printBatchUsage();
+            return 2;
+        }
+        else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if (inputs.empty() || operations.empty() || outputFolder.empty() || threads <= 0) {
+        printBatchUsage();
+        return 2;
+    }
+
+    vector<string> failures;
+    vector<string> files = collectInputs(inputs, failures);
+
+    error_code error;
+    filesystem::create_directories(outputFolder, error);
+    if (!filesystem::is_directory(outputFolder, error)) {
+        cerr << "Ошибка: не удалось создать папку " << outputFolder << endl;
+        return 1;
+    }
+
+    // Выходные имена: одинаковые имена из разных папок получают номер (name_2.png).
+    // Номер получает и имя, совпадающее с одним из входных файлов (--out указывает
+    // на папку с исходниками): иначе результат затер бы еще не прочитанный вход
+    vector<BatchJob> jobs;
+    set<string> sources, outputs;
+    for (const auto& file : files) sources.insert(canonicalPath(file));
+    auto taken = [&](const filesystem::path& output) {
+        string canonical = canonicalPath(output);
+        return sources.count(canonical) > 0 || !outputs.insert(canonical).second;
+    };
+    for (const auto& file : files) {
+        filesystem::path input(file);
+        string extension = format.empty() ? input.extension().string() : format;
+        filesystem::path output = filesystem::path(outputFolder) / (input.stem().string() + extension);
+        for (int n = 2; taken(output); n++) {
+            output = filesystem::path(outputFolder) / (input.stem().string() + "_" + to_string(n) + extension);
+        }
+        jobs.push_back({ file, output.string() });
+    }
+
+    if (!jobs.empty() && threads > static_cast<int>(jobs.size())) threads = static_cast<int>(jobs.size());
+    // OpenCV тоже распараллеливает свои функции - в пакетном режиме потоки дает пул
+    cv::setNumThreads(1);
+
+    atomic<size_t> nextJob(0);
+    atomic<size_t> done(0);
+    atomic<long long> pixels(0);
+    mutex failuresMutex;
+
+    auto worker = [&]() {
+        for (;;) {
+            size_t index = nextJob++;
+            if (index >= jobs.size()) break;
+            const BatchJob& job = jobs[index];
+
+            string message;
+            try {
+                // IMREAD_UNCHANGED сохраняет альфа-канал, как в интерактивном режиме
+                Mat image = imread(job.input, IMREAD_UNCHANGED);
+                if (image.empty()) {
+                    message = "не удалось загрузить изображение";
+                }
+                else {
+                    long long imagePixels = static_cast<long long>(image.cols) * image.rows;
+                    if (applyOperations(image, operations, message)) {
+                        if (imwrite(job.output, image)) {
+                            pixels += imagePixels;
+                            done++;
+                        }
+                        else {
+                            message = "не удалось сохранить " + job.output;
+                        }
+                    }
+                }
+            }
+            catch (const cv::Exception& e) {
+                message = e.what();
+            }
+            catch (const exception& e) {
+                // bad_alloc на огромном изображении и т.п. - ошибка этого файла, а не всего пакета
+                message = string("исключение: ") + e.what();
+            }
+
+            if (!message.empty()) {
+                lock_guard<mutex> lock(failuresMutex);
+                failures.push_back(job.input + ": " + message);
+            }
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (int i = 1; i < threads; i++) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (const auto& failure : failures) {
+        cerr << "Ошибка: " << failure << endl;
+    }
+    cout << "Обработано: " << done << " из " << jobs.size() << ", ошибок: " << failures.size()
+        << ", потоков: " << threads << endl;
+    if (seconds > 0 && done > 0) {
+        cout << "Время: " << seconds << " с, " << done / seconds << " изобр./с, "
+            << pixels / seconds / 1e6 << " Мпикс/с" << endl;
+    }
+    return failures.empty() ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
     // Отключаем лишние сообщения OpenCV в консоли
     cv::utils::logging::setLogLevel(cv::utils::logging::LOG_LEVEL_ERROR);
 
     setlocale(LC_ALL, "Russian");
 
+    // С аргументами - пакетный режим без окон и вопросов
+    if (argc > 1) {
+        return runBatch(argc, argv);
+    }
+
     string inputFilename, outputFilename;
 
     cout << "Введите имя файла для загрузки: ";
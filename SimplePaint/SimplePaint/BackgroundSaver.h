@@ -0,0 +1,53 @@
+﻿// BackgroundSaver.h: сохранение файла в отдельном потоке
+//
+// Рисующий поток готовит снимок документа - копию, которую после передачи никто не
+// меняет, - и отдаёт задание сохранения потоку. Поток кодирует и пишет файл, о ходе
+// работы сообщает через progress(percent), а по окончании вызывает done(ok). Оба
+// вызова приходят из потока сохранения, поэтому окно в них только ставит сообщения
+// в очередь (PostMessage). Правки, сделанные после снимка, в файл не попадают.
+// Одновременно выполняется одно сохранение.
+
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <functional>
+
+class BackgroundSaver {
+public:
+    typedef std::function<void(int)> Progress;
+    typedef std::function<bool(const Progress&)> Job;
+
+    BackgroundSaver() : busy(false) {}
+    ~BackgroundSaver() { Wait(); }
+
+    BackgroundSaver(const BackgroundSaver&) = delete;
+    BackgroundSaver& operator=(const BackgroundSaver&) = delete;
+
+    bool Busy() const { return busy; }
+
+    // Запуск задания; false - предыдущее сохранение ещё не закончилось
+    bool Start(Job job, Progress progress, std::function<void(bool)> done)
+    {
+        if (busy) return false;
+        Wait();
+
+        busy = true;
+        worker = std::thread([this, job, progress, done]() {
+            bool ok = job(progress);
+            busy = false;
+            done(ok);
+        });
+        return true;
+    }
+
+    // Ожидание конца текущего сохранения
+    void Wait()
+    {
+        if (worker.joinable()) worker.join();
+    }
+
+private:
+    std::thread worker;
+    std::atomic<bool> busy;
+};
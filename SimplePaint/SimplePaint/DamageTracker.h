@@ -0,0 +1,93 @@
+﻿// DamageTracker.h: накопление "грязных" прямоугольников холста между кадрами
+//
+// Каждое изменение (сегмент штриха, предпросмотр фигуры, маркеры, рамка выделения,
+// смена лупы) сообщает точный прямоугольник. Трекер сливает пересекающиеся и близкие
+// прямоугольники и держит список небольшим, чтобы перерисовывались только они.
+
+#pragma once
+
+#include <vector>
+
+class DamageTracker {
+public:
+    explicit DamageTracker(size_t maxRects = 8) : maxRects(maxRects) {}
+
+    // Добавление прямоугольника (пустые игнорируются)
+    void Add(const RECT& rect)
+    {
+        if (rect.right <= rect.left || rect.bottom <= rect.top) return;
+
+        RECT merged = rect;
+
+        // Поглощаем все прямоугольники, слияние с которыми почти не добавляет лишней площади
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 0; i < rects.size(); i++) {
+                if (ShouldMerge(merged, rects[i])) {
+                    merged = Union(merged, rects[i]);
+                    rects.erase(rects.begin() + i);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        rects.push_back(merged);
+
+        // Список переполнен - сливаем пару с наименьшим приростом площади
+        while (rects.size() > maxRects) {
+            size_t bestA = 0, bestB = 1;
+            long long bestWaste = -1;
+            for (size_t a = 0; a < rects.size(); a++) {
+                for (size_t b = a + 1; b < rects.size(); b++) {
+                    long long waste = Area(Union(rects[a], rects[b])) - Area(rects[a]) - Area(rects[b]);
+                    if (bestWaste < 0 || waste < bestWaste) {
+                        bestWaste = waste;
+                        bestA = a;
+                        bestB = b;
+                    }
+                }
+            }
+            rects[bestA] = Union(rects[bestA], rects[bestB]);
+            rects.erase(rects.begin() + bestB);
+        }
+    }
+
+    void Clear() { rects.clear(); }
+    bool Empty() const { return rects.empty(); }
+    const std::vector<RECT>& Rects() const { return rects; }
+
+    // Суммарная площадь накопленных прямоугольников в пикселях
+    long long TotalArea() const
+    {
+        long long total = 0;
+        for (const auto& r : rects) total += Area(r);
+        return total;
+    }
+
+    static long long Area(const RECT& r)
+    {
+        return static_cast<long long>(r.right - r.left) * (r.bottom - r.top);
+    }
+
+    static RECT Union(const RECT& a, const RECT& b)
+    {
+        RECT r;
+        r.left = min(a.left, b.left);
+        r.top = min(a.top, b.top);
+        r.right = max(a.right, b.right);
+        r.bottom = max(a.bottom, b.bottom);
+        return r;
+    }
+
+private:
+    // Сливаем, если объединение лишь немного больше суммы площадей
+    static bool ShouldMerge(const RECT& a, const RECT& b)
+    {
+        long long unionArea = Area(Union(a, b));
+        return unionArea <= (Area(a) + Area(b)) * 5 / 4 + 64;
+    }
+
+    std::vector<RECT> rects;
+    size_t maxRects;
+};
@@ -0,0 +1,401 @@
+﻿// DrawingStore.h: компактное колоночное хранилище объектов рисования
+//
+// Каждый объект хранится "по столбцам" (structure-of-arrays):
+//   тип, флаги, толщина            - по 1 байту
+//   индекс цвета в палитре         - 2 байта
+//   индекс записи обрезки          - 2 байта (0 - обрезки нет); запись - прямоугольник
+//                                    выделения и, для выделения произвольной формы, номер маски
+//   startX, startY, dx, dy         - по 2 байта (конец = начало + смещение)
+// Итого 15 байт на объект вместо 56 байт структуры DrawingObject.
+// Координаты, не помещающиеся в int16, уходят в отдельную таблицу (флаг STORE_FLAG_WIDE).
+// Записи, освобождённые при возврате объекта в int16 или при pop_back, занимаются снова.
+// Когда таблица обрезки заполнена (0xFFFE записей), индекс STORE_CLIP_OWN означает, что
+// у объекта собственная запись обрезки в разреженной таблице ownClips.
+// Данные объекта (номер вставленного фрагмента и т.п.) есть лишь у немногих объектов,
+// поэтому хранятся разреженно: пары (индекс объекта, значение), упорядоченные по индексу.
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+
+// Структура для объектов рисования (распакованная запись)
+struct DrawingObject {
+    int type;
+    int startX, startY, endX, endY;
+    int thickness;
+    COLORREF color;
+    bool isSelected;
+    int brushShape;
+    bool wasDrawnWithSelection;
+    RECT selectionRect;
+    uint32_t selectionMask; // номер маски выделения (0 - выделение прямоугольное)
+    uint32_t payload;      // номер записи в таблице ресурсов документа (0, если не нужен)
+};
+
+// Битовые флаги объекта
+const uint8_t STORE_FLAG_SHAPE_MASK = 0x07; // форма кисти (0..4)
+const uint8_t STORE_FLAG_SELECTED = 0x08;
+const uint8_t STORE_FLAG_WIDE = 0x10;       // координаты лежат в таблице wideCoords
+const uint8_t STORE_FLAG_PAYLOAD = 0x20;    // у объекта есть запись в таблице payloads
+
+// Индекс обрезки: запись лежит не в общей таблице clipRects, а в ownClips
+const uint16_t STORE_CLIP_OWN = 0xFFFF;
+
+class DrawingStore;
+
+// Лёгкое представление объекта внутри хранилища (ничего не распаковывает заранее)
+class DrawingRef {
+public:
+    DrawingRef(const DrawingStore* store, size_t index) : store(store), idx(index) {}
+
+    size_t index() const { return idx; }
+    int type() const;
+    int startX() const;
+    int startY() const;
+    int endX() const;
+    int endY() const;
+    int thickness() const;
+    COLORREF color() const;
+    bool isSelected() const;
+    int brushShape() const;
+    bool wasDrawnWithSelection() const;
+    RECT selectionRect() const;
+    uint32_t selectionMask() const;
+    uint32_t payload() const;
+
+private:
+    const DrawingStore* store;
+    size_t idx;
+};
+
+class DrawingStore {
+public:
+    class const_iterator {
+    public:
+        const_iterator(const DrawingStore* store, size_t index) : store(store), idx(index) {}
+        DrawingRef operator*() const { return DrawingRef(store, idx); }
+        const_iterator& operator++() { ++idx; return *this; }
+        bool operator!=(const const_iterator& other) const { return idx != other.idx; }
+        bool operator==(const const_iterator& other) const { return idx == other.idx; }
+
+    private:
+        const DrawingStore* store;
+        size_t idx;
+    };
+
+    size_t size() const { return types.size(); }
+    bool empty() const { return types.empty(); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+    DrawingRef operator[](size_t i) const { return DrawingRef(this, i); }
+    DrawingRef back() const { return DrawingRef(this, size() - 1); }
+
+    void reserve(size_t count)
+    {
+        types.reserve(count);
+        flags.reserve(count);
+        thicknesses.reserve(count);
+        colorIndex.reserve(count);
+        clipIndex.reserve(count);
+        x0.reserve(count);
+        y0.reserve(count);
+        dx.reserve(count);
+        dy.reserve(count);
+    }
+
+    void push_back(const DrawingObject& obj)
+    {
+        uint8_t f = static_cast<uint8_t>(obj.brushShape) & STORE_FLAG_SHAPE_MASK;
+        if (obj.isSelected) f |= STORE_FLAG_SELECTED;
+        if (obj.payload != 0) f |= STORE_FLAG_PAYLOAD;
+
+        types.push_back(static_cast<uint8_t>(obj.type));
+        flags.push_back(f);
+        thicknesses.push_back(static_cast<uint8_t>(obj.thickness < 0 ? 0 : (obj.thickness > 255 ? 255 : obj.thickness)));
+        colorIndex.push_back(InternColor(obj.color));
+        clipIndex.push_back(obj.wasDrawnWithSelection ? InternClip(obj.selectionRect, obj.selectionMask) : 0);
+        if (clipIndex.back() == STORE_CLIP_OWN) {
+            ownClips.push_back({ static_cast<uint32_t>(size() - 1), { obj.selectionRect, obj.selectionMask } });
+        }
+        x0.push_back(0);
+        y0.push_back(0);
+        dx.push_back(0);
+        dy.push_back(0);
+
+        SetCoords(size() - 1, obj.startX, obj.startY, obj.endX, obj.endY);
+
+        if (obj.payload != 0) {
+            payloads.push_back({ static_cast<uint32_t>(size() - 1), obj.payload });
+        }
+    }
+
+    void pop_back()
+    {
+        if (empty()) return;
+        if (flags.back() & STORE_FLAG_PAYLOAD) payloads.pop_back();
+        if (clipIndex.back() == STORE_CLIP_OWN) ownClips.pop_back();
+        if (flags.back() & STORE_FLAG_WIDE) freeWideSlots.push_back(WideSlot(size() - 1));
+        types.pop_back();
+        flags.pop_back();
+        thicknesses.pop_back();
+        colorIndex.pop_back();
+        clipIndex.pop_back();
+        x0.pop_back();
+        y0.pop_back();
+        dx.pop_back();
+        dy.pop_back();
+    }
+
+    void clear()
+    {
+        types.clear();
+        flags.clear();
+        thicknesses.clear();
+        colorIndex.clear();
+        clipIndex.clear();
+        x0.clear();
+        y0.clear();
+        dx.clear();
+        dy.clear();
+        wideCoords.clear();
+        freeWideSlots.clear();
+        palette.clear();
+        paletteLookup.clear();
+        clipRects.clear();
+        ownClips.clear();
+        payloads.clear();
+    }
+
+    // Изменение координат объекта (перемещение и изменение размера)
+    void SetCoords(size_t i, int sx, int sy, int ex, int ey)
+    {
+        int ddx = ex - sx;
+        int ddy = ey - sy;
+
+        if (FitsInt16(sx) && FitsInt16(sy) && FitsInt16(ddx) && FitsInt16(ddy)) {
+            if (flags[i] & STORE_FLAG_WIDE) freeWideSlots.push_back(WideSlot(i));
+            flags[i] &= static_cast<uint8_t>(~STORE_FLAG_WIDE);
+            x0[i] = static_cast<int16_t>(sx);
+            y0[i] = static_cast<int16_t>(sy);
+            dx[i] = static_cast<int16_t>(ddx);
+            dy[i] = static_cast<int16_t>(ddy);
+            return;
+        }
+
+        // Широкие координаты: в x0/y0 хранится номер записи в wideCoords
+        uint32_t slot;
+        if (flags[i] & STORE_FLAG_WIDE) {
+            slot = WideSlot(i);
+        }
+        else if (!freeWideSlots.empty()) {
+            slot = freeWideSlots.back();
+            freeWideSlots.pop_back();
+        }
+        else {
+            slot = static_cast<uint32_t>(wideCoords.size() / 4);
+            wideCoords.resize(wideCoords.size() + 4);
+        }
+        flags[i] |= STORE_FLAG_WIDE;
+        x0[i] = static_cast<int16_t>(slot & 0xFFFF);
+        y0[i] = static_cast<int16_t>(slot >> 16);
+        wideCoords[slot * 4 + 0] = sx;
+        wideCoords[slot * 4 + 1] = sy;
+        wideCoords[slot * 4 + 2] = ex;
+        wideCoords[slot * 4 + 3] = ey;
+    }
+
+    // Полная распаковка объекта (нужна только для редких операций)
+    DrawingObject Unpack(size_t i) const
+    {
+        DrawingRef ref(this, i);
+        DrawingObject obj;
+        obj.type = ref.type();
+        obj.startX = ref.startX();
+        obj.startY = ref.startY();
+        obj.endX = ref.endX();
+        obj.endY = ref.endY();
+        obj.thickness = ref.thickness();
+        obj.color = ref.color();
+        obj.isSelected = ref.isSelected();
+        obj.brushShape = ref.brushShape();
+        obj.wasDrawnWithSelection = ref.wasDrawnWithSelection();
+        obj.selectionRect = ref.selectionRect();
+        obj.selectionMask = ref.selectionMask();
+        obj.payload = ref.payload();
+        return obj;
+    }
+
+    // Объём памяти, занимаемый хранилищем (по ёмкости контейнеров)
+    size_t MemoryBytes() const
+    {
+        return types.capacity() + flags.capacity() + thicknesses.capacity() +
+            colorIndex.capacity() * sizeof(uint16_t) + clipIndex.capacity() * sizeof(uint16_t) +
+            (x0.capacity() + y0.capacity() + dx.capacity() + dy.capacity()) * sizeof(int16_t) +
+            wideCoords.capacity() * sizeof(int32_t) + freeWideSlots.capacity() * sizeof(uint32_t) +
+            palette.capacity() * sizeof(COLORREF) + paletteLookup.size() * (sizeof(COLORREF) + sizeof(uint16_t) + 2 * sizeof(void*)) +
+            clipRects.capacity() * sizeof(ClipEntry) +
+            ownClips.capacity() * sizeof(std::pair<uint32_t, ClipEntry>) +
+            payloads.capacity() * sizeof(std::pair<uint32_t, uint32_t>);
+    }
+
+    // Средний размер одного объекта в байтах
+    double BytesPerObject() const
+    {
+        return empty() ? 0.0 : static_cast<double>(MemoryBytes()) / static_cast<double>(size());
+    }
+
+private:
+    friend class DrawingRef;
+
+    struct ClipEntry {
+        RECT rect;
+        uint32_t mask;
+    };
+
+    static bool FitsInt16(int v) { return v >= INT16_MIN && v <= INT16_MAX; }
+
+    uint32_t WideSlot(size_t i) const
+    {
+        return static_cast<uint32_t>(static_cast<uint16_t>(x0[i])) |
+            (static_cast<uint32_t>(static_cast<uint16_t>(y0[i])) << 16);
+    }
+
+    int Coord(size_t i, int component) const
+    {
+        if (flags[i] & STORE_FLAG_WIDE) {
+            return wideCoords[WideSlot(i) * 4 + component];
+        }
+        switch (component) {
+        case 0: return x0[i];
+        case 1: return y0[i];
+        case 2: return x0[i] + dx[i];
+        default: return y0[i] + dy[i];
+        }
+    }
+
+    // Поиск данных объекта двоичным поиском по разреженной таблице
+    uint32_t Payload(size_t i) const
+    {
+        if (!(flags[i] & STORE_FLAG_PAYLOAD)) return 0;
+
+        size_t lo = 0, hi = payloads.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (payloads[mid].first < i) lo = mid + 1;
+            else hi = mid;
+        }
+        return (lo < payloads.size() && payloads[lo].first == i) ? payloads[lo].second : 0;
+    }
+
+    // Палитра цветов: одинаковые цвета хранятся один раз
+    uint16_t InternColor(COLORREF color)
+    {
+        auto it = paletteLookup.find(color);
+        if (it != paletteLookup.end()) return it->second;
+
+        if (palette.size() < 0x10000) {
+            uint16_t index = static_cast<uint16_t>(palette.size());
+            palette.push_back(color);
+            paletteLookup[color] = index;
+            return index;
+        }
+
+        // Палитра переполнена - берём ближайший из уже имеющихся цветов
+        uint16_t best = 0;
+        int bestDistance = INT32_MAX;
+        for (size_t j = 0; j < palette.size(); j++) {
+            int dr = GetRValue(palette[j]) - GetRValue(color);
+            int dg = GetGValue(palette[j]) - GetGValue(color);
+            int db = GetBValue(palette[j]) - GetBValue(color);
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = static_cast<uint16_t>(j);
+            }
+        }
+        return best;
+    }
+
+    // Собственная запись обрезки объекта (индекс STORE_CLIP_OWN)
+    const ClipEntry& OwnClip(size_t i) const
+    {
+        size_t lo = 0, hi = ownClips.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (ownClips[mid].first < i) lo = mid + 1;
+            else hi = mid;
+        }
+        return ownClips[lo].second;
+    }
+
+    // Запись обрезки объекта с ненулевым индексом
+    const ClipEntry& Clip(size_t i) const
+    {
+        uint16_t clip = clipIndex[i];
+        return clip == STORE_CLIP_OWN ? OwnClip(i) : clipRects[clip - 1];
+    }
+
+    // Таблица обрезки: подряд идущие объекты одного выделения делят одну запись.
+    // Если таблица заполнена, возвращается STORE_CLIP_OWN - запись сохраняет вызывающий
+    uint16_t InternClip(const RECT& rect, uint32_t mask)
+    {
+        for (size_t j = clipRects.size(); j > 0; j--) {
+            const RECT& r = clipRects[j - 1].rect;
+            if (r.left == rect.left && r.top == rect.top && r.right == rect.right && r.bottom == rect.bottom &&
+                clipRects[j - 1].mask == mask) {
+                return static_cast<uint16_t>(j);
+            }
+            if (clipRects.size() - j >= 8) break;
+        }
+
+        if (clipRects.size() >= STORE_CLIP_OWN - 1) {
+            return STORE_CLIP_OWN;
+        }
+        clipRects.push_back({ rect, mask });
+        return static_cast<uint16_t>(clipRects.size());
+    }
+
+    std::vector<uint8_t> types;
+    std::vector<uint8_t> flags;
+    std::vector<uint8_t> thicknesses;
+    std::vector<uint16_t> colorIndex;
+    std::vector<uint16_t> clipIndex;
+    std::vector<int16_t> x0, y0, dx, dy;
+
+    std::vector<int32_t> wideCoords;
+    std::vector<uint32_t> freeWideSlots;   // записи wideCoords, не занятые ни одним объектом
+    std::vector<COLORREF> palette;
+    std::unordered_map<COLORREF, uint16_t> paletteLookup;
+    std::vector<ClipEntry> clipRects;
+    std::vector<std::pair<uint32_t, ClipEntry>> ownClips;  // (индекс объекта, обрезка), по возрастанию индекса
+    std::vector<std::pair<uint32_t, uint32_t>> payloads;
+};
+
+inline int DrawingRef::type() const { return store->types[idx]; }
+inline int DrawingRef::startX() const { return store->Coord(idx, 0); }
+inline int DrawingRef::startY() const { return store->Coord(idx, 1); }
+inline int DrawingRef::endX() const { return store->Coord(idx, 2); }
+inline int DrawingRef::endY() const { return store->Coord(idx, 3); }
+inline int DrawingRef::thickness() const { return store->thicknesses[idx]; }
+inline COLORREF DrawingRef::color() const { return store->palette[store->colorIndex[idx]]; }
+inline bool DrawingRef::isSelected() const { return (store->flags[idx] & STORE_FLAG_SELECTED) != 0; }
+inline int DrawingRef::brushShape() const { return store->flags[idx] & STORE_FLAG_SHAPE_MASK; }
+inline bool DrawingRef::wasDrawnWithSelection() const { return store->clipIndex[idx] != 0; }
+inline uint32_t DrawingRef::payload() const { return store->Payload(idx); }
+
+inline RECT DrawingRef::selectionRect() const
+{
+    if (store->clipIndex[idx] == 0) {
+        RECT empty = { 0, 0, 0, 0 };
+        return empty;
+    }
+    return store->Clip(idx).rect;
+}
+
+inline uint32_t DrawingRef::selectionMask() const
+{
+    return store->clipIndex[idx] == 0 ? 0 : store->Clip(idx).mask;
+}
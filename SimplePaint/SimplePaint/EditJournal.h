@@ -0,0 +1,324 @@
+﻿// EditJournal.h: журнал правок документа только на дозапись, для восстановления после сбоя
+//
+// Каждая завершённая правка - небольшая двоичная запись: u32 длина данных, u8 тип,
+// данные и CRC-32 типа с данными. Рисующий поток только ставит готовые записи в очередь,
+// а поток журнала пишет их в файл и сбрасывает на диск (fsync) пачкой: записи,
+// пришедшие за интервал синхронизации, делят один fsync. При чтении журнал обрывается
+// на первой недописанной или повреждённой записи - это хвост, не успевший попасть на
+// диск, а всё до него восстанавливается.
+//
+// Сжатие журнала: поток журнала собирает полное состояние документа (тем же набором
+// записей) во временный файл, сбрасывает его на диск и атомарно подменяет им журнал.
+// Сбой в любой момент оставляет либо старый журнал, либо новый, но не смесь.
+//
+// Формат файла: "SPJ1", затем записи. Числа - little-endian (как в PaintDocument.h).
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <istream>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <share.h>
+typedef std::wstring JournalPath;
+#else
+#include <unistd.h>
+typedef std::string JournalPath;
+#endif
+
+// Типы записей; данные записей описаны в редакторе рядом с кодом, который их пишет
+enum JournalRecordType : uint8_t {
+    JOURNAL_LAYERS = 1,           // таблица слоёв целиком (с номерами слоёв прежней таблицы)
+    JOURNAL_FILL_MASK = 2,
+    JOURNAL_SELECTION_MASK = 3,
+    JOURNAL_FRAGMENT = 4,
+    JOURNAL_TEXT = 5,
+    JOURNAL_POLYGON = 6,
+    JOURNAL_GRADIENT = 7,
+    JOURNAL_ADD_OBJECT = 8,
+    JOURNAL_SET_COORDS = 9,
+    JOURNAL_CLEAR = 10
+};
+
+const char JOURNAL_MAGIC[4] = { 'S', 'P', 'J', '1' };
+
+inline uint32_t JournalCrc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+    // Таблица строится один раз (инициализация статической переменной потокобезопасна)
+    struct Table {
+        uint32_t values[256];
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                values[i] = c;
+            }
+        }
+    };
+    static const Table table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table.values[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Запись с заголовком и контрольной суммой в конец out
+inline void AppendJournalRecord(std::string& out, JournalRecordType type, const std::string& payload)
+{
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    char header[5] = {
+        static_cast<char>(length & 0xFF), static_cast<char>((length >> 8) & 0xFF),
+        static_cast<char>((length >> 16) & 0xFF), static_cast<char>((length >> 24) & 0xFF),
+        static_cast<char>(type)
+    };
+    out.append(header, 5);
+    out.append(payload);
+
+    uint32_t crc = JournalCrc32(reinterpret_cast<const uint8_t*>(header + 4), 1);
+    crc = JournalCrc32(reinterpret_cast<const uint8_t*>(payload.data()), payload.size(), crc);
+    char tail[4] = {
+        static_cast<char>(crc & 0xFF), static_cast<char>((crc >> 8) & 0xFF),
+        static_cast<char>((crc >> 16) & 0xFF), static_cast<char>((crc >> 24) & 0xFF)
+    };
+    out.append(tail, 4);
+}
+
+// Чтение записей: apply(type, payload) для каждой целой записи; false от apply
+// останавливает чтение. Возвращает число применённых записей (-1 - не журнал)
+template <typename Apply>
+long ReadJournal(std::istream& in, Apply apply)
+{
+    char magic[4];
+    if (!in.read(magic, 4) || std::string(magic, 4) != std::string(JOURNAL_MAGIC, 4)) return -1;
+
+    long count = 0;
+    std::string payload;
+    for (;;) {
+        unsigned char header[5];
+        if (!in.read(reinterpret_cast<char*>(header), 5)) break;
+        uint32_t length = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+
+        // Длина из оборванного хвоста может быть мусором - не выделяем под неё память заранее
+        payload.clear();
+        char chunk[4096];
+        uint32_t left = length;
+        while (left > 0 && in.read(chunk, left < sizeof(chunk) ? left : sizeof(chunk))) {
+            payload.append(chunk, static_cast<size_t>(in.gcount()));
+            left -= static_cast<uint32_t>(in.gcount());
+        }
+        unsigned char tail[4];
+        if (left > 0 || !in.read(reinterpret_cast<char*>(tail), 4)) break;
+
+        uint32_t stored = tail[0] | (tail[1] << 8) | (tail[2] << 16) | (static_cast<uint32_t>(tail[3]) << 24);
+        uint32_t crc = JournalCrc32(header + 4, 1);
+        crc = JournalCrc32(reinterpret_cast<const uint8_t*>(payload.data()), payload.size(), crc);
+        if (crc != stored) break;
+
+        if (!apply(static_cast<JournalRecordType>(header[4]), payload)) break;
+        count++;
+    }
+    return count;
+}
+
+class JournalWriter {
+public:
+    JournalWriter() : file(nullptr), syncInterval(100), stopping(false), failed(false),
+        bytesWritten(0), syncs(0), compactions(0)
+    {
+    }
+    ~JournalWriter() { Stop(false); }
+
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    // Запуск потока журнала. Файл открывается на дозапись и остаётся занятым до Stop;
+    // false - журнал уже открыт другим экземпляром программы. Прежнее содержимое можно
+    // прочитать (ReadJournal) до первого сжатия, которое его заменит
+    bool Start(const JournalPath& journalPath, int syncIntervalMs)
+    {
+        if (worker.joinable()) return false;
+
+        path = journalPath;
+        syncInterval = syncIntervalMs;
+        stopping = false;
+        failed = false;
+        file = OpenFile(path, false);
+        if (!file) return false;
+
+        worker = std::thread([this]() { Run(); });
+        return true;
+    }
+
+    bool Running() const { return worker.joinable(); }
+
+    // Постановка готовых записей в очередь записи
+    void Append(std::string&& records)
+    {
+        if (records.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back({ std::move(records), nullptr });
+        }
+        ready.notify_one();
+    }
+
+    // Сжатие: build(out) в потоке журнала пишет полное состояние записями (без заголовка
+    // файла), и оно заменяет журнал. Записи, поставленные позже, дописываются уже к нему
+    void Rewrite(std::function<void(std::string&)> build)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back({ std::string(), std::move(build) });
+        }
+        ready.notify_one();
+    }
+
+    // Дописывает очередь и останавливает поток; remove - удалить журнал (чистый выход)
+    void Stop(bool remove)
+    {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_one();
+        worker.join();
+
+        if (file) fclose(file);
+        file = nullptr;
+        if (remove) RemoveJournalFile(path);
+    }
+
+    // Статистика (читается рисующим потоком)
+    size_t BytesWritten() { std::lock_guard<std::mutex> lock(mutex); return bytesWritten; }
+    size_t Syncs() { std::lock_guard<std::mutex> lock(mutex); return syncs; }
+    size_t Compactions() { std::lock_guard<std::mutex> lock(mutex); return compactions; }
+    bool Failed() { std::lock_guard<std::mutex> lock(mutex); return failed; }
+
+private:
+    struct Item {
+        std::string records;
+        std::function<void(std::string&)> rewrite;
+    };
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) break;
+
+            // Пачка: всё, что пришло за интервал синхронизации, сбрасывается одним fsync
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(syncInterval);
+            bool dirty = false;
+            for (;;) {
+                while (!queue.empty()) {
+                    Item item = std::move(queue.front());
+                    queue.pop_front();
+                    lock.unlock();
+                    bool ok = item.rewrite ? Compact(item.rewrite) : Write(item.records);
+                    dirty = dirty || !item.rewrite;
+                    lock.lock();
+                    if (!ok) failed = true;
+                    if (item.rewrite) compactions++;
+                    else bytesWritten += item.records.size();
+                }
+                if (stopping || !ready.wait_until(lock, deadline, [this]() { return stopping || !queue.empty(); })) break;
+            }
+
+            if (dirty) {
+                lock.unlock();
+                bool ok = Sync(file);
+                lock.lock();
+                if (!ok) failed = true;
+                syncs++;
+            }
+        }
+    }
+
+    bool Write(const std::string& records)
+    {
+        return file && fwrite(records.data(), 1, records.size(), file) == records.size();
+    }
+
+    bool Compact(const std::function<void(std::string&)>& build)
+    {
+        std::string content(JOURNAL_MAGIC, 4);
+        build(content);
+
+        JournalPath temporary = path + JournalPath(1, '~');
+        FILE* out = OpenFile(temporary, true);
+        if (!out) return false;
+        bool ok = fwrite(content.data(), 1, content.size(), out) == content.size() && Sync(out);
+        fclose(out);
+        if (!ok) return false;
+
+        // Старый журнал закрывается перед подменой, новый открывается на дозапись
+        if (file) fclose(file);
+        ok = ReplaceJournalFile(temporary, path);
+        file = OpenFile(path, false);
+        return ok && file;
+    }
+
+    static bool Sync(FILE* f)
+    {
+        if (!f || fflush(f) != 0) return false;
+#ifdef _WIN32
+        return _commit(_fileno(f)) == 0;
+#else
+        return fsync(fileno(f)) == 0;
+#endif
+    }
+
+    // Файл на дозапись (truncate - заново); запись другим процессам запрещена
+    static FILE* OpenFile(const JournalPath& name, bool truncate)
+    {
+#ifdef _WIN32
+        return _wfsopen(name.c_str(), truncate ? L"wb" : L"ab", _SH_DENYWR);
+#else
+        return fopen(name.c_str(), truncate ? "wb" : "ab");
+#endif
+    }
+
+    static bool ReplaceJournalFile(const JournalPath& from, const JournalPath& to)
+    {
+#ifdef _WIN32
+        return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        return rename(from.c_str(), to.c_str()) == 0;
+#endif
+    }
+
+    static void RemoveJournalFile(const JournalPath& name)
+    {
+#ifdef _WIN32
+        _wremove(name.c_str());
+#else
+        remove(name.c_str());
+#endif
+    }
+
+    JournalPath path;
+    FILE* file;
+    int syncInterval;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Item> queue;
+    bool stopping;
+    bool failed;
+    size_t bytesWritten, syncs, compactions;
+};
@@ -0,0 +1,213 @@
+﻿// FloodFill.h: построчная заливка с допуском по цвету
+//
+// Заливка работает прямо по памяти 32-битного изображения (0x00RRGGBB, старший байт
+// не учитывается) и возвращает маску залитых пикселей (SpanMask), а не меняет пиксели.
+// Проверка "цвет в пределах допуска" считается для всей строки сразу векторно (SSE2),
+// по четыре пикселя за шаг, поэтому заливка с допуском не медленнее точной.
+// Строки проверяются лениво - только те, до которых дошла заливка.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FLOODFILL_SSE2 1
+#endif
+
+#include "SpanMask.h"
+
+// Способ измерения расстояния между цветами
+enum ColorDistance {
+    DISTANCE_RGB = 0,         // максимум разницы по каналам
+    DISTANCE_PERCEPTUAL = 1   // взвешенная евклидова (2R, 4G, 3B), ближе к восприятию
+};
+
+struct FillOptions {
+    int tolerance;            // 0..255, 0 - точное совпадение
+    ColorDistance distance;
+    bool eightConnected;      // соседи по диагонали тоже связаны
+};
+
+// Порог для взвешенного расстояния: 2dr^2 + 4dg^2 + 3db^2 <= 9 * tolerance^2
+inline int PerceptualThreshold(int tolerance)
+{
+    return 9 * tolerance * tolerance;
+}
+
+// Скалярная проверка одного пикселя (хвосты строк и платформы без SSE2)
+inline bool ColorMatches(uint32_t pixel, uint32_t target, const FillOptions& options)
+{
+    int dr = static_cast<int>((pixel >> 16) & 0xFF) - static_cast<int>((target >> 16) & 0xFF);
+    int dg = static_cast<int>((pixel >> 8) & 0xFF) - static_cast<int>((target >> 8) & 0xFF);
+    int db = static_cast<int>(pixel & 0xFF) - static_cast<int>(target & 0xFF);
+
+    if (options.distance == DISTANCE_PERCEPTUAL) {
+        return 2 * dr * dr + 4 * dg * dg + 3 * db * db <= PerceptualThreshold(options.tolerance);
+    }
+
+    if (dr < 0) dr = -dr;
+    if (dg < 0) dg = -dg;
+    if (db < 0) db = -db;
+    int maxDiff = dr > dg ? dr : dg;
+    if (db > maxDiff) maxDiff = db;
+    return maxDiff <= options.tolerance;
+}
+
+// Маска совпадений для отрезка строки: out[i] = 1, если пиксель в пределах допуска
+inline void MatchRow(const uint32_t* row, int count, uint32_t target, const FillOptions& options, uint8_t* out)
+{
+    int i = 0;
+
+#ifdef FLOODFILL_SSE2
+    const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i targetVec = _mm_and_si128(_mm_set1_epi32(static_cast<int>(target)), colorMask);
+
+    if (options.distance == DISTANCE_RGB) {
+        // |a - b| по байтам через насыщающее вычитание, затем сравнение с допуском
+        const __m128i toleranceVec = _mm_set1_epi8(static_cast<char>(options.tolerance));
+        for (; i + 4 <= count; i += 4) {
+            __m128i pixels = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)), colorMask);
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(pixels, targetVec), _mm_subs_epu8(targetVec, pixels));
+            // diff <= tolerance  <=>  max(diff, tolerance) == tolerance
+            __m128i within = _mm_cmpeq_epi8(_mm_max_epu8(diff, toleranceVec), toleranceVec);
+            // Пиксель подходит, если подходят все четыре байта (альфа замаскирована в 0)
+            __m128i all = _mm_cmpeq_epi32(within, _mm_set1_epi32(-1));
+            int bits = _mm_movemask_ps(_mm_castsi128_ps(all));
+            out[i + 0] = static_cast<uint8_t>(bits & 1);
+            out[i + 1] = static_cast<uint8_t>((bits >> 1) & 1);
+            out[i + 2] = static_cast<uint8_t>((bits >> 2) & 1);
+            out[i + 3] = static_cast<uint8_t>((bits >> 3) & 1);
+        }
+    }
+    else {
+        // Взвешенная сумма квадратов: разности в 16 битах, madd даёт пары (B,G) и (R,0) в 32 битах
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i weights = _mm_set_epi16(0, 2, 4, 3, 0, 2, 4, 3);
+        const __m128i threshold = _mm_set1_epi32(PerceptualThreshold(options.tolerance));
+        const __m128i targetLo = _mm_unpacklo_epi8(targetVec, zero);
+        for (; i + 4 <= count; i += 4) {
+            __m128i pixels = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)), colorMask);
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), targetLo);
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(pixels, zero), targetLo);
+
+            __m128i sumLo = _mm_madd_epi16(lo, _mm_mullo_epi16(lo, weights));
+            __m128i sumHi = _mm_madd_epi16(hi, _mm_mullo_epi16(hi, weights));
+
+            // Складываем соседние 32-битные половины: по одной сумме на пиксель
+            __m128i evens = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(sumLo), _mm_castsi128_ps(sumHi), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odds = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(sumLo), _mm_castsi128_ps(sumHi), _MM_SHUFFLE(3, 1, 3, 1)));
+            __m128i distance = _mm_add_epi32(evens, odds);
+
+            int bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(distance, threshold)));
+            out[i + 0] = static_cast<uint8_t>(!(bits & 1));
+            out[i + 1] = static_cast<uint8_t>(!((bits >> 1) & 1));
+            out[i + 2] = static_cast<uint8_t>(!((bits >> 2) & 1));
+            out[i + 3] = static_cast<uint8_t>(!((bits >> 3) & 1));
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        out[i] = ColorMatches(row[i], target, options) ? 1 : 0;
+    }
+}
+
+// Заливка от затравки (x, y) в пределах clip. Возвращает маску залитых пикселей.
+// Если задана маска allowed (сдвинутая на allowedDx, allowedDy), пиксели вне неё
+// считаются неподходящими: заливка не выходит за выделение произвольной формы.
+inline SpanMask FloodFillMask(const uint32_t* pixels, size_t stride, MaskRect clip,
+    int x, int y, const FillOptions& options,
+    const SpanMask* allowed = nullptr, int allowedDx = 0, int allowedDy = 0)
+{
+    SpanMask mask;
+    mask.SetAnchor(x, y);
+
+    if (x < clip.left || x >= clip.right || y < clip.top || y >= clip.bottom) return mask;
+    if (allowed && !allowed->Contains(x - allowedDx, y - allowedDy)) return mask;
+
+    int width = clip.right - clip.left;
+    int height = clip.bottom - clip.top;
+    uint32_t target = pixels[static_cast<size_t>(y) * stride + x];
+
+    // Состояние пикселя: 0 - не подходит, 1 - подходит, 2 - уже залит
+    std::vector<uint8_t> state(static_cast<size_t>(width) * height);
+    std::vector<uint8_t> rowReady(height, 0);
+
+    auto prepareRow = [&](int row) -> uint8_t* {
+        uint8_t* rowState = &state[static_cast<size_t>(row) * width];
+        if (!rowReady[row]) {
+            MatchRow(pixels + static_cast<size_t>(row + clip.top) * stride + clip.left, width, target, options, rowState);
+            if (allowed) {
+                allowed->ForEachGap(row + clip.top - allowedDy, clip.left, clip.right, allowedDx, [&](int left, int right) {
+                    memset(rowState + (left - clip.left), 0, right - left);
+                });
+            }
+            rowReady[row] = 1;
+        }
+        return rowState;
+    };
+
+    struct Seed { int x, y; };
+    std::vector<Seed> seeds;
+    seeds.push_back({ x - clip.left, y - clip.top });
+
+    while (!seeds.empty()) {
+        Seed seed = seeds.back();
+        seeds.pop_back();
+
+        uint8_t* rowState = prepareRow(seed.y);
+        if (rowState[seed.x] != 1) continue;
+
+        // Расширяем отрезок влево и вправо
+        int left = seed.x;
+        while (left > 0 && rowState[left - 1] == 1) left--;
+        int right = seed.x + 1;
+        while (right < width && rowState[right] == 1) right++;
+
+        for (int i = left; i < right; i++) rowState[i] = 2;
+        mask.AddRun(seed.y + clip.top, left + clip.left, right + clip.left);
+
+        // Затравки в соседних строках: начало каждого подходящего отрезка под/над залитым
+        int scanLeft = options.eightConnected && left > 0 ? left - 1 : left;
+        int scanRight = options.eightConnected && right < width ? right + 1 : right;
+
+        for (int neighbour = seed.y - 1; neighbour <= seed.y + 1; neighbour += 2) {
+            if (neighbour < 0 || neighbour >= height) continue;
+
+            uint8_t* neighbourState = prepareRow(neighbour);
+            for (int i = scanLeft; i < scanRight; i++) {
+                if (neighbourState[i] == 1 && (i == scanLeft || neighbourState[i - 1] != 1)) {
+                    seeds.push_back({ i, neighbour });
+                }
+            }
+        }
+    }
+
+    mask.Normalize();
+    return mask;
+}
+
+// Закраска маски цветом value со сдвигом (dx, dy) в пределах clip
+inline void PaintMask(uint32_t* pixels, size_t stride, const SpanMask& mask, int dx, int dy,
+    MaskRect clip, uint32_t value)
+{
+    const std::vector<SpanRun>& runs = mask.Runs();
+    for (size_t i = mask.FirstRunOfRow(clip.top - dy); i < runs.size(); i++) {
+        int y = runs[i].y + dy;
+        if (y >= clip.bottom) break;
+
+        int left = runs[i].left + dx;
+        int right = runs[i].right + dx;
+        if (left < clip.left) left = clip.left;
+        if (right > clip.right) right = clip.right;
+        if (left >= right) continue;
+
+        uint32_t* out = pixels + static_cast<size_t>(y) * stride;
+        std::fill(out + left, out + right, value);
+    }
+}
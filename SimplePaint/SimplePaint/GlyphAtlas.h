@@ -0,0 +1,284 @@
+﻿// GlyphAtlas.h: атлас покрытий глифов (байт на пиксель) с вытеснением давно не нужных
+//
+// Глиф растеризуется один раз и кладётся в ячейку атласа, повторный вывод того же
+// глифа того же шрифта - смешивание покрытия из атласа с растром. Атлас разбит на полки
+// высотой в степень двойки, полка делится на квадратные ячейки своего размера.
+// Когда места нет, атлас сначала растёт вниз до maxHeight: строка растра не меняется,
+// поэтому полки и ячейки остаются на местах. Когда расти некуда, вытесняется самый
+// давно использованный глиф с ячейкой нужного размера, а если таких полок нет -
+// целиком самая давно использованная полка. Без роста LRU по кругу вытесняет весь
+// атлас, как только надписи документа не помещаются в него целиком.
+// Глиф, не помещающийся в атлас, растеризуется при каждом выводе (считается промахом).
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "SpanMask.h"
+#include "LayerBlend.h"
+
+// Результат растеризации глифа
+struct GlyphBitmap {
+    int width = 0, height = 0;
+    int bearingX = 0;               // левый край относительно пера
+    int bearingY = 0;               // верхний край над базовой линией
+    int advance = 0;                // сдвиг пера
+    std::vector<uint8_t> coverage;  // width * height, 0..255
+};
+
+// Глиф для вывода: покрытие лежит в атласе (или во временном буфере) со строкой stride
+struct GlyphInfo {
+    int width, height;
+    int bearingX, bearingY;
+    int advance;
+    const uint8_t* coverage;
+    size_t stride;
+};
+
+class GlyphAtlas {
+public:
+    GlyphAtlas(int width, int height, int maxHeight = 0)
+        : width(width), height(height), maxHeight(maxHeight > height ? maxHeight : height),
+        pixels(static_cast<size_t>(width) * height, 0),
+        nextShelfY(0), clock(0), hits(0), misses(0), evictions(0)
+    {
+    }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    int MaxHeight() const { return maxHeight; }
+    size_t Hits() const { return hits; }
+    size_t Misses() const { return misses; }
+    size_t Evictions() const { return evictions; }
+    size_t GlyphCount() const { return index.size(); }
+    size_t MemoryBytes() const { return pixels.size() + entries.capacity() * sizeof(Entry); }
+
+    void Clear()
+    {
+        index.clear();
+        entries.clear();
+        freeEntries.clear();
+        shelves.clear();
+        nextShelfY = 0;
+    }
+
+    // Глиф glyph шрифта font; при промахе rasterize(GlyphBitmap&) строит его покрытие.
+    // Покрытие действительно до следующего вызова Find.
+    template <typename Rasterize>
+    void Find(uint32_t font, uint32_t glyph, Rasterize rasterize, GlyphInfo& info)
+    {
+        uint64_t key = (static_cast<uint64_t>(font) << 32) | glyph;
+        clock++;
+
+        auto found = index.find(key);
+        if (found != index.end()) {
+            hits++;
+            Entry& entry = entries[found->second];
+            entry.lastUse = clock;
+            if (entry.shelf >= 0) shelves[entry.shelf].lastUse = clock;
+            Describe(entry, info);
+            return;
+        }
+
+        misses++;
+        scratch = GlyphBitmap();
+        rasterize(scratch);
+
+        int cellSize = CellSizeFor(scratch.width > scratch.height ? scratch.width : scratch.height);
+        int shelf = -1, cell = -1;
+        if (cellSize < 0 || (cellSize > 0 && !Allocate(cellSize, shelf, cell))) {
+            // Глиф больше атласа или места нет даже после вытеснения - выводим из временного буфера
+            info = { scratch.width, scratch.height, scratch.bearingX, scratch.bearingY, scratch.advance,
+                scratch.coverage.data(), static_cast<size_t>(scratch.width) };
+            return;
+        }
+
+        size_t slot;
+        if (!freeEntries.empty()) {
+            slot = freeEntries.back();
+            freeEntries.pop_back();
+        }
+        else {
+            slot = entries.size();
+            entries.emplace_back();
+        }
+
+        Entry& entry = entries[slot];
+        entry.key = key;
+        entry.shelf = shelf;
+        entry.cell = cell;
+        entry.width = scratch.width;
+        entry.height = scratch.height;
+        entry.bearingX = scratch.bearingX;
+        entry.bearingY = scratch.bearingY;
+        entry.advance = scratch.advance;
+        entry.lastUse = clock;
+        index[key] = slot;
+
+        // Пустой глиф (пробел) хранит только метрики
+        if (shelf >= 0) {
+            shelves[shelf].cells[cell] = static_cast<int>(slot);
+            shelves[shelf].lastUse = clock;
+            uint8_t* target = CellPixels(entry);
+            for (int y = 0; y < entry.height; y++) {
+                memcpy(target + static_cast<size_t>(y) * width, &scratch.coverage[static_cast<size_t>(y) * entry.width], entry.width);
+            }
+        }
+        Describe(entry, info);
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        int shelf, cell;             // shelf = -1 - глиф без пикселей
+        int width, height;
+        int bearingX, bearingY;
+        int advance;
+        uint64_t lastUse;
+    };
+
+    struct Shelf {
+        int y, height;
+        int cellSize;
+        std::vector<int> cells;      // номер записи в entries или -1
+        uint64_t lastUse;
+    };
+
+    // Наименьшая ячейка-степень двойки для глифа; 0 - пикселей нет, -1 - не помещается
+    int CellSizeFor(int size) const
+    {
+        if (size <= 0) return 0;
+        int cellSize = 8;
+        while (cellSize < size) cellSize *= 2;
+        return cellSize <= width && cellSize <= maxHeight ? cellSize : -1;
+    }
+
+    bool Allocate(int cellSize, int& shelf, int& cell)
+    {
+        // Свободная ячейка на полке нужного размера
+        for (size_t i = 0; i < shelves.size(); i++) {
+            if (shelves[i].cellSize != cellSize) continue;
+            for (size_t c = 0; c < shelves[i].cells.size(); c++) {
+                if (shelves[i].cells[c] < 0) {
+                    shelf = static_cast<int>(i);
+                    cell = static_cast<int>(c);
+                    return true;
+                }
+            }
+        }
+
+        // Новая полка; если её некуда поставить, атлас удваивается в высоту
+        if (nextShelfY + cellSize > height && height < maxHeight) {
+            height = height * 2 > nextShelfY + cellSize ? height * 2 : nextShelfY + cellSize;
+            if (height > maxHeight) height = maxHeight;
+            pixels.resize(static_cast<size_t>(width) * height, 0);
+        }
+        if (nextShelfY + cellSize <= height) {
+            shelves.push_back({ nextShelfY, cellSize, cellSize, std::vector<int>(width / cellSize, -1), clock });
+            nextShelfY += cellSize;
+            shelf = static_cast<int>(shelves.size()) - 1;
+            cell = 0;
+            return true;
+        }
+
+        // Самый давно использованный глиф того же размера ячейки
+        int victim = -1;
+        for (size_t i = 0; i < shelves.size(); i++) {
+            if (shelves[i].cellSize != cellSize) continue;
+            for (int slot : shelves[i].cells) {
+                if (slot < 0) continue;
+                if (victim < 0 || entries[slot].lastUse < entries[victim].lastUse) victim = slot;
+            }
+        }
+        if (victim >= 0) {
+            shelf = entries[victim].shelf;
+            cell = entries[victim].cell;
+            Evict(victim);
+            return true;
+        }
+
+        // Самая давно использованная полка достаточной высоты переходит к новому размеру
+        int oldest = -1;
+        for (size_t i = 0; i < shelves.size(); i++) {
+            if (shelves[i].height < cellSize) continue;
+            if (oldest < 0 || shelves[i].lastUse < shelves[oldest].lastUse) oldest = static_cast<int>(i);
+        }
+        if (oldest < 0) return false;
+
+        for (int slot : shelves[oldest].cells) {
+            if (slot >= 0) Evict(slot);
+        }
+        shelves[oldest].cellSize = cellSize;
+        shelves[oldest].cells.assign(width / cellSize, -1);
+        shelf = oldest;
+        cell = 0;
+        return true;
+    }
+
+    void Evict(int slot)
+    {
+        Entry& entry = entries[slot];
+        shelves[entry.shelf].cells[entry.cell] = -1;
+        index.erase(entry.key);
+        freeEntries.push_back(static_cast<size_t>(slot));
+        evictions++;
+    }
+
+    uint8_t* CellPixels(const Entry& entry)
+    {
+        const Shelf& shelf = shelves[entry.shelf];
+        return &pixels[static_cast<size_t>(shelf.y) * width + static_cast<size_t>(entry.cell) * shelf.cellSize];
+    }
+
+    void Describe(const Entry& entry, GlyphInfo& info)
+    {
+        info = { entry.width, entry.height, entry.bearingX, entry.bearingY, entry.advance,
+            entry.shelf >= 0 ? CellPixels(entry) : nullptr, static_cast<size_t>(width) };
+    }
+
+    int width, height, maxHeight;
+    std::vector<uint8_t> pixels;
+    std::vector<Entry> entries;
+    std::vector<size_t> freeEntries;
+    std::vector<Shelf> shelves;
+    std::unordered_map<uint64_t, size_t> index;
+    int nextShelfY;
+    uint64_t clock;
+    size_t hits, misses, evictions;
+    GlyphBitmap scratch;
+};
+
+// Смешивание покрытия глифа цветом color (непрозрачный PARGB) с растром в пределах clip;
+// (x, y) - левый верхний угол глифа. aliased - без сглаживания: покрытие от половины
+// даёт сплошной цвет, иначе пиксель не меняется (растр не получает новых цветов)
+inline void BlendGlyph(uint32_t* pixels, size_t stride, const MaskRect& clip, int x, int y,
+    const GlyphInfo& glyph, uint32_t color, bool aliased)
+{
+    if (!glyph.coverage) return;
+
+    int left = x > clip.left ? x : clip.left;
+    int top = y > clip.top ? y : clip.top;
+    int right = x + glyph.width < clip.right ? x + glyph.width : clip.right;
+    int bottom = y + glyph.height < clip.bottom ? y + glyph.height : clip.bottom;
+
+    for (int row = top; row < bottom; row++) {
+        const uint8_t* coverage = glyph.coverage + static_cast<size_t>(row - y) * glyph.stride - x;
+        uint32_t* target = pixels + static_cast<size_t>(row) * stride;
+        for (int col = left; col < right; col++) {
+            uint32_t alpha = coverage[col];
+            if (aliased) {
+                if (alpha >= 128) target[col] = color;
+            }
+            else if (alpha == 255) {
+                target[col] = color;
+            }
+            else if (alpha != 0) {
+                target[col] = BlendPixelOver(target[col], color, alpha);
+            }
+        }
+    }
+}
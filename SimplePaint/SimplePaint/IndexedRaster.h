@@ -0,0 +1,120 @@
+﻿// IndexedRaster.h: растр слоя с палитрой до 256 цветов (байт на пиксель вместо четырёх)
+//
+// Схемы и диаграммы рисуются несколькими цветами без сглаживания, поэтому растр слоя
+// укладывается в палитру. Индекс 0 всегда означает прозрачный пиксель: новые области
+// при росте растра заполняются нулями без поиска в палитре. Если различных цветов
+// больше 256, упаковка не удаётся и слой остаётся 32-битным.
+// Пиксели палитры - premultiplied ARGB, как в растрах слоёв.
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+struct IndexedRaster {
+    int width = 0, height = 0;         // строка индексов - width байт
+    std::vector<uint32_t> palette;
+    std::vector<uint8_t> indices;
+
+    bool Empty() const { return indices.empty(); }
+    size_t MemoryBytes() const { return indices.capacity() + palette.capacity() * sizeof(uint32_t); }
+
+    void Clear()
+    {
+        width = height = 0;
+        std::vector<uint32_t>().swap(palette);
+        std::vector<uint8_t>().swap(indices);
+    }
+};
+
+// Упаковка 32-битного растра (stride - в пикселях); false - цветов больше 256
+inline bool PackIndexed(const uint32_t* pixels, size_t stride, int width, int height, IndexedRaster& out)
+{
+    // Открытая адресация: 512 ячеек на 256 цветов, ключ 0 - прозрачный цвет (индекс 0)
+    const int TABLE_SIZE = 512;
+    uint32_t keys[TABLE_SIZE];
+    uint8_t values[TABLE_SIZE];
+    bool used[TABLE_SIZE] = {};
+
+    std::vector<uint32_t> palette(1, 0);
+    std::vector<uint8_t> indices(static_cast<size_t>(width) * height);
+
+    uint32_t lastPixel = 0;
+    uint8_t lastIndex = 0;
+
+    for (int y = 0; y < height; y++) {
+        const uint32_t* row = pixels + static_cast<size_t>(y) * stride;
+        uint8_t* out8 = &indices[static_cast<size_t>(y) * width];
+
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = row[x];
+
+            // Соседние пиксели чаще всего совпадают - таблица не нужна
+            if (pixel == lastPixel) {
+                out8[x] = lastIndex;
+                continue;
+            }
+
+            uint8_t index = 0;
+            if (pixel != 0) {
+                uint32_t slot = (pixel * 2654435761u) >> 23;
+                while (used[slot] && keys[slot] != pixel) slot = (slot + 1) & (TABLE_SIZE - 1);
+
+                if (used[slot]) {
+                    index = values[slot];
+                }
+                else {
+                    if (palette.size() == 256) return false;
+                    index = static_cast<uint8_t>(palette.size());
+                    palette.push_back(pixel);
+                    used[slot] = true;
+                    keys[slot] = pixel;
+                    values[slot] = index;
+                }
+            }
+
+            out8[x] = index;
+            lastPixel = pixel;
+            lastIndex = index;
+        }
+    }
+
+    out.width = width;
+    out.height = height;
+    out.palette.swap(palette);
+    out.indices.swap(indices);
+    return true;
+}
+
+// Перевод строки [x, x + count) строки y в пиксели палитры
+inline void ExpandIndexedRow(const IndexedRaster& raster, int x, int y, int count, uint32_t* dst)
+{
+    const uint8_t* src = &raster.indices[static_cast<size_t>(y) * raster.width + x];
+    const uint32_t* palette = raster.palette.data();
+    for (int i = 0; i < count; i++) dst[i] = palette[src[i]];
+}
+
+// Распаковка всего растра в 32-битные пиксели (stride - в пикселях)
+inline void UnpackIndexed(const IndexedRaster& raster, uint32_t* pixels, size_t stride)
+{
+    for (int y = 0; y < raster.height; y++) {
+        ExpandIndexedRow(raster, 0, y, raster.width, pixels + static_cast<size_t>(y) * stride);
+    }
+}
+
+// Смена размеров растра: пиксели переносятся, новые области прозрачны
+inline void ResizeIndexed(IndexedRaster& raster, int width, int height)
+{
+    std::vector<uint8_t> indices(static_cast<size_t>(width) * height, 0);
+    int copyWidth = raster.width < width ? raster.width : width;
+    int copyHeight = raster.height < height ? raster.height : height;
+    for (int y = 0; y < copyHeight; y++) {
+        memcpy(&indices[static_cast<size_t>(y) * width], &raster.indices[static_cast<size_t>(y) * raster.width], copyWidth);
+    }
+
+    raster.width = width;
+    raster.height = height;
+    raster.indices.swap(indices);
+}
@@ -0,0 +1,107 @@
+﻿// LayerBlend.h: наложение растров слоёв (premultiplied ARGB) с непрозрачностью слоя
+//
+// Пиксель слоя - 0xAARRGGBB с цветом, уже умноженным на альфу (формат PARGB GDI+),
+// поэтому наложение "поверх" - это out = src * k + dst * (1 - srcA * k), где k -
+// непрозрачность слоя. Деление на 255 заменено точным (x + 128 + ((x + 128) >> 8)) >> 8.
+// Строка смешивается векторно (SSE2) по четыре пикселя; четвёрки полностью прозрачных
+// пикселей пропускаются, полностью непрозрачные при k = 255 просто копируются.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define LAYERBLEND_SSE2 1
+#endif
+
+// Деление на 255 с округлением для x в пределах 0..65025
+inline uint32_t Div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// Наложение одного пикселя слоя src на пиксель dst с непрозрачностью opacity (0..255)
+inline uint32_t BlendPixelOver(uint32_t dst, uint32_t src, uint32_t opacity)
+{
+    uint32_t srcAlpha = Div255((src >> 24) * opacity);
+    uint32_t inverse = 255 - srcAlpha;
+
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t s = Div255(((src >> shift) & 0xFF) * opacity);
+        uint32_t d = Div255(((dst >> shift) & 0xFF) * inverse);
+        uint32_t sum = s + d;
+        if (sum > 255) sum = 255;
+        result |= sum << shift;
+    }
+    return result;
+}
+
+#ifdef LAYERBLEND_SSE2
+// Деление на 255 для восьми 16-битных произведений
+inline __m128i Div255Epu16(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Наложение двух пикселей, распакованных в 16-битные каналы
+inline __m128i BlendPairOver(__m128i dst, __m128i src, __m128i opacity)
+{
+    const __m128i full = _mm_set1_epi16(255);
+
+    __m128i scaled = src;
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(opacity, full)) != 0xFFFF) {
+        scaled = Div255Epu16(_mm_mullo_epi16(src, opacity));
+    }
+
+    // Альфа каждого пикселя (канал 3 и 7) размножается на все его каналы
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(scaled, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i inverse = _mm_sub_epi16(full, alpha);
+
+    // Сумма не превышает 255 с точностью до округления - насыщение при упаковке
+    return _mm_add_epi16(scaled, Div255Epu16(_mm_mullo_epi16(dst, inverse)));
+}
+#endif
+
+// Наложение строки слоя src на строку dst (count пикселей) с непрозрачностью opacity
+inline void BlendRowOver(uint32_t* dst, const uint32_t* src, int count, int opacity)
+{
+    if (opacity <= 0) return;
+    if (opacity > 255) opacity = 255;
+
+    int i = 0;
+
+#ifdef LAYERBLEND_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaMask = _mm_set1_epi32(static_cast<int>(0xFF000000));
+    const __m128i opacityVec = _mm_set1_epi16(static_cast<short>(opacity));
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i srcPixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+        // Четыре прозрачных пикселя не меняют результат
+        __m128i alpha = _mm_and_si128(srcPixels, alphaMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) == 0xFFFF) continue;
+
+        // Четыре непрозрачных пикселя непрозрачного слоя просто заменяют результат
+        if (opacity == 255 && _mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alphaMask)) == 0xFFFF) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), srcPixels);
+            continue;
+        }
+
+        __m128i dstPixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i lo = BlendPairOver(_mm_unpacklo_epi8(dstPixels, zero), _mm_unpacklo_epi8(srcPixels, zero), opacityVec);
+        __m128i hi = BlendPairOver(_mm_unpackhi_epi8(dstPixels, zero), _mm_unpackhi_epi8(srcPixels, zero), opacityVec);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; i < count; i++) {
+        if ((src[i] >> 24) == 0) continue;
+        dst[i] = BlendPixelOver(dst[i], src[i], static_cast<uint32_t>(opacity));
+    }
+}
@@ -0,0 +1,228 @@
+﻿// MemoryStats.h: учёт памяти редактора по категориям с пиковыми значениями
+//
+// Редактор периодически делает выборку: Begin(), затем Add(категория, статья, байты,
+// штуки) для каждой статьи расхода (растры слоёв, хранилище объектов, атлас глифов...)
+// и End(). Итоги категорий и их максимумы за время работы (пики) показывает оверлей,
+// а ToJson выгружает последнюю выборку со статьями и пиками - по выгрузкам документов
+// разного размера задаются бюджеты памяти. Пики берутся по выборкам: буфер, живущий
+// только внутри одного сообщения, в них не попадает. Рядом с памятью ведутся счётчики
+// работы (Count): пиксели кадра, байты журнала на штрих - последнее, максимум и сумма.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+
+enum MemoryCategory {
+    MEMORY_OBJECTS = 0,       // объекты и их таблицы (маски, надписи, многоугольники)
+    MEMORY_CANVAS = 1,        // растры слоёв, холст, плитки фрагментов
+    MEMORY_CACHES = 2,        // пересчитываемые данные: атлас глифов, навигатор, корзины
+    MEMORY_OVERLAYS = 3,      // буфер композиции с наложениями и предпросмотр
+    MEMORY_SNAPSHOTS = 4,     // копии документа для фонового сохранения и сжатия журнала
+    MEMORY_CATEGORY_COUNT = 5
+};
+
+// Статья расхода; имя - латиница без кавычек (ключ в JSON)
+struct MemoryItem {
+    MemoryCategory category;
+    const char* name;
+    size_t bytes;
+    size_t count;
+};
+
+// Счётчик работы; имя - латиница без кавычек (ключ в JSON)
+struct WorkCounter {
+    const char* name;
+    size_t last, peak, total, events;
+};
+
+struct MemoryTotals {
+    size_t bytes = 0, count = 0;
+    size_t peakBytes = 0, peakCount = 0;
+};
+
+class MemoryStats {
+public:
+    MemoryStats() : samples(0), totalBytes(0), peakTotalBytes(0), handles(0), peakHandles(0),
+        processBytes(0), peakProcessBytes(0), width(0), height(0), layers(0), objects(0)
+    {
+    }
+
+    void Begin()
+    {
+        items.clear();
+        for (auto& totals : categories) totals.bytes = totals.count = 0;
+    }
+
+    void Add(MemoryCategory category, const char* name, size_t bytes, size_t count)
+    {
+        items.push_back({ category, name, bytes, count });
+        categories[category].bytes += bytes;
+        categories[category].count += count;
+    }
+
+    // Число GDI-объектов и закрытая память процесса (для сравнения с учтённой)
+    void SetProcess(size_t gdiHandles, size_t privateBytes)
+    {
+        handles = gdiHandles;
+        processBytes = privateBytes;
+    }
+
+    // Размер документа, к которому относится выборка
+    void SetDocument(int documentWidth, int documentHeight, size_t layerCount, size_t objectCount)
+    {
+        width = documentWidth;
+        height = documentHeight;
+        layers = layerCount;
+        objects = objectCount;
+    }
+
+    // Событие счётчика name величиной value (кадр, дозапись журнала); не зависит от выборок
+    void Count(const char* name, size_t value)
+    {
+        WorkCounter* counter = nullptr;
+        for (auto& existing : counters) {
+            if (strcmp(existing.name, name) == 0) counter = &existing;
+        }
+        if (!counter) {
+            counters.push_back({ name, 0, 0, 0, 0 });
+            counter = &counters.back();
+        }
+        counter->last = value;
+        if (value > counter->peak) counter->peak = value;
+        counter->total += value;
+        counter->events++;
+    }
+
+    void End()
+    {
+        totalBytes = 0;
+        for (auto& totals : categories) {
+            totalBytes += totals.bytes;
+            if (totals.bytes > totals.peakBytes) totals.peakBytes = totals.bytes;
+            if (totals.count > totals.peakCount) totals.peakCount = totals.count;
+        }
+        if (totalBytes > peakTotalBytes) peakTotalBytes = totalBytes;
+        if (handles > peakHandles) peakHandles = handles;
+        if (processBytes > peakProcessBytes) peakProcessBytes = processBytes;
+        samples++;
+    }
+
+    const MemoryTotals& Totals(MemoryCategory category) const { return categories[category]; }
+    const std::vector<MemoryItem>& Items() const { return items; }
+    size_t TotalBytes() const { return totalBytes; }
+    size_t PeakTotalBytes() const { return peakTotalBytes; }
+    size_t Handles() const { return handles; }
+    size_t PeakHandles() const { return peakHandles; }
+    size_t ProcessBytes() const { return processBytes; }
+    size_t PeakProcessBytes() const { return peakProcessBytes; }
+    size_t Samples() const { return samples; }
+
+    // Счётчик name или нулевой, если событий ещё не было
+    WorkCounter Counter(const char* name) const
+    {
+        for (const auto& counter : counters) {
+            if (strcmp(counter.name, name) == 0) return counter;
+        }
+        return { name, 0, 0, 0, 0 };
+    }
+
+    static const char* CategoryName(MemoryCategory category)
+    {
+        static const char* const names[MEMORY_CATEGORY_COUNT] = {
+            "objects", "canvas", "caches", "overlays", "snapshots"
+        };
+        return names[category];
+    }
+
+    // Последняя выборка: документ, итоги и пики категорий со статьями, процесс; счётчики работы
+    std::string ToJson() const
+    {
+        std::string out = "{\n";
+        Field(out, 1, "samples", samples, true);
+        out += "  \"document\": { ";
+        Inline(out, "width", static_cast<size_t>(width < 0 ? 0 : width), false);
+        Inline(out, "height", static_cast<size_t>(height < 0 ? 0 : height), false);
+        Inline(out, "layers", layers, false);
+        Inline(out, "objects", objects, true);
+        out += " },\n";
+        Field(out, 1, "total_bytes", totalBytes, true);
+        Field(out, 1, "peak_total_bytes", peakTotalBytes, true);
+        Field(out, 1, "process_private_bytes", processBytes, true);
+        Field(out, 1, "peak_process_private_bytes", peakProcessBytes, true);
+        Field(out, 1, "gdi_objects", handles, true);
+        Field(out, 1, "peak_gdi_objects", peakHandles, true);
+
+        out += "  \"categories\": {\n";
+        for (int c = 0; c < MEMORY_CATEGORY_COUNT; c++) {
+            MemoryCategory category = static_cast<MemoryCategory>(c);
+            const MemoryTotals& totals = categories[c];
+            out += "    \"";
+            out += CategoryName(category);
+            out += "\": {\n";
+            Field(out, 3, "bytes", totals.bytes, true);
+            Field(out, 3, "count", totals.count, true);
+            Field(out, 3, "peak_bytes", totals.peakBytes, true);
+            Field(out, 3, "peak_count", totals.peakCount, true);
+            out += "      \"items\": {";
+            bool first = true;
+            for (const auto& item : items) {
+                if (item.category != category) continue;
+                out += first ? "\n" : ",\n";
+                out += "        \"";
+                out += item.name;
+                out += "\": { ";
+                Inline(out, "bytes", item.bytes, false);
+                Inline(out, "count", item.count, true);
+                out += " }";
+                first = false;
+            }
+            out += first ? "}\n" : "\n      }\n";
+            out += c + 1 < MEMORY_CATEGORY_COUNT ? "    },\n" : "    }\n";
+        }
+        out += "  },\n";
+
+        out += "  \"counters\": {";
+        for (size_t i = 0; i < counters.size(); i++) {
+            out += i ? ",\n    \"" : "\n    \"";
+            out += counters[i].name;
+            out += "\": { ";
+            Inline(out, "last", counters[i].last, false);
+            Inline(out, "peak", counters[i].peak, false);
+            Inline(out, "total", counters[i].total, false);
+            Inline(out, "events", counters[i].events, true);
+            out += " }";
+        }
+        out += counters.empty() ? "}\n}\n" : "\n  }\n}\n";
+        return out;
+    }
+
+private:
+    static void Field(std::string& out, int depth, const char* name, size_t value, bool comma)
+    {
+        char line[96];
+        snprintf(line, sizeof(line), "%*s\"%s\": %llu%s\n", depth * 2, "", name,
+            static_cast<unsigned long long>(value), comma ? "," : "");
+        out += line;
+    }
+
+    static void Inline(std::string& out, const char* name, size_t value, bool last)
+    {
+        char text[64];
+        snprintf(text, sizeof(text), "\"%s\": %llu%s", name, static_cast<unsigned long long>(value), last ? "" : ", ");
+        out += text;
+    }
+
+    MemoryTotals categories[MEMORY_CATEGORY_COUNT];
+    std::vector<MemoryItem> items;
+    std::vector<WorkCounter> counters;
+    size_t samples;
+    size_t totalBytes, peakTotalBytes;
+    size_t handles, peakHandles;
+    size_t processBytes, peakProcessBytes;
+    int width, height;
+    size_t layers, objects;
+};
@@ -0,0 +1,150 @@
+﻿// MipPyramid.h: пирамида уменьшенных копий изображения для навигатора
+//
+// Каждый уровень вдвое меньше предыдущего, texel - среднее квадрата 2x2 пикселей
+// уровня ниже (нечётный край повторяется). После правки пересчитываются только texels
+// над изменённым прямоугольником: на каждом уровне он сжимается вдвое, так что
+// обновление стоит около трети площади правки. Уменьшение идёт по четыре texel за шаг
+// (SSE2): каналы восьми пикселей двух строк складываются в 16 бит и делятся на 4 с
+// округлением - результат совпадает с обычным кодом до бита.
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define MIPPYRAMID_SSE2 1
+#endif
+
+#include "SpanMask.h"
+
+// Texels [x0, x1) строки уменьшенного уровня из строк row0 и row1 уровня ниже
+// (ширина srcWidth; у последнего texel при нечётной ширине второй столбец - тот же)
+inline void ReduceRow2x2(const uint32_t* row0, const uint32_t* row1, int srcWidth, uint32_t* out, int x0, int x1)
+{
+    int x = x0;
+
+#ifdef MIPPYRAMID_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    for (; x + 4 <= x1 && 2 * x + 8 <= srcWidth; x += 4) {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 2 * x));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 2 * x + 4));
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 2 * x));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 2 * x + 4));
+
+        // Суммы по вертикали: в каждом векторе два соседних пикселя по 4 канала в 16 бит
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+        // Суммы по горизонтали: старшая половина вектора прибавляется к младшей
+        s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+        s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+        s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+        s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+
+        __m128i t01 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), two), 2);
+        __m128i t23 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), two), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(t01, t23));
+    }
+#endif
+
+    for (; x < x1; x++) {
+        int left = 2 * x;
+        int right = left + 1 < srcWidth ? left + 1 : left;
+        uint32_t a = row0[left], b = row0[right], c = row1[left], d = row1[right];
+        uint32_t texel = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t sum = ((a >> shift) & 0xFF) + ((b >> shift) & 0xFF) + ((c >> shift) & 0xFF) + ((d >> shift) & 0xFF);
+            texel |= ((sum + 2) >> 2) << shift;
+        }
+        out[x] = texel;
+    }
+}
+
+class MipPyramid {
+public:
+    MipPyramid() : sourceWidth(0), sourceHeight(0) {}
+
+    // Уровни для изображения width x height: первый - вдвое меньше, последний - наименьший,
+    // у которого большая сторона не меньше minSize (или первый, если изображение мало)
+    void Resize(int width, int height, int minSize)
+    {
+        sourceWidth = width > 0 ? width : 0;
+        sourceHeight = height > 0 ? height : 0;
+        levels.clear();
+
+        int w = sourceWidth, h = sourceHeight;
+        while (w > 1 || h > 1) {
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+            levels.push_back({ w, h, std::vector<uint32_t>(static_cast<size_t>(w) * h, 0xFFFFFFFF) });
+            if ((w > h ? w : h) / 2 < minSize) break;
+        }
+    }
+
+    int SourceWidth() const { return sourceWidth; }
+    int SourceHeight() const { return sourceHeight; }
+    int Levels() const { return static_cast<int>(levels.size()); }
+    int Width(int level) const { return levels[level].width; }
+    int Height(int level) const { return levels[level].height; }
+    const uint32_t* Pixels(int level) const { return levels[level].pixels.data(); }
+
+    size_t MemoryBytes() const
+    {
+        size_t bytes = 0;
+        for (const Level& level : levels) bytes += level.pixels.capacity() * sizeof(uint32_t);
+        return bytes;
+    }
+
+    // Пересчёт texels всех уровней над прямоугольником rect исходного изображения
+    // (source - его пиксели, stride - длина строки в пикселях). Возвращает число texels.
+    size_t Update(const uint32_t* source, size_t stride, const MaskRect& rect)
+    {
+        int left = rect.left > 0 ? rect.left : 0;
+        int top = rect.top > 0 ? rect.top : 0;
+        int right = rect.right < sourceWidth ? rect.right : sourceWidth;
+        int bottom = rect.bottom < sourceHeight ? rect.bottom : sourceHeight;
+
+        size_t texels = 0;
+        const uint32_t* below = source;
+        size_t belowStride = stride;
+        int belowWidth = sourceWidth, belowHeight = sourceHeight;
+
+        for (Level& level : levels) {
+            if (left >= right || top >= bottom) break;
+
+            // Прямоугольник на этом уровне: texels, в квадраты которых он попадает
+            left /= 2;
+            top /= 2;
+            right = (right + 1) / 2;
+            bottom = (bottom + 1) / 2;
+
+            for (int y = top; y < bottom; y++) {
+                const uint32_t* row0 = below + static_cast<size_t>(2 * y) * belowStride;
+                const uint32_t* row1 = 2 * y + 1 < belowHeight ? row0 + belowStride : row0;
+                ReduceRow2x2(row0, row1, belowWidth, &level.pixels[static_cast<size_t>(y) * level.width], left, right);
+            }
+            texels += static_cast<size_t>(right - left) * (bottom - top);
+
+            below = level.pixels.data();
+            belowStride = level.width;
+            belowWidth = level.width;
+            belowHeight = level.height;
+        }
+        return texels;
+    }
+
+private:
+    struct Level {
+        int width, height;
+        std::vector<uint32_t> pixels;
+    };
+
+    int sourceWidth, sourceHeight;
+    std::vector<Level> levels;
+};
@@ -0,0 +1,155 @@
+﻿// ObjectBins.h: пространственные корзины объектов слоя - равномерная сетка ячеек
+//
+// Холст делится на квадратные ячейки, в каждой ячейке - номера объектов, чьи габариты
+// её задевают, по возрастанию (в порядке рисования). Номера всех ячеек лежат одним
+// массивом подряд, начало ячейки - в offsets: сетка строится в два прохода (подсчёт,
+// затем раскладка) без отдельного вектора на ячейку. Перерисовка ячейки перебирает
+// только её объекты, а не все объекты слоя.
+//
+// Сетка не обновляется при правках: объекты, добавленные после построения (номера от
+// Count()), перебираются отдельно, а сдвигать и удалять объекты, пока сетка нужна, нельзя.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include "SpanMask.h"
+
+class ObjectBins {
+public:
+    // Номера объектов одной ячейки
+    struct Range {
+        const uint32_t* first;
+        const uint32_t* last;
+        const uint32_t* begin() const { return first; }
+        const uint32_t* end() const { return last; }
+        size_t size() const { return static_cast<size_t>(last - first); }
+    };
+
+    ObjectBins() : width(0), height(0), cellSize(1), cellsX(0), cellsY(0), count(0) {}
+
+    // Сетка над [0, width) x [0, height) для count объектов; bounds(i) - габариты объекта i.
+    // Объекты вне холста и с пустыми габаритами ни в одну ячейку не попадают.
+    template <typename Bounds>
+    void Build(size_t objectCount, int canvasWidth, int canvasHeight, int size, Bounds bounds)
+    {
+        width = canvasWidth > 0 ? canvasWidth : 0;
+        height = canvasHeight > 0 ? canvasHeight : 0;
+        cellSize = size > 0 ? size : 1;
+        cellsX = (width + cellSize - 1) / cellSize;
+        cellsY = (height + cellSize - 1) / cellSize;
+        count = objectCount;
+        offsets.assign(static_cast<size_t>(cellsX) * cellsY + 1, 0);
+        indices.clear();
+
+        // Диапазоны ячеек объектов считаются один раз и нужны в обоих проходах
+        std::vector<MaskRect> spans(objectCount);
+        for (size_t i = 0; i < objectCount; i++) {
+            spans[i] = CellSpan(bounds(i));
+            for (int cy = spans[i].top; cy < spans[i].bottom; cy++) {
+                for (int cx = spans[i].left; cx < spans[i].right; cx++) {
+                    offsets[static_cast<size_t>(cy) * cellsX + cx + 1]++;
+                }
+            }
+        }
+        for (size_t c = 1; c < offsets.size(); c++) offsets[c] += offsets[c - 1];
+
+        indices.resize(offsets.back());
+        std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < objectCount; i++) {
+            for (int cy = spans[i].top; cy < spans[i].bottom; cy++) {
+                for (int cx = spans[i].left; cx < spans[i].right; cx++) {
+                    indices[fill[static_cast<size_t>(cy) * cellsX + cx]++] = static_cast<uint32_t>(i);
+                }
+            }
+        }
+    }
+
+    void Clear()
+    {
+        width = height = 0;
+        cellsX = cellsY = 0;
+        count = 0;
+        offsets.clear();
+        indices.clear();
+        offsets.shrink_to_fit();
+        indices.shrink_to_fit();
+    }
+
+    bool Empty() const { return offsets.empty(); }
+    size_t Count() const { return count; }
+    int CellSize() const { return cellSize; }
+    int CellsX() const { return cellsX; }
+    int CellsY() const { return cellsY; }
+    size_t CellCount() const { return static_cast<size_t>(cellsX) * cellsY; }
+    size_t MemoryBytes() const { return offsets.capacity() * sizeof(size_t) + indices.capacity() * sizeof(uint32_t); }
+
+    Range Cell(size_t cell) const
+    {
+        if (cell >= CellCount()) return { nullptr, nullptr };
+        return { indices.data() + offsets[cell], indices.data() + offsets[cell + 1] };
+    }
+
+    MaskRect CellRect(size_t cell) const
+    {
+        int cx = static_cast<int>(cell % cellsX), cy = static_cast<int>(cell / cellsX);
+        return { cx * cellSize, cy * cellSize, (cx + 1) * cellSize, (cy + 1) * cellSize };
+    }
+
+private:
+    // Ячейки [left, right) x [top, bottom), которые задевает часть прямоугольника на холсте
+    MaskRect CellSpan(const MaskRect& rect) const
+    {
+        int left = rect.left > 0 ? rect.left : 0;
+        int top = rect.top > 0 ? rect.top : 0;
+        int right = rect.right < width ? rect.right : width;
+        int bottom = rect.bottom < height ? rect.bottom : height;
+        if (left >= right || top >= bottom) return { 0, 0, 0, 0 };
+        return { left / cellSize, top / cellSize, (right - 1) / cellSize + 1, (bottom - 1) / cellSize + 1 };
+    }
+
+    int width, height;
+    int cellSize;
+    int cellsX, cellsY;
+    size_t count;
+    std::vector<size_t> offsets;     // CellCount() + 1 начал ячеек в indices
+    std::vector<uint32_t> indices;
+};
+
+// Ячейки сетки cellsX x cellsY (сторона cellSize) по удалённости от области view:
+// сначала задевающие её, затем по расстоянию до неё, при равенстве - ближе к её центру
+inline std::vector<size_t> CellsByDistance(int cellsX, int cellsY, int cellSize, const MaskRect& view)
+{
+    struct Entry {
+        long long distance, center;
+        size_t cell;
+    };
+
+    long long centerX = (static_cast<long long>(view.left) + view.right) / 2;
+    long long centerY = (static_cast<long long>(view.top) + view.bottom) / 2;
+
+    std::vector<Entry> entries;
+    entries.reserve(static_cast<size_t>(cellsX) * cellsY);
+    for (int cy = 0; cy < cellsY; cy++) {
+        for (int cx = 0; cx < cellsX; cx++) {
+            long long left = static_cast<long long>(cx) * cellSize, right = left + cellSize;
+            long long top = static_cast<long long>(cy) * cellSize, bottom = top + cellSize;
+            long long dx = left >= view.right ? left - view.right + 1 : (right <= view.left ? view.left - right + 1 : 0);
+            long long dy = top >= view.bottom ? top - view.bottom + 1 : (bottom <= view.top ? view.top - bottom + 1 : 0);
+            long long cx2 = (left + right) / 2 - centerX, cy2 = (top + bottom) / 2 - centerY;
+            entries.push_back({ dx * dx + dy * dy, cx2 * cx2 + cy2 * cy2, static_cast<size_t>(cy) * cellsX + cx });
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.distance != b.distance ? a.distance < b.distance : a.center < b.center;
+    });
+
+    std::vector<size_t> order;
+    order.reserve(entries.size());
+    for (const Entry& entry : entries) order.push_back(entry.cell);
+    return order;
+}
@@ -0,0 +1,544 @@
+﻿// PaintDocument.h: документ SimplePaint (объекты слоёв и их таблицы) и его двоичный формат .spd
+//
+// Заголовок не зависит от windows.h: его читает и редактор, и консольный рендерер,
+// который работает на сервере без дисплея. Все числа пишутся в little-endian
+// побайтно, поэтому файл одинаков на любой платформе.
+//
+// Формат (версия 2):
+//   "SPD1", u32 версия, i32 ширина, i32 высота
+//   u32 N, N масок заливок          (маска: i32 anchorX, i32 anchorY, u32 M, M x (i32 y, left, right))
+//   u32 N, N масок выделений
+//   u32 N, N фрагментов             (i32 w, i32 h, маска, w*h x u32 пикселей PARGB)
+//   u32 N, N слоёв снизу вверх      (u32 длина, UTF-16 имя, u8 видимость, u8 непрозрачность,
+//                                    u32 M, M объектов)
+//   разделы                         (u32 тег, u32 длина, данные), u32 0 - конец документа
+//
+// В разделах лежат таблицы, на которые ссылаются объекты новых типов; раздел с
+// незнакомым тегом пропускается целиком. Версия 1 - тот же формат без разделов и без
+// завершающего нуля.
+//   надписи   u32 N, N x (строка: u32 длина, UTF-16; i32 left, top, w, h; w*h x u8 покрытия)
+//             покрытие - надпись, растеризованная редактором; left, top - от начала объекта
+//   многоуг.  u32 N, N x (i32 правило, i32 x 4 рамка построения, u32 M, M x (i32 x, i32 y))
+//   градиент  u32 N, N x (u32 конечный цвет, i32 вид, u32 маска заливки)
+//
+// Файл может быть обрезан или испорчен, поэтому при чтении размеры проверяются до
+// выделения памяти: число записей - по оставшейся длине потока (у каждой записи есть
+// минимальный размер), стороны холста и фрагментов - по DOCUMENT_MAX_SIDE. Таблицы
+// растут по мере чтения записей, а не резервируются по числу из файла.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <cstdint>
+#include <cstddef>
+
+#include "SpanMask.h"
+#include "TiledImage.h"
+
+// Типы объектов совпадают с типами DrawingObject в редакторе
+enum DocObjectType {
+    DOC_PENCIL = 0,
+    DOC_RECTANGLE = 1,
+    DOC_BRUSH = 3,
+    DOC_ERASER = 4,
+    DOC_CIRCLE = 5,
+    DOC_FILL = 6,             // payload - маска заливки (индекс + 1)
+    DOC_FRAGMENT = 9,         // payload - фрагмент (индекс + 1)
+    DOC_CLEARED_RECT = 10,
+    DOC_CLEARED_MASK = 12,    // payload - маска заливки, пиксели становятся прозрачными
+    DOC_TEXT = 13,            // payload - надпись (индекс + 1)
+    DOC_FILLED_RECT = 14,
+    DOC_FILLED_ELLIPSE = 15,  // эллипс, вписанный в рамку
+    DOC_POLYGON = 16,         // payload - многоугольник (индекс + 1), вершины отображаются в рамку объекта
+    DOC_GRADIENT = 17         // payload - градиент (индекс + 1) от цвета объекта в начале к концу
+};
+
+// Теги разделов документа
+enum DocSectionTag : uint32_t {
+    DOC_SECTION_TEXTS = 1,
+    DOC_SECTION_POLYGONS = 2,
+    DOC_SECTION_GRADIENTS = 3
+};
+
+// Формы кисти совпадают с BrushShape редактора
+enum DocBrushShape {
+    DOC_BRUSH_CIRCLE = 0,
+    DOC_BRUSH_SQUARE = 1,
+    DOC_BRUSH_ELLIPSE = 2,
+    DOC_BRUSH_RECTANGLE = 3,
+    DOC_BRUSH_TRIANGLE = 4
+};
+
+struct DocObject {
+    int32_t type;
+    int32_t startX, startY, endX, endY;
+    int32_t thickness;
+    uint32_t color;           // COLORREF: 0x00BBGGRR
+    int32_t brushShape;
+    bool clipped;             // рисовался с активным выделением
+    MaskRect clip;            // рамка выделения
+    uint32_t clipMask;        // маска выделения (индекс + 1, 0 - прямоугольное)
+    uint32_t payload;
+};
+
+struct DocLayer {
+    std::u16string name;
+    bool visible;
+    int opacity;              // 0..255
+    std::vector<DocObject> objects;
+};
+
+struct DocFragment {
+    TiledImage image;
+    SpanMask mask;            // в координатах фрагмента; пустая - фрагмент прямоугольный
+};
+
+// Надпись: строка для редактора и её покрытие для рендерера, у которого нет шрифтов
+struct DocText {
+    std::u16string text;
+    int32_t left = 0, top = 0;        // угол покрытия относительно начала объекта
+    int32_t width = 0, height = 0;
+    std::vector<uint8_t> coverage;    // width * height, 0..255
+};
+
+// Закрашенный многоугольник: вершины в рамке, в которой он строился. Объект хранит
+// текущую рамку, и вершины отображаются в неё (масштабирование маркерами)
+struct DocPoint {
+    int32_t x, y;
+};
+
+struct DocPolygon {
+    int32_t rule = 0;                 // FillRule: 0 - чёт-нечёт, 1 - ненулевой индекс
+    MaskRect bounds = { 0, 0, 0, 0 };
+    std::vector<DocPoint> points;
+};
+
+// Градиент: область - маска заливки (сдвигается вместе с началом объекта), а без
+// маски - выделение, с которым объект рисовался
+struct DocGradient {
+    uint32_t endColor = 0;            // COLORREF в конечной точке
+    int32_t kind = 0;                 // GradientKind: 0 - линейный, 1 - радиальный
+    uint32_t mask = 0;                // маска заливки (индекс + 1), 0 - область задана выделением
+};
+
+struct PaintDocument {
+    int width = 0, height = 0;
+    std::vector<DocLayer> layers;
+    std::vector<SpanMask> fillMasks;
+    std::vector<SpanMask> selectionMasks;
+    std::vector<DocFragment> fragments;
+    std::vector<DocText> texts;
+    std::vector<DocPolygon> polygons;
+    std::vector<DocGradient> gradients;
+};
+
+const uint32_t DOCUMENT_VERSION = 2;
+
+// Наибольшая сторона холста и фрагмента в документе
+const int32_t DOCUMENT_MAX_SIDE = 32768;
+
+// Минимальные размеры записей в байтах (для проверки числа записей)
+const uint64_t DOC_MASK_MIN_BYTES = 12;
+const uint64_t DOC_RUN_BYTES = 12;
+const uint64_t DOC_FRAGMENT_MIN_BYTES = 8 + DOC_MASK_MIN_BYTES;
+const uint64_t DOC_LAYER_MIN_BYTES = 10;
+const uint64_t DOC_OBJECT_BYTES = 60;
+const uint64_t DOC_TEXT_MIN_BYTES = 20;
+const uint64_t DOC_POLYGON_MIN_BYTES = 24;
+const uint64_t DOC_GRADIENT_BYTES = 12;
+
+inline void WriteDocU32(std::ostream& out, uint32_t value)
+{
+    char bytes[4] = {
+        static_cast<char>(value & 0xFF), static_cast<char>((value >> 8) & 0xFF),
+        static_cast<char>((value >> 16) & 0xFF), static_cast<char>((value >> 24) & 0xFF)
+    };
+    out.write(bytes, 4);
+}
+
+inline void WriteDocI32(std::ostream& out, int32_t value)
+{
+    WriteDocU32(out, static_cast<uint32_t>(value));
+}
+
+inline bool ReadDocU32(std::istream& in, uint32_t& value)
+{
+    unsigned char bytes[4];
+    if (!in.read(reinterpret_cast<char*>(bytes), 4)) return false;
+    value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+    return true;
+}
+
+inline bool ReadDocI32(std::istream& in, int32_t& value)
+{
+    uint32_t raw;
+    if (!ReadDocU32(in, raw)) return false;
+    value = static_cast<int32_t>(raw);
+    return true;
+}
+
+// Байт до конца потока; у потока без позиционирования длина неизвестна, и тогда
+// размеры ограничивает только само чтение (память растёт вместе с прочитанным)
+inline uint64_t DocBytesLeft(std::istream& in)
+{
+    std::streampos position = in.tellg();
+    if (position < 0) return UINT64_MAX;
+    in.seekg(0, std::ios::end);
+    std::streampos end = in.tellg();
+    in.seekg(position);
+    if (end < 0 || !in) return UINT64_MAX;
+    return end > position ? static_cast<uint64_t>(end - position) : 0;
+}
+
+// В потоке хватит места на count записей не меньше minBytes каждая
+inline bool DocCountFits(std::istream& in, uint32_t count, uint64_t minBytes)
+{
+    return count <= DocBytesLeft(in) / minBytes;
+}
+
+inline void WriteDocMask(std::ostream& out, const SpanMask& mask)
+{
+    WriteDocI32(out, mask.AnchorX());
+    WriteDocI32(out, mask.AnchorY());
+    WriteDocU32(out, static_cast<uint32_t>(mask.Runs().size()));
+    for (const auto& run : mask.Runs()) {
+        WriteDocI32(out, run.y);
+        WriteDocI32(out, run.left);
+        WriteDocI32(out, run.right);
+    }
+}
+
+inline bool ReadDocMask(std::istream& in, SpanMask& mask)
+{
+    int32_t anchorX, anchorY;
+    uint32_t count;
+    if (!ReadDocI32(in, anchorX) || !ReadDocI32(in, anchorY) || !ReadDocU32(in, count)) return false;
+    if (!DocCountFits(in, count, DOC_RUN_BYTES)) return false;
+
+    mask.Clear();
+    mask.SetAnchor(anchorX, anchorY);
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t y, left, right;
+        if (!ReadDocI32(in, y) || !ReadDocI32(in, left) || !ReadDocI32(in, right)) return false;
+        mask.AddRun(y, left, right);
+    }
+    mask.Normalize();
+    return true;
+}
+
+inline void WriteDocObject(std::ostream& out, const DocObject& obj)
+{
+    WriteDocI32(out, obj.type);
+    WriteDocI32(out, obj.startX);
+    WriteDocI32(out, obj.startY);
+    WriteDocI32(out, obj.endX);
+    WriteDocI32(out, obj.endY);
+    WriteDocI32(out, obj.thickness);
+    WriteDocU32(out, obj.color);
+    WriteDocI32(out, obj.brushShape);
+    WriteDocU32(out, obj.clipped ? 1 : 0);
+    WriteDocI32(out, obj.clip.left);
+    WriteDocI32(out, obj.clip.top);
+    WriteDocI32(out, obj.clip.right);
+    WriteDocI32(out, obj.clip.bottom);
+    WriteDocU32(out, obj.clipMask);
+    WriteDocU32(out, obj.payload);
+}
+
+inline bool ReadDocObject(std::istream& in, DocObject& obj)
+{
+    uint32_t clipped;
+    bool ok = ReadDocI32(in, obj.type) &&
+        ReadDocI32(in, obj.startX) && ReadDocI32(in, obj.startY) &&
+        ReadDocI32(in, obj.endX) && ReadDocI32(in, obj.endY) &&
+        ReadDocI32(in, obj.thickness) && ReadDocU32(in, obj.color) &&
+        ReadDocI32(in, obj.brushShape) && ReadDocU32(in, clipped) &&
+        ReadDocI32(in, obj.clip.left) && ReadDocI32(in, obj.clip.top) &&
+        ReadDocI32(in, obj.clip.right) && ReadDocI32(in, obj.clip.bottom) &&
+        ReadDocU32(in, obj.clipMask) && ReadDocU32(in, obj.payload);
+    obj.clipped = clipped != 0;
+    return ok;
+}
+
+inline void WriteDocString(std::ostream& out, const std::u16string& text)
+{
+    WriteDocU32(out, static_cast<uint32_t>(text.size()));
+    for (char16_t ch : text) {
+        char bytes[2] = { static_cast<char>(ch & 0xFF), static_cast<char>((ch >> 8) & 0xFF) };
+        out.write(bytes, 2);
+    }
+}
+
+inline bool ReadDocString(std::istream& in, std::u16string& text)
+{
+    uint32_t length;
+    if (!ReadDocU32(in, length) || !DocCountFits(in, length, 2)) return false;
+    text.clear();
+    for (uint32_t i = 0; i < length; i++) {
+        unsigned char bytes[2];
+        if (!in.read(reinterpret_cast<char*>(bytes), 2)) return false;
+        text.push_back(static_cast<char16_t>(bytes[0] | (bytes[1] << 8)));
+    }
+    return true;
+}
+
+inline void WriteDocText(std::ostream& out, const DocText& text)
+{
+    WriteDocString(out, text.text);
+    WriteDocI32(out, text.left);
+    WriteDocI32(out, text.top);
+    WriteDocI32(out, text.width);
+    WriteDocI32(out, text.height);
+    out.write(reinterpret_cast<const char*>(text.coverage.data()), static_cast<std::streamsize>(text.coverage.size()));
+}
+
+inline bool ReadDocText(std::istream& in, DocText& text)
+{
+    if (!ReadDocString(in, text.text) || !ReadDocI32(in, text.left) || !ReadDocI32(in, text.top) ||
+        !ReadDocI32(in, text.width) || !ReadDocI32(in, text.height)) return false;
+    if (text.width < 0 || text.height < 0 || text.width > DOCUMENT_MAX_SIDE || text.height > DOCUMENT_MAX_SIDE) return false;
+
+    uint64_t size = static_cast<uint64_t>(text.width) * static_cast<uint64_t>(text.height);
+    if (size > DocBytesLeft(in)) return false;
+    text.coverage.resize(static_cast<size_t>(size));
+    return size == 0 || static_cast<bool>(in.read(reinterpret_cast<char*>(text.coverage.data()), static_cast<std::streamsize>(size)));
+}
+
+inline void WriteDocPolygon(std::ostream& out, const DocPolygon& polygon)
+{
+    WriteDocI32(out, polygon.rule);
+    WriteDocI32(out, polygon.bounds.left);
+    WriteDocI32(out, polygon.bounds.top);
+    WriteDocI32(out, polygon.bounds.right);
+    WriteDocI32(out, polygon.bounds.bottom);
+    WriteDocU32(out, static_cast<uint32_t>(polygon.points.size()));
+    for (const DocPoint& point : polygon.points) {
+        WriteDocI32(out, point.x);
+        WriteDocI32(out, point.y);
+    }
+}
+
+inline bool ReadDocPolygon(std::istream& in, DocPolygon& polygon)
+{
+    uint32_t count;
+    if (!ReadDocI32(in, polygon.rule) || !ReadDocI32(in, polygon.bounds.left) || !ReadDocI32(in, polygon.bounds.top) ||
+        !ReadDocI32(in, polygon.bounds.right) || !ReadDocI32(in, polygon.bounds.bottom) ||
+        !ReadDocU32(in, count) || !DocCountFits(in, count, 8)) return false;
+    if (polygon.rule != 0 && polygon.rule != 1) return false;
+
+    polygon.points.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        DocPoint point;
+        if (!ReadDocI32(in, point.x) || !ReadDocI32(in, point.y)) return false;
+        polygon.points.push_back(point);
+    }
+    return true;
+}
+
+// Раздел: тег, длина данных, данные
+inline void WriteDocSection(std::ostream& out, DocSectionTag tag, const std::string& data)
+{
+    WriteDocU32(out, tag);
+    WriteDocU32(out, static_cast<uint32_t>(data.size()));
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+// Данные раздела; записи читаются так же, как таблицы в начале файла
+inline bool ReadDocSection(DocSectionTag tag, std::istream& in, PaintDocument& doc)
+{
+    uint32_t count;
+    switch (tag) {
+    case DOC_SECTION_TEXTS:
+        if (!ReadDocU32(in, count) || !DocCountFits(in, count, DOC_TEXT_MIN_BYTES)) return false;
+        for (uint32_t i = 0; i < count; i++) {
+            DocText text;
+            if (!ReadDocText(in, text)) return false;
+            doc.texts.push_back(std::move(text));
+        }
+        return true;
+
+    case DOC_SECTION_POLYGONS:
+        if (!ReadDocU32(in, count) || !DocCountFits(in, count, DOC_POLYGON_MIN_BYTES)) return false;
+        for (uint32_t i = 0; i < count; i++) {
+            DocPolygon polygon;
+            if (!ReadDocPolygon(in, polygon)) return false;
+            doc.polygons.push_back(std::move(polygon));
+        }
+        return true;
+
+    case DOC_SECTION_GRADIENTS:
+        if (!ReadDocU32(in, count) || !DocCountFits(in, count, DOC_GRADIENT_BYTES)) return false;
+        for (uint32_t i = 0; i < count; i++) {
+            DocGradient gradient;
+            if (!ReadDocU32(in, gradient.endColor) || !ReadDocI32(in, gradient.kind) || !ReadDocU32(in, gradient.mask)) return false;
+            if ((gradient.kind != 0 && gradient.kind != 1) || gradient.mask > doc.fillMasks.size()) return false;
+            doc.gradients.push_back(gradient);
+        }
+        return true;
+    }
+    return true;
+}
+
+inline bool SaveDocument(std::ostream& out, const PaintDocument& doc)
+{
+    out.write("SPD1", 4);
+    WriteDocU32(out, DOCUMENT_VERSION);
+    WriteDocI32(out, doc.width);
+    WriteDocI32(out, doc.height);
+
+    WriteDocU32(out, static_cast<uint32_t>(doc.fillMasks.size()));
+    for (const auto& mask : doc.fillMasks) WriteDocMask(out, mask);
+
+    WriteDocU32(out, static_cast<uint32_t>(doc.selectionMasks.size()));
+    for (const auto& mask : doc.selectionMasks) WriteDocMask(out, mask);
+
+    WriteDocU32(out, static_cast<uint32_t>(doc.fragments.size()));
+    std::vector<uint32_t> row;
+    for (const auto& fragment : doc.fragments) {
+        int width = fragment.image.Width();
+        int height = fragment.image.Height();
+        WriteDocI32(out, width);
+        WriteDocI32(out, height);
+        WriteDocMask(out, fragment.mask);
+
+        row.resize(width > 0 ? width : 0);
+        for (int y = 0; y < height; y++) {
+            fragment.image.ReadRect(0, y, width, 1, row.data(), width);
+            for (int x = 0; x < width; x++) WriteDocU32(out, row[x]);
+        }
+    }
+
+    WriteDocU32(out, static_cast<uint32_t>(doc.layers.size()));
+    for (const auto& layer : doc.layers) {
+        WriteDocString(out, layer.name);
+        char flags[2] = { static_cast<char>(layer.visible ? 1 : 0), static_cast<char>(layer.opacity & 0xFF) };
+        out.write(flags, 2);
+
+        WriteDocU32(out, static_cast<uint32_t>(layer.objects.size()));
+        for (const auto& obj : layer.objects) WriteDocObject(out, obj);
+    }
+
+    if (!doc.texts.empty()) {
+        std::ostringstream section(std::ios::binary);
+        WriteDocU32(section, static_cast<uint32_t>(doc.texts.size()));
+        for (const auto& text : doc.texts) WriteDocText(section, text);
+        WriteDocSection(out, DOC_SECTION_TEXTS, section.str());
+    }
+    if (!doc.polygons.empty()) {
+        std::ostringstream section(std::ios::binary);
+        WriteDocU32(section, static_cast<uint32_t>(doc.polygons.size()));
+        for (const auto& polygon : doc.polygons) WriteDocPolygon(section, polygon);
+        WriteDocSection(out, DOC_SECTION_POLYGONS, section.str());
+    }
+    if (!doc.gradients.empty()) {
+        std::ostringstream section(std::ios::binary);
+        WriteDocU32(section, static_cast<uint32_t>(doc.gradients.size()));
+        for (const auto& gradient : doc.gradients) {
+            WriteDocU32(section, gradient.endColor);
+            WriteDocI32(section, gradient.kind);
+            WriteDocU32(section, gradient.mask);
+        }
+        WriteDocSection(out, DOC_SECTION_GRADIENTS, section.str());
+    }
+    WriteDocU32(out, 0);
+
+    return static_cast<bool>(out);
+}
+
+inline bool LoadDocument(std::istream& in, PaintDocument& doc)
+{
+    char magic[4];
+    uint32_t version, count;
+    if (!in.read(magic, 4) || magic[0] != 'S' || magic[1] != 'P' || magic[2] != 'D' || magic[3] != '1') return false;
+    if (!ReadDocU32(in, version) || version < 1 || version > DOCUMENT_VERSION) return false;
+
+    int32_t width, height;
+    if (!ReadDocI32(in, width) || !ReadDocI32(in, height) || width < 0 || height < 0 ||
+        width > DOCUMENT_MAX_SIDE || height > DOCUMENT_MAX_SIDE) return false;
+    doc = PaintDocument();
+    doc.width = width;
+    doc.height = height;
+
+    if (!ReadDocU32(in, count) || !DocCountFits(in, count, DOC_MASK_MIN_BYTES)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        SpanMask mask;
+        if (!ReadDocMask(in, mask)) return false;
+        doc.fillMasks.push_back(std::move(mask));
+    }
+
+    if (!ReadDocU32(in, count) || !DocCountFits(in, count, DOC_MASK_MIN_BYTES)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        SpanMask mask;
+        if (!ReadDocMask(in, mask)) return false;
+        doc.selectionMasks.push_back(std::move(mask));
+    }
+
+    if (!ReadDocU32(in, count) || !DocCountFits(in, count, DOC_FRAGMENT_MIN_BYTES)) return false;
+    std::vector<uint32_t> row;
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t fragmentWidth, fragmentHeight;
+        DocFragment fragment;
+        if (!ReadDocI32(in, fragmentWidth) || !ReadDocI32(in, fragmentHeight) ||
+            fragmentWidth < 0 || fragmentHeight < 0 ||
+            fragmentWidth > DOCUMENT_MAX_SIDE || fragmentHeight > DOCUMENT_MAX_SIDE) return false;
+        if (!ReadDocMask(in, fragment.mask)) return false;
+
+        // Пиксели фрагмента должны быть в файле целиком
+        uint64_t pixelBytes = static_cast<uint64_t>(fragmentWidth) * static_cast<uint64_t>(fragmentHeight) * 4;
+        if (pixelBytes > DocBytesLeft(in)) return false;
+
+        fragment.image = TiledImage(fragmentWidth, fragmentHeight, 0);
+        row.resize(fragmentWidth);
+        for (int y = 0; y < fragmentHeight; y++) {
+            for (int x = 0; x < fragmentWidth; x++) {
+                if (!ReadDocU32(in, row[x])) return false;
+            }
+            fragment.image.WriteRect(0, y, fragmentWidth, 1, row.data(), fragmentWidth);
+        }
+        doc.fragments.push_back(std::move(fragment));
+    }
+
+    if (!ReadDocU32(in, count) || !DocCountFits(in, count, DOC_LAYER_MIN_BYTES)) return false;
+    for (uint32_t layerIndex = 0; layerIndex < count; layerIndex++) {
+        DocLayer layer;
+        if (!ReadDocString(in, layer.name)) return false;
+
+        unsigned char flags[2];
+        if (!in.read(reinterpret_cast<char*>(flags), 2)) return false;
+        layer.visible = flags[0] != 0;
+        layer.opacity = flags[1];
+
+        uint32_t objectCount;
+        if (!ReadDocU32(in, objectCount) || !DocCountFits(in, objectCount, DOC_OBJECT_BYTES)) return false;
+        for (uint32_t i = 0; i < objectCount; i++) {
+            DocObject obj;
+            if (!ReadDocObject(in, obj)) return false;
+            layer.objects.push_back(obj);
+        }
+        doc.layers.push_back(std::move(layer));
+    }
+
+    // Разделы до нулевого тега; файл, оборванный раньше, повреждён
+    while (version >= 2) {
+        uint32_t tag, length;
+        if (!ReadDocU32(in, tag)) return false;
+        if (tag == 0) break;
+        if (!ReadDocU32(in, length) || length > DocBytesLeft(in)) return false;
+
+        // Длина из испорченного файла может быть мусором - данные читаются кусками
+        std::string data;
+        char chunk[4096];
+        for (uint32_t left = length; left > 0; left -= static_cast<uint32_t>(in.gcount())) {
+            if (!in.read(chunk, left < sizeof(chunk) ? left : sizeof(chunk))) return false;
+            data.append(chunk, static_cast<size_t>(in.gcount()));
+        }
+        std::istringstream section(data, std::ios::binary);
+        if (!ReadDocSection(static_cast<DocSectionTag>(tag), section, doc)) return false;
+    }
+
+    return true;
+}
\ No newline at end of file
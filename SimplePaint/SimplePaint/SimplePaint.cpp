@@ -3,10 +3,14 @@
 #include <windowsx.h>
 #include <commdlg.h>
 #include <commctrl.h>
+#include <psapi.h>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <queue>
+#include <fstream>
+#include <sstream>
+#include <memory>
 
 // Определения идентификаторов элементов управления
 #define ID_TOOLBAR              1000
@@ -14,6 +18,23 @@
 #define ID_THICKNESS_TRACKBAR   1002
 #define ID_CLEAR_BUTTON         1003
 #define ID_BRUSH_SHAPE_COMBO    1004
+#define ID_SIMPLIFY_CHECK       1005
+#define ID_TOLERANCE_TRACKBAR   1006
+#define ID_FILL_DISTANCE_COMBO  1007
+#define ID_FILL_8WAY_CHECK      1008
+#define ID_LAYER_COMBO          1009
+#define ID_LAYER_ADD_BUTTON     1010
+#define ID_LAYER_DELETE_BUTTON  1011
+#define ID_LAYER_UP_BUTTON      1012
+#define ID_LAYER_DOWN_BUTTON    1013
+#define ID_LAYER_VISIBLE_CHECK  1014
+#define ID_LAYER_OPACITY_TRACKBAR 1015
+#define ID_INDEXED_CHECK        1016
+#define ID_FILL_SHAPES_CHECK    1017
+#define ID_FILL_RULE_COMBO      1018
+#define ID_GRADIENT_COLOR_BUTTON 1019
+#define ID_GRADIENT_KIND_COMBO  1020
+#define ID_FILTER_COMBO         1021
 #define ID_PENCIL_BUTTON        1101
 #define ID_BRUSH_BUTTON         1102
 #define ID_ERASER_BUTTON        1103
@@ -24,15 +45,46 @@
 #define ID_SAVE_BUTTON          1108
 #define ID_SELECTION_BUTTON     1109
 #define ID_ZOOM_BUTTON          1110
+#define ID_MAGIC_WAND_BUTTON    1111
+#define ID_TIMELAPSE_BUTTON     1112
+#define ID_TEXT_BUTTON          1113
+#define ID_POLYGON_BUTTON       1114
+#define ID_GRADIENT_BUTTON      1115
+#define ID_OPEN_BUTTON          1116
+
+// Сообщения потока сохранения: wParam - проценты (WM_SAVE_PROGRESS) или успех (WM_SAVE_DONE)
+#define WM_SAVE_PROGRESS        (WM_APP + 1)
+#define WM_SAVE_DONE            (WM_APP + 2)
 
 // Подключаем GDI+ для расширенной графики
 #include <gdiplus.h>
 #pragma comment(lib, "gdiplus.lib")
 #pragma comment(lib, "comdlg32.lib")
 #pragma comment(lib, "comctl32.lib")
+#pragma comment(lib, "psapi.lib")
 
 using namespace Gdiplus;
 
+#include "DrawingStore.h"
+#include "DamageTracker.h"
+#include "StrokeSimplify.h"
+#include "TiledImage.h"
+#include "SpanMask.h"
+#include "FloodFill.h"
+#include "LayerBlend.h"
+#include "IndexedRaster.h"
+#include "PaintDocument.h"
+#include "TimelapseEncoder.h"
+#include "BackgroundSaver.h"
+#include "EditJournal.h"
+#include "ObjectBins.h"
+#include "MipPyramid.h"
+#include "MemoryStats.h"
+#include "GlyphAtlas.h"
+#include "ScanlineFill.h"
+#include "GradientFill.h"
+#include "../../ImageCore/ImageFilters.h"
+
 // Глобальные переменные
 HINSTANCE hInst;
 WCHAR szTitle[100] = L"Графический редактор - Улучшенная версия";
@@ -44,6 +96,26 @@ const COLORREF BACKGROUND_COLOR = RGB(255, 255, 255);
 const int TOOLBAR_HEIGHT = 80;
 const int SIDEBAR_WIDTH = 100;
 
+// Типы объектов, которые создаются не инструментами панели
+const int OBJECT_FRAGMENT = 9;       // вставленный фрагмент растра
+const int OBJECT_CLEARED_RECT = 10;  // вырезанная область, ставшая прозрачной
+const int OBJECT_CLEARED_MASK = 12;  // вырезанное выделение произвольной формы (payload как у заливки)
+const int OBJECT_TEXT = 13;          // надпись (payload - строка в textStrings; инструмент с тем же номером)
+const int OBJECT_FILLED_RECT = 14;   // закрашенный прямоугольник
+const int OBJECT_FILLED_ELLIPSE = 15; // закрашенный эллипс, вписанный в рамку
+const int OBJECT_POLYGON = 16;       // закрашенный многоугольник (payload - вершины в fillPolygons; инструмент с тем же номером)
+const int OBJECT_GRADIENT = 17;      // градиент от начала к концу (payload - gradientFills; инструмент с тем же номером)
+
+// Инструменты, не создающие объектов (номера не пересекаются с типами объектов)
+const int TOOL_MAGIC_WAND = 11;
+
+// Перевод COLORREF (0x00BBGGRR) в непрозрачный пиксель слоя (0xFFRRGGBB)
+inline uint32_t ColorToPixel(COLORREF color)
+{
+    return 0xFF000000 | (static_cast<uint32_t>(GetRValue(color)) << 16) |
+        (static_cast<uint32_t>(GetGValue(color)) << 8) | GetBValue(color);
+}
+
 // Перечисление форм кисти
 enum BrushShape {
     BRUSH_CIRCLE = 0,
@@ -61,18 +133,6 @@ enum SelectionMode {
     SELECTION_RESIZING = 3
 };
 
-// Структура для объектов рисования
-struct DrawingObject {
-    int type;
-    int startX, startY, endX, endY;
-    int thickness;
-    COLORREF color;
-    bool isSelected;
-    int brushShape;
-    bool wasDrawnWithSelection;
-    RECT selectionRect;
-};
-
 // Структура для выделения
 struct Selection {
     RECT rect;
@@ -80,10 +140,31 @@ struct Selection {
     SelectionMode mode;
     int resizeHandle;
     int originalStartX, originalStartY, originalEndX, originalEndY;
+    uint32_t mask;      // номер маски в selectionMasks (0 - прямоугольное выделение)
+};
+
+// 32-битная DIB-секция с прямым доступом к пикселям (строки сверху вниз)
+struct Surface {
+    HBITMAP bitmap;
+    HDC dc;
+    uint32_t* bits;
+};
+
+// Слой: свои объекты и свой растр (premultiplied ARGB, прозрачный там, где ничего не нарисовано).
+// Объекты активного слоя на время работы с ним переезжают в drawings (objects пуст).
+struct Layer {
+    int id;                 // постоянный номер слоя (для журнала правок)
+    std::wstring name;
+    bool visible;
+    int opacity;            // 0..255
+    DrawingStore objects;
+    Surface surface;
+    IndexedRaster indexed;  // растр неактивного слоя в режиме палитры (surface тогда пуст)
+    ObjectBins openBins;    // корзины объектов открытого документа, пока он дорисовывается
 };
 
 // Глобальные переменные для рисования
-std::vector<DrawingObject> drawings;
+DrawingStore drawings;      // объекты активного слоя
 bool isDrawing = false;
 bool isResizing = false;
 int currentTool = 0;
@@ -100,19 +181,239 @@ const int HANDLE_SIZE = 6;
 enum ResizeMode { NONE, TOP_LEFT, TOP_RIGHT, BOTTOM_LEFT, BOTTOM_RIGHT, MOVE };
 ResizeMode resizeMode = NONE;
 
+// Слои снизу вверх. Буфер рисования - растр активного слоя; холст - результат
+// наложения видимых слоёв на белый фон, собирается только в пределах повреждений.
+std::vector<Layer> layers;
+size_t activeLayer = 0;
+int layerCounter = 0;          // для имён новых слоёв
+Surface canvas = {};
+std::vector<uint32_t> compositeRow;  // строка слоя с палитрой, переведённая в пиксели
+
+// Режим палитры для схем: рисование без сглаживания, неактивные слои хранятся
+// индексами палитры (байт на пиксель); слой с числом цветов больше 256 остаётся 32-битным.
+// Активный слой всегда 32-битный: в его DIB-секцию рисуют GDI и GDI+
+bool indexedCanvas = false;
+
 // Переменные для двойной буферизации
-HBITMAP hBufferBitmap = NULL;
-HDC hBufferDC = NULL;
+HDC hBufferDC = NULL;          // DC растра активного слоя
 size_t bufferWidth = 0, bufferHeight = 0;
+size_t bufferCapacityWidth = 0, bufferCapacityHeight = 0; // реальный размер битмапов
+uint32_t* bufferBits = NULL;   // пиксели растра активного слоя
+size_t bufferStride = 0;       // длина строки растров в пикселях
+
+// Переменные для изменения размера окна
+bool isLiveResizing = false;   // пользователь тянет край окна
+bool replayPending = false;    // нужна полная переигровка после окончания изменения размера
+const UINT_PTR RESIZE_TIMER_ID = 1;
+const UINT RESIZE_SETTLE_MS = 200;
+
+// Открытие документа: сначала строятся корзины объектов по ячейкам холста, ячейки
+// видимой области рисуются сразу, остальные - по таймеру (в паузах между сообщениями)
+// по удалённости от видимой области. Первый кадр не зависит от размера документа.
+const UINT_PTR OPEN_RENDER_TIMER_ID = 2;
+const int OPEN_RENDER_CELL = 256;
+const double OPEN_RENDER_SLICE_MS = 8.0;   // работы за один тик таймера
+
+struct OpenRender {
+    std::vector<size_t> queue;     // ячейки в порядке очереди; нарисованы те, что до next
+    size_t next = 0;
+    int cellsX = 0, cellsY = 0;
+};
+OpenRender openRender;
+
+// Буфер композиции: холст + наложения (предпросмотр, маркеры, рамка выделения)
+HBITMAP hComposeBitmap = NULL;
+HDC hComposeDC = NULL;
+
+// Повреждённые области холста, ожидающие вывода на экран
+DamageTracker damage;
+long long lastFramePixels = 0;
+
+// Навигатор на боковой панели: уменьшенный холст из пирамиды уровней (MipPyramid.h).
+// Пирамида пересчитывается только над повреждениями, выведенными на экран, уже после
+// сборки холста; щелчок по навигатору наводит лупу на это место холста.
+const int NAVIGATOR_SIZE = 90;
+const RECT NAVIGATOR_RECT = { 5, TOOLBAR_HEIGHT + 600, 5 + NAVIGATOR_SIZE, TOOLBAR_HEIGHT + 600 + NAVIGATOR_SIZE };
+MipPyramid navigatorPyramid;
+DamageTracker navigatorDamage;       // области холста, ещё не перенесённые в пирамиду
 
 // Временный объект для предпросмотра
 DrawingObject tempObject;
 bool hasTempObject = false;
+RECT lastPreviewRect = { 0, 0, 0, 0 };
+
+// Область текущего штриха карандаша, кисти или ластика
+RECT strokeBounds = { 0, 0, 0, 0 };
+size_t strokeStartIndex = 0;
+
+// Упрощение штрихов при отпускании кнопки мыши
+bool simplifyStrokes = true;
 
 // Переменные выделения
 Selection selection;
 const int SELECTION_HANDLE_SIZE = 8;
 
+// Параметры заливки; маска каждой заливки хранится, чтобы заливку можно было переиграть
+int fillTolerance = 0;
+ColorDistance fillDistance = DISTANCE_RGB;
+bool fillEightConnected = false;
+std::vector<SpanMask> fillMasks;     // payload объекта-заливки = индекс + 1
+
+// Маски выделений произвольной формы. Маска привязана к прямоугольнику выделения:
+// её сдвиг равен смещению прямоугольника относительно границ маски.
+std::vector<SpanMask> selectionMasks;
+std::vector<uint32_t> maskScratch;   // копия пикселей на время рисования с обрезкой по маске
+
+// Надписи: строки (payload объекта-надписи = индекс + 1) и атлас покрытий глифов.
+// Размер шрифта зависит от толщины, номер шрифта в textFonts - ключ шрифта в атласе.
+// Атлас растёт в высоту до 4 МБ: столько нужно, чтобы надписи восьми размеров не
+// вытесняли друг друга по кругу (SimplePaintRender/TextReplayBench.cpp).
+const int GLYPH_ATLAS_SIZE = 512;
+const int GLYPH_ATLAS_MAX_HEIGHT = 8192;
+const WCHAR* const TEXT_FONT_FACE = L"Arial";
+std::vector<std::wstring> textStrings;
+GlyphAtlas glyphAtlas(GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_MAX_HEIGHT);
+
+struct TextFont {
+    int size;               // высота символов в пикселях
+    HFONT font;
+    int ascent;             // от верха строки до базовой линии
+    int lineHeight;
+};
+std::vector<TextFont> textFonts;
+HDC hGlyphDC = NULL;        // DC для растеризации глифов
+
+// Набираемая надпись: становится объектом истории при завершении набора
+bool isTyping = false;
+int typingX = 0, typingY = 0;
+std::wstring typedText;
+
+inline int TextPixelSize(int thickness)
+{
+    return 10 + thickness * 2;
+}
+
+// Закрашенные фигуры выводятся построчно отрезками (ScanlineFill.h), без GDI+.
+// Вершины многоугольника хранятся вместе с рамкой, в которой строились: объект
+// хранит текущую рамку, и при масштабировании маркерами вершины отображаются в неё.
+struct FillPolygon {
+    std::vector<POINT> points;
+    RECT bounds;
+    FillRule rule;
+};
+std::vector<FillPolygon> fillPolygons;
+bool fillShapes = false;                // прямоугольник и окружность рисуются закрашенными
+FillRule currentFillRule = FILL_EVEN_ODD;
+
+// Строящийся многоугольник: вершины и положение курсора (следующая вершина)
+std::vector<POINT> polygonPoints;
+POINT polygonCursor = { 0, 0 };
+
+inline bool IsFilledShape(int type)
+{
+    return type == OBJECT_FILLED_RECT || type == OBJECT_FILLED_ELLIPSE || type == OBJECT_POLYGON;
+}
+
+// Градиентная заливка: от цвета объекта в начальной точке к endColor в конечной.
+// Область - выделение, с которым объект рисовался, а без выделения - область
+// заливки под начальной точкой (маска в fillMasks, сдвигается вместе с объектом).
+struct GradientFillInfo {
+    COLORREF endColor;
+    GradientKind kind;
+    uint32_t mask;            // индекс в fillMasks + 1, 0 - область задана выделением
+};
+std::vector<GradientFillInfo> gradientFills;
+COLORREF gradientEndColor = RGB(255, 255, 255);
+GradientKind currentGradientKind = GRADIENT_LINEAR;
+
+// Фрагмент растра: плитки и (для выделения произвольной формы) маска в его координатах
+struct Fragment {
+    TiledImage image;
+    SpanMask mask;                   // пустая - фрагмент прямоугольный
+};
+
+// Несжатые плитки фрагментов держатся в пределах бюджета, давно не читанные сжимаются.
+// Кэш объявлен раньше фрагментов, чтобы разрушаться после них.
+const size_t FRAGMENT_TILE_BUDGET = 64 * 1024 * 1024;
+TileCache fragmentTileCache(FRAGMENT_TILE_BUDGET);
+
+// Снимок для фонового сохранения: поток сохранения читает только его. Растр - копия
+// собранного холста, документ - копии объектов и масок, а у фрагментов общие плитки
+// вне кэша (см. TiledImage::DetachedCopy)
+struct SaveSnapshot {
+    std::wstring filename;
+    bool isDocument;
+    CLSID encoder;                   // кодировщик GDI+ для растра
+    int width, height;
+    std::vector<uint32_t> pixels;
+    PaintDocument document;
+};
+
+// Поток сохранения; объявлен после кэша плиток, чтобы остановиться раньше его разрушения
+BackgroundSaver backgroundSaver;
+
+// Журнал правок для восстановления после сбоя (EditJournal.h). После каждого завершённого
+// действия в журнал дописывается разница между документом и тем, что уже записано:
+// изменения таблицы слоёв, новые записи таблиц, новые и сдвинутые объекты.
+const int JOURNAL_SYNC_MS = 100;                        // записи за это время делят один fsync
+const size_t JOURNAL_COMPACT_BYTES = 4 * 1024 * 1024;   // сжатие, когда дозапись превысила
+
+struct JournalLayer {
+    int id;
+    std::wstring name;
+    bool visible;
+    int opacity;
+    size_t objects;                  // объектов слоя в журнале
+};
+
+// Сколько чего уже записано в журнал
+struct JournalMark {
+    std::vector<JournalLayer> layers;
+    size_t activeLayer = 0;
+    size_t fillMasks = 0, selectionMasks = 0, fragments = 0;
+    size_t texts = 0, polygons = 0, gradients = 0;
+};
+
+// Строка таблицы слоёв в записи журнала; source - номер слоя в прежней таблице (-1 - новый)
+struct JournalLayerEntry {
+    int32_t source;
+    std::wstring name;
+    bool visible;
+    int opacity;
+};
+
+// Снимок документа для сжатия журнала: записи из него собирает поток журнала
+struct JournalSnapshot {
+    PaintDocument document;
+    std::vector<JournalLayerEntry> layers;
+    size_t activeLayer;
+    std::vector<std::wstring> texts;
+    std::vector<FillPolygon> polygons;
+    std::vector<GradientFillInfo> gradients;
+};
+
+JournalWriter journal;
+JournalMark journaled;
+std::vector<size_t> journalMoved;    // объекты активного слоя, сдвинутые после записи в журнал
+size_t journalAppended = 0;          // байт дописано с последнего сжатия
+
+// Учёт памяти (MemoryStats.h): выборка по таймеру, оверлей в углу холста (F11) и
+// выгрузка в JSON (Shift+F11). Снимки сохранения и сжатия журнала живут в своих потоках,
+// поэтому учитываются через weak_ptr - пока поток их держит
+const UINT_PTR MEMORY_TIMER_ID = 3;
+const UINT MEMORY_SAMPLE_MS = 250;
+const RECT MEMORY_OVERLAY_RECT = { 8, 8, 348, 196 };   // координаты холста
+MemoryStats memoryStats;
+bool memoryOverlay = false;
+std::wstring memoryOverlayText;      // выведенный текст оверлея
+std::weak_ptr<SaveSnapshot> pendingSave;
+std::weak_ptr<JournalSnapshot> pendingCompaction;
+
+// Фрагменты растра: буфер обмена и вставленные фрагменты делят плитки до первой записи
+Fragment clipboardFragment;
+std::vector<Fragment> fragments;     // payload объекта-фрагмента = индекс + 1
+int floatingFragmentIndex = -1;      // фрагмент, который сейчас перетаскивается вместе с рамкой
+
 // Переменная для предотвращения мигания
 bool toolbarNeedsRedraw = true;
 
@@ -128,18 +429,29 @@ ATOM MyRegisterClass(HINSTANCE hInstance);
 BOOL InitInstance(HINSTANCE, int);
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 void DrawObject(HDC hdc, const DrawingObject& obj);
-void AddDrawingObject(int type, int sx, int sy, int ex, int ey);
+void DrawObject(HDC hdc, const DrawingRef& obj);
+void DrawPrimitive(HDC hdc, int type, int sx, int sy, int ex, int ey,
+    int thickness, COLORREF color, int brushShape);
+void DrawPrimitive(Graphics& graphics, int type, int sx, int sy, int ex, int ey,
+    int thickness, COLORREF color, int brushShape);
+void AddDrawingObject(int type, int sx, int sy, int ex, int ey, uint32_t payload = 0);
 void RedrawBuffer(HWND hWnd);
+void RedrawBufferRect(const RECT& rect, const ObjectBins* bins = NULL, size_t cell = 0);
 void ResizeBuffer(HWND hWnd);
+void FinishResize(HWND hWnd);
 int GetEncoderClsid(const WCHAR* format, CLSID* pClsid);
-void DrawSelection(HDC hdc, const DrawingObject& obj);
-ResizeMode GetResizeHandle(const DrawingObject& obj, int x, int y);
-void UpdateObjectHandles(DrawingObject& obj, ResizeMode handle, int newX, int newY);
+void DrawSelection(HDC hdc, const DrawingRef& obj);
+ResizeMode GetResizeHandle(const DrawingRef& obj, int x, int y);
+void UpdateObjectHandles(size_t index, ResizeMode handle, int newX, int newY);
 void CreateToolbar(HWND hWnd);
 void UpdateToolbarState(HWND hWnd);
-void DrawBrush(HDC hdc, int x1, int y1, int x2, int y2, int thickness, COLORREF color, int shape);
-void CustomFloodFill(HDC hdc, int x, int y, COLORREF newColor);
+void DrawBrush(Graphics& graphics, int x1, int y1, int x2, int y2, int thickness, COLORREF color, int shape);
+void CustomFloodFill(int x, int y, COLORREF newColor, const RECT& clip, SpanMask& filled,
+    const SpanMask* allowed = NULL, int allowedDx = 0, int allowedDy = 0);
 void SaveFile(HWND hWnd);
+void BuildDocument(PaintDocument& doc);
+bool WriteSnapshot(const SaveSnapshot& snapshot, const BackgroundSaver::Progress& progress);
+void ExportTimelapse(HWND hWnd);
 void StartSelection(int x, int y);
 void UpdateSelection(int x, int y);
 void EndSelection();
@@ -156,10 +468,129 @@ void ApplyZoom(HWND hWnd, int x, int y);
 void ResetZoom(HWND hWnd = NULL);
 void ScreenToZoomCoords(int& x, int& y);
 void ZoomToScreenCoords(int& x, int& y);
-void FloodFillWithClipping(HDC hdc, int x, int y, COLORREF color);
+void FloodFillWithClipping(int x, int y, COLORREF color, SpanMask& filled);
+void DrawFillMask(const DrawingRef& obj, const RECT& clip);
 void DrawToolWithClipping(HDC hdc, int tool, int thickness, COLORREF color, int brushShape,
     int prevX, int prevY, int currentX, int currentY);
 
+// Функции учёта повреждённых областей
+void AddDamage(const RECT& rect);
+void AddFullDamage();
+void PresentDamage(HWND hWnd);
+RECT GetSegmentBounds(int x1, int y1, int x2, int y2, int margin);
+RECT GetObjectBounds(const DrawingRef& obj);
+
+// Функции навигатора
+RECT GetNavigatorImageRect();
+void UpdateNavigator();
+void DrawNavigator(HDC hdc);
+bool NavigatorToCanvas(int x, int y, int& canvasX, int& canvasY);
+RECT GetSelectionAreaBounds();
+void SetSelectedObject(int index);
+void ComposeCanvasRect(const RECT& rect);
+void SimplifyCommittedStroke(size_t strokeStart);
+
+// Функции для работы с фрагментами выделения
+RECT GetNormalizedSelectionRect();
+bool CaptureSelection(Fragment& target);
+void CopySelection();
+void CutSelection();
+void DeleteSelection();
+void PasteFragment();
+void LiftSelection(bool duplicate);
+void PlaceFragment(const Fragment& fragment, int x, int y);
+RECT AddFragmentObject(const Fragment& fragment, int x, int y);
+void ApplySelectionFilter(int filter);
+void AddClearedRect(const RECT& rect);
+void MoveFloatingFragment();
+void DrawFragment(const DrawingRef& obj, const RECT& clip);
+
+// Функции для выделения произвольной формы
+const SpanMask* GetClipMask(uint32_t maskId, const RECT& rect, int& dx, int& dy);
+void DrawObjectToBuffer(const DrawingRef& obj, const RECT& area);
+void MagicWandSelect(int x, int y);
+void AddMaskClear();
+void DrawSelectionMaskOutline(HDC hdc);
+
+// Функции для надписей
+size_t GetTextFont(int size);
+void RasterizeGlyph(const TextFont& font, wchar_t ch, GlyphBitmap& bitmap);
+SIZE MeasureText(const std::wstring& text, size_t fontIndex);
+void DrawTextObject(const DrawingRef& obj, const RECT& clip);
+void RasterizeTextCoverage(const DrawingRef& obj, DocText& text);
+RECT GetTypingBounds();
+void StartTyping(int x, int y);
+void TypeCharacter(wchar_t ch);
+void CommitTypedText();
+void CancelTyping();
+
+// Функции для закрашенных фигур
+void MapPolygonPoints(const FillPolygon& polygon, int sx, int sy, int ex, int ey, std::vector<ScanPoint>& points);
+void DrawFilledShape(const DrawingRef& obj, const RECT& clip);
+RECT GetPolygonPreviewBounds();
+void AddPolygonPoint(int x, int y);
+void CommitPolygon();
+void CancelPolygon();
+
+// Функции для градиентов
+void FindFillRegion(int x, int y, SpanMask& region);
+void DrawGradientFill(const DrawingRef& obj, const RECT& clip);
+void AddGradientFill(int sx, int sy, int ex, int ey);
+
+// Функции журнала правок
+DocObject ToDocObject(const DrawingRef& obj);
+DrawingObject FromDocObject(const DocObject& docObject);
+std::wstring GetAppDataFolder();
+JournalPath GetJournalPath();
+void BuildJournalState(const JournalSnapshot& snapshot, std::string& out);
+const DrawingStore& LayerObjects(size_t index);
+void JournalCommit();
+void JournalClear();
+void MarkJournalMoved(size_t index);
+void CompactJournal();
+void RecoverJournal(const JournalPath& path);
+bool DocObjectRefsValid(const DocObject& obj, size_t fillMaskCount, size_t selectionMaskCount,
+    size_t fragmentCount, size_t textCount, size_t polygonCount, size_t gradientCount);
+
+// Функции учёта памяти
+size_t DocumentMemoryBytes(const PaintDocument& doc);
+void SampleMemory();
+std::wstring FormatMemorySize(size_t bytes);
+std::wstring BuildMemoryOverlayText();
+void RefreshMemoryOverlay(HWND hWnd);
+void DrawMemoryOverlay(HDC hdc);
+void DumpMemoryStats(HWND hWnd);
+
+// Функции открытия документа
+void OpenDocumentFile(HWND hWnd);
+void InstallDocument(HWND hWnd, PaintDocument& doc);
+RECT GetViewportRect();
+void StartOpenRender(HWND hWnd);
+void RenderOpenCells(double budgetMs, size_t limit);
+void RenderVisibleOpenCells();
+void ContinueOpenRender(HWND hWnd);
+void FinishOpenRender();
+void CancelOpenRender();
+
+// Функции для работы со слоями
+bool CreateSurface(HDC hdc, size_t width, size_t height, Surface& surface);
+void DestroySurface(Surface& surface);
+Layer CreateLayer();
+void UnbindLayer();
+void BindLayer(size_t index);
+void RedrawLayerRect(size_t index, const RECT& rect);
+void RedrawAllLayersRect(const RECT& rect);
+void CompositeLayers(const RECT& rect);
+void SelectLayer(HWND hWnd, size_t index);
+void AddLayer(HWND hWnd);
+void DeleteActiveLayer(HWND hWnd);
+void MoveActiveLayer(HWND hWnd, int direction);
+void UpdateLayerControls(HWND hWnd);
+void PackLayer(size_t index);
+void UnpackLayer(size_t index);
+void PackInactiveLayers();
+void SetIndexedCanvas(HWND hWnd, bool enabled);
+
 // Точка входа в приложение
 int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     _In_ LPWSTR lpCmdLine, _In_ int nCmdShow)
@@ -178,6 +609,18 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
     selection.active = false;
     selection.mode = SELECTION_NONE;
     selection.resizeHandle = -1;
+    selection.mask = 0;
+
+    // Растры слоёв создаются вместе с буфером (ResizeBuffer)
+    layers.push_back(CreateLayer());
+    activeLayer = 0;
+
+    // Журнал правок занят, пока программа работает; после сбоя из него восстанавливается рисунок
+    JournalPath journalPath = GetJournalPath();
+    if (!journalPath.empty() && journal.Start(journalPath, JOURNAL_SYNC_MS)) {
+        RecoverJournal(journalPath);
+        CompactJournal();
+    }
 
     zoomMode = false;
     zoomDrawingMode = false;
@@ -197,10 +640,19 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
     while (GetMessage(&msg, nullptr, 0, 0)) {
         TranslateMessage(&msg);
         DispatchMessage(&msg);
+        JournalCommit();
     }
 
-    if (hBufferBitmap) DeleteObject(hBufferBitmap);
-    if (hBufferDC) DeleteDC(hBufferDC);
+    for (auto& layer : layers) {
+        DestroySurface(layer.surface);
+    }
+    DestroySurface(canvas);
+    for (auto& font : textFonts) {
+        DeleteObject(font.font);
+    }
+    if (hGlyphDC) DeleteDC(hGlyphDC);
+    if (hComposeBitmap) DeleteObject(hComposeBitmap);
+    if (hComposeDC) DeleteDC(hComposeDC);
 
     GdiplusShutdown(gdiplusToken);
     return (int)msg.wParam;
@@ -211,7 +663,8 @@ ATOM MyRegisterClass(HINSTANCE hInstance)
 {
     WNDCLASSEXW wcex;
     wcex.cbSize = sizeof(WNDCLASSEX);
-    wcex.style = CS_HREDRAW | CS_VREDRAW;
+    // Без CS_HREDRAW/CS_VREDRAW система обновляет только открывшиеся при растяжении полосы
+    wcex.style = 0;
     wcex.lpfnWndProc = WndProc;
     wcex.cbClsExtra = 0;
     wcex.cbWndExtra = 0;
@@ -251,80 +704,282 @@ void ResizeBuffer(HWND hWnd)
     rect.left += SIDEBAR_WIDTH;
     rect.top += TOOLBAR_HEIGHT;
 
-    size_t newWidth = static_cast<size_t>(rect.right - rect.left);
-    size_t newHeight = static_cast<size_t>(rect.bottom - rect.top);
+    size_t newWidth = static_cast<size_t>(max(0, static_cast<int>(rect.right - rect.left)));
+    size_t newHeight = static_cast<size_t>(max(0, static_cast<int>(rect.bottom - rect.top)));
 
-    if (newWidth == bufferWidth && newHeight == bufferHeight) return;
+    if (newWidth == bufferWidth && newHeight == bufferHeight && hBufferDC) return;
 
-    if (hBufferBitmap) DeleteObject(hBufferBitmap);
-    if (hBufferDC) DeleteDC(hBufferDC);
+    size_t oldWidth = hBufferDC ? bufferWidth : 0;
+    size_t oldHeight = hBufferDC ? bufferHeight : 0;
 
-    HDC hdc = GetDC(hWnd);
-    hBufferDC = CreateCompatibleDC(hdc);
-    hBufferBitmap = CreateCompatibleBitmap(hdc, static_cast<int>(newWidth), static_cast<int>(newHeight));
-    SelectObject(hBufferDC, hBufferBitmap);
+    // Ёмкость растёт геометрически и не уменьшается при сжатии окна
+    if (!hBufferDC || newWidth > bufferCapacityWidth || newHeight > bufferCapacityHeight) {
+        size_t capacityWidth = bufferCapacityWidth;
+        size_t capacityHeight = bufferCapacityHeight;
+        if (newWidth > capacityWidth) capacityWidth = max(newWidth, capacityWidth + capacityWidth / 2);
+        if (newHeight > capacityHeight) capacityHeight = max(newHeight, capacityHeight + capacityHeight / 2);
+        capacityWidth = max(capacityWidth, static_cast<size_t>(1));
+        capacityHeight = max(capacityHeight, static_cast<size_t>(1));
+
+        HDC hdc = GetDC(hWnd);
+
+        // Уже нарисованные пиксели слоёв переносим, а не переигрываем
+        for (auto& layer : layers) {
+            if (!layer.indexed.Empty()) {
+                ResizeIndexed(layer.indexed, static_cast<int>(capacityWidth), static_cast<int>(capacityHeight));
+                continue;
+            }
+
+            Surface surface;
+            if (!CreateSurface(hdc, capacityWidth, capacityHeight, surface)) continue;
+            if (layer.surface.dc && oldWidth > 0 && oldHeight > 0) {
+                BitBlt(surface.dc, 0, 0, static_cast<int>(oldWidth), static_cast<int>(oldHeight),
+                    layer.surface.dc, 0, 0, SRCCOPY);
+            }
+            DestroySurface(layer.surface);
+            layer.surface = surface;
+        }
+
+        // Холст собирается заново при выводе, переносить его не нужно
+        DestroySurface(canvas);
+        CreateSurface(hdc, capacityWidth, capacityHeight, canvas);
+
+        if (hComposeBitmap) DeleteObject(hComposeBitmap);
+        if (hComposeDC) DeleteDC(hComposeDC);
+
+        bufferStride = capacityWidth;
+        BindLayer(activeLayer);
+
+        hComposeDC = CreateCompatibleDC(hdc);
+        hComposeBitmap = CreateCompatibleBitmap(hdc, static_cast<int>(capacityWidth), static_cast<int>(capacityHeight));
+        SelectObject(hComposeDC, hComposeBitmap);
+
+        bufferCapacityWidth = capacityWidth;
+        bufferCapacityHeight = capacityHeight;
+
+        ReleaseDC(hWnd, hdc);
+    }
 
     bufferWidth = newWidth;
     bufferHeight = newHeight;
 
-    ReleaseDC(hWnd, hdc);
+    // Рисуем только открывшиеся полосы справа и снизу
+    if (newWidth > oldWidth) {
+        RECT strip = { static_cast<LONG>(oldWidth), 0, static_cast<LONG>(newWidth), static_cast<LONG>(newHeight) };
+        RedrawAllLayersRect(strip);
+    }
+    if (newHeight > oldHeight) {
+        RECT strip = { 0, static_cast<LONG>(oldHeight), static_cast<LONG>(min(oldWidth, newWidth)), static_cast<LONG>(newHeight) };
+        RedrawAllLayersRect(strip);
+    }
+
+    if (zoomMode) {
+        AddFullDamage();
+    }
+
+    // Полная переигровка откладывается до окончания изменения размера
+    if (oldWidth > 0 && oldHeight > 0) {
+        replayPending = true;
+        if (!isLiveResizing) {
+            SetTimer(hWnd, RESIZE_TIMER_ID, RESIZE_SETTLE_MS, NULL);
+        }
+    }
+}
+
+// Отложенная полная переигровка после того, как размер окна перестал меняться
+void FinishResize(HWND hWnd)
+{
+    KillTimer(hWnd, RESIZE_TIMER_ID);
+    if (!replayPending) return;
 
+    replayPending = false;
     RedrawBuffer(hWnd);
+    AddFullDamage();
+    PresentDamage(hWnd);
 }
 
-// Функция перерисовки буфера
+// Функция перерисовки буфера (растров всех слоёв)
 void RedrawBuffer(HWND hWnd)
 {
-    if (!hBufferDC) return;
+    UNREFERENCED_PARAMETER(hWnd);
 
-    Graphics graphics(hBufferDC);
-    graphics.SetSmoothingMode(SmoothingModeAntiAlias);
+    // Полная переигровка заменяет дорисовку открытого документа
+    CancelOpenRender();
 
-    SolidBrush whiteBrush(Color(255, 255, 255, 255));
-    graphics.FillRectangle(&whiteBrush, 0, 0, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight));
+    RECT fullRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    RedrawAllLayersRect(fullRect);
+}
 
-    // Если активен режим рисования в увеличенной области, применяем обрезку
-    if (zoomDrawingMode && zoomMode) {
-        HRGN clipRegion = CreateRectRgn(zoomRect.left, zoomRect.top, zoomRect.right, zoomRect.bottom);
-        SelectClipRgn(hBufferDC, clipRegion);
+// Раскладка надписи: перо идёт по базовой линии, '\n' начинает новую строку.
+// visit(глиф, левый край, верхний край) получает каждый символ с покрытием из атласа.
+template <typename Visit>
+void LayoutText(const std::wstring& text, size_t fontIndex, int x, int y, Visit visit)
+{
+    int penX = x;
+    int baseline = y + textFonts[fontIndex].ascent;
 
-        for (const auto& obj : drawings) {
-            DrawObject(hBufferDC, obj);
+    for (wchar_t ch : text) {
+        if (ch == L'\n') {
+            penX = x;
+            baseline += textFonts[fontIndex].lineHeight;
+            continue;
         }
 
-        SelectClipRgn(hBufferDC, NULL);
-        DeleteObject(clipRegion);
+        GlyphInfo glyph;
+        glyphAtlas.Find(static_cast<uint32_t>(fontIndex), ch, [&](GlyphBitmap& bitmap) {
+            RasterizeGlyph(textFonts[fontIndex], ch, bitmap);
+        }, glyph);
+        visit(glyph, penX + glyph.bearingX, baseline - glyph.bearingY);
+        penX += glyph.advance;
+    }
+}
+
+// Рисование в буфер с обрезкой по маске без регионов GDI: область touched сохраняется,
+// а после рисования пиксели вне маски (сдвинутой на dx, dy) возвращаются на место
+template <typename Draw>
+void DrawMasked(const RECT& touched, const SpanMask& mask, int dx, int dy, Draw draw)
+{
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    RECT area;
+    if (!bufferBits || !IntersectRect(&area, &touched, &canvasRect)) return;
+
+    size_t width = static_cast<size_t>(area.right - area.left);
+    maskScratch.resize(width * (area.bottom - area.top));
+
+    GdiFlush();
+    for (int y = area.top; y < area.bottom; y++) {
+        memcpy(&maskScratch[(y - area.top) * width], bufferBits + y * bufferStride + area.left, width * sizeof(uint32_t));
+    }
+
+    draw();
+
+    GdiFlush();
+    MaskRect restoreRect = { area.left, area.top, area.right, area.bottom };
+    RestoreOutsideMask(bufferBits, bufferStride, maskScratch.data(), width, restoreRect, mask, dx, dy);
+}
+
+// Перерисовка части буфера активного слоя: переигрываются только объекты слоя,
+// задевающие область; остальные слои не трогаются, холст соберётся при выводе.
+// С корзинами (открытие документа) перебираются объекты ячейки cell и объекты,
+// добавленные после построения корзин, а не все объекты слоя.
+void RedrawBufferRect(const RECT& rect, const ObjectBins* bins, size_t cell)
+{
+    if (!hBufferDC) return;
+
+    RECT area;
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    if (!IntersectRect(&area, &rect, &canvasRect)) return;
+
+    // Если активен режим рисования в увеличенной области, применяем обрезку
+    if (zoomDrawingMode && zoomMode) {
+        if (!IntersectRect(&area, &area, &zoomRect)) return;
+    }
+
+    // Растр слоя в области становится прозрачным
+    GdiFlush();
+    for (int y = area.top; y < area.bottom; y++) {
+        memset(bufferBits + y * bufferStride + area.left, 0, (area.right - area.left) * sizeof(uint32_t));
     }
-    else {
-        for (const auto& obj : drawings) {
-            if (obj.wasDrawnWithSelection) {
-                HRGN oldClipRegion = CreateRectRgn(0, 0, 0, 0);
-                GetClipRgn(hBufferDC, oldClipRegion);
 
-                HRGN clipRegion = CreateRectRgn(obj.selectionRect.left, obj.selectionRect.top,
-                    obj.selectionRect.right, obj.selectionRect.bottom);
-                SelectClipRgn(hBufferDC, clipRegion);
+    HRGN areaRegion = CreateRectRgn(area.left, area.top, area.right, area.bottom);
+    SelectClipRgn(hBufferDC, areaRegion);
 
-                DrawObject(hBufferDC, obj);
+    auto replay = [&area](const DrawingRef& obj) {
+        RECT bounds = GetObjectBounds(obj);
+        RECT overlap;
+        if (IntersectRect(&overlap, &bounds, &area)) DrawObjectToBuffer(obj, area);
+    };
 
-                SelectClipRgn(hBufferDC, oldClipRegion);
-                DeleteObject(clipRegion);
-                DeleteObject(oldClipRegion);
+    size_t tail = 0;
+    if (bins) {
+        for (uint32_t index : bins->Cell(cell)) replay(drawings[index]);
+        tail = bins->Count();
+    }
+    for (size_t i = tail; i < drawings.size(); i++) {
+        replay(drawings[i]);
+    }
+
+    SelectClipRgn(hBufferDC, NULL);
+    DeleteObject(areaRegion);
+}
+
+// Вывод объекта истории в буфер в пределах area с той обрезкой, с которой он рисовался
+void DrawObjectToBuffer(const DrawingRef& obj, const RECT& area)
+{
+    if (obj.type() == OBJECT_FRAGMENT) {
+        // Фрагмент копируется в память буфера только в пределах области
+        DrawFragment(obj, area);
+        return;
+    }
+    if (obj.type() == 6 || obj.type() == OBJECT_CLEARED_MASK) {
+        // Заливка уже обрезана выделением при построении маски
+        DrawFillMask(obj, area);
+        return;
+    }
+    if (obj.type() == OBJECT_TEXT || obj.type() == OBJECT_GRADIENT || IsFilledShape(obj.type())) {
+        // Надпись, градиент и закрашенные фигуры пишутся в память растра, обрезка по рамке - через clip
+        auto draw = [&](const RECT& clip) {
+            if (obj.type() == OBJECT_TEXT) {
+                DrawTextObject(obj, clip);
+            }
+            else if (obj.type() == OBJECT_GRADIENT) {
+                DrawGradientFill(obj, clip);
             }
             else {
-                DrawObject(hBufferDC, obj);
+                DrawFilledShape(obj, clip);
+            }
+        };
+
+        RECT clip = area;
+        if (obj.wasDrawnWithSelection() && !(zoomDrawingMode && zoomMode)) {
+            RECT selectionRect = obj.selectionRect();
+            int dx = 0, dy = 0;
+            const SpanMask* mask = GetClipMask(obj.selectionMask(), selectionRect, dx, dy);
+            RECT frame = {
+                min(selectionRect.left, selectionRect.right), min(selectionRect.top, selectionRect.bottom),
+                max(selectionRect.left, selectionRect.right), max(selectionRect.top, selectionRect.bottom)
+            };
+            if (!IntersectRect(&clip, &clip, &frame)) return;
+            if (mask) {
+                DrawMasked(clip, *mask, dx, dy, [&]() { draw(clip); });
+                return;
             }
         }
+        draw(clip);
+        return;
+    }
+    if (!obj.wasDrawnWithSelection() || (zoomDrawingMode && zoomMode)) {
+        DrawObject(hBufferDC, obj);
+        return;
+    }
+
+    RECT clip = obj.selectionRect();
+    int dx = 0, dy = 0;
+    const SpanMask* mask = GetClipMask(obj.selectionMask(), clip, dx, dy);
+
+    if (mask) {
+        // Выделение произвольной формы: пересечение с отрезками маски, регионы не строятся
+        RECT touched;
+        RECT bounds = GetObjectBounds(obj);
+        if (!IntersectRect(&touched, &bounds, &area)) return;
+        DrawMasked(touched, *mask, dx, dy, [&]() { DrawObject(hBufferDC, obj); });
+    }
+    else {
+        SaveDC(hBufferDC);
+        IntersectClipRect(hBufferDC, clip.left, clip.top, clip.right, clip.bottom);
+        DrawObject(hBufferDC, obj);
+        RestoreDC(hBufferDC, -1);
     }
 }
 
 // Функция рисования выделения объекта
-void DrawSelection(HDC hdc, const DrawingObject& obj)
+void DrawSelection(HDC hdc, const DrawingRef& obj)
 {
-    int left = min(obj.startX, obj.endX);
-    int top = min(obj.startY, obj.endY);
-    int right = max(obj.startX, obj.endX);
-    int bottom = max(obj.startY, obj.endY);
+    int sx = obj.startX(), sy = obj.startY(), ex = obj.endX(), ey = obj.endY();
+    int left = min(sx, ex);
+    int top = min(sy, ey);
+    int right = max(sx, ex);
+    int bottom = max(sy, ey);
 
     HPEN hPen = CreatePen(PS_DOT, 1, RGB(0, 0, 0));
     HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
@@ -347,12 +1002,13 @@ void DrawSelection(HDC hdc, const DrawingObject& obj)
 }
 
 // Функция определения, в какой маркер попал курсор
-ResizeMode GetResizeHandle(const DrawingObject& obj, int x, int y)
+ResizeMode GetResizeHandle(const DrawingRef& obj, int x, int y)
 {
-    int left = min(obj.startX, obj.endX);
-    int top = min(obj.startY, obj.endY);
-    int right = max(obj.startX, obj.endX);
-    int bottom = max(obj.startY, obj.endY);
+    int sx = obj.startX(), sy = obj.startY(), ex = obj.endX(), ey = obj.endY();
+    int left = min(sx, ex);
+    int top = min(sy, ey);
+    int right = max(sx, ex);
+    int bottom = max(sy, ey);
 
     if (x >= left - HANDLE_SIZE && x <= left + HANDLE_SIZE &&
         y >= top - HANDLE_SIZE && y <= top + HANDLE_SIZE)
@@ -377,43 +1033,46 @@ ResizeMode GetResizeHandle(const DrawingObject& obj, int x, int y)
 }
 
 // Функция обновления объекта при изменении размера
-void UpdateObjectHandles(DrawingObject& obj, ResizeMode handle, int newX, int newY)
+void UpdateObjectHandles(size_t index, ResizeMode handle, int newX, int newY)
 {
+    DrawingRef obj = drawings[index];
+    int sx = obj.startX(), sy = obj.startY(), ex = obj.endX(), ey = obj.endY();
+
     switch (handle) {
     case TOP_LEFT:
-        obj.startX = newX;
-        obj.startY = newY;
+        sx = newX;
+        sy = newY;
         break;
     case TOP_RIGHT:
-        obj.endX = newX;
-        obj.startY = newY;
+        ex = newX;
+        sy = newY;
         break;
     case BOTTOM_LEFT:
-        obj.startX = newX;
-        obj.endY = newY;
+        sx = newX;
+        ey = newY;
         break;
     case BOTTOM_RIGHT:
-        obj.endX = newX;
-        obj.endY = newY;
+        ex = newX;
+        ey = newY;
         break;
     case MOVE:
-        int deltaX = newX - (obj.startX + (obj.endX - obj.startX) / 2);
-        int deltaY = newY - (obj.startY + (obj.endY - obj.startY) / 2);
-        obj.startX += deltaX;
-        obj.endX += deltaX;
-        obj.startY += deltaY;
-        obj.endY += deltaY;
+        int deltaX = newX - (sx + (ex - sx) / 2);
+        int deltaY = newY - (sy + (ey - sy) / 2);
+        sx += deltaX;
+        ex += deltaX;
+        sy += deltaY;
+        ey += deltaY;
         break;
     }
+
+    drawings.SetCoords(index, sx, sy, ex, ey);
+    MarkJournalMoved(index);
 }
 
 // Функция рисования кисти
-void DrawBrush(HDC hdc, int x1, int y1, int x2, int y2, int thickness, COLORREF color, int shape)
+void DrawBrush(Graphics& graphics, int x1, int y1, int x2, int y2, int thickness, COLORREF color, int shape)
 {
-    HBRUSH hBrush = CreateSolidBrush(color);
-    HBRUSH hOldBrush = (HBRUSH)SelectObject(hdc, hBrush);
-    HPEN hPen = CreatePen(PS_SOLID, 1, color);
-    HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
+    SolidBrush brush(Color(GetRValue(color), GetGValue(color), GetBValue(color)));
 
     int brushSize = thickness * 2;
     int left = min(x1, x2) - brushSize / 2;
@@ -427,76 +1086,57 @@ void DrawBrush(HDC hdc, int x1, int y1, int x2, int y2, int thickness, COLORREF
     case BRUSH_CIRCLE:
     {
         int size = min(width, height);
-        Ellipse(hdc, left, top, left + size, top + size);
+        graphics.FillEllipse(&brush, left, top, size, size);
     }
     break;
 
     case BRUSH_SQUARE:
     {
         int size = min(width, height);
-        Rectangle(hdc, left, top, left + size, top + size);
+        graphics.FillRectangle(&brush, left, top, size, size);
     }
     break;
 
     case BRUSH_ELLIPSE:
-        Ellipse(hdc, left, top, right, bottom);
+        graphics.FillEllipse(&brush, left, top, width, height);
         break;
 
     case BRUSH_RECTANGLE:
-        Rectangle(hdc, left, top, right, bottom);
+        graphics.FillRectangle(&brush, left, top, width, height);
         break;
 
     case BRUSH_TRIANGLE:
     {
-        POINT points[3];
-        points[0].x = (left + right) / 2;
-        points[0].y = top;
-        points[1].x = left;
-        points[1].y = bottom;
-        points[2].x = right;
-        points[2].y = bottom;
-        Polygon(hdc, points, 3);
+        Point points[3] = {
+            Point((left + right) / 2, top),
+            Point(left, bottom),
+            Point(right, bottom)
+        };
+        graphics.FillPolygon(&brush, points, 3);
     }
     break;
     }
-
-    SelectObject(hdc, hOldBrush);
-    SelectObject(hdc, hOldPen);
-    DeleteObject(hBrush);
-    DeleteObject(hPen);
 }
 
-// Функция заливки области (алгоритм заливки с затравкой)
-void CustomFloodFill(HDC hdc, int x, int y, COLORREF newColor)
+// Функция заливки области (построчная заливка с допуском прямо по памяти буфера)
+void CustomFloodFill(int x, int y, COLORREF newColor, const RECT& clip, SpanMask& filled,
+    const SpanMask* allowed, int allowedDx, int allowedDy)
 {
-    COLORREF targetColor = GetPixel(hdc, x, y);
-
-    if (targetColor == newColor) return;
-
-    std::queue<POINT> pixels;
-    pixels.push({ x, y });
-
-    while (!pixels.empty()) {
-        POINT p = pixels.front();
-        pixels.pop();
+    filled.Clear();
+    if (!bufferBits || !canvas.bits || !IsPointInDrawingArea(x, y)) return;
 
-        int currentX = p.x;
-        int currentY = p.y;
+    // Область ищется по видимому холсту (всем слоям), а закрашивается растр активного слоя
+    CompositeLayers(clip);
 
-        if (currentX < 0 || currentX >= static_cast<int>(bufferWidth) ||
-            currentY < 0 || currentY >= static_cast<int>(bufferHeight))
-            continue;
-
-        COLORREF currentColor = GetPixel(hdc, currentX, currentY);
-        if (currentColor != targetColor) continue;
+    uint32_t newPixel = ColorToPixel(newColor);
+    uint32_t targetPixel = canvas.bits[y * bufferStride + x];
+    if (fillTolerance == 0 && (targetPixel & 0x00FFFFFF) == (newPixel & 0x00FFFFFF)) return;
 
-        SetPixel(hdc, currentX, currentY, newColor);
+    FillOptions options = { fillTolerance, fillDistance, fillEightConnected };
+    MaskRect fillClip = { clip.left, clip.top, clip.right, clip.bottom };
+    filled = FloodFillMask(canvas.bits, bufferStride, fillClip, x, y, options, allowed, allowedDx, allowedDy);
 
-        pixels.push({ currentX + 1, currentY });
-        pixels.push({ currentX - 1, currentY });
-        pixels.push({ currentX, currentY + 1 });
-        pixels.push({ currentX, currentY - 1 });
-    }
+    PaintMask(bufferBits, bufferStride, filled, 0, 0, fillClip, newPixel);
 }
 
 // Функции для работы с выделением
@@ -507,18 +1147,26 @@ bool IsPointInDrawingArea(int x, int y) {
 
 void StartSelection(int x, int y)
 {
+    AddDamage(GetSelectionAreaBounds());
+    floatingFragmentIndex = -1;
+    selection.mask = 0;
+
     selection.rect.left = x;
     selection.rect.top = y;
     selection.rect.right = x;
     selection.rect.bottom = y;
     selection.active = true;
     selection.mode = SELECTION_CREATING;
+
+    AddDamage(GetSelectionAreaBounds());
 }
 
 void UpdateSelection(int x, int y)
 {
     if (!selection.active) return;
 
+    AddDamage(GetSelectionAreaBounds());
+
     if (selection.mode == SELECTION_CREATING) {
         selection.rect.right = x;
         selection.rect.bottom = y;
@@ -546,8 +1194,14 @@ void UpdateSelection(int x, int y)
             selection.rect.top = newTop;
             selection.rect.right = newRight;
             selection.rect.bottom = newBottom;
+
+            // Точка захвата сдвигается вместе с рамкой
+            selection.originalStartX = x;
+            selection.originalStartY = y;
         }
     }
+
+    AddDamage(GetSelectionAreaBounds());
 }
 
 void EndSelection()
@@ -558,7 +1212,11 @@ void EndSelection()
 
 void ClearSelection()
 {
+    AddDamage(GetSelectionAreaBounds());
+    floatingFragmentIndex = -1;
+
     selection.active = false;
+    selection.mask = 0;
     selection.mode = SELECTION_NONE;
     selection.resizeHandle = -1;
 }
@@ -568,6 +1226,11 @@ void DrawSelectionArea(HDC hdc)
 {
     if (!selection.active) return;
 
+    if (selection.mask) {
+        DrawSelectionMaskOutline(hdc);
+        return;
+    }
+
     HPEN hPen = CreatePen(PS_DOT, 1, RGB(0, 0, 255));
     HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
     SelectObject(hdc, GetStockObject(NULL_BRUSH));
@@ -609,6 +1272,13 @@ int GetSelectionHandle(int x, int y)
 {
     if (!selection.active) return -1;
 
+    // У выделения произвольной формы нет маркеров размера - его можно только двигать
+    int dx = 0, dy = 0;
+    const SpanMask* mask = GetClipMask(selection.mask, selection.rect, dx, dy);
+    if (mask) {
+        return mask->Contains(x - dx, y - dy) ? 6 : -1;
+    }
+
     if (x >= selection.rect.left - SELECTION_HANDLE_SIZE && x <= selection.rect.left + SELECTION_HANDLE_SIZE &&
         y >= selection.rect.top - SELECTION_HANDLE_SIZE && y <= selection.rect.top + SELECTION_HANDLE_SIZE)
         return 0;
@@ -689,17 +1359,36 @@ void RemoveClipping(HDC hdc)
 }
 
 // Функция для заливки с обрезкой
-void FloodFillWithClipping(HDC hdc, int x, int y, COLORREF color)
+void FloodFillWithClipping(int x, int y, COLORREF color, SpanMask& filled)
 {
+    RECT clip = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    const SpanMask* mask = NULL;
+    int dx = 0, dy = 0;
     if (selection.active) {
-        ApplyClipping(hdc);
+        RECT selectionRect = GetNormalizedSelectionRect();
+        IntersectRect(&clip, &clip, &selectionRect);
+        mask = GetClipMask(selection.mask, selection.rect, dx, dy);
     }
 
-    CustomFloodFill(hdc, x, y, color);
+    CustomFloodFill(x, y, color, clip, filled, mask, dx, dy);
+}
 
-    if (selection.active) {
-        RemoveClipping(hdc);
-    }
+// Переигровка заливки: закрашиваются отрезки сохранённой маски в пределах clip
+void DrawFillMask(const DrawingRef& obj, const RECT& clip)
+{
+    uint32_t id = obj.payload();
+    if (!bufferBits || id == 0 || id > fillMasks.size()) return;
+
+    const SpanMask& mask = fillMasks[id - 1];
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    RECT area;
+    if (!IntersectRect(&area, &clip, &canvasRect)) return;
+
+    GdiFlush();
+    MaskRect maskClip = { area.left, area.top, area.right, area.bottom };
+    uint32_t value = obj.type() == OBJECT_CLEARED_MASK ? 0 : ColorToPixel(obj.color());
+    PaintMask(bufferBits, bufferStride, mask, obj.startX() - mask.AnchorX(), obj.startY() - mask.AnchorY(),
+        maskClip, value);
 }
 
 // Функция для рисования инструментами с обрезкой
@@ -715,28 +1404,25 @@ void DrawToolWithClipping(HDC hdc, int tool, int thickness, COLORREF color, int
         ApplyClipping(hdc);
     }
 
-    if (tool == 0) {
-        HPEN hPen = CreatePen(PS_SOLID, thickness, color);
-        HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
-
-        MoveToEx(hdc, prevX, prevY, NULL);
-        LineTo(hdc, currentX, currentY);
+    // Сегмент рисуется тем же примитивом, что и при переигровке: GDI не пишет альфа-канал слоя
+    auto draw = [&]() {
+        if (tool == 0 || tool == 3 || tool == 4) {
+            DrawPrimitive(hdc, tool, prevX, prevY, currentX, currentY, thickness, color, brushShape);
+        }
+    };
 
-        SelectObject(hdc, hOldPen);
-        DeleteObject(hPen);
+    // Выделение произвольной формы: сегмент обрезается по отрезкам маски
+    int dx = 0, dy = 0;
+    const SpanMask* mask = NULL;
+    if (selection.active && !(zoomDrawingMode && zoomMode)) {
+        mask = GetClipMask(selection.mask, selection.rect, dx, dy);
     }
-    else if (tool == 3) {
-        DrawBrush(hdc, prevX, prevY, currentX, currentY, thickness, color, brushShape);
-    }
-    else if (tool == 4) {
-        HPEN hPen = CreatePen(PS_SOLID, thickness, BACKGROUND_COLOR);
-        HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
-
-        MoveToEx(hdc, prevX, prevY, NULL);
-        LineTo(hdc, currentX, currentY);
 
-        SelectObject(hdc, hOldPen);
-        DeleteObject(hPen);
+    if (mask) {
+        DrawMasked(GetSegmentBounds(prevX, prevY, currentX, currentY, thickness + 2), *mask, dx, dy, draw);
+    }
+    else {
+        draw();
     }
 
     // Убираем обрезку
@@ -748,104 +1434,644 @@ void DrawToolWithClipping(HDC hdc, int tool, int thickness, COLORREF color, int
     }
 }
 
-// Функции для лупы
+// Функции учёта повреждённых областей
 
-// Применение увеличения области
-void ApplyZoom(HWND hWnd, int x, int y)
+// Добавление повреждённого прямоугольника (координаты холста)
+void AddDamage(const RECT& rect)
 {
-    if (!hBufferDC) return;
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    RECT clipped;
+    if (IntersectRect(&clipped, &rect, &canvasRect)) {
+        damage.Add(clipped);
+    }
+}
 
-    // Определяем область для увеличения (размер зависит от коэффициента увеличения)
-    int zoomWidth = static_cast<int>(bufferWidth / zoomFactor);
-    int zoomHeight = static_cast<int>(bufferHeight / zoomFactor);
+// Повреждён весь холст
+void AddFullDamage()
+{
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    damage.Add(canvasRect);
+}
 
-    zoomRect.left = max(0, x - zoomWidth / 2);
-    zoomRect.top = max(0, y - zoomHeight / 2);
-    zoomRect.right = min(static_cast<int>(bufferWidth), zoomRect.left + zoomWidth);
-    zoomRect.bottom = min(static_cast<int>(bufferHeight), zoomRect.top + zoomHeight);
+// Передача накопленных прямоугольников окну (без стирания фона)
+void PresentDamage(HWND hWnd)
+{
+    if (damage.Empty()) return;
 
-    // Включаем режим лупы и режим рисования в увеличенной области
-    zoomMode = true;
-    zoomDrawingMode = true;
+    if (zoomMode) {
+        // В режиме лупы холст растянут на всё окно - обновляем область рисования целиком
+        RECT drawingRect;
+        GetClientRect(hWnd, &drawingRect);
+        drawingRect.left = SIDEBAR_WIDTH;
+        drawingRect.top = TOOLBAR_HEIGHT;
+        InvalidateRect(hWnd, &drawingRect, FALSE);
+    }
+    else {
+        for (const auto& rect : damage.Rects()) {
+            RECT windowRect = rect;
+            OffsetRect(&windowRect, SIDEBAR_WIDTH, TOOLBAR_HEIGHT);
+            InvalidateRect(hWnd, &windowRect, FALSE);
+        }
+    }
 
-    // Обновляем отображение
-    RECT drawingRect;
-    GetClientRect(hWnd, &drawingRect);
-    drawingRect.left = SIDEBAR_WIDTH;
-    drawingRect.top = TOOLBAR_HEIGHT;
-    InvalidateRect(hWnd, &drawingRect, TRUE);
+    // Те же области попадут в навигатор после сборки холста в WM_PAINT
+    for (const auto& rect : damage.Rects()) {
+        navigatorDamage.Add(rect);
+    }
+    InvalidateRect(hWnd, &NAVIGATOR_RECT, FALSE);
 
-    // Обновляем текст кнопки лупы
-    SetWindowText(GetDlgItem(hWnd, ID_ZOOM_BUTTON), L"Лупа [активна]");
+    damage.Clear();
 }
 
-// Сброс увеличения
-void ResetZoom(HWND hWnd)
+// Прямоугольник, покрывающий отрезок с заданным запасом
+RECT GetSegmentBounds(int x1, int y1, int x2, int y2, int margin)
 {
-    zoomMode = false;
-    zoomDrawingMode = false;
-    zoomRect = { 0, 0, 0, 0 };
-    zoomOffsetX = 0;
-    zoomOffsetY = 0;
-
-    if (hWnd) {
-        SetWindowText(GetDlgItem(hWnd, ID_ZOOM_BUTTON), L"Лупа");
-    }
+    RECT rect;
+    rect.left = min(x1, x2) - margin;
+    rect.top = min(y1, y2) - margin;
+    rect.right = max(x1, x2) + margin + 1;
+    rect.bottom = max(y1, y2) + margin + 1;
+    return rect;
 }
 
-// Преобразование координат из экранных в координаты увеличенной области
-void ScreenToZoomCoords(int& x, int& y)
+// Область объекта на холсте вместе с маркерами выделения
+RECT GetObjectBounds(const DrawingRef& obj)
 {
-    if (!zoomMode) return;
+    int margin = max(obj.thickness() + 2, HANDLE_SIZE + 1);
+
+    // Заливка занимает всю свою маску, а не точку затравки
+    uint32_t id = obj.payload();
+    if ((obj.type() == 6 || obj.type() == OBJECT_CLEARED_MASK) && id != 0 && id <= fillMasks.size()) {
+        const SpanMask& mask = fillMasks[id - 1];
+        int dx = obj.startX() - mask.AnchorX();
+        int dy = obj.startY() - mask.AnchorY();
+        RECT rect = GetSegmentBounds(mask.Bounds().left + dx, mask.Bounds().top + dy,
+            mask.Bounds().right + dx, mask.Bounds().bottom + dy, 0);
+        RECT handles = GetSegmentBounds(obj.startX(), obj.startY(), obj.endX(), obj.endY(), margin);
+        return DamageTracker::Union(rect, handles);
+    }
 
-    // Вычисляем коэффициенты масштабирования
-    float scaleX = static_cast<float>(zoomRect.right - zoomRect.left) / bufferWidth;
-    float scaleY = static_cast<float>(zoomRect.bottom - zoomRect.top) / bufferHeight;
+    // Градиент занимает свою область: маску заливки или рамку выделения
+    if (obj.type() == OBJECT_GRADIENT && id != 0 && id <= gradientFills.size()) {
+        RECT handles = GetSegmentBounds(obj.startX(), obj.startY(), obj.endX(), obj.endY(), margin);
+        uint32_t maskId = gradientFills[id - 1].mask;
+        if (maskId != 0 && maskId <= fillMasks.size()) {
+            const SpanMask& mask = fillMasks[maskId - 1];
+            int dx = obj.startX() - mask.AnchorX();
+            int dy = obj.startY() - mask.AnchorY();
+            RECT rect = GetSegmentBounds(mask.Bounds().left + dx, mask.Bounds().top + dy,
+                mask.Bounds().right + dx, mask.Bounds().bottom + dy, 0);
+            return DamageTracker::Union(rect, handles);
+        }
+        RECT frame = obj.selectionRect();
+        return DamageTracker::Union(GetSegmentBounds(frame.left, frame.top, frame.right, frame.bottom, 0), handles);
+    }
 
-    // Преобразуем координаты
-    x = zoomRect.left + static_cast<int>((x - SIDEBAR_WIDTH) * scaleX);
-    y = zoomRect.top + static_cast<int>((y - TOOLBAR_HEIGHT) * scaleY);
+    return GetSegmentBounds(obj.startX(), obj.startY(), obj.endX(), obj.endY(), margin);
 }
 
-// Преобразование координат из увеличенной области в экранные
-void ZoomToScreenCoords(int& x, int& y)
+// Область рамки выделения вместе с её маркерами
+RECT GetSelectionAreaBounds()
 {
-    if (!zoomMode) return;
-
-    // Вычисляем коэффициенты масштабирования
-    float scaleX = static_cast<float>(bufferWidth) / (zoomRect.right - zoomRect.left);
-    float scaleY = static_cast<float>(bufferHeight) / (zoomRect.bottom - zoomRect.top);
+    RECT rect = { 0, 0, 0, 0 };
+    if (!selection.active) return rect;
 
-    // Преобразуем координаты
-    x = SIDEBAR_WIDTH + static_cast<int>((x - zoomRect.left) * scaleX);
-    y = TOOLBAR_HEIGHT + static_cast<int>((y - zoomRect.top) * scaleY);
+    return GetSegmentBounds(selection.rect.left, selection.rect.top,
+        selection.rect.right, selection.rect.bottom, SELECTION_HANDLE_SIZE + 1);
 }
 
-// Создание панели инструментов
-void CreateToolbar(HWND hWnd)
+// Смена выбранного объекта: повреждены маркеры старого и нового
+void SetSelectedObject(int index)
 {
-    // ВЕРХНЯЯ ПАНЕЛЬ (горизонтальная) - кнопки управления
-    CreateWindowW(L"BUTTON", L"Сохранить", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
-        SIDEBAR_WIDTH + 10, 10, 80, 30, hWnd, (HMENU)ID_SAVE_BUTTON, hInst, NULL);
+    if (index == selectedObjectIndex) return;
 
-    CreateWindowW(L"BUTTON", L"Очистить", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
-        SIDEBAR_WIDTH + 100, 10, 80, 30, hWnd, (HMENU)ID_CLEAR_BUTTON, hInst, NULL);
+    if (selectedObjectIndex >= 0 && selectedObjectIndex < static_cast<int>(drawings.size())) {
+        AddDamage(GetObjectBounds(drawings[selectedObjectIndex]));
+    }
+    selectedObjectIndex = index;
+    if (selectedObjectIndex >= 0 && selectedObjectIndex < static_cast<int>(drawings.size())) {
+        AddDamage(GetObjectBounds(drawings[selectedObjectIndex]));
+    }
+}
 
-    CreateWindowW(L"BUTTON", L"Цвет", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
-        SIDEBAR_WIDTH + 190, 10, 60, 30, hWnd, (HMENU)ID_COLOR_BUTTON, hInst, NULL);
+// Композиция прямоугольника холста: слои + предпросмотр + маркеры + рамка выделения
+void ComposeCanvasRect(const RECT& rect)
+{
+    CompositeLayers(rect);
+
+    // Набираемая надпись выводится поверх собранного холста теми же глифами из атласа
+    RECT typingBounds = { 0, 0, 0, 0 };
+    if (isTyping) {
+        typingBounds = GetTypingBounds();
+        RECT overlap;
+        if (IntersectRect(&overlap, &typingBounds, &rect) && !typedText.empty()) {
+            size_t fontIndex = GetTextFont(TextPixelSize(currentThickness));
+            MaskRect clip = { overlap.left, overlap.top, overlap.right, overlap.bottom };
+            uint32_t color = ColorToPixel(currentColor);
+            GdiFlush();
+            LayoutText(typedText, fontIndex, typingX, typingY, [&](const GlyphInfo& glyph, int left, int top) {
+                BlendGlyph(canvas.bits, bufferStride, clip, left, top, glyph, color, indexedCanvas);
+            });
+        }
+    }
 
-    CreateWindowW(L"STATIC", L"Толщина:", WS_VISIBLE | WS_CHILD,
-        SIDEBAR_WIDTH + 260, 15, 60, 20, hWnd, NULL, hInst, NULL);
+    // Строящийся многоугольник закрашивается тем же правилом, что и готовый
+    RECT polygonBounds = { 0, 0, 0, 0 };
+    if (!polygonPoints.empty()) {
+        polygonBounds = GetPolygonPreviewBounds();
+        RECT overlap;
+        if (IntersectRect(&overlap, &polygonBounds, &rect)) {
+            std::vector<ScanPoint> points;
+            for (const POINT& point : polygonPoints) {
+                points.push_back({ point.x * SCAN_ONE, point.y * SCAN_ONE });
+            }
+            points.push_back({ polygonCursor.x * SCAN_ONE, polygonCursor.y * SCAN_ONE });
+
+            MaskRect clip = { overlap.left, overlap.top, overlap.right, overlap.bottom };
+            uint32_t color = ColorToPixel(currentColor);
+            GdiFlush();
+            ScanPolygon(points.data(), points.size(), currentFillRule, clip, [&](int y, int left, int right) {
+                FillSpan(canvas.bits + static_cast<size_t>(y) * bufferStride, left, right, color);
+            });
+        }
+    }
 
-    HWND hTrackbar = CreateWindowW(TRACKBAR_CLASS, L"Толщина",
-        WS_VISIBLE | WS_CHILD | TBS_AUTOTICKS | TBS_ENABLESELRANGE,
-        SIDEBAR_WIDTH + 320, 10, 150, 30, hWnd, (HMENU)ID_THICKNESS_TRACKBAR, hInst, NULL);
+    BitBlt(hComposeDC, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top,
+        canvas.dc, rect.left, rect.top, SRCCOPY);
 
-    SendMessage(hTrackbar, TBM_SETRANGE, TRUE, MAKELONG(1, 50));
-    SendMessage(hTrackbar, TBM_SETPOS, TRUE, currentThickness);
-    SendMessage(hTrackbar, TBM_SETTICFREQ, 5, 0);
+    if (hasTempObject) {
+        if (selection.active) {
+            ApplyClipping(hComposeDC);
+            IntersectClipRect(hComposeDC, rect.left, rect.top, rect.right, rect.bottom);
+        }
+        else {
+            HRGN rectRegion = CreateRectRgn(rect.left, rect.top, rect.right, rect.bottom);
+            SelectClipRgn(hComposeDC, rectRegion);
+            DeleteObject(rectRegion);
+        }
+        DrawObject(hComposeDC, tempObject);
+        RemoveClipping(hComposeDC);
+    }
 
-    CreateWindowW(L"STATIC", L"Форма кисти:", WS_VISIBLE | WS_CHILD,
+    HRGN rectRegion = CreateRectRgn(rect.left, rect.top, rect.right, rect.bottom);
+    SelectClipRgn(hComposeDC, rectRegion);
+    DeleteObject(rectRegion);
+
+    if (selectedObjectIndex != -1 && selectedObjectIndex < static_cast<int>(drawings.size())) {
+        DrawSelection(hComposeDC, drawings[selectedObjectIndex]);
+    }
+    if (selection.active) {
+        DrawSelectionArea(hComposeDC);
+    }
+    if (!polygonPoints.empty()) {
+        // Контур строящегося многоугольника и сторона к курсору
+        HPEN hPen = CreatePen(PS_DOT, 1, RGB(0, 0, 0));
+        HPEN hOldPen = (HPEN)SelectObject(hComposeDC, hPen);
+        Polyline(hComposeDC, polygonPoints.data(), static_cast<int>(polygonPoints.size()));
+        MoveToEx(hComposeDC, polygonPoints.back().x, polygonPoints.back().y, NULL);
+        LineTo(hComposeDC, polygonCursor.x, polygonCursor.y);
+        SelectObject(hComposeDC, hOldPen);
+        DeleteObject(hPen);
+    }
+    if (isTyping) {
+        // Пунктирная рамка набираемой надписи
+        HPEN hPen = CreatePen(PS_DOT, 1, RGB(0, 0, 0));
+        HPEN hOldPen = (HPEN)SelectObject(hComposeDC, hPen);
+        HBRUSH hOldBrush = (HBRUSH)SelectObject(hComposeDC, GetStockObject(NULL_BRUSH));
+        Rectangle(hComposeDC, typingBounds.left, typingBounds.top, typingBounds.right, typingBounds.bottom);
+        SelectObject(hComposeDC, hOldBrush);
+        SelectObject(hComposeDC, hOldPen);
+        DeleteObject(hPen);
+    }
+
+    RemoveClipping(hComposeDC);
+}
+
+// Функции навигатора
+
+// Место уменьшенного холста в навигаторе (пропорции холста, по центру)
+RECT GetNavigatorImageRect()
+{
+    RECT rect = NAVIGATOR_RECT;
+    int width = navigatorPyramid.SourceWidth(), height = navigatorPyramid.SourceHeight();
+    if (width <= 0 || height <= 0) {
+        SetRectEmpty(&rect);
+        return rect;
+    }
+
+    if (width >= height) {
+        int imageHeight = max(1, NAVIGATOR_SIZE * height / width);
+        rect.top += (NAVIGATOR_SIZE - imageHeight) / 2;
+        rect.bottom = rect.top + imageHeight;
+    }
+    else {
+        int imageWidth = max(1, NAVIGATOR_SIZE * width / height);
+        rect.left += (NAVIGATOR_SIZE - imageWidth) / 2;
+        rect.right = rect.left + imageWidth;
+    }
+    return rect;
+}
+
+// Перенос выведенных повреждений в пирамиду (холст в них уже собран). После изменения
+// размера холст собирается и пирамида строится заново - но не пока тянут край окна.
+void UpdateNavigator()
+{
+    if (!canvas.bits || bufferWidth == 0 || bufferHeight == 0) return;
+
+    int width = static_cast<int>(bufferWidth), height = static_cast<int>(bufferHeight);
+    if (navigatorPyramid.SourceWidth() != width || navigatorPyramid.SourceHeight() != height) {
+        if (isLiveResizing) return;
+
+        navigatorPyramid.Resize(width, height, NAVIGATOR_SIZE);
+        RECT canvasRect = { 0, 0, width, height };
+        CompositeLayers(canvasRect);
+        navigatorDamage.Clear();
+        navigatorDamage.Add(canvasRect);
+    }
+    if (navigatorDamage.Empty()) return;
+
+    GdiFlush();
+    for (const auto& rect : navigatorDamage.Rects()) {
+        MaskRect dirty = { rect.left, rect.top, rect.right, rect.bottom };
+        navigatorPyramid.Update(canvas.bits, bufferStride, dirty);
+    }
+    navigatorDamage.Clear();
+}
+
+// Навигатор: последний уровень пирамиды и рамка видимой области (в режиме лупы)
+void DrawNavigator(HDC hdc)
+{
+    FillRect(hdc, &NAVIGATOR_RECT, (HBRUSH)(COLOR_BTNFACE + 1));
+    if (navigatorPyramid.Levels() == 0) return;
+
+    int level = navigatorPyramid.Levels() - 1;
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = navigatorPyramid.Width(level);
+    bmi.bmiHeader.biHeight = -navigatorPyramid.Height(level);
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    // Последний уровень не больше чем вдвое крупнее навигатора - сглаживание GDI хватает
+    RECT image = GetNavigatorImageRect();
+    int oldMode = SetStretchBltMode(hdc, HALFTONE);
+    SetBrushOrgEx(hdc, 0, 0, NULL);
+    StretchDIBits(hdc, image.left, image.top, image.right - image.left, image.bottom - image.top,
+        0, 0, navigatorPyramid.Width(level), navigatorPyramid.Height(level),
+        navigatorPyramid.Pixels(level), &bmi, DIB_RGB_COLORS, SRCCOPY);
+    SetStretchBltMode(hdc, oldMode);
+
+    FrameRect(hdc, &image, (HBRUSH)GetStockObject(GRAY_BRUSH));
+
+    if (zoomMode) {
+        int sourceWidth = navigatorPyramid.SourceWidth(), sourceHeight = navigatorPyramid.SourceHeight();
+        int imageWidth = image.right - image.left, imageHeight = image.bottom - image.top;
+        RECT view = {
+            image.left + zoomRect.left * imageWidth / sourceWidth,
+            image.top + zoomRect.top * imageHeight / sourceHeight,
+            image.left + (zoomRect.right * imageWidth + sourceWidth - 1) / sourceWidth,
+            image.top + (zoomRect.bottom * imageHeight + sourceHeight - 1) / sourceHeight
+        };
+        HBRUSH hRed = CreateSolidBrush(RGB(255, 0, 0));
+        FrameRect(hdc, &view, hRed);
+        DeleteObject(hRed);
+    }
+}
+
+// Точка окна (x, y) в навигаторе - в координаты холста
+bool NavigatorToCanvas(int x, int y, int& canvasX, int& canvasY)
+{
+    RECT image = GetNavigatorImageRect();
+    POINT point = { x, y };
+    if (IsRectEmpty(&image) || !PtInRect(&image, point)) return false;
+
+    canvasX = (x - image.left) * navigatorPyramid.SourceWidth() / (image.right - image.left);
+    canvasY = (y - image.top) * navigatorPyramid.SourceHeight() / (image.bottom - image.top);
+    return true;
+}
+
+// Функции учёта памяти
+
+// Копия документа (снимок): объекты и маски. Плитки фрагментов у снимка общие с
+// редактором и учтены среди плиток холста
+size_t DocumentMemoryBytes(const PaintDocument& doc)
+{
+    size_t bytes = doc.layers.capacity() * sizeof(DocLayer);
+    for (const auto& layer : doc.layers) bytes += layer.objects.capacity() * sizeof(DocObject);
+    for (const auto& mask : doc.fillMasks) bytes += sizeof(SpanMask) + mask.MemoryBytes();
+    for (const auto& mask : doc.selectionMasks) bytes += sizeof(SpanMask) + mask.MemoryBytes();
+    return bytes + doc.fragments.capacity() * sizeof(DocFragment);
+}
+
+size_t TextStringsMemoryBytes(const std::vector<std::wstring>& texts)
+{
+    size_t bytes = texts.capacity() * sizeof(std::wstring);
+    for (const auto& text : texts) bytes += (text.capacity() + 1) * sizeof(wchar_t);
+    return bytes;
+}
+
+size_t PolygonsMemoryBytes(const std::vector<FillPolygon>& polygons)
+{
+    size_t bytes = polygons.capacity() * sizeof(FillPolygon);
+    for (const auto& polygon : polygons) bytes += polygon.points.capacity() * sizeof(POINT);
+    return bytes;
+}
+
+size_t MasksMemoryBytes(const std::vector<SpanMask>& masks)
+{
+    size_t bytes = masks.capacity() * sizeof(SpanMask);
+    for (const auto& mask : masks) bytes += mask.MemoryBytes();
+    return bytes;
+}
+
+// Выборка: статьи расхода по категориям, GDI-объекты и закрытая память процесса
+void SampleMemory()
+{
+    memoryStats.Begin();
+
+    // Объекты и таблицы, на которые они ссылаются
+    size_t objectBytes = 0, objectCount = 0;
+    for (size_t i = 0; i < layers.size(); i++) {
+        objectBytes += LayerObjects(i).MemoryBytes();
+        objectCount += LayerObjects(i).size();
+    }
+    size_t fragmentBytes = fragments.capacity() * sizeof(Fragment) + clipboardFragment.mask.MemoryBytes();
+    for (const auto& fragment : fragments) fragmentBytes += fragment.mask.MemoryBytes();
+
+    memoryStats.Add(MEMORY_OBJECTS, "drawing_store", objectBytes, objectCount);
+    memoryStats.Add(MEMORY_OBJECTS, "fill_masks", MasksMemoryBytes(fillMasks), fillMasks.size());
+    memoryStats.Add(MEMORY_OBJECTS, "selection_masks", MasksMemoryBytes(selectionMasks), selectionMasks.size());
+    memoryStats.Add(MEMORY_OBJECTS, "fragments", fragmentBytes, fragments.size());
+    memoryStats.Add(MEMORY_OBJECTS, "text_strings", TextStringsMemoryBytes(textStrings), textStrings.size());
+    memoryStats.Add(MEMORY_OBJECTS, "polygons", PolygonsMemoryBytes(fillPolygons), fillPolygons.size());
+    memoryStats.Add(MEMORY_OBJECTS, "gradients", gradientFills.capacity() * sizeof(GradientFillInfo), gradientFills.size());
+
+    // Растры: DIB-секции слоёв и холста по ёмкости буфера, слои с палитрой, плитки фрагментов
+    size_t surfaceBytes = bufferCapacityWidth * bufferCapacityHeight * sizeof(uint32_t);
+    size_t rasterCount = 0, indexedBytes = 0, indexedCount = 0;
+    for (const auto& layer : layers) {
+        if (layer.surface.bits) rasterCount++;
+        if (!layer.indexed.Empty()) {
+            indexedBytes += layer.indexed.MemoryBytes();
+            indexedCount++;
+        }
+    }
+    memoryStats.Add(MEMORY_CANVAS, "layer_rasters", rasterCount * surfaceBytes, rasterCount);
+    memoryStats.Add(MEMORY_CANVAS, "indexed_rasters", indexedBytes, indexedCount);
+    memoryStats.Add(MEMORY_CANVAS, "composite", canvas.bits ? surfaceBytes : 0, canvas.bits ? 1 : 0);
+    memoryStats.Add(MEMORY_CANVAS, "fragment_tiles", fragmentTileCache.ResidentBytes() + fragmentTileCache.CompressedBytes(),
+        fragmentTileCache.ResidentTiles() + fragmentTileCache.CompressedTiles());
+
+    // Кэши и рабочие буферы
+    size_t binBytes = 0, binLayers = 0;
+    for (const auto& layer : layers) {
+        if (layer.openBins.Empty()) continue;
+        binBytes += layer.openBins.MemoryBytes();
+        binLayers++;
+    }
+    memoryStats.Add(MEMORY_CACHES, "glyph_atlas", glyphAtlas.MemoryBytes(), textFonts.size());
+    memoryStats.Add(MEMORY_CACHES, "navigator", navigatorPyramid.MemoryBytes(), navigatorPyramid.Levels());
+    memoryStats.Add(MEMORY_CACHES, "open_bins", binBytes, binLayers);
+    memoryStats.Add(MEMORY_CACHES, "scratch_rows", (compositeRow.capacity() + maskScratch.capacity()) * sizeof(uint32_t),
+        (compositeRow.capacity() ? 1 : 0) + (maskScratch.capacity() ? 1 : 0));
+
+    // Наложения: совместимый с экраном буфер композиции и предпросмотр
+    BITMAP composeInfo = {};
+    size_t composeBytes = 0;
+    if (hComposeBitmap && GetObject(hComposeBitmap, sizeof(composeInfo), &composeInfo)) {
+        composeBytes = static_cast<size_t>(composeInfo.bmWidthBytes) * composeInfo.bmHeight;
+    }
+    memoryStats.Add(MEMORY_OVERLAYS, "compose_buffer", composeBytes, hComposeBitmap ? 1 : 0);
+    memoryStats.Add(MEMORY_OVERLAYS, "preview",
+        polygonPoints.capacity() * sizeof(POINT) + typedText.capacity() * sizeof(wchar_t),
+        (hasTempObject ? 1 : 0) + (polygonPoints.empty() ? 0 : 1) + (isTyping ? 1 : 0));
+
+    // Снимки документа, которые ещё держат потоки сохранения и журнала
+    if (auto snapshot = pendingSave.lock()) {
+        memoryStats.Add(MEMORY_SNAPSHOTS, "save",
+            snapshot->pixels.capacity() * sizeof(uint32_t) + DocumentMemoryBytes(snapshot->document), 1);
+    }
+    if (auto snapshot = pendingCompaction.lock()) {
+        memoryStats.Add(MEMORY_SNAPSHOTS, "journal_compaction", DocumentMemoryBytes(snapshot->document) +
+            TextStringsMemoryBytes(snapshot->texts) + PolygonsMemoryBytes(snapshot->polygons) +
+            snapshot->gradients.capacity() * sizeof(GradientFillInfo), 1);
+    }
+
+    PROCESS_MEMORY_COUNTERS_EX counters = {};
+    counters.cb = sizeof(counters);
+    size_t privateBytes = 0;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters))) {
+        privateBytes = counters.PrivateUsage;
+    }
+    memoryStats.SetProcess(GetGuiResources(GetCurrentProcess(), GR_GDIOBJECTS), privateBytes);
+    memoryStats.SetDocument(static_cast<int>(bufferWidth), static_cast<int>(bufferHeight), layers.size(), objectCount);
+    memoryStats.End();
+}
+
+// Размер в КБ или МБ с одним знаком после запятой
+std::wstring FormatMemorySize(size_t bytes)
+{
+    WCHAR text[32];
+    if (bytes < 1024 * 1024) {
+        wsprintfW(text, L"%d КБ", static_cast<int>((bytes + 1023) / 1024));
+    }
+    else {
+        size_t tenths = (bytes * 10 + 512 * 1024) / (1024 * 1024);
+        wsprintfW(text, L"%d.%d МБ", static_cast<int>(tenths / 10), static_cast<int>(tenths % 10));
+    }
+    return text;
+}
+
+// Строки оверлея: категории (текущее и пик), итог и показатели процесса
+std::wstring BuildMemoryOverlayText()
+{
+    static const WCHAR* const names[MEMORY_CATEGORY_COUNT] = {
+        L"объекты", L"холст", L"кэши", L"наложения", L"снимки"
+    };
+
+    std::wstring text = L"Память (Shift+F11 - JSON)\n";
+    for (int c = 0; c < MEMORY_CATEGORY_COUNT; c++) {
+        const MemoryTotals& totals = memoryStats.Totals(static_cast<MemoryCategory>(c));
+        WCHAR line[160];
+        wsprintfW(line, L"%s: %s (%d), пик %s\n", names[c], FormatMemorySize(totals.bytes).c_str(),
+            static_cast<int>(totals.count), FormatMemorySize(totals.peakBytes).c_str());
+        text += line;
+    }
+
+    WCHAR line[160];
+    WorkCounter frame = memoryStats.Counter("frame_pixels");
+    wsprintfW(line, L"кадр: %d пикс., пик %d (кадров %d)\n", static_cast<int>(frame.last),
+        static_cast<int>(frame.peak), static_cast<int>(frame.events));
+    text += line;
+    WorkCounter glyphHits = memoryStats.Counter("glyph_hits");
+    WorkCounter glyphMisses = memoryStats.Counter("glyph_misses");
+    wsprintfW(line, L"атлас: промахов %d из %d, вытеснений %d, глифов %d\n", static_cast<int>(glyphMisses.total),
+        static_cast<int>(glyphHits.total + glyphMisses.total), static_cast<int>(memoryStats.Counter("glyph_evictions").total),
+        static_cast<int>(glyphAtlas.GlyphCount()));
+    text += line;
+    WorkCounter commitBytes = memoryStats.Counter("journal_commit_bytes");
+    WorkCounter commitTime = memoryStats.Counter("journal_commit_us");
+    wsprintfW(line, L"журнал: правка %d Б / %d мкс, пик %d Б / %d мкс\n", static_cast<int>(commitBytes.last),
+        static_cast<int>(commitTime.last), static_cast<int>(commitBytes.peak), static_cast<int>(commitTime.peak));
+    text += line;
+    wsprintfW(line, L"учтено %s, пик %s; процесс %s\n", FormatMemorySize(memoryStats.TotalBytes()).c_str(),
+        FormatMemorySize(memoryStats.PeakTotalBytes()).c_str(), FormatMemorySize(memoryStats.ProcessBytes()).c_str());
+    text += line;
+    wsprintfW(line, L"GDI-объектов %d, пик %d", static_cast<int>(memoryStats.Handles()),
+        static_cast<int>(memoryStats.PeakHandles()));
+    return text + line;
+}
+
+// Перерисовка оверлея, если изменился его текст (или он включён / выключен)
+void RefreshMemoryOverlay(HWND hWnd)
+{
+    std::wstring text = memoryOverlay ? BuildMemoryOverlayText() : std::wstring();
+    if (text == memoryOverlayText) return;
+
+    memoryOverlayText = text;
+    RECT windowRect = MEMORY_OVERLAY_RECT;
+    OffsetRect(&windowRect, SIDEBAR_WIDTH, TOOLBAR_HEIGHT);
+    InvalidateRect(hWnd, &windowRect, FALSE);
+}
+
+// Оверлей поверх выведенного холста: hdc обрезан областью обновления, поэтому
+// холст под оверлеем к этому моменту уже выведен заново
+void DrawMemoryOverlay(HDC hdc)
+{
+    RECT rect = MEMORY_OVERLAY_RECT;
+    OffsetRect(&rect, SIDEBAR_WIDTH, TOOLBAR_HEIGHT);
+    FillRect(hdc, &rect, (HBRUSH)GetStockObject(WHITE_BRUSH));
+    FrameRect(hdc, &rect, (HBRUSH)GetStockObject(GRAY_BRUSH));
+
+    HFONT hOldFont = (HFONT)SelectObject(hdc, GetStockObject(DEFAULT_GUI_FONT));
+    SetBkMode(hdc, TRANSPARENT);
+    SetTextColor(hdc, RGB(0, 0, 0));
+    InflateRect(&rect, -6, -4);
+    DrawTextW(hdc, memoryOverlayText.c_str(), static_cast<int>(memoryOverlayText.size()), &rect, DT_LEFT | DT_NOPREFIX);
+    SelectObject(hdc, hOldFont);
+}
+
+// Выгрузка свежей выборки в memory.json в папке данных программы
+void DumpMemoryStats(HWND hWnd)
+{
+    SampleMemory();
+    std::wstring folder = GetAppDataFolder();
+    std::wstring path = folder + L"\\memory.json";
+    std::string json = memoryStats.ToJson();
+
+    std::ofstream file(path, std::ios::binary);
+    if (folder.empty() || !file.write(json.data(), json.size())) {
+        MessageBox(hWnd, L"Не удалось записать статистику памяти", L"Ошибка", MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    std::wstring message = L"Статистика памяти записана в " + path;
+    MessageBox(hWnd, message.c_str(), L"Память", MB_OK | MB_ICONINFORMATION);
+}
+
+// Функции для лупы
+
+// Применение увеличения области
+void ApplyZoom(HWND hWnd, int x, int y)
+{
+    if (!hBufferDC) return;
+
+    // Определяем область для увеличения (размер зависит от коэффициента увеличения)
+    int zoomWidth = static_cast<int>(bufferWidth / zoomFactor);
+    int zoomHeight = static_cast<int>(bufferHeight / zoomFactor);
+
+    zoomRect.left = max(0, x - zoomWidth / 2);
+    zoomRect.top = max(0, y - zoomHeight / 2);
+    zoomRect.right = min(static_cast<int>(bufferWidth), zoomRect.left + zoomWidth);
+    zoomRect.bottom = min(static_cast<int>(bufferHeight), zoomRect.top + zoomHeight);
+
+    // Включаем режим лупы и режим рисования в увеличенной области
+    zoomMode = true;
+    zoomDrawingMode = true;
+
+    // Недорисованные ячейки открытого документа в новой видимой области - сразу
+    RenderVisibleOpenCells();
+
+    // Обновляем отображение
+    AddFullDamage();
+    PresentDamage(hWnd);
+
+    // Обновляем текст кнопки лупы
+    SetWindowText(GetDlgItem(hWnd, ID_ZOOM_BUTTON), L"Лупа [активна]");
+}
+
+// Сброс увеличения
+void ResetZoom(HWND hWnd)
+{
+    if (zoomMode) {
+        AddFullDamage();
+    }
+
+    zoomMode = false;
+    zoomDrawingMode = false;
+    zoomRect = { 0, 0, 0, 0 };
+    zoomOffsetX = 0;
+    zoomOffsetY = 0;
+
+    if (hWnd) {
+        SetWindowText(GetDlgItem(hWnd, ID_ZOOM_BUTTON), L"Лупа");
+    }
+}
+
+// Преобразование координат из экранных в координаты увеличенной области
+void ScreenToZoomCoords(int& x, int& y)
+{
+    if (!zoomMode) return;
+
+    // Вычисляем коэффициенты масштабирования
+    float scaleX = static_cast<float>(zoomRect.right - zoomRect.left) / bufferWidth;
+    float scaleY = static_cast<float>(zoomRect.bottom - zoomRect.top) / bufferHeight;
+
+    // Преобразуем координаты
+    x = zoomRect.left + static_cast<int>((x - SIDEBAR_WIDTH) * scaleX);
+    y = zoomRect.top + static_cast<int>((y - TOOLBAR_HEIGHT) * scaleY);
+}
+
+// Преобразование координат из увеличенной области в экранные
+void ZoomToScreenCoords(int& x, int& y)
+{
+    if (!zoomMode) return;
+
+    // Вычисляем коэффициенты масштабирования
+    float scaleX = static_cast<float>(bufferWidth) / (zoomRect.right - zoomRect.left);
+    float scaleY = static_cast<float>(bufferHeight) / (zoomRect.bottom - zoomRect.top);
+
+    // Преобразуем координаты
+    x = SIDEBAR_WIDTH + static_cast<int>((x - zoomRect.left) * scaleX);
+    y = TOOLBAR_HEIGHT + static_cast<int>((y - zoomRect.top) * scaleY);
+}
+
+// Создание панели инструментов
+void CreateToolbar(HWND hWnd)
+{
+    // ВЕРХНЯЯ ПАНЕЛЬ (горизонтальная) - кнопки управления
+    CreateWindowW(L"BUTTON", L"Сохранить", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        SIDEBAR_WIDTH + 10, 10, 80, 30, hWnd, (HMENU)ID_SAVE_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Очистить", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        SIDEBAR_WIDTH + 100, 10, 80, 30, hWnd, (HMENU)ID_CLEAR_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Цвет", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        SIDEBAR_WIDTH + 190, 10, 60, 30, hWnd, (HMENU)ID_COLOR_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"STATIC", L"Толщина:", WS_VISIBLE | WS_CHILD,
+        SIDEBAR_WIDTH + 260, 15, 60, 20, hWnd, NULL, hInst, NULL);
+
+    HWND hTrackbar = CreateWindowW(TRACKBAR_CLASS, L"Толщина",
+        WS_VISIBLE | WS_CHILD | TBS_AUTOTICKS | TBS_ENABLESELRANGE,
+        SIDEBAR_WIDTH + 320, 10, 150, 30, hWnd, (HMENU)ID_THICKNESS_TRACKBAR, hInst, NULL);
+
+    SendMessage(hTrackbar, TBM_SETRANGE, TRUE, MAKELONG(1, 50));
+    SendMessage(hTrackbar, TBM_SETPOS, TRUE, currentThickness);
+    SendMessage(hTrackbar, TBM_SETTICFREQ, 5, 0);
+
+    CreateWindowW(L"STATIC", L"Форма кисти:", WS_VISIBLE | WS_CHILD,
         SIDEBAR_WIDTH + 480, 15, 80, 20, hWnd, NULL, hInst, NULL);
 
     HWND hCombo = CreateWindowW(L"COMBOBOX", L"",
@@ -859,6 +2085,80 @@ void CreateToolbar(HWND hWnd)
     SendMessageW(hCombo, CB_ADDSTRING, 0, (LPARAM)L"Треугольник");
     SendMessageW(hCombo, CB_SETCURSEL, currentBrushShape, 0);
 
+    CreateWindowW(L"BUTTON", L"Time-lapse", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        SIDEBAR_WIDTH + 700, 10, 90, 30, hWnd, (HMENU)ID_TIMELAPSE_BUTTON, hInst, NULL);
+
+    HWND hSimplify = CreateWindowW(L"BUTTON", L"Упрощать штрихи", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+        SIDEBAR_WIDTH + 10, 48, 140, 24, hWnd, (HMENU)ID_SIMPLIFY_CHECK, hInst, NULL);
+    SendMessage(hSimplify, BM_SETCHECK, simplifyStrokes ? BST_CHECKED : BST_UNCHECKED, 0);
+
+    // Параметры заливки: допуск, мера расстояния между цветами, 8-связность
+    CreateWindowW(L"STATIC", L"Допуск:", WS_VISIBLE | WS_CHILD,
+        SIDEBAR_WIDTH + 160, 52, 55, 20, hWnd, NULL, hInst, NULL);
+
+    HWND hTolerance = CreateWindowW(TRACKBAR_CLASS, L"Допуск",
+        WS_VISIBLE | WS_CHILD | TBS_AUTOTICKS,
+        SIDEBAR_WIDTH + 215, 45, 120, 30, hWnd, (HMENU)ID_TOLERANCE_TRACKBAR, hInst, NULL);
+
+    SendMessage(hTolerance, TBM_SETRANGE, TRUE, MAKELONG(0, 128));
+    SendMessage(hTolerance, TBM_SETPOS, TRUE, fillTolerance);
+    SendMessage(hTolerance, TBM_SETTICFREQ, 16, 0);
+
+    HWND hDistance = CreateWindowW(L"COMBOBOX", L"",
+        WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | CBS_HASSTRINGS,
+        SIDEBAR_WIDTH + 345, 48, 110, 200, hWnd, (HMENU)ID_FILL_DISTANCE_COMBO, hInst, NULL);
+
+    SendMessageW(hDistance, CB_ADDSTRING, 0, (LPARAM)L"RGB");
+    SendMessageW(hDistance, CB_ADDSTRING, 0, (LPARAM)L"Восприятие");
+    SendMessageW(hDistance, CB_SETCURSEL, fillDistance, 0);
+
+    HWND hEightWay = CreateWindowW(L"BUTTON", L"8-связность", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+        SIDEBAR_WIDTH + 465, 48, 100, 24, hWnd, (HMENU)ID_FILL_8WAY_CHECK, hInst, NULL);
+    SendMessage(hEightWay, BM_SETCHECK, fillEightConnected ? BST_CHECKED : BST_UNCHECKED, 0);
+
+    HWND hIndexed = CreateWindowW(L"BUTTON", L"Слои в палитре", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+        SIDEBAR_WIDTH + 575, 48, 120, 24, hWnd, (HMENU)ID_INDEXED_CHECK, hInst, NULL);
+    SendMessage(hIndexed, BM_SETCHECK, indexedCanvas ? BST_CHECKED : BST_UNCHECKED, 0);
+
+    // Закрашенные фигуры: прямоугольник и окружность без контура, правило для многоугольника
+    HWND hFillShapes = CreateWindowW(L"BUTTON", L"Закрашивать", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+        SIDEBAR_WIDTH + 705, 48, 100, 24, hWnd, (HMENU)ID_FILL_SHAPES_CHECK, hInst, NULL);
+    SendMessage(hFillShapes, BM_SETCHECK, fillShapes ? BST_CHECKED : BST_UNCHECKED, 0);
+
+    HWND hFillRule = CreateWindowW(L"COMBOBOX", L"",
+        WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | CBS_HASSTRINGS,
+        SIDEBAR_WIDTH + 800, 10, 110, 200, hWnd, (HMENU)ID_FILL_RULE_COMBO, hInst, NULL);
+
+    SendMessageW(hFillRule, CB_ADDSTRING, 0, (LPARAM)L"Чёт-нечёт");
+    SendMessageW(hFillRule, CB_ADDSTRING, 0, (LPARAM)L"Ненулевое");
+    SendMessageW(hFillRule, CB_SETCURSEL, currentFillRule, 0);
+
+    // Градиент: второй цвет и вид
+    CreateWindowW(L"BUTTON", L"Цвет 2", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        SIDEBAR_WIDTH + 815, 46, 60, 26, hWnd, (HMENU)ID_GRADIENT_COLOR_BUTTON, hInst, NULL);
+
+    HWND hGradientKind = CreateWindowW(L"COMBOBOX", L"",
+        WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | CBS_HASSTRINGS,
+        SIDEBAR_WIDTH + 885, 48, 110, 200, hWnd, (HMENU)ID_GRADIENT_KIND_COMBO, hInst, NULL);
+
+    SendMessageW(hGradientKind, CB_ADDSTRING, 0, (LPARAM)L"Линейный");
+    SendMessageW(hGradientKind, CB_ADDSTRING, 0, (LPARAM)L"Радиальный");
+    SendMessageW(hGradientKind, CB_SETCURSEL, currentGradientKind, 0);
+
+    // Фильтры выделения (общее ядро с LAB3); после применения список возвращается к заголовку
+    HWND hFilter = CreateWindowW(L"COMBOBOX", L"",
+        WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | CBS_HASSTRINGS,
+        SIDEBAR_WIDTH + 920, 10, 130, 200, hWnd, (HMENU)ID_FILTER_COMBO, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Открыть", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        SIDEBAR_WIDTH + 1060, 10, 80, 30, hWnd, (HMENU)ID_OPEN_BUTTON, hInst, NULL);
+
+    SendMessageW(hFilter, CB_ADDSTRING, 0, (LPARAM)L"Фильтр:");
+    SendMessageW(hFilter, CB_ADDSTRING, 0, (LPARAM)L"Резкость");
+    SendMessageW(hFilter, CB_ADDSTRING, 0, (LPARAM)L"Размытие");
+    SendMessageW(hFilter, CB_ADDSTRING, 0, (LPARAM)L"Оттенки серого");
+    SendMessageW(hFilter, CB_SETCURSEL, 0, 0);
+
     // БОКОВАЯ ПАНЕЛЬ (вертикальная) - инструменты рисования
     CreateWindowW(L"BUTTON", L"Карандаш", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
         10, TOOLBAR_HEIGHT + 10, 80, 30, hWnd, (HMENU)ID_PENCIL_BUTTON, hInst, NULL);
@@ -883,6 +2183,42 @@ void CreateToolbar(HWND hWnd)
 
     CreateWindowW(L"BUTTON", L"Лупа", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
         10, TOOLBAR_HEIGHT + 290, 80, 30, hWnd, (HMENU)ID_ZOOM_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Палочка", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        10, TOOLBAR_HEIGHT + 330, 80, 30, hWnd, (HMENU)ID_MAGIC_WAND_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Текст", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        10, TOOLBAR_HEIGHT + 370, 80, 30, hWnd, (HMENU)ID_TEXT_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Многоуг.", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        10, TOOLBAR_HEIGHT + 410, 80, 30, hWnd, (HMENU)ID_POLYGON_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Градиент", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        10, TOOLBAR_HEIGHT + 450, 80, 30, hWnd, (HMENU)ID_GRADIENT_BUTTON, hInst, NULL);
+
+    // Слои: выбор активного, добавление/удаление, порядок, видимость и непрозрачность
+    CreateWindowW(L"COMBOBOX", L"",
+        WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | CBS_HASSTRINGS | WS_VSCROLL,
+        10, TOOLBAR_HEIGHT + 492, 80, 200, hWnd, (HMENU)ID_LAYER_COMBO, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"+", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        10, TOOLBAR_HEIGHT + 520, 19, 22, hWnd, (HMENU)ID_LAYER_ADD_BUTTON, hInst, NULL);
+    CreateWindowW(L"BUTTON", L"−", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        30, TOOLBAR_HEIGHT + 520, 19, 22, hWnd, (HMENU)ID_LAYER_DELETE_BUTTON, hInst, NULL);
+    CreateWindowW(L"BUTTON", L"▲", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        51, TOOLBAR_HEIGHT + 520, 19, 22, hWnd, (HMENU)ID_LAYER_UP_BUTTON, hInst, NULL);
+    CreateWindowW(L"BUTTON", L"▼", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+        71, TOOLBAR_HEIGHT + 520, 19, 22, hWnd, (HMENU)ID_LAYER_DOWN_BUTTON, hInst, NULL);
+
+    CreateWindowW(L"BUTTON", L"Видимый", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+        10, TOOLBAR_HEIGHT + 546, 80, 20, hWnd, (HMENU)ID_LAYER_VISIBLE_CHECK, hInst, NULL);
+
+    HWND hOpacity = CreateWindowW(TRACKBAR_CLASS, L"Непрозрачность",
+        WS_VISIBLE | WS_CHILD,
+        5, TOOLBAR_HEIGHT + 568, 90, 26, hWnd, (HMENU)ID_LAYER_OPACITY_TRACKBAR, hInst, NULL);
+    SendMessage(hOpacity, TBM_SETRANGE, TRUE, MAKELONG(0, 100));
+
+    UpdateLayerControls(hWnd);
 }
 
 // Обновление состояния панели инструментов
@@ -907,748 +2243,3233 @@ void SaveFile(HWND hWnd)
 
     ofn.lStructSize = sizeof(ofn);
     ofn.hwndOwner = hWnd;
-    ofn.lpstrFilter = L"BMP Files\0*.bmp\0WMF Files\0*.wmf\0ICO Files\0*.ico\0All Files\0*.*\0";
+    ofn.lpstrFilter = L"BMP Files\0*.bmp\0SimplePaint Document\0*.spd\0WMF Files\0*.wmf\0ICO Files\0*.ico\0All Files\0*.*\0";
     ofn.lpstrFile = filename;
     ofn.nMaxFile = MAX_PATH;
     ofn.Flags = OFN_EXPLORER | OFN_OVERWRITEPROMPT;
     ofn.lpstrDefExt = L"bmp";
 
-    if (GetSaveFileName(&ofn)) {
-        Bitmap bitmap(hBufferBitmap, NULL);
+    if (!GetSaveFileName(&ofn)) return;
 
-        std::wstring fileExt = ofn.lpstrFile;
-        if (fileExt.find(L".wmf") != std::wstring::npos) {
-            CLSID clsidWmf;
-            if (GetEncoderClsid(L"image/wmf", &clsidWmf) != -1) {
-                bitmap.Save(filename, &clsidWmf, NULL);
-            }
+    // Снимок берётся сейчас, кодирование и запись идут в потоке - рисовать можно сразу
+    auto snapshot = std::make_shared<SaveSnapshot>();
+    snapshot->filename = filename;
+    snapshot->width = static_cast<int>(bufferWidth);
+    snapshot->height = static_cast<int>(bufferHeight);
+
+    // Документ сохраняется списком объектов - его растеризует консольный рендерер
+    std::wstring fileExt = ofn.lpstrFile;
+    snapshot->isDocument = fileExt.size() >= 4 && fileExt.compare(fileExt.size() - 4, 4, L".spd") == 0;
+    if (snapshot->isDocument) {
+        BuildDocument(snapshot->document);
+    }
+    else {
+        const WCHAR* mimeType = L"image/bmp";
+        if (fileExt.find(L".wmf") != std::wstring::npos) mimeType = L"image/wmf";
+        else if (fileExt.find(L".ico") != std::wstring::npos) mimeType = L"image/x-icon";
+        if (GetEncoderClsid(mimeType, &snapshot->encoder) == -1) {
+            MessageBox(hWnd, L"Нет кодировщика для этого формата", L"Ошибка", MB_OK | MB_ICONERROR);
+            return;
         }
-        else if (fileExt.find(L".ico") != std::wstring::npos) {
-            CLSID clsidIco;
-            if (GetEncoderClsid(L"image/x-icon", &clsidIco) != -1) {
-                bitmap.Save(filename, &clsidIco, NULL);
-            }
+
+        // Видимая часть холста копируется построчно (ёмкость буфера может быть больше)
+        RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+        CompositeLayers(canvasRect);
+        snapshot->pixels.resize(bufferWidth * bufferHeight);
+        for (size_t y = 0; y < bufferHeight; y++) {
+            memcpy(&snapshot->pixels[y * bufferWidth], canvas.bits + y * bufferStride, bufferWidth * sizeof(uint32_t));
         }
-        else {
-            CLSID clsidBmp;
-            if (GetEncoderClsid(L"image/bmp", &clsidBmp) != -1) {
-                bitmap.Save(filename, &clsidBmp, NULL);
+    }
+
+    pendingSave = snapshot;
+    PostMessage(hWnd, WM_SAVE_PROGRESS, 0, 0);
+    backgroundSaver.Start(
+        [snapshot](const BackgroundSaver::Progress& progress) { return WriteSnapshot(*snapshot, progress); },
+        [hWnd](int percent) { PostMessage(hWnd, WM_SAVE_PROGRESS, static_cast<WPARAM>(percent), 0); },
+        [hWnd](bool ok) { PostMessage(hWnd, WM_SAVE_DONE, ok ? 1 : 0, 0); });
+}
+
+// Документ .spd: объекты всех слоёв и их таблицы. Фрагменты отвязаны от кэша
+// плиток, поэтому документ можно писать из потока сохранения. Надпись сохраняется
+// строкой и покрытием глифов: рендереру без шрифтов нечем растеризовать строку.
+void BuildDocument(PaintDocument& doc)
+{
+    doc.width = static_cast<int>(bufferWidth);
+    doc.height = static_cast<int>(bufferHeight);
+    doc.fillMasks = fillMasks;
+    doc.selectionMasks = selectionMasks;
+    for (const auto& fragment : fragments) {
+        doc.fragments.push_back({ fragment.image.DetachedCopy(), fragment.mask });
+    }
+
+    for (const auto& polygon : fillPolygons) {
+        DocPolygon docPolygon;
+        docPolygon.rule = polygon.rule;
+        docPolygon.bounds = { polygon.bounds.left, polygon.bounds.top, polygon.bounds.right, polygon.bounds.bottom };
+        for (const POINT& point : polygon.points) docPolygon.points.push_back({ point.x, point.y });
+        doc.polygons.push_back(std::move(docPolygon));
+    }
+
+    for (const auto& gradient : gradientFills) {
+        doc.gradients.push_back({ static_cast<uint32_t>(gradient.endColor), gradient.kind, gradient.mask });
+    }
+
+    doc.texts.resize(textStrings.size());
+    std::vector<bool> rasterized(textStrings.size(), false);
+    for (size_t i = 0; i < textStrings.size(); i++) {
+        doc.texts[i].text.assign(textStrings[i].begin(), textStrings[i].end());
+    }
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        // Объекты активного слоя лежат в drawings
+        const DrawingStore& objects = i == activeLayer ? drawings : layers[i].objects;
+
+        DocLayer docLayer;
+        docLayer.name.assign(layers[i].name.begin(), layers[i].name.end());
+        docLayer.visible = layers[i].visible;
+        docLayer.opacity = layers[i].opacity;
+        docLayer.objects.reserve(objects.size());
+        for (const auto& obj : objects) {
+            docLayer.objects.push_back(ToDocObject(obj));
+
+            uint32_t id = obj.payload();
+            if (obj.type() == OBJECT_TEXT && id != 0 && id <= textStrings.size() && !rasterized[id - 1]) {
+                RasterizeTextCoverage(obj, doc.texts[id - 1]);
+                rasterized[id - 1] = true;
             }
         }
+        doc.layers.push_back(std::move(docLayer));
     }
 }
 
-// Главная оконная процедура
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+// Запись снимка (в потоке сохранения). Документ собирается в памяти и пишется на диск
+// кусками, растр кодирует GDI+; ход работы - в процентах
+bool WriteSnapshot(const SaveSnapshot& snapshot, const BackgroundSaver::Progress& progress)
 {
-    static int dragStartX, dragStartY;
-    static int originalStartX, originalStartY, originalEndX, originalEndY;
+    if (!snapshot.isDocument) {
+        Bitmap bitmap(snapshot.width, snapshot.height, snapshot.width * static_cast<INT>(sizeof(uint32_t)),
+            PixelFormat32bppRGB, reinterpret_cast<BYTE*>(const_cast<uint32_t*>(snapshot.pixels.data())));
+        progress(10);
+        return bitmap.Save(snapshot.filename.c_str(), &snapshot.encoder, NULL) == Ok;
+    }
 
-    switch (message) {
+    std::ostringstream encoded(std::ios::binary);
+    if (!SaveDocument(encoded, snapshot.document)) return false;
+    progress(50);
+
+    const std::string data = encoded.str();
+    std::ofstream out(snapshot.filename, std::ios::binary);
+    const size_t CHUNK = 1 << 20;
+    for (size_t offset = 0; out && offset < data.size(); offset += CHUNK) {
+        size_t length = data.size() - offset < CHUNK ? data.size() - offset : CHUNK;
+        out.write(data.data() + offset, static_cast<std::streamsize>(length));
+        progress(50 + static_cast<int>((offset + length) * 50 / data.size()));
+    }
+    return static_cast<bool>(out);
+}
 
-    case WM_SIZE:
-        ResizeBuffer(hWnd);
-        toolbarNeedsRedraw = true;
-        break;
+// Объект документа из объекта редактора
+DocObject ToDocObject(const DrawingRef& obj)
+{
+    RECT clip = obj.selectionRect();
+    DocObject docObject;
+    docObject.type = obj.type();
+    docObject.startX = obj.startX();
+    docObject.startY = obj.startY();
+    docObject.endX = obj.endX();
+    docObject.endY = obj.endY();
+    docObject.thickness = obj.thickness();
+    docObject.color = obj.color();
+    docObject.brushShape = obj.brushShape();
+    docObject.clipped = obj.wasDrawnWithSelection();
+    docObject.clip = { clip.left, clip.top, clip.right, clip.bottom };
+    docObject.clipMask = obj.selectionMask();
+    docObject.payload = obj.payload();
+    return docObject;
+}
 
-    case WM_COMMAND:
-    {
-        int wmId = LOWORD(wParam);
-        int wmEvent = HIWORD(wParam);
+// Объект редактора из объекта документа
+DrawingObject FromDocObject(const DocObject& docObject)
+{
+    DrawingObject obj = {};
+    obj.type = docObject.type;
+    obj.startX = docObject.startX;
+    obj.startY = docObject.startY;
+    obj.endX = docObject.endX;
+    obj.endY = docObject.endY;
+    obj.thickness = docObject.thickness;
+    obj.color = docObject.color;
+    obj.isSelected = false;
+    obj.brushShape = docObject.brushShape;
+    obj.wasDrawnWithSelection = docObject.clipped;
+    obj.selectionRect = { docObject.clip.left, docObject.clip.top, docObject.clip.right, docObject.clip.bottom };
+    obj.selectionMask = docObject.clipMask;
+    obj.payload = docObject.payload;
+    return obj;
+}
 
-        switch (wmId) {
-        case ID_PENCIL_BUTTON:
-            currentTool = 0;
-            selectedObjectIndex = -1;
-            toolbarNeedsRedraw = true;
+// Данные записей журнала правок (числа - как в PaintDocument.h):
+//   слои      u32 N, u32 активный, N x (i32 прежний номер или -1, строка, u8 видимость, u8 непрозрачность)
+//   маски     маска PaintDocument
+//   фрагмент  i32 w, i32 h, маска, w*h x u32 пикселей
+//   надпись   строка (u32 длина, UTF-16)
+//   многоуг.  i32 правило, i32 x 4 рамка, u32 N, N x (i32 x, i32 y)
+//   градиент  u32 цвет, i32 вид, u32 маска
+//   объект    u32 слой, объект PaintDocument
+//   сдвиг     u32 слой, u32 номер объекта, i32 x 4 координаты
+//   очистка   без данных
+void WriteJournalString(std::ostream& out, const std::wstring& text)
+{
+    WriteDocU32(out, static_cast<uint32_t>(text.size()));
+    for (wchar_t ch : text) {
+        char bytes[2] = { static_cast<char>(ch & 0xFF), static_cast<char>((ch >> 8) & 0xFF) };
+        out.write(bytes, 2);
+    }
+}
+
+bool ReadJournalString(std::istream& in, std::wstring& text)
+{
+    uint32_t length;
+    if (!ReadDocU32(in, length)) return false;
+    text.clear();
+    for (uint32_t i = 0; i < length; i++) {
+        unsigned char bytes[2];
+        if (!in.read(reinterpret_cast<char*>(bytes), 2)) return false;
+        text.push_back(static_cast<wchar_t>(bytes[0] | (bytes[1] << 8)));
+    }
+    return true;
+}
+
+std::string EncodeLayersRecord(const std::vector<JournalLayerEntry>& entries, size_t active)
+{
+    std::ostringstream out(std::ios::binary);
+    WriteDocU32(out, static_cast<uint32_t>(entries.size()));
+    WriteDocU32(out, static_cast<uint32_t>(active));
+    for (const auto& entry : entries) {
+        WriteDocI32(out, entry.source);
+        WriteJournalString(out, entry.name);
+        char flags[2] = { static_cast<char>(entry.visible ? 1 : 0), static_cast<char>(entry.opacity & 0xFF) };
+        out.write(flags, 2);
+    }
+    return out.str();
+}
+
+std::string EncodeMaskRecord(const SpanMask& mask)
+{
+    std::ostringstream out(std::ios::binary);
+    WriteDocMask(out, mask);
+    return out.str();
+}
+
+std::string EncodeFragmentRecord(const TiledImage& image, const SpanMask& mask)
+{
+    std::ostringstream out(std::ios::binary);
+    int width = image.Width(), height = image.Height();
+    WriteDocI32(out, width);
+    WriteDocI32(out, height);
+    WriteDocMask(out, mask);
+
+    std::vector<uint32_t> row(width > 0 ? width : 0);
+    for (int y = 0; y < height; y++) {
+        image.ReadRect(0, y, width, 1, row.data(), width);
+        for (int x = 0; x < width; x++) WriteDocU32(out, row[x]);
+    }
+    return out.str();
+}
+
+std::string EncodeTextRecord(const std::wstring& text)
+{
+    std::ostringstream out(std::ios::binary);
+    WriteJournalString(out, text);
+    return out.str();
+}
+
+std::string EncodePolygonRecord(const FillPolygon& polygon)
+{
+    std::ostringstream out(std::ios::binary);
+    WriteDocI32(out, polygon.rule);
+    WriteDocI32(out, polygon.bounds.left);
+    WriteDocI32(out, polygon.bounds.top);
+    WriteDocI32(out, polygon.bounds.right);
+    WriteDocI32(out, polygon.bounds.bottom);
+    WriteDocU32(out, static_cast<uint32_t>(polygon.points.size()));
+    for (const POINT& point : polygon.points) {
+        WriteDocI32(out, point.x);
+        WriteDocI32(out, point.y);
+    }
+    return out.str();
+}
+
+std::string EncodeGradientRecord(const GradientFillInfo& gradient)
+{
+    std::ostringstream out(std::ios::binary);
+    WriteDocU32(out, gradient.endColor);
+    WriteDocI32(out, gradient.kind);
+    WriteDocU32(out, gradient.mask);
+    return out.str();
+}
+
+std::string EncodeObjectRecord(size_t layer, const DocObject& obj)
+{
+    std::ostringstream out(std::ios::binary);
+    WriteDocU32(out, static_cast<uint32_t>(layer));
+    WriteDocObject(out, obj);
+    return out.str();
+}
+
+std::string EncodeCoordsRecord(size_t layer, size_t index, const DrawingRef& obj)
+{
+    std::ostringstream out(std::ios::binary);
+    WriteDocU32(out, static_cast<uint32_t>(layer));
+    WriteDocU32(out, static_cast<uint32_t>(index));
+    WriteDocI32(out, obj.startX());
+    WriteDocI32(out, obj.startY());
+    WriteDocI32(out, obj.endX());
+    WriteDocI32(out, obj.endY());
+    return out.str();
+}
+
+// Папка данных программы: %LOCALAPPDATA%\SimplePaint (или во временной папке)
+std::wstring GetAppDataFolder()
+{
+    WCHAR folder[MAX_PATH];
+    DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", folder, MAX_PATH);
+    if (length == 0 || length >= MAX_PATH) {
+        length = GetTempPathW(MAX_PATH, folder);
+        if (length == 0 || length >= MAX_PATH) return std::wstring();
+    }
+
+    std::wstring path = folder;
+    if (path.back() != L'\\') path += L'\\';
+    path += L"SimplePaint";
+    CreateDirectoryW(path.c_str(), NULL);
+    return path;
+}
+
+// Журнал лежит в папке данных программы
+JournalPath GetJournalPath()
+{
+    std::wstring folder = GetAppDataFolder();
+    return folder.empty() ? JournalPath() : folder + L"\\autosave.spj";
+}
+
+// Полное состояние документа записями журнала (в потоке журнала при сжатии)
+void BuildJournalState(const JournalSnapshot& snapshot, std::string& out)
+{
+    const PaintDocument& doc = snapshot.document;
+    AppendJournalRecord(out, JOURNAL_LAYERS, EncodeLayersRecord(snapshot.layers, snapshot.activeLayer));
+    for (const auto& mask : doc.fillMasks) AppendJournalRecord(out, JOURNAL_FILL_MASK, EncodeMaskRecord(mask));
+    for (const auto& mask : doc.selectionMasks) AppendJournalRecord(out, JOURNAL_SELECTION_MASK, EncodeMaskRecord(mask));
+    for (const auto& fragment : doc.fragments) {
+        AppendJournalRecord(out, JOURNAL_FRAGMENT, EncodeFragmentRecord(fragment.image, fragment.mask));
+    }
+    for (const auto& text : snapshot.texts) AppendJournalRecord(out, JOURNAL_TEXT, EncodeTextRecord(text));
+    for (const auto& polygon : snapshot.polygons) AppendJournalRecord(out, JOURNAL_POLYGON, EncodePolygonRecord(polygon));
+    for (const auto& gradient : snapshot.gradients) AppendJournalRecord(out, JOURNAL_GRADIENT, EncodeGradientRecord(gradient));
+
+    for (size_t i = 0; i < doc.layers.size(); i++) {
+        for (const auto& obj : doc.layers[i].objects) {
+            AppendJournalRecord(out, JOURNAL_ADD_OBJECT, EncodeObjectRecord(i, obj));
+        }
+    }
+}
+
+const DrawingStore& LayerObjects(size_t index)
+{
+    // Объекты активного слоя лежат в drawings
+    return index == activeLayer ? drawings : layers[index].objects;
+}
+
+// Запись в журнал правок, сделанных после прошлой записи. Вызывается после каждого
+// сообщения, но не посреди жеста мышью: штрих попадает в журнал уже упрощённым,
+// а перетаскивание - одним сдвигом
+void JournalCommit()
+{
+    if (!journal.Running() || isDrawing || isResizing || GetKeyState(VK_LBUTTON) < 0) return;
+
+    bool layersChanged = layers.size() != journaled.layers.size() || activeLayer != journaled.activeLayer;
+    for (size_t i = 0; i < layers.size() && !layersChanged; i++) {
+        const JournalLayer& mark = journaled.layers[i];
+        layersChanged = layers[i].id != mark.id || layers[i].name != mark.name ||
+            layers[i].visible != mark.visible || layers[i].opacity != mark.opacity;
+    }
+
+    bool objectsAdded = false;
+    for (size_t i = 0; i < layers.size() && !layersChanged && !objectsAdded; i++) {
+        objectsAdded = LayerObjects(i).size() != journaled.layers[i].objects;
+    }
+    bool tablesChanged = fillMasks.size() != journaled.fillMasks || selectionMasks.size() != journaled.selectionMasks ||
+        fragments.size() != journaled.fragments || textStrings.size() != journaled.texts ||
+        fillPolygons.size() != journaled.polygons || gradientFills.size() != journaled.gradients;
+    if (!layersChanged && !objectsAdded && !tablesChanged && journalMoved.empty()) return;
+
+    LARGE_INTEGER frequency, started;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&started);
+
+    // Слои сопоставляются с записанными по постоянному номеру
+    std::vector<JournalLayer> marks;
+    std::vector<JournalLayerEntry> entries;
+    for (const auto& layer : layers) {
+        int32_t source = -1;
+        for (size_t j = 0; j < journaled.layers.size(); j++) {
+            if (journaled.layers[j].id == layer.id) source = static_cast<int32_t>(j);
+        }
+        marks.push_back({ layer.id, layer.name, layer.visible, layer.opacity,
+            source >= 0 ? journaled.layers[source].objects : 0 });
+        entries.push_back({ source, layer.name, layer.visible, layer.opacity });
+    }
+
+    // Объекты и таблицы только растут (очистку записывает JournalClear); если что-то
+    // уменьшилось иначе, журнал переписывается полным состоянием
+    for (size_t i = 0; i < layers.size(); i++) {
+        if (LayerObjects(i).size() < marks[i].objects) {
+            CompactJournal();
+            return;
+        }
+    }
+    if (fillMasks.size() < journaled.fillMasks || selectionMasks.size() < journaled.selectionMasks ||
+        fragments.size() < journaled.fragments || textStrings.size() < journaled.texts ||
+        fillPolygons.size() < journaled.polygons || gradientFills.size() < journaled.gradients) {
+        CompactJournal();
+        return;
+    }
+
+    std::string records;
+    if (layersChanged) {
+        AppendJournalRecord(records, JOURNAL_LAYERS, EncodeLayersRecord(entries, activeLayer));
+    }
+    journaled.layers.swap(marks);
+    journaled.activeLayer = activeLayer;
+
+    // Таблицы - раньше объектов, которые на них ссылаются
+    for (; journaled.fillMasks < fillMasks.size(); journaled.fillMasks++) {
+        AppendJournalRecord(records, JOURNAL_FILL_MASK, EncodeMaskRecord(fillMasks[journaled.fillMasks]));
+    }
+    for (; journaled.selectionMasks < selectionMasks.size(); journaled.selectionMasks++) {
+        AppendJournalRecord(records, JOURNAL_SELECTION_MASK, EncodeMaskRecord(selectionMasks[journaled.selectionMasks]));
+    }
+    for (; journaled.fragments < fragments.size(); journaled.fragments++) {
+        const Fragment& fragment = fragments[journaled.fragments];
+        AppendJournalRecord(records, JOURNAL_FRAGMENT, EncodeFragmentRecord(fragment.image, fragment.mask));
+    }
+    for (; journaled.texts < textStrings.size(); journaled.texts++) {
+        AppendJournalRecord(records, JOURNAL_TEXT, EncodeTextRecord(textStrings[journaled.texts]));
+    }
+    for (; journaled.polygons < fillPolygons.size(); journaled.polygons++) {
+        AppendJournalRecord(records, JOURNAL_POLYGON, EncodePolygonRecord(fillPolygons[journaled.polygons]));
+    }
+    for (; journaled.gradients < gradientFills.size(); journaled.gradients++) {
+        AppendJournalRecord(records, JOURNAL_GRADIENT, EncodeGradientRecord(gradientFills[journaled.gradients]));
+    }
+
+    // Сдвинутые объекты, уже бывшие в журнале (новые запишутся с текущими координатами)
+    std::sort(journalMoved.begin(), journalMoved.end());
+    journalMoved.erase(std::unique(journalMoved.begin(), journalMoved.end()), journalMoved.end());
+    for (size_t index : journalMoved) {
+        if (index < journaled.layers[activeLayer].objects) {
+            AppendJournalRecord(records, JOURNAL_SET_COORDS, EncodeCoordsRecord(activeLayer, index, drawings[index]));
+        }
+    }
+    journalMoved.clear();
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        const DrawingStore& objects = LayerObjects(i);
+        for (size_t& k = journaled.layers[i].objects; k < objects.size(); k++) {
+            AppendJournalRecord(records, JOURNAL_ADD_OBJECT, EncodeObjectRecord(i, ToDocObject(objects[k])));
+        }
+    }
+
+    size_t bytes = records.size();
+    journalAppended += bytes;
+    journal.Append(std::move(records));
+
+    // Цена журнала на одну правку (обычно штрих): байты записи и время кодирования в потоке окна
+    LARGE_INTEGER finished;
+    QueryPerformanceCounter(&finished);
+    memoryStats.Count("journal_commit_bytes", bytes);
+    memoryStats.Count("journal_commit_us", static_cast<size_t>((finished.QuadPart - started.QuadPart) * 1000000 / frequency.QuadPart));
+
+    if (journalAppended > JOURNAL_COMPACT_BYTES) CompactJournal();
+}
+
+// Очистка холста - одна запись вместо удаления объектов по одному
+void JournalClear()
+{
+    if (!journal.Running()) return;
+
+    std::string records;
+    AppendJournalRecord(records, JOURNAL_CLEAR, std::string());
+    journalAppended += records.size();
+    journal.Append(std::move(records));
+
+    for (auto& mark : journaled.layers) mark.objects = 0;
+    journaled.fillMasks = journaled.selectionMasks = journaled.fragments = 0;
+    journaled.texts = journaled.polygons = journaled.gradients = 0;
+    journalMoved.clear();
+}
+
+// Объект активного слоя сдвинут или изменён маркерами
+void MarkJournalMoved(size_t index)
+{
+    if (journalMoved.empty() || journalMoved.back() != index) journalMoved.push_back(index);
+}
+
+// Сжатие журнала: полное состояние документа заменяет накопленные записи. Снимок
+// собирается здесь (фрагменты отвязаны от кэша плиток), записи - в потоке журнала
+void CompactJournal()
+{
+    if (!journal.Running()) return;
+
+    auto snapshot = std::make_shared<JournalSnapshot>();
+    BuildDocument(snapshot->document);
+    snapshot->activeLayer = activeLayer;
+    snapshot->texts = textStrings;
+    snapshot->polygons = fillPolygons;
+    snapshot->gradients = gradientFills;
+
+    journaled = JournalMark();
+    for (size_t i = 0; i < layers.size(); i++) {
+        const Layer& layer = layers[i];
+        snapshot->layers.push_back({ -1, layer.name, layer.visible, layer.opacity });
+        journaled.layers.push_back({ layer.id, layer.name, layer.visible, layer.opacity, LayerObjects(i).size() });
+    }
+    journaled.activeLayer = activeLayer;
+    journaled.fillMasks = fillMasks.size();
+    journaled.selectionMasks = selectionMasks.size();
+    journaled.fragments = fragments.size();
+    journaled.texts = textStrings.size();
+    journaled.polygons = fillPolygons.size();
+    journaled.gradients = gradientFills.size();
+    journalMoved.clear();
+    journalAppended = 0;
+
+    pendingCompaction = snapshot;
+    journal.Rewrite([snapshot](std::string& out) { BuildJournalState(*snapshot, out); });
+}
+
+// Документ, восстановленный из журнала, до установки в редактор
+struct RecoveredDocument {
+    std::vector<Layer> layers;
+    size_t activeLayer = 0;
+    std::vector<SpanMask> fillMasks;
+    std::vector<SpanMask> selectionMasks;
+    std::vector<Fragment> fragments;
+    std::vector<std::wstring> texts;
+    std::vector<FillPolygon> polygons;
+    std::vector<GradientFillInfo> gradients;
+};
+
+// Ссылки объекта документа на таблицы (маски, фрагменты, надписи...) не выходят за их размеры
+bool DocObjectRefsValid(const DocObject& obj, size_t fillMaskCount, size_t selectionMaskCount,
+    size_t fragmentCount, size_t textCount, size_t polygonCount, size_t gradientCount)
+{
+    size_t table = SIZE_MAX;
+    switch (obj.type) {
+    case 6:
+    case OBJECT_CLEARED_MASK: table = fillMaskCount; break;
+    case OBJECT_FRAGMENT: table = fragmentCount; break;
+    case OBJECT_TEXT: table = textCount; break;
+    case OBJECT_POLYGON: table = polygonCount; break;
+    case OBJECT_GRADIENT: table = gradientCount; break;
+    }
+    return obj.payload <= table && obj.clipMask <= selectionMaskCount;
+}
+
+// Применение записи журнала; false - запись повреждена или ссылается на то, чего нет
+bool ApplyJournalRecord(RecoveredDocument& doc, JournalRecordType type, const std::string& payload)
+{
+    std::istringstream in(payload, std::ios::binary);
+
+    switch (type) {
+    case JOURNAL_LAYERS:
+    {
+        uint32_t count, active;
+        if (!ReadDocU32(in, count) || !ReadDocU32(in, active) || count == 0 || active >= count) return false;
+
+        std::vector<Layer> next;
+        for (uint32_t i = 0; i < count; i++) {
+            int32_t source;
+            std::wstring name;
+            unsigned char flags[2];
+            if (!ReadDocI32(in, source) || !ReadJournalString(in, name) ||
+                !in.read(reinterpret_cast<char*>(flags), 2)) return false;
+            if (source >= static_cast<int32_t>(doc.layers.size())) return false;
+
+            Layer layer = source >= 0 ? std::move(doc.layers[source]) : CreateLayer();
+            layer.name = name;
+            layer.visible = flags[0] != 0;
+            layer.opacity = flags[1];
+            next.push_back(std::move(layer));
+        }
+        doc.layers.swap(next);
+        doc.activeLayer = active;
+        return true;
+    }
+
+    case JOURNAL_FILL_MASK:
+    case JOURNAL_SELECTION_MASK:
+    {
+        SpanMask mask;
+        if (!ReadDocMask(in, mask)) return false;
+        (type == JOURNAL_FILL_MASK ? doc.fillMasks : doc.selectionMasks).push_back(std::move(mask));
+        return true;
+    }
+
+    case JOURNAL_FRAGMENT:
+    {
+        int32_t width, height;
+        Fragment fragment;
+        if (!ReadDocI32(in, width) || !ReadDocI32(in, height) || width < 0 || height < 0 ||
+            width > DOCUMENT_MAX_SIDE || height > DOCUMENT_MAX_SIDE || !ReadDocMask(in, fragment.mask)) return false;
+        if (payload.size() - static_cast<size_t>(in.tellg()) != static_cast<size_t>(width) * height * 4) return false;
+
+        fragment.image = TiledImage(width, height, 0);
+        fragment.image.AttachCache(&fragmentTileCache);
+        std::vector<uint32_t> row(width);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) ReadDocU32(in, row[x]);
+            fragment.image.WriteRect(0, y, width, 1, row.data(), width);
+        }
+        doc.fragments.push_back(std::move(fragment));
+        return true;
+    }
+
+    case JOURNAL_TEXT:
+    {
+        std::wstring text;
+        if (!ReadJournalString(in, text)) return false;
+        doc.texts.push_back(std::move(text));
+        return true;
+    }
+
+    case JOURNAL_POLYGON:
+    {
+        int32_t rule, left, top, right, bottom;
+        uint32_t count;
+        if (!ReadDocI32(in, rule) || !ReadDocI32(in, left) || !ReadDocI32(in, top) ||
+            !ReadDocI32(in, right) || !ReadDocI32(in, bottom) || !ReadDocU32(in, count)) return false;
+        if (count > payload.size() / 8) return false;
+
+        FillPolygon polygon;
+        polygon.rule = rule == FILL_NON_ZERO ? FILL_NON_ZERO : FILL_EVEN_ODD;
+        polygon.bounds = { left, top, right, bottom };
+        for (uint32_t i = 0; i < count; i++) {
+            int32_t x, y;
+            if (!ReadDocI32(in, x) || !ReadDocI32(in, y)) return false;
+            polygon.points.push_back({ x, y });
+        }
+        doc.polygons.push_back(std::move(polygon));
+        return true;
+    }
+
+    case JOURNAL_GRADIENT:
+    {
+        uint32_t endColor, mask;
+        int32_t kind;
+        if (!ReadDocU32(in, endColor) || !ReadDocI32(in, kind) || !ReadDocU32(in, mask)) return false;
+        if (mask > doc.fillMasks.size()) return false;
+        doc.gradients.push_back({ endColor, kind == GRADIENT_RADIAL ? GRADIENT_RADIAL : GRADIENT_LINEAR, mask });
+        return true;
+    }
+
+    case JOURNAL_ADD_OBJECT:
+    {
+        uint32_t layer;
+        DocObject docObject;
+        if (!ReadDocU32(in, layer) || !ReadDocObject(in, docObject) || layer >= doc.layers.size()) return false;
+
+        // Ссылки объекта на таблицы должны указывать на уже восстановленные записи
+        if (!DocObjectRefsValid(docObject, doc.fillMasks.size(), doc.selectionMasks.size(), doc.fragments.size(),
+            doc.texts.size(), doc.polygons.size(), doc.gradients.size())) return false;
+
+        doc.layers[layer].objects.push_back(FromDocObject(docObject));
+        return true;
+    }
+
+    case JOURNAL_SET_COORDS:
+    {
+        uint32_t layer, index;
+        int32_t sx, sy, ex, ey;
+        if (!ReadDocU32(in, layer) || !ReadDocU32(in, index) || !ReadDocI32(in, sx) || !ReadDocI32(in, sy) ||
+            !ReadDocI32(in, ex) || !ReadDocI32(in, ey)) return false;
+        if (layer >= doc.layers.size() || index >= doc.layers[layer].objects.size()) return false;
+        doc.layers[layer].objects.SetCoords(index, sx, sy, ex, ey);
+        return true;
+    }
+
+    case JOURNAL_CLEAR:
+        for (auto& layer : doc.layers) layer.objects.clear();
+        doc.fillMasks.clear();
+        doc.selectionMasks.clear();
+        doc.fragments.clear();
+        doc.texts.clear();
+        doc.polygons.clear();
+        doc.gradients.clear();
+        return true;
+    }
+    return false;
+}
+
+// Восстановление после сбоя: журнал прошлого запуска переигрывается в документ,
+// и если в нём есть объекты, пользователь решает, вернуть ли рисунок
+void RecoverJournal(const JournalPath& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return;
+
+    RecoveredDocument doc;
+    long records = ReadJournal(in, [&doc](JournalRecordType type, const std::string& payload) {
+        return ApplyJournalRecord(doc, type, payload);
+    });
+
+    size_t objects = 0;
+    for (const auto& layer : doc.layers) objects += layer.objects.size();
+    if (records <= 0 || objects == 0) return;
+
+    WCHAR message[256];
+    wsprintfW(message, L"Прошлый сеанс завершился аварийно. Восстановить рисунок из журнала правок (объектов: %d)?",
+        static_cast<int>(objects));
+    if (MessageBox(NULL, message, szTitle, MB_YESNO | MB_ICONQUESTION) != IDYES) return;
+
+    // Растров у слоёв ещё нет - их создаст и переиграет ResizeBuffer
+    layers.swap(doc.layers);
+    activeLayer = doc.activeLayer;
+    std::swap(drawings, layers[activeLayer].objects);
+    fillMasks.swap(doc.fillMasks);
+    selectionMasks.swap(doc.selectionMasks);
+    fragments.swap(doc.fragments);
+    textStrings.swap(doc.texts);
+    fillPolygons.swap(doc.polygons);
+    gradientFills.swap(doc.gradients);
+}
+
+// Параметры time-lapse: длина видео ограничена, очередь записи держит несколько кадров
+const int TIMELAPSE_FPS = 30;
+const size_t TIMELAPSE_MAX_FRAMES = 900;
+const size_t TIMELAPSE_QUEUE_FRAMES = 4;
+
+// Открытие документа .spd
+void OpenDocumentFile(HWND hWnd)
+{
+    OPENFILENAME ofn = {};
+    WCHAR filename[MAX_PATH] = L"";
+
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = hWnd;
+    ofn.lpstrFilter = L"SimplePaint Document\0*.spd\0All Files\0*.*\0";
+    ofn.lpstrFile = filename;
+    ofn.nMaxFile = MAX_PATH;
+    ofn.Flags = OFN_EXPLORER | OFN_FILEMUSTEXIST;
+    ofn.lpstrDefExt = L"spd";
+
+    if (!GetOpenFileName(&ofn)) return;
+
+    PaintDocument doc;
+    std::ifstream in(filename, std::ios::binary);
+    if (!in || !LoadDocument(in, doc) || doc.layers.empty()) {
+        MessageBox(hWnd, L"Не удалось прочитать документ", L"Ошибка", MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    InstallDocument(hWnd, doc);
+}
+
+// Замена рисунка документом: слои с пустыми растрами, таблицы масок и фрагментов.
+// Растры рисуются не здесь, а по ячейкам (StartOpenRender)
+void InstallDocument(HWND hWnd, PaintDocument& doc)
+{
+    // Незавершённые действия относятся к прежнему рисунку
+    CancelTyping();
+    CancelPolygon();
+    ClearSelection();
+    SetSelectedObject(-1);
+    floatingFragmentIndex = -1;
+    hasTempObject = false;
+    CancelOpenRender();
+
+    // Объекты со ссылками за пределы таблиц документа пропускаются
+    std::vector<Layer> opened;
+    size_t skipped = 0;
+    HDC hdc = GetDC(hWnd);
+    for (const auto& docLayer : doc.layers) {
+        Layer layer = CreateLayer();
+        if (!CreateSurface(hdc, bufferCapacityWidth, bufferCapacityHeight, layer.surface)) {
+            for (auto& created : opened) DestroySurface(created.surface);
+            ReleaseDC(hWnd, hdc);
+            MessageBox(hWnd, L"Недостаточно памяти для слоёв документа", L"Ошибка", MB_OK | MB_ICONERROR);
+            return;
+        }
+
+        layer.name.assign(docLayer.name.begin(), docLayer.name.end());
+        layer.visible = docLayer.visible;
+        layer.opacity = docLayer.opacity;
+        layer.objects.reserve(docLayer.objects.size());
+        for (const auto& docObject : docLayer.objects) {
+            if (!DocObjectRefsValid(docObject, doc.fillMasks.size(), doc.selectionMasks.size(),
+                doc.fragments.size(), doc.texts.size(), doc.polygons.size(), doc.gradients.size())) {
+                skipped++;
+                continue;
+            }
+            layer.objects.push_back(FromDocObject(docObject));
+        }
+        opened.push_back(std::move(layer));
+    }
+    ReleaseDC(hWnd, hdc);
+
+    UnbindLayer();
+    for (auto& layer : layers) DestroySurface(layer.surface);
+    layers.swap(opened);
+
+    fillMasks.swap(doc.fillMasks);
+    selectionMasks.swap(doc.selectionMasks);
+    fragments.clear();
+    for (auto& docFragment : doc.fragments) {
+        Fragment fragment;
+        fragment.image = std::move(docFragment.image);
+        fragment.image.AttachCache(&fragmentTileCache);
+        fragment.mask = std::move(docFragment.mask);
+        fragments.push_back(std::move(fragment));
+    }
+    textStrings.clear();
+    for (const auto& text : doc.texts) textStrings.emplace_back(text.text.begin(), text.text.end());
+    fillPolygons.clear();
+    for (const auto& docPolygon : doc.polygons) {
+        FillPolygon polygon;
+        polygon.rule = docPolygon.rule == FILL_NON_ZERO ? FILL_NON_ZERO : FILL_EVEN_ODD;
+        polygon.bounds = { docPolygon.bounds.left, docPolygon.bounds.top, docPolygon.bounds.right, docPolygon.bounds.bottom };
+        for (const DocPoint& point : docPolygon.points) polygon.points.push_back({ point.x, point.y });
+        fillPolygons.push_back(std::move(polygon));
+    }
+    gradientFills.clear();
+    for (const auto& docGradient : doc.gradients) {
+        GradientKind kind = docGradient.kind == GRADIENT_RADIAL ? GRADIENT_RADIAL : GRADIENT_LINEAR;
+        gradientFills.push_back({ docGradient.endColor, kind, docGradient.mask });
+    }
+
+    BindLayer(layers.size() - 1);
+    UpdateLayerControls(hWnd);
+    CompactJournal();
+    StartOpenRender(hWnd);
+
+    if (skipped > 0) {
+        WCHAR message[160];
+        wsprintfW(message, L"Пропущено объектов без данных в документе: %d", static_cast<int>(skipped));
+        MessageBox(hWnd, message, L"Открытие", MB_OK | MB_ICONWARNING);
+    }
+}
+
+// Видимая часть холста: область лупы или весь буфер
+RECT GetViewportRect()
+{
+    if (zoomMode) return zoomRect;
+    RECT rect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    return rect;
+}
+
+// Корзины объектов всех слоёв, сразу - видимые ячейки, остальные - по таймеру
+void StartOpenRender(HWND hWnd)
+{
+    for (size_t i = 0; i < layers.size(); i++) {
+        const DrawingStore& objects = LayerObjects(i);
+        layers[i].openBins.Build(objects.size(), static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
+            OPEN_RENDER_CELL, [&objects](size_t k) {
+                RECT bounds = GetObjectBounds(objects[k]);
+                return MaskRect{ bounds.left, bounds.top, bounds.right, bounds.bottom };
+            });
+    }
+
+    const ObjectBins& grid = layers[activeLayer].openBins;
+    openRender.cellsX = grid.CellsX();
+    openRender.cellsY = grid.CellsY();
+    openRender.queue.resize(grid.CellCount());
+    for (size_t cell = 0; cell < openRender.queue.size(); cell++) openRender.queue[cell] = cell;
+    openRender.next = 0;
+
+    RenderVisibleOpenCells();
+
+    AddFullDamage();
+    PresentDamage(hWnd);
+    if (openRender.next < openRender.queue.size()) {
+        SetTimer(hWnd, OPEN_RENDER_TIMER_ID, USER_TIMER_MINIMUM, NULL);
+    }
+    else {
+        CancelOpenRender();
+    }
+}
+
+// Очередные ячейки из очереди во всех слоях: не больше limit и не дольше budgetMs
+// (0 - без ограничения времени). Каждый слой перерисовывает ячейку объектами своих
+// корзин. Слои привязываются на время пачки, а упаковываются (режим палитры) один
+// раз после неё, а не после каждой ячейки.
+void RenderOpenCells(double budgetMs, size_t limit)
+{
+    LARGE_INTEGER frequency, started;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&started);
+
+    size_t active = activeLayer;
+    for (size_t rendered = 0; rendered < limit && openRender.next < openRender.queue.size(); rendered++) {
+        size_t cell = openRender.queue[openRender.next++];
+        for (size_t i = 0; i < layers.size(); i++) {
+            const ObjectBins& bins = layers[i].openBins;
+            if (bins.Empty()) continue;
+            if (i != activeLayer) BindLayer(i);
+
+            MaskRect cellRect = bins.CellRect(cell);
+            RECT rect = { cellRect.left, cellRect.top, cellRect.right, cellRect.bottom };
+            RedrawBufferRect(rect, &bins, cell);
+            AddDamage(rect);
+        }
+
+        if (budgetMs > 0) {
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            if ((now.QuadPart - started.QuadPart) * 1000.0 / frequency.QuadPart >= budgetMs) break;
+        }
+    }
+
+    if (activeLayer != active) BindLayer(active);
+    PackInactiveLayers();
+}
+
+// Очередь заново по удалённости от видимой области; ячейки, задевающие её, рисуются сразу
+void RenderVisibleOpenCells()
+{
+    if (openRender.next >= openRender.queue.size()) return;
+
+    std::vector<bool> pending(static_cast<size_t>(openRender.cellsX) * openRender.cellsY, false);
+    for (size_t i = openRender.next; i < openRender.queue.size(); i++) pending[openRender.queue[i]] = true;
+
+    RECT view = GetViewportRect();
+    MaskRect viewRect = { view.left, view.top, view.right, view.bottom };
+    std::vector<size_t> order = CellsByDistance(openRender.cellsX, openRender.cellsY, OPEN_RENDER_CELL, viewRect);
+
+    openRender.queue.clear();
+    openRender.next = 0;
+    size_t visible = 0;
+    for (size_t cell : order) {
+        if (!pending[cell]) continue;
+        openRender.queue.push_back(cell);
+
+        int cx = static_cast<int>(cell % openRender.cellsX), cy = static_cast<int>(cell / openRender.cellsX);
+        RECT cellRect = { cx * OPEN_RENDER_CELL, cy * OPEN_RENDER_CELL, (cx + 1) * OPEN_RENDER_CELL, (cy + 1) * OPEN_RENDER_CELL };
+        RECT overlap;
+        if (IntersectRect(&overlap, &cellRect, &view)) visible++;
+    }
+
+    RenderOpenCells(0, visible);
+}
+
+// Тик таймера дорисовки: пачка ячеек и вывод нарисованного
+void ContinueOpenRender(HWND hWnd)
+{
+    if (openRender.next < openRender.queue.size()) {
+        RenderOpenCells(OPEN_RENDER_SLICE_MS, SIZE_MAX);
+        PresentDamage(hWnd);
+    }
+    if (openRender.next < openRender.queue.size()) return;
+
+    KillTimer(hWnd, OPEN_RENDER_TIMER_ID);
+
+    CancelOpenRender();
+}
+
+// Дорисовка всех оставшихся ячеек сразу (перед правкой, которую корзины не учитывают)
+void FinishOpenRender()
+{
+    if (openRender.next >= openRender.queue.size()) return;
+
+    RenderOpenCells(0, SIZE_MAX);
+    CancelOpenRender();
+}
+
+// Корзины больше не нужны; таймер, если он ещё идёт, остановится на следующем тике
+void CancelOpenRender()
+{
+    for (auto& layer : layers) layer.openBins.Clear();
+    openRender.queue.clear();
+    openRender.next = 0;
+}
+
+// Экспорт истории рисования в видео Y4M. Видимые слои переигрываются снизу вверх
+// в отдельный растр: каждый объект рисуется один раз поверх предыдущих, а кадр
+// пересобирается только в области объектов, добавленных с прошлого кадра.
+// Кадры кодирует и пишет на диск поток TimelapseEncoder.
+void ExportTimelapse(HWND hWnd)
+{
+    OPENFILENAME ofn = {};
+    WCHAR filename[MAX_PATH] = L"timelapse.y4m";
+
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = hWnd;
+    ofn.lpstrFilter = L"Y4M Video\0*.y4m\0All Files\0*.*\0";
+    ofn.lpstrFile = filename;
+    ofn.nMaxFile = MAX_PATH;
+    ofn.Flags = OFN_EXPLORER | OFN_OVERWRITEPROMPT;
+    ofn.lpstrDefExt = L"y4m";
+
+    if (!GetSaveFileName(&ofn)) return;
+
+    int width = static_cast<int>(bufferWidth);
+    int height = static_cast<int>(bufferHeight);
+    size_t total = 0;
+    for (size_t i = 0; i < layers.size(); i++) {
+        if (layers[i].visible) total += (i == activeLayer ? drawings : layers[i].objects).size();
+    }
+    if (total == 0 || width < 2 || height < 2) return;
+    size_t objectsPerFrame = (total + TIMELAPSE_MAX_FRAMES - 1) / TIMELAPSE_MAX_FRAMES;
+
+    Surface replay = {};
+    HDC hdc = GetDC(hWnd);
+    bool created = CreateSurface(hdc, bufferCapacityWidth, bufferCapacityHeight, replay);
+    ReleaseDC(hWnd, hdc);
+    if (!created) return;
+
+    std::ofstream out(filename, std::ios::binary);
+    TimelapseEncoder encoder;
+    if (!out || !encoder.Start(out, width, height, TIMELAPSE_FPS, TIMELAPSE_QUEUE_FRAMES)) {
+        DestroySurface(replay);
+        MessageBox(hWnd, L"Не удалось создать видеофайл", L"Ошибка", MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    HCURSOR oldCursor = SetCursor(LoadCursor(NULL, IDC_WAIT));
+    SetSelectedObject(-1);
+
+    // below - белый фон с уже переигранными слоями, frame - текущий кадр
+    RECT canvasRect = { 0, 0, width, height };
+    std::vector<uint32_t> below(static_cast<size_t>(width) * height, ColorToPixel(BACKGROUND_COLOR));
+    std::vector<uint32_t> frame = below;
+    size_t active = activeLayer;
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        if (!layers[i].visible || layers[i].opacity <= 0) continue;
+
+        // Объекты слоя рисуются в отдельный растр, растр самого слоя не меняется
+        BindLayer(i);
+        hBufferDC = replay.dc;
+        bufferBits = replay.bits;
+        GdiFlush();
+        for (int y = 0; y < height; y++) {
+            memset(replay.bits + y * bufferStride, 0, width * sizeof(uint32_t));
+        }
+
+        RECT dirty = { 0, 0, 0, 0 };
+        size_t pending = 0;
+        for (size_t k = 0; k < drawings.size(); k++) {
+            DrawingRef obj = drawings[k];
+            RECT bounds = GetObjectBounds(obj);
+            RECT area;
+            if (IntersectRect(&area, &bounds, &canvasRect)) {
+                DrawObjectToBuffer(obj, area);
+                UnionRect(&dirty, &dirty, &area);
+            }
+            if (++pending < objectsPerFrame && k + 1 < drawings.size()) continue;
+
+            GdiFlush();
+            int dirtyWidth = dirty.right - dirty.left;
+            for (int y = dirty.top; y < dirty.bottom; y++) {
+                uint32_t* row = &frame[static_cast<size_t>(y) * width + dirty.left];
+                memcpy(row, &below[static_cast<size_t>(y) * width + dirty.left], dirtyWidth * sizeof(uint32_t));
+                BlendRowOver(row, replay.bits + y * bufferStride + dirty.left, dirtyWidth, layers[i].opacity);
+            }
+
+            // Ждём свободный буфер, если поток записи отстаёт
+            std::vector<uint32_t> buffer = encoder.AcquireFrame();
+            memcpy(buffer.data(), frame.data(), frame.size() * sizeof(uint32_t));
+            encoder.SubmitFrame(std::move(buffer));
+
+            dirty = { 0, 0, 0, 0 };
+            pending = 0;
+        }
+
+        below = frame;
+    }
+
+    BindLayer(active);
+    PackInactiveLayers();
+    DestroySurface(replay);
+
+    bool written = encoder.Finish();
+    SetCursor(oldCursor);
+    if (!written) {
+        MessageBox(hWnd, L"Не удалось записать видео", L"Ошибка", MB_OK | MB_ICONERROR);
+    }
+}
+
+// Главная оконная процедура
+LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    static int dragStartX, dragStartY;
+    static int originalStartX, originalStartY, originalEndX, originalEndY;
+
+    switch (message) {
+
+    case WM_SIZE:
+        if (wParam == SIZE_MINIMIZED) break;
+        ResizeBuffer(hWnd);
+        toolbarNeedsRedraw = true;
+        PresentDamage(hWnd);
+        break;
+
+    case WM_ENTERSIZEMOVE:
+        isLiveResizing = true;
+        break;
+
+    case WM_EXITSIZEMOVE:
+        isLiveResizing = false;
+        FinishResize(hWnd);
+        break;
+
+    case WM_SAVE_PROGRESS:
+    {
+        WCHAR title[160];
+        wsprintfW(title, L"%s - сохранение %d%%", szTitle, static_cast<int>(wParam));
+        SetWindowText(hWnd, title);
+    }
+    break;
+
+    case WM_SAVE_DONE:
+        backgroundSaver.Wait();
+        SetWindowText(hWnd, szTitle);
+        if (!wParam) {
+            MessageBox(hWnd, L"Не удалось сохранить файл", L"Ошибка", MB_OK | MB_ICONERROR);
+        }
+        break;
+
+    case WM_TIMER:
+        if (wParam == RESIZE_TIMER_ID && !isLiveResizing) {
+            FinishResize(hWnd);
+        }
+        else if (wParam == OPEN_RENDER_TIMER_ID) {
+            ContinueOpenRender(hWnd);
+        }
+        else if (wParam == MEMORY_TIMER_ID) {
+            SampleMemory();
+            if (memoryOverlay) RefreshMemoryOverlay(hWnd);
+        }
+        break;
+
+    case WM_COMMAND:
+    {
+        int wmId = LOWORD(wParam);
+        int wmEvent = HIWORD(wParam);
+
+        // Любая команда панели завершает набираемую надпись и строящийся многоугольник
+        // (кроме смены правила закраски - она видна в предпросмотре)
+        if (isTyping) {
+            CommitTypedText();
+            PresentDamage(hWnd);
+        }
+        if (!polygonPoints.empty() && wmId != ID_FILL_RULE_COMBO) {
+            CommitPolygon();
+            PresentDamage(hWnd);
+        }
+
+        switch (wmId) {
+        case ID_PENCIL_BUTTON:
+            currentTool = 0;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
             break;
         case ID_BRUSH_BUTTON:
             currentTool = 3;
-            selectedObjectIndex = -1;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+        case ID_ERASER_BUTTON:
+            currentTool = 4;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+        case ID_FILL_BUTTON:
+            currentTool = 6;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+        case ID_RECTANGLE_BUTTON:
+            currentTool = 1;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+        case ID_CIRCLE_BUTTON:
+            currentTool = 5;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+        case ID_SELECTION_BUTTON:
+            if (selection.active) {
+                ClearSelection();
+                currentTool = 0;
+            }
+            else {
+                currentTool = 7;
+            }
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+
+        case ID_MAGIC_WAND_BUTTON:
+            currentTool = TOOL_MAGIC_WAND;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+
+        case ID_TEXT_BUTTON:
+            currentTool = OBJECT_TEXT;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+
+        case ID_POLYGON_BUTTON:
+            currentTool = OBJECT_POLYGON;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+
+        case ID_GRADIENT_BUTTON:
+            currentTool = OBJECT_GRADIENT;
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+
+        case ID_GRADIENT_COLOR_BUTTON:
+        {
+            CHOOSECOLOR cc = {};
+            static COLORREF customColors[16] = {};
+            cc.lStructSize = sizeof(cc);
+            cc.hwndOwner = hWnd;
+            cc.lpCustColors = customColors;
+            cc.rgbResult = gradientEndColor;
+            cc.Flags = CC_FULLOPEN | CC_RGBINIT;
+
+            if (ChooseColor(&cc)) {
+                gradientEndColor = cc.rgbResult;
+            }
+        }
+        break;
+
+        case ID_GRADIENT_KIND_COMBO:
+            if (wmEvent == CBN_SELCHANGE) {
+                int kind = (int)SendMessage(GetDlgItem(hWnd, ID_GRADIENT_KIND_COMBO), CB_GETCURSEL, 0, 0);
+                currentGradientKind = kind == GRADIENT_RADIAL ? GRADIENT_RADIAL : GRADIENT_LINEAR;
+            }
+            break;
+
+        case ID_FILTER_COMBO:
+            if (wmEvent == CBN_SELCHANGE) {
+                HWND hFilter = GetDlgItem(hWnd, ID_FILTER_COMBO);
+                int filter = (int)SendMessage(hFilter, CB_GETCURSEL, 0, 0);
+                SendMessage(hFilter, CB_SETCURSEL, 0, 0);
+                if (filter > 0) {
+                    ApplySelectionFilter(filter);
+                    PresentDamage(hWnd);
+                }
+            }
+            break;
+
+        case ID_FILL_SHAPES_CHECK:
+            if (wmEvent == BN_CLICKED) {
+                fillShapes = SendMessage(GetDlgItem(hWnd, ID_FILL_SHAPES_CHECK), BM_GETCHECK, 0, 0) == BST_CHECKED;
+            }
+            break;
+
+        case ID_FILL_RULE_COMBO:
+            if (wmEvent == CBN_SELCHANGE) {
+                int rule = (int)SendMessage(GetDlgItem(hWnd, ID_FILL_RULE_COMBO), CB_GETCURSEL, 0, 0);
+                currentFillRule = rule == FILL_NON_ZERO ? FILL_NON_ZERO : FILL_EVEN_ODD;
+                if (!polygonPoints.empty()) {
+                    AddDamage(GetPolygonPreviewBounds());
+                    PresentDamage(hWnd);
+                }
+            }
+            break;
+
+        case ID_ZOOM_BUTTON:
+            if (zoomMode) {
+                ResetZoom(hWnd);
+                currentTool = 0;
+            }
+            else {
+                currentTool = 8;
+                SetWindowText(GetDlgItem(hWnd, ID_ZOOM_BUTTON), L"Лупа [режим]");
+            }
+            SetSelectedObject(-1);
+            toolbarNeedsRedraw = true;
+            break;
+
+        case ID_COLOR_BUTTON:
+        {
+            CHOOSECOLOR cc = {};
+            static COLORREF customColors[16] = {};
+            cc.lStructSize = sizeof(cc);
+            cc.hwndOwner = hWnd;
+            cc.lpCustColors = customColors;
+            cc.rgbResult = currentColor;
+            cc.Flags = CC_FULLOPEN | CC_RGBINIT;
+
+            if (ChooseColor(&cc)) {
+                currentColor = cc.rgbResult;
+            }
+            toolbarNeedsRedraw = true;
+        }
+        break;
+
+        case ID_SAVE_BUTTON:
+            if (backgroundSaver.Busy()) {
+                MessageBox(hWnd, L"Предыдущее сохранение ещё не закончилось", L"Сохранение", MB_OK | MB_ICONINFORMATION);
+                break;
+            }
+            SaveFile(hWnd);
+            break;
+
+        case ID_OPEN_BUTTON:
+            OpenDocumentFile(hWnd);
+            break;
+
+        case ID_TIMELAPSE_BUTTON:
+            ExportTimelapse(hWnd);
+            break;
+
+        case ID_CLEAR_BUTTON:
+            drawings.clear();
+            for (auto& layer : layers) {
+                layer.objects.clear();
+            }
+            fragments.clear();
+            fillMasks.clear();
+            textStrings.clear();
+            fillPolygons.clear();
+            polygonPoints.clear();
+            gradientFills.clear();
+            ClearSelection();
+            selectionMasks.clear();
+            JournalClear();
+            ResetZoom(hWnd);
+            RedrawBuffer(hWnd);
+            AddFullDamage();
             toolbarNeedsRedraw = true;
+            InvalidateRect(hWnd, NULL, FALSE);
+            break;
+
+        case ID_LAYER_COMBO:
+            if (wmEvent == CBN_SELCHANGE) {
+                // В списке верхний слой идёт первым
+                int item = (int)SendMessage(GetDlgItem(hWnd, ID_LAYER_COMBO), CB_GETCURSEL, 0, 0);
+                if (item >= 0 && item < static_cast<int>(layers.size())) {
+                    SelectLayer(hWnd, layers.size() - 1 - item);
+                }
+            }
+            break;
+
+        case ID_LAYER_ADD_BUTTON:
+            AddLayer(hWnd);
+            break;
+
+        case ID_LAYER_DELETE_BUTTON:
+            DeleteActiveLayer(hWnd);
+            break;
+
+        case ID_LAYER_UP_BUTTON:
+            MoveActiveLayer(hWnd, 1);
+            break;
+
+        case ID_LAYER_DOWN_BUTTON:
+            MoveActiveLayer(hWnd, -1);
+            break;
+
+        case ID_LAYER_VISIBLE_CHECK:
+            // Видимость меняет только сборку холста, растр слоя остаётся в памяти
+            layers[activeLayer].visible =
+                SendMessage(GetDlgItem(hWnd, ID_LAYER_VISIBLE_CHECK), BM_GETCHECK, 0, 0) == BST_CHECKED;
+            AddFullDamage();
+            UpdateLayerControls(hWnd);
+            break;
+
+        case ID_SIMPLIFY_CHECK:
+            simplifyStrokes = SendMessage(GetDlgItem(hWnd, ID_SIMPLIFY_CHECK), BM_GETCHECK, 0, 0) == BST_CHECKED;
+            break;
+
+        case ID_FILL_8WAY_CHECK:
+            fillEightConnected = SendMessage(GetDlgItem(hWnd, ID_FILL_8WAY_CHECK), BM_GETCHECK, 0, 0) == BST_CHECKED;
+            break;
+
+        case ID_INDEXED_CHECK:
+            SetIndexedCanvas(hWnd, SendMessage(GetDlgItem(hWnd, ID_INDEXED_CHECK), BM_GETCHECK, 0, 0) == BST_CHECKED);
+            break;
+
+        case ID_FILL_DISTANCE_COMBO:
+            if (wmEvent == CBN_SELCHANGE) {
+                HWND hCombo = GetDlgItem(hWnd, ID_FILL_DISTANCE_COMBO);
+                fillDistance = static_cast<ColorDistance>(SendMessage(hCombo, CB_GETCURSEL, 0, 0));
+            }
+            break;
+
+        case ID_BRUSH_SHAPE_COMBO:
+            if (wmEvent == CBN_SELCHANGE) {
+                HWND hCombo = GetDlgItem(hWnd, ID_BRUSH_SHAPE_COMBO);
+                currentBrushShape = (int)SendMessage(hCombo, CB_GETCURSEL, 0, 0);
+                UpdateToolbarState(hWnd);
+                toolbarNeedsRedraw = true;
+            }
+            break;
+        }
+
+        PresentDamage(hWnd);
+    }
+    break;
+
+    case WM_HSCROLL:
+    {
+        HWND hTrackbar = (HWND)lParam;
+        if (hTrackbar == GetDlgItem(hWnd, ID_THICKNESS_TRACKBAR)) {
+            // Толщина задаёт и размер набираемой надписи
+            if (isTyping) AddDamage(GetTypingBounds());
+            currentThickness = (int)SendMessage(hTrackbar, TBM_GETPOS, 0, 0);
+            if (isTyping) {
+                AddDamage(GetTypingBounds());
+                PresentDamage(hWnd);
+            }
+        }
+        else if (hTrackbar == GetDlgItem(hWnd, ID_TOLERANCE_TRACKBAR)) {
+            fillTolerance = (int)SendMessage(hTrackbar, TBM_GETPOS, 0, 0);
+        }
+        else if (hTrackbar == GetDlgItem(hWnd, ID_LAYER_OPACITY_TRACKBAR)) {
+            int percent = (int)SendMessage(hTrackbar, TBM_GETPOS, 0, 0);
+            layers[activeLayer].opacity = (percent * 255 + 50) / 100;
+            AddFullDamage();
+            PresentDamage(hWnd);
+        }
+    }
+    break;
+
+    case WM_KEYDOWN:
+        if (isTyping) {
+            // Пока идёт набор, клавиши принадлежат надписи (символы приходят в WM_CHAR)
+            if (wParam == VK_ESCAPE) {
+                CancelTyping();
+                PresentDamage(hWnd);
+            }
+        }
+        else if (!polygonPoints.empty() && (wParam == VK_RETURN || wParam == VK_ESCAPE)) {
+            // Enter замыкает строящийся многоугольник, Esc отменяет его
+            if (wParam == VK_RETURN) {
+                CommitPolygon();
+            }
+            else {
+                CancelPolygon();
+            }
+            PresentDamage(hWnd);
+        }
+        else if (wParam == VK_ESCAPE) {
+            if (selection.active) {
+                ClearSelection();
+                PresentDamage(hWnd);
+            }
+            else if (zoomMode) {
+                ResetZoom(hWnd);
+                PresentDamage(hWnd);
+            }
+        }
+        else if (wParam == VK_DELETE) {
+            DeleteSelection();
+            PresentDamage(hWnd);
+        }
+        else if (wParam == VK_F11) {
+            // F11 - оверлей учёта памяти, Shift+F11 - выгрузка статистики в JSON
+            if (GetKeyState(VK_SHIFT) < 0) {
+                DumpMemoryStats(hWnd);
+            }
+            else {
+                memoryOverlay = !memoryOverlay;
+                SampleMemory();
+                RefreshMemoryOverlay(hWnd);
+            }
+        }
+        else if (GetKeyState(VK_CONTROL) < 0) {
+            // Ctrl+C / Ctrl+X / Ctrl+V - копирование, вырезание и вставка фрагмента выделения
+            if (wParam == 'C') {
+                CopySelection();
+            }
+            else if (wParam == 'X') {
+                CutSelection();
+            }
+            else if (wParam == 'V') {
+                PasteFragment();
+                currentTool = 7;
+            }
+            PresentDamage(hWnd);
+        }
+        break;
+
+    case WM_CHAR:
+        if (!isTyping) break;
+
+        // Enter - новая строка, Ctrl+Enter - конец набора
+        if (wParam == '\n') {
+            CommitTypedText();
+        }
+        else {
+            TypeCharacter(wParam == VK_RETURN ? L'\n' : static_cast<wchar_t>(wParam));
+        }
+        PresentDamage(hWnd);
+        break;
+
+    case WM_LBUTTONDOWN:
+    {
+        int x = GET_X_LPARAM(lParam);
+        int y = GET_Y_LPARAM(lParam);
+
+        // Щелчок по навигатору наводит лупу на это место холста
+        int navigatorX, navigatorY;
+        if (NavigatorToCanvas(x, y, navigatorX, navigatorY)) {
+            ApplyZoom(hWnd, navigatorX, navigatorY);
             break;
-        case ID_ERASER_BUTTON:
-            currentTool = 4;
-            selectedObjectIndex = -1;
-            toolbarNeedsRedraw = true;
+        }
+
+        // Проверяем, не кликнули ли по панелям инструментов
+        if (y < TOOLBAR_HEIGHT || x < SIDEBAR_WIDTH) {
             break;
-        case ID_FILL_BUTTON:
-            currentTool = 6;
-            selectedObjectIndex = -1;
-            toolbarNeedsRedraw = true;
+        }
+
+        // Клавиатурные команды (Esc, Delete, Ctrl+C/X/V) должны приходить окну, а не кнопке панели
+        SetFocus(hWnd);
+
+        // Корректируем координаты для области рисования
+        x -= SIDEBAR_WIDTH;
+        y -= TOOLBAR_HEIGHT;
+
+        // Обработка режима лупы
+        if (currentTool == 8) {
+            ApplyZoom(hWnd, x, y);
             break;
-        case ID_RECTANGLE_BUTTON:
-            currentTool = 1;
-            selectedObjectIndex = -1;
-            toolbarNeedsRedraw = true;
+        }
+
+        // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
+        if (zoomDrawingMode && zoomMode) {
+            ScreenToZoomCoords(x, y);
+
+            // Проверяем, что клик внутри увеличенной области
+            if (x < zoomRect.left || x >= zoomRect.right || y < zoomRect.top || y >= zoomRect.bottom) {
+                break; // Игнорируем клики вне увеличенной области
+            }
+        }
+
+        if (currentTool == OBJECT_TEXT) {
+            // Щелчок завершает набираемую надпись и начинает новую
+            CommitTypedText();
+            StartTyping(x, y);
+            PresentDamage(hWnd);
             break;
-        case ID_CIRCLE_BUTTON:
-            currentTool = 5;
-            selectedObjectIndex = -1;
-            toolbarNeedsRedraw = true;
+        }
+
+        if (currentTool == OBJECT_POLYGON) {
+            // Щелчки ставят вершины, щелчок по первой вершине замыкает многоугольник
+            if (polygonPoints.size() >= 3 &&
+                abs(x - polygonPoints[0].x) <= HANDLE_SIZE && abs(y - polygonPoints[0].y) <= HANDLE_SIZE) {
+                CommitPolygon();
+            }
+            else {
+                AddPolygonPoint(x, y);
+            }
+            PresentDamage(hWnd);
             break;
-        case ID_SELECTION_BUTTON:
+        }
+
+        if (currentTool == TOOL_MAGIC_WAND) {
+            // Выделение строится той же заливкой; дальше с ним работает инструмент выделения
+            MagicWandSelect(x, y);
             if (selection.active) {
-                ClearSelection();
-                currentTool = 0;
+                currentTool = 7;
+            }
+            PresentDamage(hWnd);
+            break;
+        }
+
+        if (currentTool == 7) {
+            int handle = GetSelectionHandle(x, y);
+
+            if (handle >= 0 && handle <= 3) {
+                // Изменение размера рамки оставляет перетаскиваемый фрагмент на месте
+                floatingFragmentIndex = -1;
+                selection.mode = SELECTION_RESIZING;
+                selection.resizeHandle = handle;
+                selection.originalStartX = x;
+                selection.originalStartY = y;
+            }
+            else if (handle == 6) {
+                // Перетаскивание поднимает пиксели выделения (с Ctrl - дублирует их,
+                // с Shift - двигает только рамку)
+                if (floatingFragmentIndex < 0 && GetKeyState(VK_SHIFT) >= 0) {
+                    LiftSelection(GetKeyState(VK_CONTROL) < 0);
+                }
+
+                selection.mode = SELECTION_MOVING;
+                selection.originalStartX = x;
+                selection.originalStartY = y;
+                selection.originalEndX = selection.rect.right;
+                selection.originalEndY = selection.rect.bottom;
             }
             else {
-                currentTool = 7;
+                StartSelection(x, y);
             }
-            selectedObjectIndex = -1;
-            toolbarNeedsRedraw = true;
+            PresentDamage(hWnd);
+        }
+        else {
+            if (selectedObjectIndex != -1) {
+                resizeMode = GetResizeHandle(drawings[selectedObjectIndex], x, y);
+
+                // Фрагмент растра, надпись и градиент (его область привязана к началу)
+                // не масштабируются - любой маркер их только двигает
+                int selectedType = drawings[selectedObjectIndex].type();
+                if (resizeMode != NONE && (selectedType == OBJECT_FRAGMENT || selectedType == OBJECT_TEXT ||
+                    selectedType == OBJECT_GRADIENT)) {
+                    resizeMode = MOVE;
+                }
+
+                if (resizeMode != NONE) {
+                    isResizing = true;
+                    dragStartX = x;
+                    dragStartY = y;
+
+                    originalStartX = drawings[selectedObjectIndex].startX();
+                    originalStartY = drawings[selectedObjectIndex].startY();
+                    originalEndX = drawings[selectedObjectIndex].endX();
+                    originalEndY = drawings[selectedObjectIndex].endY();
+
+                    break;
+                }
+            }
+
+            isDrawing = true;
+            startX = x;
+            startY = y;
+            prevX = startX;
+            prevY = startY;
+            strokeBounds = GetSegmentBounds(x, y, x, y, currentThickness + 2);
+            strokeStartIndex = drawings.size();
+            SetSelectedObject(-1);
+
+            if (currentTool == 6) {
+                SpanMask filled;
+                FloodFillWithClipping(x, y, currentColor, filled);
+                if (!filled.Empty()) {
+                    const MaskRect& bounds = filled.Bounds();
+                    RECT filledBounds = { bounds.left, bounds.top, bounds.right, bounds.bottom };
+                    fillMasks.push_back(std::move(filled));
+                    AddDrawingObject(currentTool, x, y, x, y, static_cast<uint32_t>(fillMasks.size()));
+                    AddDamage(filledBounds);
+                }
+                isDrawing = false;
+                PresentDamage(hWnd);
+                break;
+            }
+
+            if (currentTool == 1 || currentTool == 5 || currentTool == OBJECT_GRADIENT) {
+                tempObject.type = !fillShapes || currentTool == OBJECT_GRADIENT ? currentTool :
+                    (currentTool == 1 ? OBJECT_FILLED_RECT : OBJECT_FILLED_ELLIPSE);
+                tempObject.startX = startX;
+                tempObject.startY = startY;
+                tempObject.endX = startX;
+                tempObject.endY = startY;
+                tempObject.thickness = currentThickness;
+                tempObject.color = currentColor;
+                hasTempObject = true;
+                lastPreviewRect = GetSegmentBounds(startX, startY, startX, startY, currentThickness + 2);
+            }
+
+            PresentDamage(hWnd);
+        }
+    }
+    break;
+
+    case WM_MOUSEMOVE:
+    {
+        int currentX = GET_X_LPARAM(lParam);
+        int currentY = GET_Y_LPARAM(lParam);
+
+        // Корректируем координаты для области рисования
+        if (currentY >= TOOLBAR_HEIGHT && currentX >= SIDEBAR_WIDTH) {
+            currentX -= SIDEBAR_WIDTH;
+            currentY -= TOOLBAR_HEIGHT;
+
+            // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
+            if (zoomDrawingMode && zoomMode) {
+                ScreenToZoomCoords(currentX, currentY);
+
+                // Проверяем, что движение внутри увеличенной области
+                if (currentX < zoomRect.left || currentX >= zoomRect.right ||
+                    currentY < zoomRect.top || currentY >= zoomRect.bottom) {
+                    break; // Игнорируем движение вне увеличенной области
+                }
+            }
+        }
+        else {
             break;
+        }
+
+        if (currentTool == OBJECT_POLYGON && !polygonPoints.empty()) {
+            // Сторона к курсору - предпросмотр следующей вершины
+            AddDamage(GetPolygonPreviewBounds());
+            polygonCursor = { currentX, currentY };
+            AddDamage(GetPolygonPreviewBounds());
+            PresentDamage(hWnd);
+            break;
+        }
+
+        if (currentTool == 7 && selection.active) {
+            if (selection.mode != SELECTION_NONE && (wParam & MK_LBUTTON)) {
+                UpdateSelection(currentX, currentY);
+                if (selection.mode == SELECTION_MOVING) {
+                    MoveFloatingFragment();
+                }
+                PresentDamage(hWnd);
+            }
+        }
+        else if (isResizing && selectedObjectIndex != -1) {
+            // Старое положение объекта вместе с маркерами
+            RECT oldBounds = GetObjectBounds(drawings[selectedObjectIndex]);
+
+            // Корзины открытого документа не знают о сдвигах: перед первым сдвигом
+            // загруженного объекта документ дорисовывается целиком
+            if (static_cast<size_t>(selectedObjectIndex) < layers[activeLayer].openBins.Count()) {
+                FinishOpenRender();
+            }
+
+            if (resizeMode == MOVE) {
+                int deltaX = currentX - dragStartX;
+                int deltaY = currentY - dragStartY;
+                drawings.SetCoords(selectedObjectIndex, originalStartX + deltaX, originalStartY + deltaY,
+                    originalEndX + deltaX, originalEndY + deltaY);
+                MarkJournalMoved(selectedObjectIndex);
+            }
+            else {
+                UpdateObjectHandles(selectedObjectIndex, resizeMode, currentX, currentY);
+            }
+
+            // Перерисовываем только область старого и нового положения
+            RECT changed = DamageTracker::Union(oldBounds, GetObjectBounds(drawings[selectedObjectIndex]));
+            RedrawBufferRect(changed);
+            AddDamage(changed);
+            PresentDamage(hWnd);
+            UpdateWindow(hWnd);
+        }
+        else if (isDrawing && (wParam & MK_LBUTTON)) {
+            if (currentTool == 0 || currentTool == 3 || currentTool == 4) {
+                DrawToolWithClipping(hBufferDC, currentTool, currentThickness, currentColor,
+                    currentBrushShape, prevX, prevY, currentX, currentY);
+
+                AddDrawingObject(currentTool, prevX, prevY, currentX, currentY);
+
+                // Прямоугольник сегмента считаем до сдвига prevX/prevY
+                RECT segmentRect = GetSegmentBounds(prevX, prevY, currentX, currentY, currentThickness + 2);
+                strokeBounds = DamageTracker::Union(strokeBounds, segmentRect);
+                AddDamage(segmentRect);
+
+                prevX = currentX;
+                prevY = currentY;
+
+                PresentDamage(hWnd);
+                UpdateWindow(hWnd);
+            }
+            else if (currentTool == 1 || currentTool == 5 || currentTool == OBJECT_GRADIENT) {
+                tempObject.endX = currentX;
+                tempObject.endY = currentY;
+
+                // Стираем прежний предпросмотр и рисуем новый
+                RECT previewRect = GetSegmentBounds(startX, startY, currentX, currentY, currentThickness + 2);
+                AddDamage(lastPreviewRect);
+                AddDamage(previewRect);
+                lastPreviewRect = previewRect;
+
+                PresentDamage(hWnd);
+                UpdateWindow(hWnd);
+            }
+        }
+        else if (!isDrawing && !isResizing) {
+            for (int i = static_cast<int>(drawings.size()) - 1; i >= 0; i--) {
+                if (GetResizeHandle(drawings[i], currentX, currentY) != NONE) {
+                    SetCursor(LoadCursor(NULL, IDC_SIZEALL));
+                    break;
+                }
+            }
+        }
+    }
+    break;
+
+    case WM_LBUTTONUP:
+        if (currentTool == 7 && selection.active) {
+            EndSelection();
+        }
+        else if (isResizing) {
+            isResizing = false;
+            resizeMode = NONE;
+            PresentDamage(hWnd);
+        }
+        else if (isDrawing) {
+            isDrawing = false;
+            int endX = GET_X_LPARAM(lParam) - SIDEBAR_WIDTH;
+            int endY = GET_Y_LPARAM(lParam) - TOOLBAR_HEIGHT;
+
+            // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
+            if (zoomDrawingMode && zoomMode) {
+                ScreenToZoomCoords(endX, endY);
+            }
+
+            if (currentTool == 1 || currentTool == 5) {
+                AddDrawingObject(tempObject.type, startX, startY, endX, endY);
+                hasTempObject = false;
+                AddDamage(lastPreviewRect);
+                SetSelectedObject(static_cast<int>(drawings.size()) - 1);
+
+                // Дорисовываем новую фигуру в буфер с той же обрезкой, что и при перерисовке
+                DrawingRef obj = drawings.back();
+                RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+                DrawObjectToBuffer(obj, canvasRect);
+                AddDamage(GetObjectBounds(obj));
+            }
+            else if (currentTool == OBJECT_GRADIENT) {
+                hasTempObject = false;
+                AddDamage(lastPreviewRect);
+                AddGradientFill(startX, startY, endX, endY);
+            }
+            else if (currentTool == 0 || currentTool == 3 || currentTool == 4) {
+                if (simplifyStrokes) {
+                    SimplifyCommittedStroke(strokeStartIndex);
+                }
+
+                // Штрих рисовался пером GDI; переигрываем его область со сглаживанием
+                RedrawBufferRect(strokeBounds);
+                AddDamage(strokeBounds);
+            }
+
+            PresentDamage(hWnd);
+        }
+        else {
+            int x = GET_X_LPARAM(lParam) - SIDEBAR_WIDTH;
+            int y = GET_Y_LPARAM(lParam) - TOOLBAR_HEIGHT;
+
+            // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
+            if (zoomDrawingMode && zoomMode) {
+                ScreenToZoomCoords(x, y);
+            }
+
+            int hitIndex = -1;
+            for (int i = static_cast<int>(drawings.size()) - 1; i >= 0; i--) {
+                if (GetResizeHandle(drawings[i], x, y) != NONE) {
+                    hitIndex = i;
+                    break;
+                }
+            }
+            SetSelectedObject(hitIndex);
+            PresentDamage(hWnd);
+        }
+        break;
+
+    case WM_ERASEBKGND:
+        // Фон не стираем: WM_PAINT сам закрашивает панели и выводит холст
+        return 1;
+
+    case WM_PAINT:
+    {
+        // Точный список прямоугольников области обновления (до BeginPaint, который её сбрасывает)
+        std::vector<RECT> paintRects;
+        HRGN updateRegion = CreateRectRgn(0, 0, 0, 0);
+        if (GetUpdateRgn(hWnd, updateRegion, FALSE) != ERROR) {
+            DWORD dataSize = GetRegionData(updateRegion, 0, NULL);
+            if (dataSize > 0) {
+                std::vector<BYTE> data(dataSize);
+                RGNDATA* regionData = reinterpret_cast<RGNDATA*>(data.data());
+                if (GetRegionData(updateRegion, dataSize, regionData)) {
+                    const RECT* rects = reinterpret_cast<const RECT*>(regionData->Buffer);
+                    paintRects.assign(rects, rects + regionData->rdh.nCount);
+                }
+            }
+        }
+        DeleteObject(updateRegion);
+
+        PAINTSTRUCT ps;
+        HDC hdc = BeginPaint(hWnd, &ps);
+
+        if (paintRects.empty()) {
+            paintRects.push_back(ps.rcPaint);
+        }
 
-        case ID_ZOOM_BUTTON:
+        // Рисуем верхнюю панель инструментов
+        if (toolbarNeedsRedraw || ps.rcPaint.top < TOOLBAR_HEIGHT) {
+            RECT toolbarRect;
+            GetClientRect(hWnd, &toolbarRect);
+            toolbarRect.bottom = TOOLBAR_HEIGHT;
+            FillRect(hdc, &toolbarRect, (HBRUSH)(COLOR_BTNFACE + 1));
+
+            HPEN hPen = CreatePen(PS_SOLID, 1, GetSysColor(COLOR_3DSHADOW));
+            HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
+            MoveToEx(hdc, 0, TOOLBAR_HEIGHT - 1, NULL);
+            LineTo(hdc, toolbarRect.right, TOOLBAR_HEIGHT - 1);
+            SelectObject(hdc, hOldPen);
+            DeleteObject(hPen);
+        }
+
+        // Рисуем боковую панель инструментов
+        if (toolbarNeedsRedraw || ps.rcPaint.left < SIDEBAR_WIDTH) {
+            RECT sidebarRect;
+            GetClientRect(hWnd, &sidebarRect);
+            sidebarRect.right = SIDEBAR_WIDTH;
+            sidebarRect.top = TOOLBAR_HEIGHT;
+            FillRect(hdc, &sidebarRect, (HBRUSH)(COLOR_BTNFACE + 1));
+
+            HPEN hPen = CreatePen(PS_SOLID, 1, GetSysColor(COLOR_3DSHADOW));
+            HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
+            MoveToEx(hdc, SIDEBAR_WIDTH - 1, TOOLBAR_HEIGHT, NULL);
+            LineTo(hdc, SIDEBAR_WIDTH - 1, sidebarRect.bottom);
+            SelectObject(hdc, hOldPen);
+            DeleteObject(hPen);
+        }
+
+        toolbarNeedsRedraw = false;
+
+        if (hBufferDC && hComposeDC) {
             if (zoomMode) {
-                ResetZoom(hWnd);
-                currentTool = 0;
+                // РЕЖИМ ЛУПЫ: собираем холст с наложениями и растягиваем область увеличения
+                RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+                ComposeCanvasRect(canvasRect);
+
+                int srcWidth = zoomRect.right - zoomRect.left;
+                int srcHeight = zoomRect.bottom - zoomRect.top;
+
+                StretchBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
+                    hComposeDC, zoomRect.left, zoomRect.top, srcWidth, srcHeight, SRCCOPY);
+
+                // Рисуем красную рамку вокруг увеличенной области
+                HPEN hPen = CreatePen(PS_SOLID, 2, RGB(255, 0, 0));
+                HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
+                SelectObject(hdc, GetStockObject(NULL_BRUSH));
+
+                int frameLeft = SIDEBAR_WIDTH;
+                int frameTop = TOOLBAR_HEIGHT;
+                int frameRight = SIDEBAR_WIDTH + static_cast<int>(bufferWidth);
+                int frameBottom = TOOLBAR_HEIGHT + static_cast<int>(bufferHeight);
+
+                Rectangle(hdc, frameLeft, frameTop, frameRight, frameBottom);
+                SelectObject(hdc, hOldPen);
+                DeleteObject(hPen);
+
+                lastFramePixels = static_cast<long long>(bufferWidth) * bufferHeight;
             }
             else {
-                currentTool = 8;
-                SetWindowText(GetDlgItem(hWnd, ID_ZOOM_BUTTON), L"Лупа [режим]");
-            }
-            selectedObjectIndex = -1;
-            toolbarNeedsRedraw = true;
-            break;
+                // НОРМАЛЬНЫЙ РЕЖИМ: выводим только прямоугольники области обновления
+                lastFramePixels = 0;
+                RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
 
-        case ID_COLOR_BUTTON:
-        {
-            CHOOSECOLOR cc = {};
-            static COLORREF customColors[16] = {};
-            cc.lStructSize = sizeof(cc);
-            cc.hwndOwner = hWnd;
-            cc.lpCustColors = customColors;
-            cc.rgbResult = currentColor;
-            cc.Flags = CC_FULLOPEN | CC_RGBINIT;
+                for (const auto& windowRect : paintRects) {
+                    RECT rect = windowRect;
+                    OffsetRect(&rect, -SIDEBAR_WIDTH, -TOOLBAR_HEIGHT);
+                    if (!IntersectRect(&rect, &rect, &canvasRect)) continue;
 
-            if (ChooseColor(&cc)) {
-                currentColor = cc.rgbResult;
+                    ComposeCanvasRect(rect);
+                    BitBlt(hdc, rect.left + SIDEBAR_WIDTH, rect.top + TOOLBAR_HEIGHT,
+                        rect.right - rect.left, rect.bottom - rect.top,
+                        hComposeDC, rect.left, rect.top, SRCCOPY);
+
+                    lastFramePixels += DamageTracker::Area(rect);
+                }
             }
-            toolbarNeedsRedraw = true;
+
+            UpdateNavigator();
+            DrawNavigator(hdc);
+            if (memoryOverlay) DrawMemoryOverlay(hdc);
+            memoryStats.Count("frame_pixels", static_cast<size_t>(lastFramePixels));
+        }
+        else {
+            RECT rect;
+            GetClientRect(hWnd, &rect);
+            rect.left = SIDEBAR_WIDTH;
+            rect.top = TOOLBAR_HEIGHT;
+            FillRect(hdc, &rect, (HBRUSH)GetStockObject(WHITE_BRUSH));
         }
+
+        EndPaint(hWnd, &ps);
+    }
+    break;
+
+    case WM_CREATE:
+        CreateToolbar(hWnd);
+        ResizeBuffer(hWnd);
+        SetTimer(hWnd, MEMORY_TIMER_ID, MEMORY_SAMPLE_MS, NULL);
         break;
 
-        case ID_SAVE_BUTTON:
-            SaveFile(hWnd);
-            break;
+    case WM_DESTROY:
+        // Начатое сохранение дописывается до выключения GDI+; журнал при чистом выходе не нужен
+        backgroundSaver.Wait();
+        journal.Stop(true);
+        PostQuitMessage(0);
+        break;
+
+    default:
+        return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+    return 0;
+}
+
+// Graphics для рисования в hdc. В растр слоя GDI+ рисует через Bitmap в формате PARGB
+// поверх памяти DIB-секции: Graphics поверх DC не сохраняет альфа-канал. Обрезка DC
+// переносится в Graphics.
+template <typename Draw>
+void WithGraphics(HDC hdc, Draw draw)
+{
+    if (hdc != hBufferDC || !bufferBits) {
+        Graphics graphics(hdc);
+        draw(graphics);
+        return;
+    }
+
+    GdiFlush();
+    Bitmap bitmap(static_cast<INT>(bufferWidth), static_cast<INT>(bufferHeight),
+        static_cast<INT>(bufferStride * sizeof(uint32_t)), PixelFormat32bppPARGB,
+        reinterpret_cast<BYTE*>(bufferBits));
+    Graphics graphics(&bitmap);
+
+    HRGN clipRegion = CreateRectRgn(0, 0, 0, 0);
+    if (GetClipRgn(hdc, clipRegion) == 1) {
+        graphics.SetClip(clipRegion);
+    }
+    DeleteObject(clipRegion);
+
+    draw(graphics);
+}
+
+// Функция рисования объекта (распакованная запись, например временный объект)
+void DrawObject(HDC hdc, const DrawingObject& obj)
+{
+    DrawPrimitive(hdc, obj.type, obj.startX, obj.startY, obj.endX, obj.endY,
+        obj.thickness, obj.color, obj.brushShape);
+}
+
+// Функция рисования объекта прямо из хранилища
+void DrawObject(HDC hdc, const DrawingRef& obj)
+{
+    DrawPrimitive(hdc, obj.type(), obj.startX(), obj.startY(), obj.endX(), obj.endY(),
+        obj.thickness(), obj.color(), obj.brushShape());
+}
+
+// Рисование примитива по его параметрам
+void DrawPrimitive(HDC hdc, int type, int sx, int sy, int ex, int ey,
+    int thickness, COLORREF color, int brushShape)
+{
+    WithGraphics(hdc, [&](Graphics& graphics) {
+        DrawPrimitive(graphics, type, sx, sy, ex, ey, thickness, color, brushShape);
+    });
+}
+
+void DrawPrimitive(Graphics& graphics, int type, int sx, int sy, int ex, int ey,
+    int thickness, COLORREF color, int brushShape)
+{
+    // В режиме палитры сглаживание не добавляет промежуточных цветов
+    graphics.SetSmoothingMode(indexedCanvas ? SmoothingModeNone : SmoothingModeAntiAlias);
+
+    // Ластик и вырезание делают пиксели слоя прозрачными (на холсте под ними - нижние слои)
+    bool erases = type == 4 || type == OBJECT_CLEARED_RECT;
+    if (erases) {
+        graphics.SetCompositingMode(CompositingModeSourceCopy);
+    }
+
+    Color penColor = erases ? Color(0, 0, 0, 0) : Color(GetRValue(color), GetGValue(color), GetBValue(color));
+    Pen pen(penColor, (REAL)thickness);
+
+    if (type == 0 || type == 4) {
+        pen.SetLineCap(LineCapRound, LineCapRound, DashCapRound);
+        pen.SetLineJoin(LineJoinRound);
+    }
+
+    int left = min(sx, ex);
+    int top = min(sy, ey);
+    int right = max(sx, ex);
+    int bottom = max(sy, ey);
+    int width = right - left;
+    int height = bottom - top;
+
+    switch (type) {
+    case 0:
+    case 4:
+        graphics.DrawLine(&pen, sx, sy, ex, ey);
+        break;
+
+    case 1:
+        graphics.DrawRectangle(&pen, left, top, width, height);
+        break;
+
+    case 3:
+        DrawBrush(graphics, sx, sy, ex, ey, thickness, color, brushShape);
+        break;
+
+    case 5:
+    {
+        int size = min(width, height);
+        graphics.DrawEllipse(&pen, left, top, size, size);
+    }
+    break;
+
+    case 6:
+        break;
+
+    case OBJECT_CLEARED_RECT:
+    {
+        SolidBrush clearBrush(penColor);
+        graphics.FillRectangle(&clearBrush, left, top, width, height);
+    }
+    break;
+
+    // Закрашенные фигуры в буфер выводит DrawFilledShape; здесь - только предпросмотр
+    case OBJECT_FILLED_RECT:
+    {
+        SolidBrush fillBrush(penColor);
+        graphics.FillRectangle(&fillBrush, left, top, width, height);
+    }
+    break;
+
+    case OBJECT_FILLED_ELLIPSE:
+    {
+        SolidBrush fillBrush(penColor);
+        graphics.FillEllipse(&fillBrush, left, top, width, height);
+    }
+    break;
+
+    case OBJECT_GRADIENT:
+    {
+        // Предпросмотр - ось градиента
+        Pen axisPen(penColor, 1.0f);
+        axisPen.SetDashStyle(DashStyleDash);
+        graphics.DrawLine(&axisPen, sx, sy, ex, ey);
+    }
+    break;
+    }
+}
+
+// Функция добавления объекта в историю
+void AddDrawingObject(int type, int sx, int sy, int ex, int ey, uint32_t payload)
+{
+    DrawingObject newObj;
+    newObj.type = type;
+    newObj.startX = sx;
+    newObj.startY = sy;
+    newObj.endX = ex;
+    newObj.endY = ey;
+    newObj.thickness = currentThickness;
+    newObj.color = (type == 4) ? BACKGROUND_COLOR : currentColor;
+    newObj.isSelected = false;
+    newObj.brushShape = currentBrushShape;
+    newObj.payload = payload;
+
+    newObj.wasDrawnWithSelection = selection.active;
+    if (selection.active) {
+        newObj.selectionRect = selection.rect;
+        newObj.selectionMask = selection.mask;
+    }
+    else {
+        newObj.selectionRect = { 0, 0, 0, 0 };
+        newObj.selectionMask = 0;
+    }
+
+    drawings.push_back(newObj);
+}
+
+// Упрощение только что завершённого штриха (сегменты с индекса strokeStart до конца)
+void SimplifyCommittedStroke(size_t strokeStart)
+{
+    if (strokeStart >= drawings.size()) return;
+
+    size_t segmentCount = drawings.size() - strokeStart;
+    DrawingObject proto = drawings.Unpack(strokeStart);
+
+    // Сегменты штриха идут цепочкой: конец одного - начало следующего
+    std::vector<StrokePoint> points;
+    points.push_back({ proto.startX, proto.startY });
+    for (size_t i = strokeStart; i < drawings.size(); i++) {
+        points.push_back({ drawings[i].endX(), drawings[i].endY() });
+    }
+
+    std::vector<StrokePoint> simplified;
+    if (proto.type == 3) {
+        // Кисть штампует фигуру по габариту каждого сегмента, поэтому объединять сегменты нельзя:
+        // убираем только точные повторы предыдущего сегмента (дрожание мыши на месте)
+        simplified.push_back(points[0]);
+        for (size_t i = 1; i < points.size(); i++) {
+            size_t n = simplified.size();
+            bool repeatsPrevious = n >= 2 &&
+                points[i].x == simplified[n - 1].x && points[i].y == simplified[n - 1].y &&
+                simplified[n - 2].x == simplified[n - 1].x && simplified[n - 2].y == simplified[n - 1].y;
+            if (!repeatsPrevious) simplified.push_back(points[i]);
+        }
+    }
+    else {
+        simplified = SimplifyStroke(points, StrokeTolerance(proto.thickness));
+    }
+
+    if (simplified.size() == points.size()) return;
+
+    // Заменяем сегменты штриха упрощёнными с теми же параметрами
+    for (size_t i = 0; i < segmentCount; i++) {
+        drawings.pop_back();
+    }
+    for (size_t i = 1; i < simplified.size(); i++) {
+        DrawingObject segment = proto;
+        segment.startX = simplified[i - 1].x;
+        segment.startY = simplified[i - 1].y;
+        segment.endX = simplified[i].x;
+        segment.endY = simplified[i].y;
+        drawings.push_back(segment);
+    }
+}
+
+// Функции для работы с фрагментами выделения
+
+// Рамка выделения с упорядоченными сторонами, обрезанная по холсту
+RECT GetNormalizedSelectionRect()
+{
+    RECT rect = {
+        min(selection.rect.left, selection.rect.right), min(selection.rect.top, selection.rect.bottom),
+        max(selection.rect.left, selection.rect.right), max(selection.rect.top, selection.rect.bottom)
+    };
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    if (!IntersectRect(&rect, &rect, &canvasRect)) {
+        SetRectEmpty(&rect);
+    }
+    return rect;
+}
+
+// Захват пикселей выделения в плитки (единственное копирование пикселей за всю операцию)
+bool CaptureSelection(Fragment& target)
+{
+    if (!selection.active || !bufferBits) return false;
+
+    RECT rect = GetNormalizedSelectionRect();
+    if (IsRectEmpty(&rect)) return false;
+
+    int width = rect.right - rect.left;
+    int height = rect.bottom - rect.top;
+
+    GdiFlush();
+    target.image = TiledImage(width, height, 0);
+    target.image.AttachCache(&fragmentTileCache);
+    target.image.WriteRect(0, 0, width, height, bufferBits + rect.top * bufferStride + rect.left, bufferStride);
+
+    // Маска выделения переводится в координаты фрагмента
+    target.mask.Clear();
+    int dx = 0, dy = 0;
+    const SpanMask* mask = GetClipMask(selection.mask, selection.rect, dx, dy);
+    if (mask) {
+        for (const auto& run : mask->Runs()) {
+            target.mask.AddRun(run.y + dy - rect.top, run.left + dx - rect.left, run.right + dx - rect.left);
+        }
+    }
+    return true;
+}
+
+// Ctrl+C
+void CopySelection()
+{
+    CaptureSelection(clipboardFragment);
+}
+
+// Ctrl+X
+void CutSelection()
+{
+    if (!CaptureSelection(clipboardFragment)) return;
+    DeleteSelection();
+}
+
+// Delete
+void DeleteSelection()
+{
+    if (!selection.active) return;
+
+    if (selection.mask) {
+        AddMaskClear();
+        return;
+    }
+
+    RECT rect = GetNormalizedSelectionRect();
+    if (!IsRectEmpty(&rect)) {
+        AddClearedRect(rect);
+    }
+}
+
+// Ctrl+V: фрагмент из буфера обмена встаёт в угол рамки выделения (или холста)
+void PasteFragment()
+{
+    if (clipboardFragment.image.Empty()) return;
+
+    int x = 0, y = 0;
+    if (selection.active) {
+        RECT rect = GetNormalizedSelectionRect();
+        x = rect.left;
+        y = rect.top;
+    }
+    PlaceFragment(clipboardFragment, x, y);
+}
+
+// Начало перетаскивания выделения: пиксели поднимаются во вставленный фрагмент
+void LiftSelection(bool duplicate)
+{
+    Fragment fragment;
+    if (!CaptureSelection(fragment)) return;
+
+    RECT rect = GetNormalizedSelectionRect();
+    if (!duplicate) {
+        DeleteSelection();
+    }
+    PlaceFragment(fragment, rect.left, rect.top);
+}
+
+// Объект истории для фрагмента в точке (x, y); возвращает его границы
+RECT AddFragmentObject(const Fragment& fragment, int x, int y)
+{
+    // Копируются только указатели на плитки
+    fragments.push_back(fragment);
+
+    DrawingObject obj = {};
+    obj.type = OBJECT_FRAGMENT;
+    obj.startX = x;
+    obj.startY = y;
+    obj.endX = x + fragment.image.Width();
+    obj.endY = y + fragment.image.Height();
+    obj.color = BACKGROUND_COLOR;
+    obj.brushShape = BRUSH_CIRCLE;
+    obj.payload = static_cast<uint32_t>(fragments.size());
+    drawings.push_back(obj);
+
+    RECT bounds = { obj.startX, obj.startY, obj.endX, obj.endY };
+    return bounds;
+}
+
+// Вставка фрагмента новым объектом; рамка выделения охватывает его и перетаскивает
+void PlaceFragment(const Fragment& fragment, int x, int y)
+{
+    // Новый объект лежит поверх всех - дорисовываем только его
+    RECT bounds = AddFragmentObject(fragment, x, y);
+    DrawFragment(drawings.back(), bounds);
+    AddDamage(bounds);
+
+    AddDamage(GetSelectionAreaBounds());
+    selection.rect = bounds;
+    selection.active = true;
+    selection.mode = SELECTION_NONE;
+    selection.mask = 0;
+    if (!fragment.mask.Empty()) {
+        // Рамка повторяет форму фрагмента (маска в его координатах привязана к рамке)
+        selectionMasks.push_back(fragment.mask);
+        selection.mask = static_cast<uint32_t>(selectionMasks.size());
+    }
+    floatingFragmentIndex = static_cast<int>(drawings.size()) - 1;
+    AddDamage(GetSelectionAreaBounds());
+}
 
-        case ID_CLEAR_BUTTON:
-            drawings.clear();
-            ClearSelection();
-            ResetZoom(hWnd);
-            RedrawBuffer(hWnd);
-            toolbarNeedsRedraw = true;
-            InvalidateRect(hWnd, NULL, TRUE);
-            break;
+// Фильтр выделения (1 - резкость, 2 - размытие, 3 - оттенки серого) прямо по растру
+// слоя. Результат записывается в историю фрагментом на месте выделения, поэтому
+// перерисовка и отмена воспроизводят его без повторного применения фильтра.
+void ApplySelectionFilter(int filter)
+{
+    if (!selection.active || !bufferBits) return;
 
-        case ID_BRUSH_SHAPE_COMBO:
-            if (wmEvent == CBN_SELCHANGE) {
-                HWND hCombo = GetDlgItem(hWnd, ID_BRUSH_SHAPE_COMBO);
-                currentBrushShape = (int)SendMessage(hCombo, CB_GETCURSEL, 0, 0);
-                UpdateToolbarState(hWnd);
-                toolbarNeedsRedraw = true;
-            }
-            break;
-        }
+    RECT rect = GetNormalizedSelectionRect();
+    if (IsRectEmpty(&rect)) return;
 
-        RECT drawingRect;
-        GetClientRect(hWnd, &drawingRect);
-        drawingRect.left = SIDEBAR_WIDTH;
-        drawingRect.top = TOOLBAR_HEIGHT;
-        InvalidateRect(hWnd, &drawingRect, FALSE);
+    GdiFlush();
+    ImageView view = { reinterpret_cast<uint8_t*>(bufferBits + rect.top * bufferStride + rect.left),
+        rect.right - rect.left, rect.bottom - rect.top, static_cast<size_t>(bufferStride) * 4, 4, true };
+
+    switch (filter) {
+    case 1: SharpenLaplacianImage(view); break;
+    case 2: GaussianBlurImage(view, currentThickness * 2 + 1); break;
+    case 3: GrayscaleImage(view, view); break;
+    default: return;
     }
-    break;
 
-    case WM_HSCROLL:
-    {
-        HWND hTrackbar = (HWND)lParam;
-        if (hTrackbar == GetDlgItem(hWnd, ID_THICKNESS_TRACKBAR)) {
-            currentThickness = (int)SendMessage(hTrackbar, TBM_GETPOS, 0, 0);
-        }
+    Fragment fragment;
+    if (!CaptureSelection(fragment)) return;
+    AddFragmentObject(fragment, rect.left, rect.top);
+
+    // Фильтр прошёл по всему прямоугольнику: пиксели вне маски восстанавливаются из истории
+    if (selection.mask) {
+        RedrawBufferRect(rect);
     }
-    break;
+    AddDamage(rect);
+}
 
-    case WM_KEYDOWN:
-        if (wParam == VK_ESCAPE) {
-            if (selection.active) {
-                ClearSelection();
-                RECT drawingRect;
-                GetClientRect(hWnd, &drawingRect);
-                drawingRect.left = SIDEBAR_WIDTH;
-                drawingRect.top = TOOLBAR_HEIGHT;
-                InvalidateRect(hWnd, &drawingRect, TRUE);
-            }
-            else if (zoomMode) {
-                ResetZoom(hWnd);
-                RECT drawingRect;
-                GetClientRect(hWnd, &drawingRect);
-                drawingRect.left = SIDEBAR_WIDTH;
-                drawingRect.top = TOOLBAR_HEIGHT;
-                InvalidateRect(hWnd, &drawingRect, TRUE);
-            }
-        }
-        break;
+// Заливка области фоном как отдельный объект истории
+void AddClearedRect(const RECT& rect)
+{
+    DrawingObject obj = {};
+    obj.type = OBJECT_CLEARED_RECT;
+    obj.startX = rect.left;
+    obj.startY = rect.top;
+    obj.endX = rect.right;
+    obj.endY = rect.bottom;
+    obj.color = BACKGROUND_COLOR;
+    obj.brushShape = BRUSH_CIRCLE;
+    drawings.push_back(obj);
+
+    DrawObject(hBufferDC, drawings.back());
+    AddDamage(rect);
+}
 
-    case WM_LBUTTONDOWN:
-    {
-        int x = GET_X_LPARAM(lParam);
-        int y = GET_Y_LPARAM(lParam);
+// Перетаскиваемый фрагмент следует за рамкой: меняются только координаты объекта
+void MoveFloatingFragment()
+{
+    if (floatingFragmentIndex < 0 || floatingFragmentIndex >= static_cast<int>(drawings.size())) return;
 
-        // Проверяем, не кликнули ли по панелям инструментов
-        if (y < TOOLBAR_HEIGHT || x < SIDEBAR_WIDTH) {
-            break;
-        }
+    DrawingRef obj = drawings[floatingFragmentIndex];
+    int width = obj.endX() - obj.startX();
+    int height = obj.endY() - obj.startY();
+    if (obj.startX() == selection.rect.left && obj.startY() == selection.rect.top) return;
 
-        // Корректируем координаты для области рисования
-        x -= SIDEBAR_WIDTH;
-        y -= TOOLBAR_HEIGHT;
+    RECT oldBounds = GetObjectBounds(obj);
+    drawings.SetCoords(floatingFragmentIndex, selection.rect.left, selection.rect.top,
+        selection.rect.left + width, selection.rect.top + height);
+    MarkJournalMoved(floatingFragmentIndex);
 
-        // Обработка режима лупы
-        if (currentTool == 8) {
-            ApplyZoom(hWnd, x, y);
-            break;
-        }
+    RECT changed = DamageTracker::Union(oldBounds, GetObjectBounds(drawings[floatingFragmentIndex]));
+    RedrawBufferRect(changed);
+    AddDamage(changed);
+}
 
-        // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
-        if (zoomDrawingMode && zoomMode) {
-            ScreenToZoomCoords(x, y);
+// Вывод фрагмента в память буфера: читаются только плитки, задевающие clip
+void DrawFragment(const DrawingRef& obj, const RECT& clip)
+{
+    uint32_t id = obj.payload();
+    if (!bufferBits || id == 0 || id > fragments.size()) return;
+
+    const Fragment& fragment = fragments[id - 1];
+    int x = min(obj.startX(), obj.endX());
+    int y = min(obj.startY(), obj.endY());
+
+    RECT target = { x, y, x + fragment.image.Width(), y + fragment.image.Height() };
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    RECT area;
+    if (!IntersectRect(&area, &target, &clip) || !IntersectRect(&area, &area, &canvasRect)) return;
+
+    GdiFlush();
+    if (fragment.mask.Empty()) {
+        fragment.image.ReadRect(area.left - x, area.top - y, area.right - area.left, area.bottom - area.top,
+            bufferBits + area.top * bufferStride + area.left, bufferStride);
+        return;
+    }
 
-            // Проверяем, что клик внутри увеличенной области
-            if (x < zoomRect.left || x >= zoomRect.right || y < zoomRect.top || y >= zoomRect.bottom) {
-                break; // Игнорируем клики вне увеличенной области
-            }
-        }
+    // Фрагмент произвольной формы: копируются только отрезки его маски
+    for (int row = area.top; row < area.bottom; row++) {
+        fragment.mask.ForEachSpan(row - y, area.left, area.right, x, [&](int left, int right) {
+            fragment.image.ReadRect(left - x, row - y, right - left, 1, bufferBits + row * bufferStride + left, bufferStride);
+        });
+    }
+}
 
-        if (currentTool == 7) {
-            int handle = GetSelectionHandle(x, y);
+// Функции для выделения произвольной формы
 
-            if (handle >= 0 && handle <= 3) {
-                selection.mode = SELECTION_RESIZING;
-                selection.resizeHandle = handle;
-                selection.originalStartX = x;
-                selection.originalStartY = y;
-            }
-            else if (handle == 6) {
-                selection.mode = SELECTION_MOVING;
-                selection.originalStartX = x;
-                selection.originalStartY = y;
-                selection.originalStartX = selection.rect.left;
-                selection.originalStartY = selection.rect.top;
-                selection.originalEndX = selection.rect.right;
-                selection.originalEndY = selection.rect.bottom;
-            }
-            else {
-                StartSelection(x, y);
-            }
-        }
-        else {
-            if (selectedObjectIndex != -1) {
-                resizeMode = GetResizeHandle(drawings[selectedObjectIndex], x, y);
-                if (resizeMode != NONE) {
-                    isResizing = true;
-                    dragStartX = x;
-                    dragStartY = y;
+// Маска выделения, привязанная к прямоугольнику rect; dx, dy - её сдвиг
+const SpanMask* GetClipMask(uint32_t maskId, const RECT& rect, int& dx, int& dy)
+{
+    if (maskId == 0 || maskId > selectionMasks.size()) return NULL;
 
-                    originalStartX = drawings[selectedObjectIndex].startX;
-                    originalStartY = drawings[selectedObjectIndex].startY;
-                    originalEndX = drawings[selectedObjectIndex].endX;
-                    originalEndY = drawings[selectedObjectIndex].endY;
+    const SpanMask& mask = selectionMasks[maskId - 1];
+    dx = rect.left - mask.Bounds().left;
+    dy = rect.top - mask.Bounds().top;
+    return &mask;
+}
 
-                    break;
-                }
-            }
+// Волшебная палочка: связная область близкого цвета (допуск и связность - как у заливки)
+void MagicWandSelect(int x, int y)
+{
+    if (!canvas.bits || !IsPointInDrawingArea(x, y)) return;
 
-            isDrawing = true;
-            startX = x;
-            startY = y;
-            prevX = startX;
-            prevY = startY;
-            selectedObjectIndex = -1;
+    // Палочка, как и заливка, смотрит на видимый холст, а не на активный слой
+    RECT fullRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    CompositeLayers(fullRect);
 
-            if (currentTool == 6) {
-                FloodFillWithClipping(hBufferDC, x, y, currentColor);
-                AddDrawingObject(currentTool, x, y, x, y);
-                isDrawing = false;
-                RECT drawingRect;
-                GetClientRect(hWnd, &drawingRect);
-                drawingRect.left = SIDEBAR_WIDTH;
-                drawingRect.top = TOOLBAR_HEIGHT;
-                InvalidateRect(hWnd, &drawingRect, TRUE);
-                break;
-            }
+    FillOptions options = { fillTolerance, fillDistance, fillEightConnected };
+    MaskRect canvasRect = { 0, 0, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight) };
+    SpanMask mask = FloodFillMask(canvas.bits, bufferStride, canvasRect, x, y, options);
+    if (mask.Empty()) return;
 
-            if (currentTool == 1 || currentTool == 5) {
-                tempObject.type = currentTool;
-                tempObject.startX = startX;
-                tempObject.startY = startY;
-                tempObject.endX = startX;
-                tempObject.endY = startY;
-                tempObject.thickness = currentThickness;
-                tempObject.color = currentColor;
-                hasTempObject = true;
-            }
-        }
-    }
-    break;
+    AddDamage(GetSelectionAreaBounds());
+    floatingFragmentIndex = -1;
 
-    case WM_MOUSEMOVE:
-    {
-        int currentX = GET_X_LPARAM(lParam);
-        int currentY = GET_Y_LPARAM(lParam);
+    const MaskRect& bounds = mask.Bounds();
+    selection.rect = { bounds.left, bounds.top, bounds.right, bounds.bottom };
+    selectionMasks.push_back(std::move(mask));
+    selection.mask = static_cast<uint32_t>(selectionMasks.size());
+    selection.active = true;
+    selection.mode = SELECTION_NONE;
+    selection.resizeHandle = -1;
 
-        // Корректируем координаты для области рисования
-        if (currentY >= TOOLBAR_HEIGHT && currentX >= SIDEBAR_WIDTH) {
-            currentX -= SIDEBAR_WIDTH;
-            currentY -= TOOLBAR_HEIGHT;
+    AddDamage(GetSelectionAreaBounds());
+}
 
-            // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
-            if (zoomDrawingMode && zoomMode) {
-                ScreenToZoomCoords(currentX, currentY);
+// Очистка выделения произвольной формы: пиксели маски на слое становятся прозрачными
+void AddMaskClear()
+{
+    int dx = 0, dy = 0;
+    const SpanMask* mask = GetClipMask(selection.mask, selection.rect, dx, dy);
+    if (!mask) return;
+
+    fillMasks.push_back(*mask);
+    const SpanMask& cleared = fillMasks.back();
+
+    DrawingObject obj = {};
+    obj.type = OBJECT_CLEARED_MASK;
+    obj.startX = obj.endX = cleared.AnchorX() + dx;
+    obj.startY = obj.endY = cleared.AnchorY() + dy;
+    obj.color = BACKGROUND_COLOR;
+    obj.brushShape = BRUSH_CIRCLE;
+    obj.payload = static_cast<uint32_t>(fillMasks.size());
+    drawings.push_back(obj);
+
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    DrawFillMask(drawings.back(), canvasRect);
+    AddDamage(selection.rect);
+}
 
-                // Проверяем, что движение внутри увеличенной области
-                if (currentX < zoomRect.left || currentX >= zoomRect.right ||
-                    currentY < zoomRect.top || currentY >= zoomRect.bottom) {
-                    break; // Игнорируем движение вне увеличенной области
-                }
-            }
-        }
-        else {
-            break;
-        }
+// Контур выделения произвольной формы: края отрезков маски в пределах области отсечения
+void DrawSelectionMaskOutline(HDC hdc)
+{
+    int dx = 0, dy = 0;
+    const SpanMask* mask = GetClipMask(selection.mask, selection.rect, dx, dy);
+    if (!mask) return;
 
-        if (currentTool == 7 && selection.active) {
-            if (selection.mode != SELECTION_NONE && (wParam & MK_LBUTTON)) {
-                UpdateSelection(currentX, currentY);
-                RECT drawingRect;
-                GetClientRect(hWnd, &drawingRect);
-                drawingRect.left = SIDEBAR_WIDTH;
-                drawingRect.top = TOOLBAR_HEIGHT;
-                InvalidateRect(hWnd, &drawingRect, FALSE);
-            }
-        }
-        else if (isResizing && selectedObjectIndex != -1) {
-            if (resizeMode == MOVE) {
-                int deltaX = currentX - dragStartX;
-                int deltaY = currentY - dragStartY;
-                drawings[selectedObjectIndex].startX = originalStartX + deltaX;
-                drawings[selectedObjectIndex].startY = originalStartY + deltaY;
-                drawings[selectedObjectIndex].endX = originalEndX + deltaX;
-                drawings[selectedObjectIndex].endY = originalEndY + deltaY;
-            }
-            else {
-                UpdateObjectHandles(drawings[selectedObjectIndex], resizeMode, currentX, currentY);
-            }
+    RECT clipBox;
+    if (GetClipBox(hdc, &clipBox) == NULLREGION) return;
 
-            RedrawBuffer(hWnd);
+    HPEN hPen = CreatePen(PS_DOT, 1, RGB(0, 0, 255));
+    HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
 
-            RECT updateRect;
-            GetClientRect(hWnd, &updateRect);
-            updateRect.left = SIDEBAR_WIDTH;
-            updateRect.top = TOOLBAR_HEIGHT;
-            InvalidateRect(hWnd, &updateRect, FALSE);
-            UpdateWindow(hWnd);
-        }
-        else if (isDrawing && (wParam & MK_LBUTTON)) {
-            if (currentTool == 0 || currentTool == 3 || currentTool == 4) {
-                DrawToolWithClipping(hBufferDC, currentTool, currentThickness, currentColor,
-                    currentBrushShape, prevX, prevY, currentX, currentY);
+    const std::vector<SpanRun>& runs = mask->Runs();
+    for (size_t i = mask->FirstRunOfRow(clipBox.top - dy - 1); i < runs.size(); i++) {
+        const SpanRun& run = runs[i];
+        int y = run.y + dy;
+        if (y > clipBox.bottom) break;
+
+        int left = run.left + dx;
+        int right = run.right + dx;
+
+        // Левый и правый края отрезка
+        MoveToEx(hdc, left, y, NULL);
+        LineTo(hdc, left, y + 1);
+        MoveToEx(hdc, right - 1, y, NULL);
+        LineTo(hdc, right - 1, y + 1);
+
+        // Верхний и нижний края: части отрезка, не покрытые соседней строкой
+        mask->ForEachGap(run.y - 1, left, right, dx, [&](int gapLeft, int gapRight) {
+            MoveToEx(hdc, gapLeft, y, NULL);
+            LineTo(hdc, gapRight, y);
+        });
+        mask->ForEachGap(run.y + 1, left, right, dx, [&](int gapLeft, int gapRight) {
+            MoveToEx(hdc, gapLeft, y, NULL);
+            LineTo(hdc, gapRight, y);
+        });
+    }
 
-                AddDrawingObject(currentTool, prevX, prevY, currentX, currentY);
+    SelectObject(hdc, hOldPen);
+    DeleteObject(hPen);
+}
 
-                prevX = currentX;
-                prevY = currentY;
+// Функция для получения CLSID кодера
+int GetEncoderClsid(const WCHAR* format, CLSID* pClsid)
+{
+    UINT num = 0;
+    UINT size = 0;
 
-                RECT updateRect;
-                updateRect.left = min(prevX, currentX) - currentThickness - 5 + SIDEBAR_WIDTH;
-                updateRect.top = min(prevY, currentY) - currentThickness - 5 + TOOLBAR_HEIGHT;
-                updateRect.right = max(prevX, currentX) + currentThickness + 5 + SIDEBAR_WIDTH;
-                updateRect.bottom = max(prevY, currentY) + currentThickness + 5 + TOOLBAR_HEIGHT;
+    Gdiplus::Status status = Gdiplus::GetImageEncodersSize(&num, &size);
+    if (status != Gdiplus::Ok || size == 0) {
+        return -1;
+    }
 
-                InvalidateRect(hWnd, &updateRect, FALSE);
-                UpdateWindow(hWnd);
-            }
-            else if (currentTool == 1 || currentTool == 5) {
-                tempObject.endX = currentX;
-                tempObject.endY = currentY;
+    Gdiplus::ImageCodecInfo* pImageCodecInfo = (Gdiplus::ImageCodecInfo*)malloc(size);
+    if (pImageCodecInfo == NULL) {
+        return -1;
+    }
 
-                RECT updateRect;
-                updateRect.left = min(startX, currentX) - currentThickness - 5 + SIDEBAR_WIDTH;
-                updateRect.top = min(startY, currentY) - currentThickness - 5 + TOOLBAR_HEIGHT;
-                updateRect.right = max(startX, currentX) + currentThickness + 5 + SIDEBAR_WIDTH;
-                updateRect.bottom = max(startY, currentY) + currentThickness + 5 + TOOLBAR_HEIGHT;
+    status = Gdiplus::GetImageEncoders(num, size, pImageCodecInfo);
+    if (status != Gdiplus::Ok) {
+        free(pImageCodecInfo);
+        return -1;
+    }
 
-                InvalidateRect(hWnd, &updateRect, FALSE);
-                UpdateWindow(hWnd);
-            }
-        }
-        else if (!isDrawing && !isResizing) {
-            for (int i = static_cast<int>(drawings.size()) - 1; i >= 0; i--) {
-                if (GetResizeHandle(drawings[i], currentX, currentY) != NONE) {
-                    SetCursor(LoadCursor(NULL, IDC_SIZEALL));
-                    break;
-                }
-            }
+    int result = -1;
+    for (UINT j = 0; j < num; ++j) {
+        if (wcscmp(pImageCodecInfo[j].MimeType, format) == 0) {
+            *pClsid = pImageCodecInfo[j].Clsid;
+            result = (int)j;
+            break;
         }
     }
-    break;
 
-    case WM_LBUTTONUP:
-        if (currentTool == 7 && selection.active) {
-            EndSelection();
-        }
-        else if (isResizing) {
-            isResizing = false;
-            resizeMode = NONE;
-            RedrawBuffer(hWnd);
-            RECT drawingRect;
-            GetClientRect(hWnd, &drawingRect);
-            drawingRect.left = SIDEBAR_WIDTH;
-            drawingRect.top = TOOLBAR_HEIGHT;
-            InvalidateRect(hWnd, &drawingRect, TRUE);
-        }
-        else if (isDrawing) {
-            isDrawing = false;
-            int endX = GET_X_LPARAM(lParam) - SIDEBAR_WIDTH;
-            int endY = GET_Y_LPARAM(lParam) - TOOLBAR_HEIGHT;
+    free(pImageCodecInfo);
+    return result;
+}
+// Функции для работы со слоями
 
-            // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
-            if (zoomDrawingMode && zoomMode) {
-                ScreenToZoomCoords(endX, endY);
-            }
+// Создание 32-битной DIB-секции (память обнулена - растр прозрачный)
+bool CreateSurface(HDC hdc, size_t width, size_t height, Surface& surface)
+{
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = static_cast<LONG>(width);
+    bmi.bmiHeader.biHeight = -static_cast<LONG>(height);
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    void* bits = NULL;
+    HBITMAP bitmap = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!bitmap) return false;
+
+    surface.dc = CreateCompatibleDC(hdc);
+    surface.bitmap = bitmap;
+    surface.bits = static_cast<uint32_t*>(bits);
+    SelectObject(surface.dc, surface.bitmap);
+    return true;
+}
+
+void DestroySurface(Surface& surface)
+{
+    if (surface.dc) DeleteDC(surface.dc);
+    if (surface.bitmap) DeleteObject(surface.bitmap);
+    surface = {};
+}
+
+// Новый пустой видимый слой (растр создаётся отдельно)
+Layer CreateLayer()
+{
+    Layer layer;
+    layer.name = L"Слой " + std::to_wstring(++layerCounter);
+    layer.id = layerCounter;
+    layer.visible = true;
+    layer.opacity = 255;
+    layer.surface = {};
+    return layer;
+}
+
+// Объекты активного слоя возвращаются в его запись; до BindLayer активного слоя нет
+void UnbindLayer()
+{
+    if (activeLayer < layers.size()) {
+        std::swap(drawings, layers[activeLayer].objects);
+    }
+    activeLayer = layers.size();
+    hBufferDC = NULL;
+    bufferBits = NULL;
+}
+
+// Привязка активного слоя: его объекты переезжают в drawings, его растр становится буфером рисования
+void BindLayer(size_t index)
+{
+    UnbindLayer();
+    activeLayer = index;
+    std::swap(drawings, layers[activeLayer].objects);
+    UnpackLayer(activeLayer);
 
-            if (currentTool == 1 || currentTool == 5) {
-                AddDrawingObject(currentTool, startX, startY, endX, endY);
-                hasTempObject = false;
-                selectedObjectIndex = static_cast<int>(drawings.size()) - 1;
-            }
+    hBufferDC = layers[activeLayer].surface.dc;
+    bufferBits = layers[activeLayer].surface.bits;
+}
 
-            RedrawBuffer(hWnd);
-            RECT drawingRect;
-            GetClientRect(hWnd, &drawingRect);
-            drawingRect.left = SIDEBAR_WIDTH;
-            drawingRect.top = TOOLBAR_HEIGHT;
-            InvalidateRect(hWnd, &drawingRect, TRUE);
-        }
-        else {
-            int x = GET_X_LPARAM(lParam) - SIDEBAR_WIDTH;
-            int y = GET_Y_LPARAM(lParam) - TOOLBAR_HEIGHT;
+// Переигровка области растра любого слоя (временно делаем его активным)
+void RedrawLayerRect(size_t index, const RECT& rect)
+{
+    size_t active = activeLayer;
+    if (index == active) {
+        RedrawBufferRect(rect);
+        return;
+    }
 
-            // ПРЕОБРАЗУЕМ КООРДИНАТЫ ЕСЛИ РЕЖИМ РИСОВАНИЯ В УВЕЛИЧЕННОЙ ОБЛАСТИ АКТИВЕН
-            if (zoomDrawingMode && zoomMode) {
-                ScreenToZoomCoords(x, y);
-            }
+    BindLayer(index);
+    RedrawBufferRect(rect);
+    BindLayer(active);
+    PackLayer(index);
+}
 
-            selectedObjectIndex = -1;
+void RedrawAllLayersRect(const RECT& rect)
+{
+    for (size_t i = 0; i < layers.size(); i++) {
+        RedrawLayerRect(i, rect);
+    }
+}
 
-            for (int i = static_cast<int>(drawings.size()) - 1; i >= 0; i--) {
-                if (GetResizeHandle(drawings[i], x, y) != NONE) {
-                    selectedObjectIndex = i;
-                    break;
-                }
-            }
-            RECT drawingRect;
-            GetClientRect(hWnd, &drawingRect);
-            drawingRect.left = SIDEBAR_WIDTH;
-            drawingRect.top = TOOLBAR_HEIGHT;
-            InvalidateRect(hWnd, &drawingRect, TRUE);
-        }
-        break;
+// Сборка холста в пределах rect: белый фон и видимые слои снизу вверх.
+// Растры слоёв не переигрываются - стоимость зависит только от площади rect.
+void CompositeLayers(const RECT& rect)
+{
+    if (!canvas.bits) return;
 
-    case WM_PAINT:
-    {
-        PAINTSTRUCT ps;
-        HDC hdc = BeginPaint(hWnd, &ps);
+    RECT area;
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    if (!IntersectRect(&area, &rect, &canvasRect)) return;
 
-        // Рисуем верхнюю панель инструментов
-        if (toolbarNeedsRedraw || ps.rcPaint.top < TOOLBAR_HEIGHT) {
-            RECT toolbarRect;
-            GetClientRect(hWnd, &toolbarRect);
-            toolbarRect.bottom = TOOLBAR_HEIGHT;
-            FillRect(hdc, &toolbarRect, (HBRUSH)(COLOR_BTNFACE + 1));
+    GdiFlush();
+    uint32_t background = ColorToPixel(BACKGROUND_COLOR);
+    int width = area.right - area.left;
 
-            HPEN hPen = CreatePen(PS_SOLID, 1, GetSysColor(COLOR_3DSHADOW));
-            HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
-            MoveToEx(hdc, 0, TOOLBAR_HEIGHT - 1, NULL);
-            LineTo(hdc, toolbarRect.right, TOOLBAR_HEIGHT - 1);
-            SelectObject(hdc, hOldPen);
-            DeleteObject(hPen);
+    for (int y = area.top; y < area.bottom; y++) {
+        uint32_t* row = canvas.bits + y * bufferStride + area.left;
+        std::fill(row, row + width, background);
+
+        for (const auto& layer : layers) {
+            if (!layer.visible || layer.opacity <= 0) continue;
+            if (layer.surface.bits) {
+                BlendRowOver(row, layer.surface.bits + y * bufferStride + area.left, width, layer.opacity);
+            }
+            else if (!layer.indexed.Empty()) {
+                // Пиксели слоя с палитрой получаются только здесь - при выводе и экспорте
+                compositeRow.resize(width);
+                ExpandIndexedRow(layer.indexed, area.left, y, width, compositeRow.data());
+                BlendRowOver(row, compositeRow.data(), width, layer.opacity);
+            }
         }
+    }
+}
 
-        // Рисуем боковую панель инструментов
-        if (toolbarNeedsRedraw || ps.rcPaint.left < SIDEBAR_WIDTH) {
-            RECT sidebarRect;
-            GetClientRect(hWnd, &sidebarRect);
-            sidebarRect.right = SIDEBAR_WIDTH;
-            sidebarRect.top = TOOLBAR_HEIGHT;
-            FillRect(hdc, &sidebarRect, (HBRUSH)(COLOR_BTNFACE + 1));
+// Смена активного слоя: выбор объекта и перетаскиваемый фрагмент относятся к старому слою
+void SelectLayer(HWND hWnd, size_t index)
+{
+    if (index >= layers.size() || index == activeLayer) return;
+
+    SetSelectedObject(-1);
+    floatingFragmentIndex = -1;
+    size_t previous = activeLayer;
+    BindLayer(index);
+    PackLayer(previous);
+    UpdateLayerControls(hWnd);
+}
 
-            HPEN hPen = CreatePen(PS_SOLID, 1, GetSysColor(COLOR_3DSHADOW));
-            HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
-            MoveToEx(hdc, SIDEBAR_WIDTH - 1, TOOLBAR_HEIGHT, NULL);
-            LineTo(hdc, SIDEBAR_WIDTH - 1, sidebarRect.bottom);
-            SelectObject(hdc, hOldPen);
-            DeleteObject(hPen);
-        }
+// Новый слой над активным
+void AddLayer(HWND hWnd)
+{
+    Layer layer = CreateLayer();
+    HDC hdc = GetDC(hWnd);
+    bool created = CreateSurface(hdc, bufferCapacityWidth, bufferCapacityHeight, layer.surface);
+    ReleaseDC(hWnd, hdc);
+    if (!created) return;
+
+    SetSelectedObject(-1);
+    floatingFragmentIndex = -1;
+
+    // Индексы слоёв сдвигаются, поэтому объекты активного слоя сначала возвращаются на место
+    size_t index = activeLayer + 1;
+    size_t previous = activeLayer;
+    UnbindLayer();
+    layers.insert(layers.begin() + index, std::move(layer));
+    BindLayer(index);
+    PackLayer(previous);
+    UpdateLayerControls(hWnd);
+}
 
-        toolbarNeedsRedraw = false;
+// Удаление активного слоя вместе с его объектами (последний слой не удаляется)
+void DeleteActiveLayer(HWND hWnd)
+{
+    if (layers.size() <= 1) return;
 
-        if (hBufferDC) {
-            if (zoomMode) {
-                // РЕЖИМ ЛУПЫ: рисуем увеличенную область из буфера
-                HDC hZoomDC = CreateCompatibleDC(hdc);
-                HBITMAP hZoomBitmap = CreateCompatibleBitmap(hdc, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight));
-                SelectObject(hZoomDC, hZoomBitmap);
+    SetSelectedObject(-1);
+    floatingFragmentIndex = -1;
 
-                // Копируем содержимое основного буфера во временный буфер
-                BitBlt(hZoomDC, 0, 0, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                    hBufferDC, 0, 0, SRCCOPY);
+    size_t index = activeLayer;
+    drawings.clear();
+    UnbindLayer();
+    DestroySurface(layers[index].surface);
+    layers.erase(layers.begin() + index);
+    BindLayer(index > 0 ? index - 1 : 0);
 
-                // Масштабируем область увеличения на весь холст
-                int srcWidth = zoomRect.right - zoomRect.left;
-                int srcHeight = zoomRect.bottom - zoomRect.top;
+    // Растры остальных слоёв не меняются - холст только собирается заново
+    AddFullDamage();
+    UpdateLayerControls(hWnd);
+}
 
-                StretchBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                    hZoomDC, zoomRect.left, zoomRect.top, srcWidth, srcHeight, SRCCOPY);
+// Перемещение активного слоя выше (direction = 1) или ниже (-1) в стопке
+void MoveActiveLayer(HWND hWnd, int direction)
+{
+    size_t index = activeLayer;
+    if (direction > 0 && index + 1 >= layers.size()) return;
+    if (direction < 0 && index == 0) return;
 
-                // Рисуем красную рамку вокруг увеличенной области
-                HPEN hPen = CreatePen(PS_SOLID, 2, RGB(255, 0, 0));
-                HPEN hOldPen = (HPEN)SelectObject(hdc, hPen);
-                SelectObject(hdc, GetStockObject(NULL_BRUSH));
+    size_t other = direction > 0 ? index + 1 : index - 1;
+    UnbindLayer();
+    std::swap(layers[index], layers[other]);
+    BindLayer(other);
 
-                int frameLeft = SIDEBAR_WIDTH;
-                int frameTop = TOOLBAR_HEIGHT;
-                int frameRight = SIDEBAR_WIDTH + static_cast<int>(bufferWidth);
-                int frameBottom = TOOLBAR_HEIGHT + static_cast<int>(bufferHeight);
+    AddFullDamage();
+    UpdateLayerControls(hWnd);
+}
 
-                Rectangle(hdc, frameLeft, frameTop, frameRight, frameBottom);
-                SelectObject(hdc, hOldPen);
-                DeleteObject(hPen);
+// Список слоёв (верхний - первым) и свойства активного слоя на панели
+void UpdateLayerControls(HWND hWnd)
+{
+    HWND hCombo = GetDlgItem(hWnd, ID_LAYER_COMBO);
+    if (hCombo) {
+        SendMessageW(hCombo, CB_RESETCONTENT, 0, 0);
+        for (size_t i = layers.size(); i-- > 0;) {
+            std::wstring title = layers[i].name;
+            if (!layers[i].visible) title += L" (скрыт)";
+            SendMessageW(hCombo, CB_ADDSTRING, 0, (LPARAM)title.c_str());
+        }
+        SendMessageW(hCombo, CB_SETCURSEL, layers.size() - 1 - activeLayer, 0);
+    }
 
-                DeleteObject(hZoomBitmap);
-                DeleteDC(hZoomDC);
-            }
-            else {
-                // НОРМАЛЬНЫЙ РЕЖИМ: рисуем буфер как есть
-                BitBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                    hBufferDC, 0, 0, SRCCOPY);
-            }
+    HWND hVisible = GetDlgItem(hWnd, ID_LAYER_VISIBLE_CHECK);
+    if (hVisible) {
+        SendMessage(hVisible, BM_SETCHECK, layers[activeLayer].visible ? BST_CHECKED : BST_UNCHECKED, 0);
+    }
 
-            // Рисуем временный объект поверх с обрезкой
-            if (hasTempObject) {
-                HDC hTempDC = CreateCompatibleDC(hdc);
-                HBITMAP hTempBmp = CreateCompatibleBitmap(hdc, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight));
-                SelectObject(hTempDC, hTempBmp);
+    HWND hOpacity = GetDlgItem(hWnd, ID_LAYER_OPACITY_TRACKBAR);
+    if (hOpacity) {
+        SendMessage(hOpacity, TBM_SETPOS, TRUE, layers[activeLayer].opacity * 100 / 255);
+    }
+}
 
-                BitBlt(hTempDC, 0, 0, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                    hBufferDC, 0, 0, SRCCOPY);
+// Упаковка растра неактивного слоя в палитру (только в режиме палитры).
+// Если цветов больше 256, слой остаётся 32-битным.
+void PackLayer(size_t index)
+{
+    if (!indexedCanvas || index >= layers.size() || index == activeLayer) return;
 
-                if (selection.active) {
-                    ApplyClipping(hTempDC);
-                }
-                DrawObject(hTempDC, tempObject);
-                if (selection.active) {
-                    RemoveClipping(hTempDC);
-                }
+    Layer& layer = layers[index];
+    if (!layer.surface.bits) return;
 
-                if (zoomMode) {
-                    int srcWidth = zoomRect.right - zoomRect.left;
-                    int srcHeight = zoomRect.bottom - zoomRect.top;
-                    StretchBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                        hTempDC, zoomRect.left, zoomRect.top, srcWidth, srcHeight, SRCCOPY);
-                }
-                else {
-                    BitBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                        hTempDC, 0, 0, SRCCOPY);
-                }
+    GdiFlush();
+    if (PackIndexed(layer.surface.bits, bufferStride,
+        static_cast<int>(bufferCapacityWidth), static_cast<int>(bufferCapacityHeight), layer.indexed)) {
+        DestroySurface(layer.surface);
+    }
+}
 
-                DeleteObject(hTempBmp);
-                DeleteDC(hTempDC);
-            }
+// Перевод слоя с палитрой обратно в DIB-секцию (перед рисованием в него)
+void UnpackLayer(size_t index)
+{
+    Layer& layer = layers[index];
+    if (layer.indexed.Empty()) return;
+    if (!CreateSurface(NULL, bufferCapacityWidth, bufferCapacityHeight, layer.surface)) return;
+
+    UnpackIndexed(layer.indexed, layer.surface.bits, bufferStride);
+    layer.indexed.Clear();
+}
 
-            // Рисуем выделение выбранного объекта
-            if (selectedObjectIndex != -1 && selectedObjectIndex < static_cast<int>(drawings.size())) {
-                HDC hTempDC = CreateCompatibleDC(hdc);
-                HBITMAP hTempBmp = CreateCompatibleBitmap(hdc, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight));
-                SelectObject(hTempDC, hTempBmp);
+void PackInactiveLayers()
+{
+    for (size_t i = 0; i < layers.size(); i++) {
+        PackLayer(i);
+    }
+}
 
-                BitBlt(hTempDC, 0, 0, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                    hBufferDC, 0, 0, SRCCOPY);
+// Включение и выключение режима палитры: растры переигрываются заново (со сглаживанием
+// или без), после чего неактивные слои упаковываются
+void SetIndexedCanvas(HWND hWnd, bool enabled)
+{
+    if (enabled == indexedCanvas) return;
 
-                DrawSelection(hTempDC, drawings[selectedObjectIndex]);
+    indexedCanvas = enabled;
+    for (size_t i = 0; i < layers.size(); i++) {
+        UnpackLayer(i);
+    }
 
-                if (zoomMode) {
-                    int srcWidth = zoomRect.right - zoomRect.left;
-                    int srcHeight = zoomRect.bottom - zoomRect.top;
-                    StretchBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                        hTempDC, zoomRect.left, zoomRect.top, srcWidth, srcHeight, SRCCOPY);
-                }
-                else {
-                    BitBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                        hTempDC, 0, 0, SRCCOPY);
-                }
+    RedrawBuffer(hWnd);
+    PackInactiveLayers();
+    AddFullDamage();
+    PresentDamage(hWnd);
+}
 
-                DeleteObject(hTempBmp);
-                DeleteDC(hTempDC);
-            }
+// Шрифт надписей заданного размера (создаётся при первом обращении)
+size_t GetTextFont(int size)
+{
+    for (size_t i = 0; i < textFonts.size(); i++) {
+        if (textFonts[i].size == size) return i;
+    }
 
-            // Рисуем область выделения
-            if (selection.active) {
-                HDC hTempDC = CreateCompatibleDC(hdc);
-                HBITMAP hTempBmp = CreateCompatibleBitmap(hdc, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight));
-                SelectObject(hTempDC, hTempBmp);
+    if (!hGlyphDC) hGlyphDC = CreateCompatibleDC(NULL);
 
-                BitBlt(hTempDC, 0, 0, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                    hBufferDC, 0, 0, SRCCOPY);
+    TextFont font;
+    font.size = size;
+    font.font = CreateFontW(-size, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, DEFAULT_CHARSET,
+        OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS, ANTIALIASED_QUALITY, DEFAULT_PITCH | FF_SWISS, TEXT_FONT_FACE);
 
-                DrawSelectionArea(hTempDC);
+    TEXTMETRICW metrics = {};
+    SelectObject(hGlyphDC, font.font);
+    GetTextMetricsW(hGlyphDC, &metrics);
+    font.ascent = metrics.tmAscent;
+    font.lineHeight = metrics.tmHeight + metrics.tmExternalLeading;
 
-                if (zoomMode) {
-                    int srcWidth = zoomRect.right - zoomRect.left;
-                    int srcHeight = zoomRect.bottom - zoomRect.top;
-                    StretchBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                        hTempDC, zoomRect.left, zoomRect.top, srcWidth, srcHeight, SRCCOPY);
-                }
-                else {
-                    BitBlt(hdc, SIDEBAR_WIDTH, TOOLBAR_HEIGHT, static_cast<int>(bufferWidth), static_cast<int>(bufferHeight),
-                        hTempDC, 0, 0, SRCCOPY);
-                }
+    textFonts.push_back(font);
+    return textFonts.size() - 1;
+}
 
-                DeleteObject(hTempBmp);
-                DeleteDC(hTempDC);
-            }
+// Покрытие глифа из контура шрифта (вызывается только при промахе атласа)
+void RasterizeGlyph(const TextFont& font, wchar_t ch, GlyphBitmap& bitmap)
+{
+    static const MAT2 identity = { { 0, 1 }, { 0, 0 }, { 0, 0 }, { 0, 1 } };
+
+    GLYPHMETRICS metrics = {};
+    SelectObject(hGlyphDC, font.font);
+    DWORD size = GetGlyphOutlineW(hGlyphDC, ch, GGO_GRAY8_BITMAP, &metrics, 0, NULL, &identity);
+    if (size == GDI_ERROR) return;
+
+    bitmap.bearingX = metrics.gmptGlyphOrigin.x;
+    bitmap.bearingY = metrics.gmptGlyphOrigin.y;
+    bitmap.advance = metrics.gmCellIncX;
+    if (size == 0) return;  // пробел - только сдвиг пера
+
+    std::vector<BYTE> raw(size);
+    if (GetGlyphOutlineW(hGlyphDC, ch, GGO_GRAY8_BITMAP, &metrics, size, raw.data(), &identity) == GDI_ERROR) return;
+
+    // Строки выровнены на 4 байта, покрытие - от 0 до 64
+    int rowBytes = (metrics.gmBlackBoxX + 3) & ~3;
+    bitmap.width = metrics.gmBlackBoxX;
+    bitmap.height = metrics.gmBlackBoxY;
+    bitmap.coverage.resize(static_cast<size_t>(bitmap.width) * bitmap.height);
+    for (int y = 0; y < bitmap.height; y++) {
+        for (int x = 0; x < bitmap.width; x++) {
+            bitmap.coverage[y * bitmap.width + x] = static_cast<uint8_t>((raw[y * rowBytes + x] * 255 + 32) / 64);
         }
-        else {
-            RECT rect;
-            GetClientRect(hWnd, &rect);
-            rect.left = SIDEBAR_WIDTH;
-            rect.top = TOOLBAR_HEIGHT;
-            FillRect(hdc, &rect, (HBRUSH)GetStockObject(WHITE_BRUSH));
+    }
+}
+
+// Размер надписи: ширина самой длинной строки и высота всех строк
+SIZE MeasureText(const std::wstring& text, size_t fontIndex)
+{
+    SIZE size = { 0, textFonts[fontIndex].lineHeight };
+    int penX = 0;
+    for (wchar_t ch : text) {
+        if (ch == L'\n') {
+            penX = 0;
+            size.cy += textFonts[fontIndex].lineHeight;
+            continue;
         }
 
-        EndPaint(hWnd, &ps);
+        GlyphInfo glyph;
+        glyphAtlas.Find(static_cast<uint32_t>(fontIndex), ch, [&](GlyphBitmap& bitmap) {
+            RasterizeGlyph(textFonts[fontIndex], ch, bitmap);
+        }, glyph);
+        size.cx = max(size.cx, static_cast<LONG>(max(penX + glyph.advance, penX + glyph.bearingX + glyph.width)));
+        penX += glyph.advance;
     }
-    break;
+    return size;
+}
 
-    case WM_CREATE:
-        CreateToolbar(hWnd);
-        ResizeBuffer(hWnd);
-        break;
+// Вывод надписи в буфер активного слоя в пределах clip
+void DrawTextObject(const DrawingRef& obj, const RECT& clip)
+{
+    uint32_t id = obj.payload();
+    if (!bufferBits || id == 0 || id > textStrings.size()) return;
 
-    case WM_DESTROY:
-        PostQuitMessage(0);
-        break;
+    size_t fontIndex = GetTextFont(TextPixelSize(obj.thickness()));
+    uint32_t color = ColorToPixel(obj.color());
+    MaskRect area = { clip.left, clip.top, clip.right, clip.bottom };
 
-    default:
-        return DefWindowProc(hWnd, message, wParam, lParam);
-    }
-    return 0;
+    size_t hits = glyphAtlas.Hits(), misses = glyphAtlas.Misses(), evictions = glyphAtlas.Evictions();
+
+    GdiFlush();
+    LayoutText(textStrings[id - 1], fontIndex, obj.startX(), obj.startY(), [&](const GlyphInfo& glyph, int left, int top) {
+        BlendGlyph(bufferBits, bufferStride, area, left, top, glyph, color, indexedCanvas);
+    });
+
+    // Работа атласа на одну надпись: пик промахов - надпись, на которой атлас пробуксовывает
+    memoryStats.Count("glyph_hits", glyphAtlas.Hits() - hits);
+    memoryStats.Count("glyph_misses", glyphAtlas.Misses() - misses);
+    memoryStats.Count("glyph_evictions", glyphAtlas.Evictions() - evictions);
 }
 
-// Функция рисования объекта
-void DrawObject(HDC hdc, const DrawingObject& obj)
+// Покрытие надписи для документа: глифы, выложенные от начала объекта, собираются
+// в один байтовый растр по габариту самих глифов (наложение - как у BlendGlyph)
+void RasterizeTextCoverage(const DrawingRef& obj, DocText& text)
+{
+    const std::wstring& string = textStrings[obj.payload() - 1];
+    size_t fontIndex = GetTextFont(TextPixelSize(obj.thickness()));
+
+    // Первый проход - габарит; покрытие глифа из атласа действительно только внутри visit,
+    // поэтому смешивание - вторым проходом
+    RECT bounds = { 0, 0, 0, 0 };
+    bool empty = true;
+    LayoutText(string, fontIndex, 0, 0, [&](const GlyphInfo& glyph, int left, int top) {
+        if (!glyph.coverage || glyph.width <= 0 || glyph.height <= 0) return;
+        RECT rect = { left, top, left + glyph.width, top + glyph.height };
+        if (empty) bounds = rect;
+        else UnionRect(&bounds, &bounds, &rect);
+        empty = false;
+    });
+    if (empty) return;
+
+    text.left = bounds.left;
+    text.top = bounds.top;
+    text.width = bounds.right - bounds.left;
+    text.height = bounds.bottom - bounds.top;
+    text.coverage.assign(static_cast<size_t>(text.width) * text.height, 0);
+
+    LayoutText(string, fontIndex, 0, 0, [&](const GlyphInfo& glyph, int left, int top) {
+        if (!glyph.coverage) return;
+        for (int y = 0; y < glyph.height; y++) {
+            const uint8_t* source = glyph.coverage + static_cast<size_t>(y) * glyph.stride;
+            uint8_t* target = &text.coverage[static_cast<size_t>(top - text.top + y) * text.width + (left - text.left)];
+            for (int x = 0; x < glyph.width; x++) {
+                target[x] = static_cast<uint8_t>(target[x] + Div255(source[x] * (255u - target[x])));
+            }
+        }
+    });
+}
+
+// Область набираемой надписи вместе с рамкой
+RECT GetTypingBounds()
 {
-    Graphics graphics(hdc);
-    graphics.SetSmoothingMode(SmoothingModeAntiAlias);
+    SIZE size = MeasureText(typedText, GetTextFont(TextPixelSize(currentThickness)));
+    RECT rect = { typingX - 2, typingY - 2, typingX + size.cx + 3, typingY + size.cy + 3 };
+    return rect;
+}
 
-    COLORREF drawColor = (obj.type == 4) ? BACKGROUND_COLOR : obj.color;
-    Color penColor(GetRValue(drawColor), GetGValue(drawColor), GetBValue(drawColor));
-    Pen pen(penColor, (REAL)obj.thickness);
+void StartTyping(int x, int y)
+{
+    isTyping = true;
+    typingX = x;
+    typingY = y;
+    typedText.clear();
+    AddDamage(GetTypingBounds());
+}
 
-    if (obj.type == 0 || obj.type == 4) {
-        pen.SetLineCap(LineCapRound, LineCapRound, DashCapRound);
-        pen.SetLineJoin(LineJoinRound);
+// Символ набора: Backspace стирает последний, управляющие символы пропускаются
+void TypeCharacter(wchar_t ch)
+{
+    AddDamage(GetTypingBounds());
+    if (ch == L'\b') {
+        if (!typedText.empty()) typedText.pop_back();
+    }
+    else if (ch == L'\n' || ch >= L' ') {
+        typedText.push_back(ch);
     }
+    AddDamage(GetTypingBounds());
+}
 
-    int left = min(obj.startX, obj.endX);
-    int top = min(obj.startY, obj.endY);
-    int right = max(obj.startX, obj.endX);
-    int bottom = max(obj.startY, obj.endY);
-    int width = right - left;
-    int height = bottom - top;
+// Набранная надпись становится объектом истории и выводится в буфер
+void CommitTypedText()
+{
+    if (!isTyping) return;
+
+    AddDamage(GetTypingBounds());
+    isTyping = false;
+    if (typedText.empty()) return;
+
+    SIZE size = MeasureText(typedText, GetTextFont(TextPixelSize(currentThickness)));
+    textStrings.push_back(typedText);
+    AddDrawingObject(OBJECT_TEXT, typingX, typingY, typingX + size.cx, typingY + size.cy,
+        static_cast<uint32_t>(textStrings.size()));
+    typedText.clear();
+
+    DrawingRef obj = drawings.back();
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    DrawObjectToBuffer(obj, canvasRect);
+    AddDamage(GetObjectBounds(obj));
+}
 
-    switch (obj.type) {
-    case 0:
-    case 4:
-        graphics.DrawLine(&pen, obj.startX, obj.startY, obj.endX, obj.endY);
-        break;
+void CancelTyping()
+{
+    if (!isTyping) return;
 
-    case 1:
-        graphics.DrawRectangle(&pen, left, top, width, height);
+    AddDamage(GetTypingBounds());
+    isTyping = false;
+    typedText.clear();
+}
+
+// Вершины многоугольника в 16.16, отображённые из рамки построения в рамку объекта
+void MapPolygonPoints(const FillPolygon& polygon, int sx, int sy, int ex, int ey, std::vector<ScanPoint>& points)
+{
+    const RECT& bounds = polygon.bounds;
+    double scaleX = bounds.right > bounds.left ? static_cast<double>(ex - sx) / (bounds.right - bounds.left) : 0.0;
+    double scaleY = bounds.bottom > bounds.top ? static_cast<double>(ey - sy) / (bounds.bottom - bounds.top) : 0.0;
+
+    points.resize(polygon.points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        double x = sx + (polygon.points[i].x - bounds.left) * scaleX;
+        double y = sy + (polygon.points[i].y - bounds.top) * scaleY;
+        points[i].x = static_cast<int32_t>(floor(x * SCAN_ONE + 0.5));
+        points[i].y = static_cast<int32_t>(floor(y * SCAN_ONE + 0.5));
+    }
+}
+
+// Вывод закрашенной фигуры в буфер активного слоя отрезками строк в пределах clip
+void DrawFilledShape(const DrawingRef& obj, const RECT& clip)
+{
+    if (!bufferBits) return;
+
+    MaskRect area = { clip.left, clip.top, clip.right, clip.bottom };
+    uint32_t color = ColorToPixel(obj.color());
+    auto fill = [&](int y, int left, int right) {
+        FillSpan(bufferBits + static_cast<size_t>(y) * bufferStride, left, right, color);
+    };
+
+    int left = min(obj.startX(), obj.endX());
+    int top = min(obj.startY(), obj.endY());
+    int right = max(obj.startX(), obj.endX());
+    int bottom = max(obj.startY(), obj.endY());
+
+    GdiFlush();
+    switch (obj.type()) {
+    case OBJECT_FILLED_RECT:
+        ScanRectangle(left, top, right, bottom, area, fill);
         break;
 
-    case 3:
-        DrawBrush(hdc, obj.startX, obj.startY, obj.endX, obj.endY, obj.thickness, obj.color, obj.brushShape);
+    case OBJECT_FILLED_ELLIPSE:
+        ScanEllipse(left, top, right, bottom, area, fill);
         break;
 
-    case 5:
+    case OBJECT_POLYGON:
     {
-        int size = min(width, height);
-        graphics.DrawEllipse(&pen, left, top, size, size);
+        uint32_t id = obj.payload();
+        if (id == 0 || id > fillPolygons.size()) break;
+
+        std::vector<ScanPoint> points;
+        MapPolygonPoints(fillPolygons[id - 1], obj.startX(), obj.startY(), obj.endX(), obj.endY(), points);
+        ScanPolygon(points.data(), points.size(), fillPolygons[id - 1].rule, area, fill);
     }
     break;
+    }
+}
 
-    case 6:
-        break;
+// Область строящегося многоугольника вместе со стороной к курсору
+RECT GetPolygonPreviewBounds()
+{
+    RECT rect = { polygonCursor.x, polygonCursor.y, polygonCursor.x, polygonCursor.y };
+    for (const POINT& point : polygonPoints) {
+        rect.left = min(rect.left, point.x);
+        rect.top = min(rect.top, point.y);
+        rect.right = max(rect.right, point.x);
+        rect.bottom = max(rect.bottom, point.y);
     }
+    return GetSegmentBounds(rect.left, rect.top, rect.right, rect.bottom, 2);
 }
 
-// Функция добавления объекта в историю
-void AddDrawingObject(int type, int sx, int sy, int ex, int ey)
+void AddPolygonPoint(int x, int y)
 {
-    DrawingObject newObj;
-    newObj.type = type;
-    newObj.startX = sx;
-    newObj.startY = sy;
-    newObj.endX = ex;
-    newObj.endY = ey;
-    newObj.thickness = currentThickness;
-    newObj.color = (type == 4) ? BACKGROUND_COLOR : currentColor;
-    newObj.isSelected = false;
-    newObj.brushShape = currentBrushShape;
+    if (!polygonPoints.empty()) AddDamage(GetPolygonPreviewBounds());
+    polygonPoints.push_back({ x, y });
+    polygonCursor = { x, y };
+    AddDamage(GetPolygonPreviewBounds());
+}
 
-    newObj.wasDrawnWithSelection = selection.active;
-    if (selection.active) {
-        newObj.selectionRect = selection.rect;
+// Построенный многоугольник становится объектом истории; меньше трёх вершин - отмена
+void CommitPolygon()
+{
+    if (polygonPoints.size() < 3) {
+        CancelPolygon();
+        return;
     }
-    else {
-        newObj.selectionRect = { 0, 0, 0, 0 };
+
+    AddDamage(GetPolygonPreviewBounds());
+
+    FillPolygon polygon;
+    polygon.points.swap(polygonPoints);
+    polygon.rule = currentFillRule;
+    polygon.bounds = { polygon.points[0].x, polygon.points[0].y, polygon.points[0].x, polygon.points[0].y };
+    for (const POINT& point : polygon.points) {
+        polygon.bounds.left = min(polygon.bounds.left, point.x);
+        polygon.bounds.top = min(polygon.bounds.top, point.y);
+        polygon.bounds.right = max(polygon.bounds.right, point.x);
+        polygon.bounds.bottom = max(polygon.bounds.bottom, point.y);
     }
 
-    drawings.push_back(newObj);
+    RECT bounds = polygon.bounds;
+    fillPolygons.push_back(std::move(polygon));
+    AddDrawingObject(OBJECT_POLYGON, bounds.left, bounds.top, bounds.right, bounds.bottom,
+        static_cast<uint32_t>(fillPolygons.size()));
+    SetSelectedObject(static_cast<int>(drawings.size()) - 1);
+
+    DrawingRef obj = drawings.back();
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    DrawObjectToBuffer(obj, canvasRect);
+    AddDamage(GetObjectBounds(obj));
 }
 
-// Функция для получения CLSID кодера
-int GetEncoderClsid(const WCHAR* format, CLSID* pClsid)
+void CancelPolygon()
 {
-    UINT num = 0;
-    UINT size = 0;
+    if (polygonPoints.empty()) return;
 
-    Gdiplus::Status status = Gdiplus::GetImageEncodersSize(&num, &size);
-    if (status != Gdiplus::Ok || size == 0) {
-        return -1;
-    }
+    AddDamage(GetPolygonPreviewBounds());
+    polygonPoints.clear();
+}
 
-    Gdiplus::ImageCodecInfo* pImageCodecInfo = (Gdiplus::ImageCodecInfo*)malloc(size);
-    if (pImageCodecInfo == NULL) {
-        return -1;
-    }
+// Область заливки под точкой (x, y) по видимому холсту с учётом выделения, без закраски
+void FindFillRegion(int x, int y, SpanMask& region)
+{
+    region.Clear();
+    if (!canvas.bits || !IsPointInDrawingArea(x, y)) return;
 
-    status = Gdiplus::GetImageEncoders(num, size, pImageCodecInfo);
-    if (status != Gdiplus::Ok) {
-        free(pImageCodecInfo);
-        return -1;
+    RECT clip = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    const SpanMask* mask = NULL;
+    int dx = 0, dy = 0;
+    if (selection.active) {
+        RECT selectionRect = GetNormalizedSelectionRect();
+        IntersectRect(&clip, &clip, &selectionRect);
+        mask = GetClipMask(selection.mask, selection.rect, dx, dy);
     }
 
-    int result = -1;
-    for (UINT j = 0; j < num; ++j) {
-        if (wcscmp(pImageCodecInfo[j].MimeType, format) == 0) {
-            *pClsid = pImageCodecInfo[j].Clsid;
-            result = (int)j;
-            break;
+    CompositeLayers(clip);
+    FillOptions options = { fillTolerance, fillDistance, fillEightConnected };
+    MaskRect fillClip = { clip.left, clip.top, clip.right, clip.bottom };
+    region = FloodFillMask(canvas.bits, bufferStride, fillClip, x, y, options, mask, dx, dy);
+}
+
+// Вывод градиента в буфер активного слоя: отрезки маски области или рамка выделения
+void DrawGradientFill(const DrawingRef& obj, const RECT& clip)
+{
+    uint32_t id = obj.payload();
+    if (!bufferBits || id == 0 || id > gradientFills.size()) return;
+
+    const GradientFillInfo& info = gradientFills[id - 1];
+    Gradient gradient;
+    gradient.kind = info.kind;
+    gradient.x0 = static_cast<float>(obj.startX());
+    gradient.y0 = static_cast<float>(obj.startY());
+    gradient.x1 = static_cast<float>(obj.endX());
+    gradient.y1 = static_cast<float>(obj.endY());
+    gradient.from = ColorToPixel(obj.color()) & 0x00FFFFFF;
+    gradient.to = ColorToPixel(info.endColor) & 0x00FFFFFF;
+
+    MaskRect area = { clip.left, clip.top, clip.right, clip.bottom };
+    auto fill = [&](int y, int left, int right) {
+        GradientSpan(gradient, y, left, right, bufferBits + static_cast<size_t>(y) * bufferStride);
+    };
+
+    GdiFlush();
+    if (info.mask != 0 && info.mask <= fillMasks.size()) {
+        const SpanMask& mask = fillMasks[info.mask - 1];
+        int dx = obj.startX() - mask.AnchorX();
+        int dy = obj.startY() - mask.AnchorY();
+        const std::vector<SpanRun>& runs = mask.Runs();
+        for (size_t i = mask.FirstRunOfRow(area.top - dy); i < runs.size(); i++) {
+            int y = runs[i].y + dy;
+            if (y >= area.bottom) break;
+            fill(y, max(runs[i].left + dx, area.left), min(runs[i].right + dx, area.right));
         }
     }
+    else {
+        RECT frame = obj.selectionRect();
+        ScanRectangle(min(frame.left, frame.right), min(frame.top, frame.bottom),
+            max(frame.left, frame.right), max(frame.top, frame.bottom), area, fill);
+    }
+}
 
-    free(pImageCodecInfo);
-    return result;
-}
\ No newline at end of file
+// Градиент от (sx, sy) к (ex, ey): по выделению или по области заливки под началом
+void AddGradientFill(int sx, int sy, int ex, int ey)
+{
+    GradientFillInfo info;
+    info.endColor = gradientEndColor;
+    info.kind = currentGradientKind;
+    info.mask = 0;
+
+    if (!selection.active) {
+        SpanMask region;
+        FindFillRegion(sx, sy, region);
+        if (region.Empty()) return;
+        fillMasks.push_back(std::move(region));
+        info.mask = static_cast<uint32_t>(fillMasks.size());
+    }
+
+    gradientFills.push_back(info);
+    AddDrawingObject(OBJECT_GRADIENT, sx, sy, ex, ey, static_cast<uint32_t>(gradientFills.size()));
+
+    DrawingRef obj = drawings.back();
+    RECT canvasRect = { 0, 0, static_cast<LONG>(bufferWidth), static_cast<LONG>(bufferHeight) };
+    DrawObjectToBuffer(obj, canvasRect);
+    AddDamage(GetObjectBounds(obj));
+}
@@ -0,0 +1,613 @@
+﻿// SoftRaster.h: программная растеризация документа SimplePaint без GDI
+//
+// Нужна там, где нет окна и GDI+ (консольный рендерер на Linux-сервере). Документ
+// рисуется в любом масштабе: каждая выборка переводится в координаты холста и
+// проверяется на попадание в фигуру, поэтому толщины и размеры масштабируются сами.
+// Сглаживание - суперсэмплинг supersample x supersample выборок на пиксель.
+// Размеры результата и буферов выборок считаются в int64: при большом масштабе сторона
+// не помещается в int, а буфер плитки выборок ограничен RENDER_MAX_TILE_SAMPLES по стороне.
+// Изображение делится на плитки, плитки разбирают рабочие потоки; у каждого потока
+// свои буферы, общие данные (документ) только читаются.
+// Геометрия повторяет редактор: перо GDI+ центрировано на контуре, у линий
+// круглые концы, кисть - залитые фигуры DrawBrush, ластик делает пиксели слоя прозрачными.
+// Шрифтов у рендерера нет: надпись рисуется по покрытию, которое редактор сохранил
+// в документе, и в отличие от остальных фигур смешивается с выборкой под ней.
+// Многоугольник раскладывается на отрезки строк тем же ScanPolygon, что и в редакторе,
+// и дальше проверяется как маска заливки: пиксели холста совпадают с редактором.
+// Градиент заполняет свою маску заливки или рамку выделения, цвет выборки считает
+// GradientPixel - тот же расчёт, которым GradientSpan заполняет отрезки в редакторе.
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+#include "PaintDocument.h"
+#include "LayerBlend.h"
+#include "ScanlineFill.h"
+#include "GradientFill.h"
+
+const int RENDER_MAX_SUPERSAMPLE = 16;      // 256 выборок на пиксель
+const int RENDER_MAX_TILE = 4096;           // сторона плитки результата
+const int RENDER_MAX_TILE_SAMPLES = 4096;   // сторона плитки выборок (64 МБ на поток)
+
+struct RenderOptions {
+    double scale = 1.0;       // пикселей результата на пиксель холста
+    int supersample = 1;      // выборок на пиксель по каждой оси
+    int tileSize = 256;       // сторона плитки результата
+    int threads = 0;          // 0 - по числу ядер
+};
+
+struct RenderedImage {
+    int width = 0, height = 0;
+    std::vector<uint32_t> pixels;   // 0xFFRRGGBB, строки сверху вниз
+};
+
+struct RenderStats {
+    int64_t tiles = 0;
+    int threads = 0;
+    size_t objectTests = 0;         // пар "плитка - объект", прошедших отсечение по габаритам
+};
+
+// Размер результата при масштабе scale; false, если сторона не помещается в int
+inline bool RenderedSize(const PaintDocument& doc, double scale, int64_t& width, int64_t& height)
+{
+    double w = std::ceil(doc.width * scale), h = std::ceil(doc.height * scale);
+    if (!(w >= 0 && h >= 0 && w <= INT32_MAX && h <= INT32_MAX)) return false;
+    width = static_cast<int64_t>(w);
+    height = static_cast<int64_t>(h);
+    return true;
+}
+
+// Непрозрачный пиксель слоя из COLORREF (0x00BBGGRR)
+inline uint32_t DocColorToPixel(uint32_t color)
+{
+    return 0xFF000000 | ((color & 0xFF) << 16) | (color & 0xFF00) | ((color >> 16) & 0xFF);
+}
+
+// Фигура объекта, подготовленная для проверки выборок (координаты холста)
+struct RasterShape {
+    const DocObject* obj;
+    double left, top, right, bottom;    // габарит на холсте
+    double ax, ay, bx, by;              // отрезок линии
+    double radius;                      // половина толщины пера
+    double cx, cy, r;                   // окружность
+    const SpanMask* mask;               // маска заливки или многоугольника
+    int maskDx, maskDy;
+    std::shared_ptr<SpanMask> polygonMask;
+    const DocGradient* gradientFill;
+    Gradient gradient;
+    const DocFragment* fragment;
+    const DocText* text;
+    bool blend;                         // выборка смешивается с прежней (сглаженный край надписи)
+    const SpanMask* clipMask;
+    int clipDx, clipDy;
+    MaskRect clip;
+};
+
+// Отрезки многоугольника на пикселях холста: вершины отображаются из рамки построения
+// в рамку объекта в фиксированной точке, как в редакторе (MapPolygonPoints)
+inline std::shared_ptr<SpanMask> ScanDocPolygon(const DocPolygon& polygon, const DocObject& obj)
+{
+    const MaskRect& bounds = polygon.bounds;
+    double scaleX = bounds.right > bounds.left ? static_cast<double>(obj.endX - obj.startX) / (bounds.right - bounds.left) : 0.0;
+    double scaleY = bounds.bottom > bounds.top ? static_cast<double>(obj.endY - obj.startY) / (bounds.bottom - bounds.top) : 0.0;
+
+    std::vector<ScanPoint> points(polygon.points.size());
+    MaskRect area = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < points.size(); i++) {
+        double x = obj.startX + (polygon.points[i].x - bounds.left) * scaleX;
+        double y = obj.startY + (polygon.points[i].y - bounds.top) * scaleY;
+        points[i].x = static_cast<int32_t>(std::floor(x * SCAN_ONE + 0.5));
+        points[i].y = static_cast<int32_t>(std::floor(y * SCAN_ONE + 0.5));
+
+        // Область обхода - габарит вершин с запасом в пиксель
+        int px = static_cast<int>(std::floor(x)), py = static_cast<int>(std::floor(y));
+        if (i == 0 || px < area.left) area.left = px;
+        if (i == 0 || py < area.top) area.top = py;
+        if (i == 0 || px + 2 > area.right) area.right = px + 2;
+        if (i == 0 || py + 2 > area.bottom) area.bottom = py + 2;
+    }
+
+    auto mask = std::make_shared<SpanMask>();
+    ScanPolygon(points.data(), points.size(), polygon.rule == FILL_NON_ZERO ? FILL_NON_ZERO : FILL_EVEN_ODD, area,
+        [&](int y, int left, int right) { mask->AddRun(y, left, right); });
+    mask->Normalize();
+    return mask;
+}
+
+inline RasterShape PrepareShape(const PaintDocument& doc, const DocObject& obj)
+{
+    RasterShape shape = {};
+    shape.obj = &obj;
+
+    double left = obj.startX < obj.endX ? obj.startX : obj.endX;
+    double top = obj.startY < obj.endY ? obj.startY : obj.endY;
+    double right = obj.startX < obj.endX ? obj.endX : obj.startX;
+    double bottom = obj.startY < obj.endY ? obj.endY : obj.startY;
+    double half = (obj.thickness > 1 ? obj.thickness : 1) / 2.0;
+
+    shape.ax = obj.startX;
+    shape.ay = obj.startY;
+    shape.bx = obj.endX;
+    shape.by = obj.endY;
+    shape.radius = half;
+
+    switch (obj.type) {
+    case DOC_BRUSH:
+    {
+        // Габарит DrawBrush: сегмент, расширенный на толщину кисти
+        int brushSize = obj.thickness * 2;
+        left -= brushSize / 2;
+        top -= brushSize / 2;
+        right += brushSize / 2;
+        bottom += brushSize / 2;
+    }
+    break;
+
+    case DOC_CIRCLE:
+    {
+        double size = right - left < bottom - top ? right - left : bottom - top;
+        shape.cx = left + size / 2;
+        shape.cy = top + size / 2;
+        shape.r = size / 2;
+        right = left + size + half;
+        bottom = top + size + half;
+        left -= half;
+        top -= half;
+    }
+    break;
+
+    case DOC_FILL:
+    case DOC_CLEARED_MASK:
+        if (obj.payload != 0 && obj.payload <= doc.fillMasks.size()) {
+            const SpanMask& mask = doc.fillMasks[obj.payload - 1];
+            shape.mask = &mask;
+            shape.maskDx = obj.startX - mask.AnchorX();
+            shape.maskDy = obj.startY - mask.AnchorY();
+            left = mask.Bounds().left + shape.maskDx;
+            top = mask.Bounds().top + shape.maskDy;
+            right = mask.Bounds().right + shape.maskDx;
+            bottom = mask.Bounds().bottom + shape.maskDy;
+        }
+        break;
+
+    case DOC_FRAGMENT:
+        if (obj.payload != 0 && obj.payload <= doc.fragments.size()) {
+            shape.fragment = &doc.fragments[obj.payload - 1];
+            right = left + shape.fragment->image.Width();
+            bottom = top + shape.fragment->image.Height();
+        }
+        break;
+
+    case DOC_POLYGON:
+        if (obj.payload != 0 && obj.payload <= doc.polygons.size()) {
+            shape.polygonMask = ScanDocPolygon(doc.polygons[obj.payload - 1], obj);
+            shape.mask = shape.polygonMask.get();
+            left = shape.mask->Bounds().left;
+            top = shape.mask->Bounds().top;
+            right = shape.mask->Bounds().right;
+            bottom = shape.mask->Bounds().bottom;
+        }
+        break;
+
+    case DOC_GRADIENT:
+        if (obj.payload != 0 && obj.payload <= doc.gradients.size()) {
+            const DocGradient& info = doc.gradients[obj.payload - 1];
+            shape.gradientFill = &info;
+            shape.gradient.kind = info.kind == GRADIENT_RADIAL ? GRADIENT_RADIAL : GRADIENT_LINEAR;
+            shape.gradient.x0 = static_cast<float>(obj.startX);
+            shape.gradient.y0 = static_cast<float>(obj.startY);
+            shape.gradient.x1 = static_cast<float>(obj.endX);
+            shape.gradient.y1 = static_cast<float>(obj.endY);
+            shape.gradient.from = DocColorToPixel(obj.color) & 0x00FFFFFF;
+            shape.gradient.to = DocColorToPixel(info.endColor) & 0x00FFFFFF;
+
+            if (info.mask != 0 && info.mask <= doc.fillMasks.size()) {
+                const SpanMask& mask = doc.fillMasks[info.mask - 1];
+                shape.mask = &mask;
+                shape.maskDx = obj.startX - mask.AnchorX();
+                shape.maskDy = obj.startY - mask.AnchorY();
+                left = mask.Bounds().left + shape.maskDx;
+                top = mask.Bounds().top + shape.maskDy;
+                right = mask.Bounds().right + shape.maskDx;
+                bottom = mask.Bounds().bottom + shape.maskDy;
+            }
+            else {
+                // Без маски область - рамка выделения (её проверяет отсечение по clip)
+                left = obj.clip.left < obj.clip.right ? obj.clip.left : obj.clip.right;
+                top = obj.clip.top < obj.clip.bottom ? obj.clip.top : obj.clip.bottom;
+                right = obj.clip.left < obj.clip.right ? obj.clip.right : obj.clip.left;
+                bottom = obj.clip.top < obj.clip.bottom ? obj.clip.bottom : obj.clip.top;
+            }
+        }
+        break;
+
+    case DOC_TEXT:
+        if (obj.payload != 0 && obj.payload <= doc.texts.size()) {
+            shape.text = &doc.texts[obj.payload - 1];
+            shape.blend = true;
+            left = obj.startX + shape.text->left;
+            top = obj.startY + shape.text->top;
+            right = left + shape.text->width;
+            bottom = top + shape.text->height;
+        }
+        break;
+
+    case DOC_CLEARED_RECT:
+    case DOC_FILLED_RECT:
+    case DOC_FILLED_ELLIPSE:
+        break;
+
+    default:
+        left -= half;
+        top -= half;
+        right += half;
+        bottom += half;
+        break;
+    }
+
+    shape.left = left;
+    shape.top = top;
+    shape.right = right;
+    shape.bottom = bottom;
+
+    if (obj.clipped) {
+        shape.clip.left = obj.clip.left < obj.clip.right ? obj.clip.left : obj.clip.right;
+        shape.clip.right = obj.clip.left < obj.clip.right ? obj.clip.right : obj.clip.left;
+        shape.clip.top = obj.clip.top < obj.clip.bottom ? obj.clip.top : obj.clip.bottom;
+        shape.clip.bottom = obj.clip.top < obj.clip.bottom ? obj.clip.bottom : obj.clip.top;
+
+        // Маска выделения привязана к рамке так же, как в редакторе
+        if (obj.clipMask != 0 && obj.clipMask <= doc.selectionMasks.size()) {
+            const SpanMask& mask = doc.selectionMasks[obj.clipMask - 1];
+            shape.clipMask = &mask;
+            shape.clipDx = obj.clip.left - mask.Bounds().left;
+            shape.clipDy = obj.clip.top - mask.Bounds().top;
+        }
+
+        if (shape.left < shape.clip.left) shape.left = shape.clip.left;
+        if (shape.top < shape.clip.top) shape.top = shape.clip.top;
+        if (shape.right > shape.clip.right) shape.right = shape.clip.right;
+        if (shape.bottom > shape.clip.bottom) shape.bottom = shape.clip.bottom;
+    }
+
+    return shape;
+}
+
+// Квадрат расстояния от точки до отрезка
+inline double RasterSegmentDistance2(double px, double py, double ax, double ay, double bx, double by)
+{
+    double dx = bx - ax, dy = by - ay;
+    double length2 = dx * dx + dy * dy;
+    double t = length2 > 0 ? ((px - ax) * dx + (py - ay) * dy) / length2 : 0;
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    double ex = px - ax - t * dx, ey = py - ay - t * dy;
+    return ex * ex + ey * ey;
+}
+
+inline bool RasterInsideTriangle(double px, double py, double x0, double y0, double x1, double y1, double x2, double y2)
+{
+    double d0 = (x1 - x0) * (py - y0) - (y1 - y0) * (px - x0);
+    double d1 = (x2 - x1) * (py - y1) - (y2 - y1) * (px - x1);
+    double d2 = (x0 - x2) * (py - y2) - (y0 - y2) * (px - x2);
+    bool hasNegative = d0 < 0 || d1 < 0 || d2 < 0;
+    bool hasPositive = d0 > 0 || d1 > 0 || d2 > 0;
+    return !(hasNegative && hasPositive);
+}
+
+// Значение выборки (x, y) на холсте; false - фигура не покрывает выборку
+inline bool SampleShape(const RasterShape& shape, double x, double y, uint32_t& value)
+{
+    const DocObject& obj = *shape.obj;
+
+    if (obj.clipped) {
+        if (x < shape.clip.left || x >= shape.clip.right || y < shape.clip.top || y >= shape.clip.bottom) return false;
+        if (shape.clipMask) {
+            int px = static_cast<int>(std::floor(x)), py = static_cast<int>(std::floor(y));
+            if (!shape.clipMask->Contains(px - shape.clipDx, py - shape.clipDy)) return false;
+        }
+    }
+
+    double left = obj.startX < obj.endX ? obj.startX : obj.endX;
+    double top = obj.startY < obj.endY ? obj.startY : obj.endY;
+    double right = obj.startX < obj.endX ? obj.endX : obj.startX;
+    double bottom = obj.startY < obj.endY ? obj.endY : obj.startY;
+
+    switch (obj.type) {
+    case DOC_PENCIL:
+    case DOC_ERASER:
+        if (RasterSegmentDistance2(x, y, shape.ax, shape.ay, shape.bx, shape.by) > shape.radius * shape.radius) return false;
+        value = obj.type == DOC_ERASER ? 0 : DocColorToPixel(obj.color);
+        return true;
+
+    case DOC_RECTANGLE:
+    {
+        double h = shape.radius;
+        bool outer = x >= left - h && x < right + h && y >= top - h && y < bottom + h;
+        bool inner = x >= left + h && x < right - h && y >= top + h && y < bottom - h;
+        if (!outer || inner) return false;
+        value = DocColorToPixel(obj.color);
+        return true;
+    }
+
+    case DOC_CIRCLE:
+    {
+        double dx = x - shape.cx, dy = y - shape.cy;
+        double distance = std::sqrt(dx * dx + dy * dy);
+        if (std::fabs(distance - shape.r) > shape.radius) return false;
+        value = DocColorToPixel(obj.color);
+        return true;
+    }
+
+    case DOC_BRUSH:
+    {
+        // Габарит DrawBrush (shape.left... мог быть урезан рамкой выделения)
+        int brushSize = obj.thickness * 2;
+        double l = left - brushSize / 2, t = top - brushSize / 2;
+        double width = right + brushSize / 2 - l, height = bottom + brushSize / 2 - t;
+        double size = width < height ? width : height;
+
+        bool inside = false;
+        switch (obj.brushShape) {
+        case DOC_BRUSH_CIRCLE:
+        {
+            double rx = (x - l - size / 2) / (size / 2), ry = (y - t - size / 2) / (size / 2);
+            inside = size > 0 && rx * rx + ry * ry <= 1.0;
+        }
+        break;
+        case DOC_BRUSH_SQUARE:
+            inside = x >= l && x < l + size && y >= t && y < t + size;
+            break;
+        case DOC_BRUSH_ELLIPSE:
+        {
+            double rx = (x - l - width / 2) / (width / 2), ry = (y - t - height / 2) / (height / 2);
+            inside = width > 0 && height > 0 && rx * rx + ry * ry <= 1.0;
+        }
+        break;
+        case DOC_BRUSH_RECTANGLE:
+            inside = x >= l && x < l + width && y >= t && y < t + height;
+            break;
+        case DOC_BRUSH_TRIANGLE:
+            inside = RasterInsideTriangle(x, y, l + width / 2, t, l, t + height, l + width, t + height);
+            break;
+        }
+        if (!inside) return false;
+        value = DocColorToPixel(obj.color);
+        return true;
+    }
+
+    case DOC_FILL:
+    case DOC_CLEARED_MASK:
+    case DOC_POLYGON:
+    {
+        if (!shape.mask) return false;
+        int px = static_cast<int>(std::floor(x)), py = static_cast<int>(std::floor(y));
+        if (!shape.mask->Contains(px - shape.maskDx, py - shape.maskDy)) return false;
+        value = obj.type == DOC_CLEARED_MASK ? 0 : DocColorToPixel(obj.color);
+        return true;
+    }
+
+    case DOC_CLEARED_RECT:
+        if (x < left || x >= right || y < top || y >= bottom) return false;
+        value = 0;
+        return true;
+
+    case DOC_FILLED_RECT:
+        if (x < left || x >= right || y < top || y >= bottom) return false;
+        value = DocColorToPixel(obj.color);
+        return true;
+
+    case DOC_FILLED_ELLIPSE:
+    {
+        double rx = (right - left) / 2, ry = (bottom - top) / 2;
+        if (rx <= 0 || ry <= 0) return false;
+        double dx = (x - left - rx) / rx, dy = (y - top - ry) / ry;
+        if (dx * dx + dy * dy >= 1.0) return false;
+        value = DocColorToPixel(obj.color);
+        return true;
+    }
+
+    case DOC_FRAGMENT:
+    {
+        if (!shape.fragment) return false;
+        int fx = static_cast<int>(std::floor(x - left)), fy = static_cast<int>(std::floor(y - top));
+        const TiledImage& image = shape.fragment->image;
+        if (fx < 0 || fy < 0 || fx >= image.Width() || fy >= image.Height()) return false;
+        if (!shape.fragment->mask.Empty() && !shape.fragment->mask.Contains(fx, fy)) return false;
+        value = image.Pixel(fx, fy);
+        return true;
+    }
+
+    case DOC_GRADIENT:
+    {
+        if (!shape.gradientFill) return false;
+        if (shape.mask) {
+            int px = static_cast<int>(std::floor(x)), py = static_cast<int>(std::floor(y));
+            if (!shape.mask->Contains(px - shape.maskDx, py - shape.maskDy)) return false;
+        }
+        else if (!obj.clipped || x < shape.left || x >= shape.right || y < shape.top || y >= shape.bottom) {
+            return false;
+        }
+        value = GradientPixel(shape.gradient, static_cast<float>(x), static_cast<float>(y));
+        return true;
+    }
+
+    case DOC_TEXT:
+    {
+        if (!shape.text) return false;
+        const DocText& text = *shape.text;
+        int tx = static_cast<int>(std::floor(x)) - obj.startX - text.left;
+        int ty = static_cast<int>(std::floor(y)) - obj.startY - text.top;
+        if (tx < 0 || ty < 0 || tx >= text.width || ty >= text.height) return false;
+        uint32_t alpha = text.coverage[static_cast<size_t>(ty) * text.width + tx];
+        if (alpha == 0) return false;
+
+        // Цвет, умноженный на покрытие (premultiplied)
+        uint32_t color = DocColorToPixel(obj.color);
+        value = alpha << 24 | Div255(((color >> 16) & 0xFF) * alpha) << 16 |
+            Div255(((color >> 8) & 0xFF) * alpha) << 8 | Div255((color & 0xFF) * alpha);
+        return true;
+    }
+    }
+
+    return false;
+}
+
+// Растеризация одной плитки результата [x0, x1) x [y0, y1)
+// samples - буфер выборок слоя, layerRow - строка слоя после усреднения (буферы потока)
+inline void RenderTile(const PaintDocument& doc, const std::vector<std::vector<RasterShape>>& shapes,
+    const RenderOptions& options, int x0, int y0, int x1, int y1, uint32_t* out, size_t outStride,
+    std::vector<uint32_t>& samples, std::vector<uint32_t>& layerRow, size_t& objectTests)
+{
+    int ss = options.supersample;
+    int tileWidth = x1 - x0, tileHeight = y1 - y0;
+    int sampleWidth = tileWidth * ss, sampleHeight = tileHeight * ss;
+    double step = 1.0 / (options.scale * ss);
+
+    for (int y = y0; y < y1; y++) {
+        uint32_t* row = out + static_cast<size_t>(y) * outStride + x0;
+        for (int x = 0; x < tileWidth; x++) row[x] = 0xFFFFFFFF;
+    }
+
+    // Габарит плитки на холсте
+    double tileLeft = x0 / options.scale, tileTop = y0 / options.scale;
+    double tileRight = x1 / options.scale, tileBottom = y1 / options.scale;
+
+    samples.resize(static_cast<size_t>(sampleWidth) * sampleHeight);
+    layerRow.resize(tileWidth);
+
+    for (size_t layerIndex = 0; layerIndex < doc.layers.size(); layerIndex++) {
+        const DocLayer& layer = doc.layers[layerIndex];
+        if (!layer.visible || layer.opacity <= 0) continue;
+
+        bool touched = false;
+        for (const RasterShape& shape : shapes[layerIndex]) {
+            if (shape.right <= tileLeft || shape.left >= tileRight ||
+                shape.bottom <= tileTop || shape.top >= tileBottom) continue;
+
+            if (!touched) {
+                std::fill(samples.begin(), samples.end(), 0u);
+                touched = true;
+            }
+            objectTests++;
+
+            // Выборки внутри габарита фигуры (границы обрезаются до плитки ещё в double:
+            // фигура, уходящая далеко за холст, при большом масштабе не помещается в int)
+            auto sampleIndex = [](double value, int limit) {
+                return value <= 0 ? 0 : value >= limit ? limit : static_cast<int>(value);
+            };
+            int sx0 = sampleIndex(std::floor((shape.left - tileLeft) / step - 0.5), sampleWidth);
+            int sy0 = sampleIndex(std::floor((shape.top - tileTop) / step - 0.5), sampleHeight);
+            int sx1 = sampleIndex(std::ceil((shape.right - tileLeft) / step + 0.5), sampleWidth);
+            int sy1 = sampleIndex(std::ceil((shape.bottom - tileTop) / step + 0.5), sampleHeight);
+
+            for (int sy = sy0; sy < sy1; sy++) {
+                double canvasY = tileTop + (sy + 0.5) * step;
+                uint32_t* sampleRow = &samples[static_cast<size_t>(sy) * sampleWidth];
+                for (int sx = sx0; sx < sx1; sx++) {
+                    uint32_t value;
+                    if (SampleShape(shape, tileLeft + (sx + 0.5) * step, canvasY, value)) {
+                        sampleRow[sx] = shape.blend ? BlendPixelOver(sampleRow[sx], value, 255) : value;
+                    }
+                }
+            }
+        }
+        if (!touched) continue;
+
+        // Усреднение выборок (premultiplied - можно складывать каналы) и наложение слоя
+        int count = ss * ss;
+        for (int y = 0; y < tileHeight; y++) {
+            for (int x = 0; x < tileWidth; x++) {
+                uint32_t sum[4] = { 0, 0, 0, 0 };
+                for (int j = 0; j < ss; j++) {
+                    const uint32_t* sampleRow = &samples[static_cast<size_t>(y * ss + j) * sampleWidth + x * ss];
+                    for (int i = 0; i < ss; i++) {
+                        uint32_t value = sampleRow[i];
+                        sum[0] += value & 0xFF;
+                        sum[1] += (value >> 8) & 0xFF;
+                        sum[2] += (value >> 16) & 0xFF;
+                        sum[3] += value >> 24;
+                    }
+                }
+                layerRow[x] = ((sum[3] + count / 2) / count) << 24 | ((sum[2] + count / 2) / count) << 16 |
+                    ((sum[1] + count / 2) / count) << 8 | ((sum[0] + count / 2) / count);
+            }
+            BlendRowOver(out + static_cast<size_t>(y0 + y) * outStride + x0, layerRow.data(), tileWidth, layer.opacity);
+        }
+    }
+}
+
+// Растеризация документа целиком; плитки результата разбирают рабочие потоки
+inline RenderedImage RenderDocument(const PaintDocument& doc, RenderOptions options, RenderStats* stats = nullptr)
+{
+    RenderedImage image;
+    if (options.scale <= 0) options.scale = 1.0;
+    if (options.supersample < 1) options.supersample = 1;
+    if (options.supersample > RENDER_MAX_SUPERSAMPLE) options.supersample = RENDER_MAX_SUPERSAMPLE;
+    if (options.tileSize < 16) options.tileSize = 16;
+    if (options.tileSize > RENDER_MAX_TILE) options.tileSize = RENDER_MAX_TILE;
+    if (options.tileSize * options.supersample > RENDER_MAX_TILE_SAMPLES) {
+        options.tileSize = RENDER_MAX_TILE_SAMPLES / options.supersample;
+    }
+
+    int64_t width, height;
+    if (!RenderedSize(doc, options.scale, width, height)) return image;
+    image.width = static_cast<int>(width);
+    image.height = static_cast<int>(height);
+    image.pixels.assign(static_cast<size_t>(width) * static_cast<size_t>(height), 0xFFFFFFFF);
+    if (image.width == 0 || image.height == 0) return image;
+
+    // Фигуры готовятся один раз и дальше только читаются
+    std::vector<std::vector<RasterShape>> shapes(doc.layers.size());
+    for (size_t i = 0; i < doc.layers.size(); i++) {
+        shapes[i].reserve(doc.layers[i].objects.size());
+        for (const auto& obj : doc.layers[i].objects) {
+            shapes[i].push_back(PrepareShape(doc, obj));
+        }
+    }
+
+    int64_t tilesX = (width + options.tileSize - 1) / options.tileSize;
+    int64_t tilesY = (height + options.tileSize - 1) / options.tileSize;
+    int64_t tileCount = tilesX * tilesY;
+
+    int threadCount = options.threads;
+    if (threadCount <= 0) threadCount = static_cast<int>(std::thread::hardware_concurrency());
+    if (threadCount <= 0) threadCount = 1;
+    if (threadCount > tileCount) threadCount = static_cast<int>(tileCount);
+
+    std::atomic<int64_t> nextTile(0);
+    std::atomic<size_t> objectTests(0);
+
+    auto worker = [&]() {
+        std::vector<uint32_t> samples, layerRow;
+        size_t tests = 0;
+        for (int64_t tile = nextTile++; tile < tileCount; tile = nextTile++) {
+            int x0 = static_cast<int>((tile % tilesX) * options.tileSize);
+            int y0 = static_cast<int>((tile / tilesX) * options.tileSize);
+            int x1 = x0 < image.width - options.tileSize ? x0 + options.tileSize : image.width;
+            int y1 = y0 < image.height - options.tileSize ? y0 + options.tileSize : image.height;
+            RenderTile(doc, shapes, options, x0, y0, x1, y1, image.pixels.data(), image.width,
+                samples, layerRow, tests);
+        }
+        objectTests += tests;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; i++) threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads) thread.join();
+
+    if (stats) {
+        stats->tiles = tileCount;
+        stats->threads = threadCount;
+        stats->objectTests = objectTests;
+    }
+    return image;
+}
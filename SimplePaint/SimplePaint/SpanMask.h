@@ -0,0 +1,158 @@
+﻿// SpanMask.h: маска пикселей в виде горизонтальных отрезков (run-length)
+//
+// Каждый отрезок - строка y и полуинтервал [left, right). После Normalize отрезки
+// упорядочены по (y, left) и не пересекаются, поэтому отрезки строки находятся
+// двоичным поиском, а закраска маски сводится к заполнению отрезков подряд.
+// Опорная точка (anchor) - точка, от которой маска строилась (затравка заливки);
+// сдвиг объекта считается относительно неё.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+struct SpanRun {
+    int y;
+    int left, right;
+};
+
+// Прямоугольник без зависимости от windows.h (right и bottom не включаются)
+struct MaskRect {
+    int left, top, right, bottom;
+};
+
+class SpanMask {
+public:
+    SpanMask() : anchorX(0), anchorY(0), bounds{ 0, 0, 0, 0 } {}
+
+    void SetAnchor(int x, int y) { anchorX = x; anchorY = y; }
+    int AnchorX() const { return anchorX; }
+    int AnchorY() const { return anchorY; }
+
+    bool Empty() const { return runs.empty(); }
+    const std::vector<SpanRun>& Runs() const { return runs; }
+    const MaskRect& Bounds() const { return bounds; }
+
+    void Clear()
+    {
+        runs.clear();
+        bounds = { 0, 0, 0, 0 };
+    }
+
+    // Добавление отрезка в любом порядке (после серии добавлений нужен Normalize)
+    void AddRun(int y, int left, int right)
+    {
+        if (right <= left) return;
+
+        if (runs.empty()) {
+            bounds = { left, y, right, y + 1 };
+        }
+        else {
+            if (left < bounds.left) bounds.left = left;
+            if (y < bounds.top) bounds.top = y;
+            if (right > bounds.right) bounds.right = right;
+            if (y + 1 > bounds.bottom) bounds.bottom = y + 1;
+        }
+        runs.push_back({ y, left, right });
+    }
+
+    // Сортировка по (y, left) и слияние соприкасающихся отрезков
+    void Normalize()
+    {
+        std::sort(runs.begin(), runs.end(), [](const SpanRun& a, const SpanRun& b) {
+            return a.y != b.y ? a.y < b.y : a.left < b.left;
+        });
+
+        size_t out = 0;
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (out > 0 && runs[out - 1].y == runs[i].y && runs[i].left <= runs[out - 1].right) {
+                if (runs[i].right > runs[out - 1].right) runs[out - 1].right = runs[i].right;
+            }
+            else {
+                runs[out++] = runs[i];
+            }
+        }
+        runs.resize(out);
+    }
+
+    // Первый отрезок строки y (или конец списка)
+    size_t FirstRunOfRow(int y) const
+    {
+        size_t lo = 0, hi = runs.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (runs[mid].y < y) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    bool Contains(int x, int y) const
+    {
+        for (size_t i = FirstRunOfRow(y); i < runs.size() && runs[i].y == y; i++) {
+            if (x < runs[i].left) return false;
+            if (x < runs[i].right) return true;
+        }
+        return false;
+    }
+
+    size_t PixelCount() const
+    {
+        size_t count = 0;
+        for (const auto& run : runs) count += static_cast<size_t>(run.right - run.left);
+        return count;
+    }
+
+    size_t MemoryBytes() const { return runs.capacity() * sizeof(SpanRun); }
+
+    // Обход покрытых маской (сдвинутой на dx) частей строки y внутри [left, right)
+    template <typename Visit>
+    void ForEachSpan(int y, int left, int right, int dx, Visit visit) const
+    {
+        for (size_t i = FirstRunOfRow(y); i < runs.size() && runs[i].y == y; i++) {
+            int runLeft = runs[i].left + dx;
+            int runRight = runs[i].right + dx;
+            if (runLeft >= right) break;
+            if (runLeft < left) runLeft = left;
+            if (runRight > right) runRight = right;
+            if (runLeft < runRight) visit(runLeft, runRight);
+        }
+    }
+
+    // Обход промежутков строки y, не покрытых маской (сдвинутой на dx), внутри [left, right)
+    template <typename Visit>
+    void ForEachGap(int y, int left, int right, int dx, Visit visit) const
+    {
+        int x = left;
+        for (size_t i = FirstRunOfRow(y); i < runs.size() && runs[i].y == y && x < right; i++) {
+            int runLeft = runs[i].left + dx;
+            int runRight = runs[i].right + dx;
+            if (runRight <= x) continue;
+            if (runLeft > x) visit(x, runLeft < right ? runLeft : right);
+            x = runRight;
+        }
+        if (x < right) visit(x, right);
+    }
+
+private:
+    int anchorX, anchorY;
+    MaskRect bounds;
+    std::vector<SpanRun> runs;
+};
+
+// Обрезка по маске без регионов GDI: после рисования в rect пиксели вне маски
+// (сдвинутой на dx, dy) возвращаются из копии saved, снятой до рисования
+inline void RestoreOutsideMask(uint32_t* pixels, size_t stride, const uint32_t* saved, size_t savedStride,
+    MaskRect rect, const SpanMask& mask, int dx, int dy)
+{
+    for (int y = rect.top; y < rect.bottom; y++) {
+        uint32_t* row = pixels + static_cast<size_t>(y) * stride;
+        const uint32_t* savedRow = saved + static_cast<size_t>(y - rect.top) * savedStride - rect.left;
+        mask.ForEachGap(y - dy, rect.left, rect.right, dx, [&](int left, int right) {
+            memcpy(row + left, savedRow + left, (right - left) * sizeof(uint32_t));
+        });
+    }
+}
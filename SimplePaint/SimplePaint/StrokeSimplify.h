@@ -0,0 +1,87 @@
+﻿// StrokeSimplify.h: упрощение ломаной штриха алгоритмом Рамера - Дугласа - Пекера
+//
+// Точки, отклоняющиеся от хорды меньше чем на tolerance пикселей, отбрасываются.
+// Рекурсия заменена явным стеком, чтобы длинные штрихи не переполняли стек вызовов.
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+struct StrokePoint {
+    int x, y;
+};
+
+// Допуск упрощения в зависимости от толщины: всегда меньше пикселя
+inline double StrokeTolerance(int thickness)
+{
+    double tolerance = 0.15 * thickness;
+    if (tolerance < 0.25) tolerance = 0.25;
+    if (tolerance > 0.75) tolerance = 0.75;
+    return tolerance;
+}
+
+// Квадрат расстояния от точки p до отрезка ab
+inline double SegmentDistanceSquared(const StrokePoint& p, const StrokePoint& a, const StrokePoint& b)
+{
+    double dx = static_cast<double>(b.x - a.x);
+    double dy = static_cast<double>(b.y - a.y);
+    double px = static_cast<double>(p.x - a.x);
+    double py = static_cast<double>(p.y - a.y);
+
+    double lengthSquared = dx * dx + dy * dy;
+    if (lengthSquared == 0.0) {
+        return px * px + py * py;
+    }
+
+    double t = (px * dx + py * dy) / lengthSquared;
+    if (t < 0.0) t = 0.0;
+    if (t > 1.0) t = 1.0;
+
+    double ex = px - t * dx;
+    double ey = py - t * dy;
+    return ex * ex + ey * ey;
+}
+
+// Упрощение ломаной; первая и последняя точки сохраняются всегда
+inline std::vector<StrokePoint> SimplifyStroke(const std::vector<StrokePoint>& points, double tolerance)
+{
+    if (points.size() < 3) return points;
+
+    std::vector<bool> keep(points.size(), false);
+    keep.front() = true;
+    keep.back() = true;
+
+    double toleranceSquared = tolerance * tolerance;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    ranges.push_back({ 0, points.size() - 1 });
+
+    while (!ranges.empty()) {
+        size_t first = ranges.back().first;
+        size_t last = ranges.back().second;
+        ranges.pop_back();
+
+        double maxDistance = -1.0;
+        size_t farthest = first;
+        for (size_t i = first + 1; i < last; i++) {
+            double distance = SegmentDistanceSquared(points[i], points[first], points[last]);
+            if (distance > maxDistance) {
+                maxDistance = distance;
+                farthest = i;
+            }
+        }
+
+        if (maxDistance > toleranceSquared) {
+            keep[farthest] = true;
+            if (farthest - first > 1) ranges.push_back({ first, farthest });
+            if (last - farthest > 1) ranges.push_back({ farthest, last });
+        }
+    }
+
+    std::vector<StrokePoint> result;
+    for (size_t i = 0; i < points.size(); i++) {
+        if (keep[i]) result.push_back(points[i]);
+    }
+    return result;
+}
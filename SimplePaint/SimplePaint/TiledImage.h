@@ -0,0 +1,458 @@
+﻿// TiledImage.h: растровое изображение из плиток 64x64 с копированием при записи
+//
+// Плитки хранятся через shared_ptr. Копия изображения копирует только указатели,
+// поэтому дублирование большой области не трогает пиксели. Плитка клонируется
+// лишь тогда, когда одну из копий начинают менять (MutableTile).
+// Отсутствующая плитка (nullptr) целиком залита цветом фона.
+// Формат пикселя совпадает с 32-битным DIB: 0x00RRGGBB.
+//
+// Изображение можно подключить к TileCache с бюджетом памяти: давно не читанные
+// плитки сверх бюджета сжимаются (LRU), а при обращении распаковываются обратно.
+// Кодек - LZ77 над 32-битными словами: совпадение со смещением 1 - это серия
+// одинаковых пикселей (RLE), остальные совпадения ищутся по хешу как в LZ4.
+// Указатель, полученный от Tile/MutableTile, действителен до следующего обращения
+// к плиткам того же кэша; кэш не потокобезопасен и должен жить дольше изображений.
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+const int TILE_SIZE = 64;
+const int TILE_PIXELS = TILE_SIZE * TILE_SIZE;
+
+struct PixelTile {
+    uint32_t pixels[TILE_PIXELS];
+};
+
+// Число без знака кусками по 7 бит (LEB128)
+inline void PackVarint(std::vector<uint8_t>& out, uint32_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline bool UnpackVarint(const uint8_t*& data, const uint8_t* end, uint32_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 32 && data < end; shift += 7) {
+        uint8_t byte = *data++;
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Сжатие плитки. Поток - последовательности (число литералов, литералы по 4 байта,
+// длина совпадения, смещение назад в словах); длина совпадения 0 завершает поток.
+inline void PackTile(const PixelTile& tile, std::vector<uint8_t>& out)
+{
+    const int HASH_BITS = 12;
+    const uint32_t MIN_MATCH = 2;
+    uint16_t table[1 << HASH_BITS] = {};   // позиция + 1 последнего слова с таким хешем
+
+    const uint32_t* words = tile.pixels;
+    out.clear();
+
+    auto emit = [&](uint32_t literalStart, uint32_t literalEnd, uint32_t length, uint32_t offset) {
+        PackVarint(out, literalEnd - literalStart);
+        for (uint32_t i = literalStart; i < literalEnd; i++) {
+            uint32_t word = words[i];
+            uint8_t bytes[4] = {
+                static_cast<uint8_t>(word), static_cast<uint8_t>(word >> 8),
+                static_cast<uint8_t>(word >> 16), static_cast<uint8_t>(word >> 24)
+            };
+            out.insert(out.end(), bytes, bytes + 4);
+        }
+        PackVarint(out, length);
+        if (length) PackVarint(out, offset);
+    };
+
+    auto matchLength = [&](uint32_t from, uint32_t at) {
+        uint32_t length = 0;
+        while (at + length < TILE_PIXELS && words[from + length] == words[at + length]) length++;
+        return length;
+    };
+
+    uint32_t literalStart = 0;
+    uint32_t i = 0;
+    while (i < TILE_PIXELS) {
+        uint32_t bestLength = 0, bestOffset = 0;
+
+        // Серия одинаковых пикселей
+        if (i > 0 && words[i] == words[i - 1]) {
+            bestLength = matchLength(i - 1, i);
+            bestOffset = 1;
+        }
+
+        // Более раннее вхождение того же слова
+        uint32_t hash = (words[i] * 2654435761u) >> (32 - HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = static_cast<uint16_t>(i + 1);
+        if (candidate != 0 && candidate < i && words[candidate - 1] == words[i]) {
+            uint32_t length = matchLength(candidate - 1, i);
+            if (length > bestLength) {
+                bestLength = length;
+                bestOffset = i - (candidate - 1);
+            }
+        }
+
+        if (bestLength >= MIN_MATCH) {
+            emit(literalStart, i, bestLength, bestOffset);
+            i += bestLength;
+            literalStart = i;
+        }
+        else {
+            i++;
+        }
+    }
+    emit(literalStart, TILE_PIXELS, 0, 0);
+}
+
+// Распаковка плитки; false - поток повреждён
+inline bool UnpackTile(const std::vector<uint8_t>& packed, PixelTile& tile)
+{
+    const uint8_t* data = packed.data();
+    const uint8_t* end = data + packed.size();
+    uint32_t* words = tile.pixels;
+    uint32_t position = 0;
+
+    for (;;) {
+        uint32_t literals, length, offset;
+        if (!UnpackVarint(data, end, literals)) return false;
+        if (literals > TILE_PIXELS - position || static_cast<size_t>(end - data) < literals * 4u) return false;
+        for (uint32_t i = 0; i < literals; i++, data += 4) {
+            words[position++] = data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+        }
+
+        if (!UnpackVarint(data, end, length)) return false;
+        if (length == 0) return position == TILE_PIXELS;
+        if (!UnpackVarint(data, end, offset)) return false;
+        if (offset == 0 || offset > position || length > TILE_PIXELS - position) return false;
+
+        // Совпадение может перекрывать само себя (серия при смещении 1)
+        for (uint32_t i = 0; i < length; i++, position++) {
+            words[position] = words[position - offset];
+        }
+    }
+}
+
+class TileCache;
+
+// Плитка, общая для копий изображения: пиксели или сжатые данные остывшей плитки
+struct TileSlot {
+    std::unique_ptr<PixelTile> pixels;  // nullptr, пока плитка сжата
+    std::vector<uint8_t> packed;
+    TileCache* cache = nullptr;
+    TileSlot* newer = nullptr;          // соседи в списке LRU несжатых плиток
+    TileSlot* older = nullptr;
+
+    TileSlot() = default;
+    TileSlot(const TileSlot&) = delete;
+    TileSlot& operator=(const TileSlot&) = delete;
+    ~TileSlot();
+};
+
+// Бюджет памяти несжатых плиток и очередь LRU, общие для подключённых изображений
+class TileCache {
+public:
+    explicit TileCache(size_t budgetBytes)
+        : budget(budgetBytes), newest(nullptr), oldest(nullptr),
+        residentTiles(0), compressedTiles(0), compressedBytes(0), compressions(0), decompressions(0)
+    {
+    }
+
+    TileCache(const TileCache&) = delete;
+    TileCache& operator=(const TileCache&) = delete;
+
+    size_t Budget() const { return budget; }
+    size_t ResidentTiles() const { return residentTiles; }
+    size_t CompressedTiles() const { return compressedTiles; }
+    size_t ResidentBytes() const { return residentTiles * sizeof(PixelTile); }
+    size_t CompressedBytes() const { return compressedBytes; }
+    size_t Compressions() const { return compressions; }
+    size_t Decompressions() const { return decompressions; }
+
+    void SetBudget(size_t budgetBytes)
+    {
+        budget = budgetBytes;
+        Trim(nullptr);
+    }
+
+    // Новая несжатая плитка
+    void Add(TileSlot* slot)
+    {
+        slot->cache = this;
+        residentTiles++;
+        PushNewest(slot);
+        Trim(slot);
+    }
+
+    // Обращение к плитке: сжатая распаковывается, плитка становится самой свежей
+    void Touch(TileSlot* slot)
+    {
+        if (!slot->pixels) {
+            slot->pixels.reset(new PixelTile);
+            UnpackTile(slot->packed, *slot->pixels);
+            compressedBytes -= slot->packed.size();
+            compressedTiles--;
+            std::vector<uint8_t>().swap(slot->packed);
+            residentTiles++;
+            decompressions++;
+            PushNewest(slot);
+            Trim(slot);
+        }
+        else if (slot != newest) {
+            Unlink(slot);
+            PushNewest(slot);
+        }
+    }
+
+    // Плитка удаляется (последняя копия изображения её больше не держит)
+    void Forget(TileSlot* slot)
+    {
+        if (slot->pixels) {
+            Unlink(slot);
+            residentTiles--;
+        }
+        else {
+            compressedBytes -= slot->packed.size();
+            compressedTiles--;
+        }
+    }
+
+private:
+    // Сжатие самых старых плиток, пока несжатые не уложатся в бюджет (keep не трогается)
+    void Trim(const TileSlot* keep)
+    {
+        while (ResidentBytes() > budget && oldest && oldest != keep) {
+            TileSlot* slot = oldest;
+            Unlink(slot);
+
+            PackTile(*slot->pixels, slot->packed);
+            slot->packed.shrink_to_fit();
+            slot->pixels.reset();
+
+            residentTiles--;
+            compressedTiles++;
+            compressedBytes += slot->packed.size();
+            compressions++;
+        }
+    }
+
+    void PushNewest(TileSlot* slot)
+    {
+        slot->older = newest;
+        slot->newer = nullptr;
+        if (newest) newest->newer = slot;
+        newest = slot;
+        if (!oldest) oldest = slot;
+    }
+
+    void Unlink(TileSlot* slot)
+    {
+        if (slot->newer) slot->newer->older = slot->older;
+        else newest = slot->older;
+        if (slot->older) slot->older->newer = slot->newer;
+        else oldest = slot->newer;
+        slot->newer = slot->older = nullptr;
+    }
+
+    size_t budget;
+    TileSlot* newest;
+    TileSlot* oldest;
+    size_t residentTiles, compressedTiles;
+    size_t compressedBytes;
+    size_t compressions, decompressions;
+};
+
+inline TileSlot::~TileSlot()
+{
+    if (cache) cache->Forget(this);
+}
+
+class TiledImage {
+public:
+    TiledImage() : width(0), height(0), tilesX(0), tilesY(0), background(0x00FFFFFF), cache(nullptr) {}
+
+    TiledImage(int width, int height, uint32_t background = 0x00FFFFFF)
+        : width(width), height(height),
+        tilesX((width + TILE_SIZE - 1) / TILE_SIZE), tilesY((height + TILE_SIZE - 1) / TILE_SIZE),
+        background(background), cache(nullptr), tiles(static_cast<size_t>(tilesX) * tilesY)
+    {
+    }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    int TilesX() const { return tilesX; }
+    int TilesY() const { return tilesY; }
+    uint32_t Background() const { return background; }
+    bool Empty() const { return width <= 0 || height <= 0; }
+    TileCache* Cache() const { return cache; }
+
+    // Подключение к кэшу: плитки сверх его бюджета начнут сжиматься.
+    // Плитки, уже подключённые к другому кэшу (через копию изображения), остаются в нём.
+    void AttachCache(TileCache* tileCache)
+    {
+        cache = tileCache;
+        if (!cache) return;
+        for (const auto& slot : tiles) {
+            if (slot && !slot->cache) cache->Add(slot.get());
+        }
+    }
+
+    // Плитка только для чтения (nullptr - плитка залита фоном); сжатая распаковывается
+    const PixelTile* Tile(int tx, int ty) const
+    {
+        TileSlot* slot = tiles[static_cast<size_t>(ty) * tilesX + tx].get();
+        if (!slot) return nullptr;
+        if (slot->cache) slot->cache->Touch(slot);
+        return slot->pixels.get();
+    }
+
+    // Плитка для записи: общая плитка клонируется, отсутствующая создаётся
+    PixelTile* MutableTile(int tx, int ty)
+    {
+        std::shared_ptr<TileSlot>& slot = tiles[static_cast<size_t>(ty) * tilesX + tx];
+        if (!slot) {
+            slot = std::make_shared<TileSlot>();
+            slot->pixels.reset(new PixelTile);
+            for (int i = 0; i < TILE_PIXELS; i++) slot->pixels->pixels[i] = background;
+            if (cache) cache->Add(slot.get());
+        }
+        else if (slot.use_count() > 1) {
+            auto copy = std::make_shared<TileSlot>();
+            copy->pixels.reset(new PixelTile(*Tile(tx, ty)));
+            slot = copy;
+            if (cache) cache->Add(slot.get());
+        }
+        else if (slot->cache) {
+            slot->cache->Touch(slot.get());
+        }
+        return slot->pixels.get();
+    }
+
+    // Копия, которую можно читать из другого потока: плитки без кэша общие (они не
+    // сжимаются, а запись в любую из копий клонирует плитку), плитки кэша копируются
+    TiledImage DetachedCopy() const
+    {
+        TiledImage copy(width, height, background);
+        for (size_t i = 0; i < tiles.size(); i++) {
+            const std::shared_ptr<TileSlot>& slot = tiles[i];
+            if (!slot) continue;
+            if (!slot->cache) {
+                copy.tiles[i] = slot;
+                continue;
+            }
+            auto own = std::make_shared<TileSlot>();
+            own->pixels.reset(new PixelTile(*Tile(static_cast<int>(i % tilesX), static_cast<int>(i / tilesX))));
+            copy.tiles[i] = own;
+        }
+        return copy;
+    }
+
+    uint32_t Pixel(int x, int y) const
+    {
+        const PixelTile* tile = Tile(x / TILE_SIZE, y / TILE_SIZE);
+        if (!tile) return background;
+        return tile->pixels[(y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE)];
+    }
+
+    void SetPixel(int x, int y, uint32_t value)
+    {
+        PixelTile* tile = MutableTile(x / TILE_SIZE, y / TILE_SIZE);
+        tile->pixels[(y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE)] = value;
+    }
+
+    // Запись прямоугольника из линейного буфера (stride - в пикселях)
+    void WriteRect(int x, int y, int w, int h, const uint32_t* src, size_t stride)
+    {
+        ForEachTileSpan(x, y, w, h, [&](int tx, int ty, int px, int py, int spanX, int spanWidth, int row) {
+            PixelTile* tile = MutableTile(tx, ty);
+            memcpy(&tile->pixels[py * TILE_SIZE + px], src + static_cast<size_t>(row) * stride + spanX,
+                spanWidth * sizeof(uint32_t));
+        });
+    }
+
+    // Чтение прямоугольника в линейный буфер (stride - в пикселях)
+    void ReadRect(int x, int y, int w, int h, uint32_t* dst, size_t stride) const
+    {
+        ForEachTileSpan(x, y, w, h, [&](int tx, int ty, int px, int py, int spanX, int spanWidth, int row) {
+            uint32_t* out = dst + static_cast<size_t>(row) * stride + spanX;
+            const PixelTile* tile = Tile(tx, ty);
+            if (tile) {
+                memcpy(out, &tile->pixels[py * TILE_SIZE + px], spanWidth * sizeof(uint32_t));
+            }
+            else {
+                for (int i = 0; i < spanWidth; i++) out[i] = background;
+            }
+        });
+    }
+
+    // Число плиток, разделяемых с другими копиями изображения
+    size_t SharedTileCount() const
+    {
+        size_t count = 0;
+        for (const auto& tile : tiles) {
+            if (tile && tile.use_count() > 1) count++;
+        }
+        return count;
+    }
+
+    // Объём памяти несжатых плиток (общие плитки учитываются в каждой копии)
+    size_t TileBytes() const
+    {
+        size_t count = 0;
+        for (const auto& slot : tiles) {
+            if (slot && slot->pixels) count++;
+        }
+        return count * sizeof(PixelTile);
+    }
+
+    // Объём сжатых данных остывших плиток
+    size_t PackedBytes() const
+    {
+        size_t bytes = 0;
+        for (const auto& slot : tiles) {
+            if (slot && !slot->pixels) bytes += slot->packed.size();
+        }
+        return bytes;
+    }
+
+private:
+    // Обход строк прямоугольника, разрезанных по границам плиток.
+    // visit(tx, ty, x в плитке, y в плитке, x от начала прямоугольника, длина отрезка, строка прямоугольника)
+    template <typename Visit>
+    void ForEachTileSpan(int x, int y, int w, int h, Visit visit) const
+    {
+        int left = x < 0 ? 0 : x;
+        int top = y < 0 ? 0 : y;
+        int right = x + w > width ? width : x + w;
+        int bottom = y + h > height ? height : y + h;
+
+        for (int row = top; row < bottom; row++) {
+            int ty = row / TILE_SIZE;
+            int py = row % TILE_SIZE;
+            for (int col = left; col < right;) {
+                int tx = col / TILE_SIZE;
+                int px = col % TILE_SIZE;
+                int spanWidth = TILE_SIZE - px;
+                if (col + spanWidth > right) spanWidth = right - col;
+                visit(tx, ty, px, py, col - x, spanWidth, row - y);
+                col += spanWidth;
+            }
+        }
+    }
+
+    int width, height;
+    int tilesX, tilesY;
+    uint32_t background;
+    TileCache* cache;
+    std::vector<std::shared_ptr<TileSlot>> tiles;
+};
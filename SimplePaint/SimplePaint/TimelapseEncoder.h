@@ -0,0 +1,173 @@
+﻿// TimelapseEncoder.h: запись кадров time-lapse в несжатое видео Y4M в отдельном потоке
+//
+// Кадры передаются через ограниченную очередь: у кодировщика есть пул из capacity
+// буферов, и рисующий поток берёт свободный буфер (ожидая, если все заняты), заполняет
+// его и ставит в очередь. Поток записи переводит кадр в YUV 4:2:0 (BT.601, полный
+// диапазон - "C420jpeg") и возвращает буфер в пул. Память ограничена capacity кадрами,
+// а рисование и запись на диск идут параллельно.
+//
+// Y4M требует чётных размеров для 4:2:0, поэтому нечётные последний столбец и строка
+// отбрасываются.
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+class TimelapseEncoder {
+public:
+    TimelapseEncoder() : out(nullptr), width(0), height(0), sourceWidth(0), stopping(false), failed(false), framesWritten(0) {}
+    ~TimelapseEncoder() { Finish(); }
+
+    TimelapseEncoder(const TimelapseEncoder&) = delete;
+    TimelapseEncoder& operator=(const TimelapseEncoder&) = delete;
+
+    // Запуск потока записи; поток out должен жить до Finish
+    bool Start(std::ostream& stream, int frameWidth, int frameHeight, int fps, size_t capacity)
+    {
+        if (worker.joinable()) return false;
+
+        width = frameWidth & ~1;
+        height = frameHeight & ~1;
+        if (width <= 0 || height <= 0 || fps <= 0 || capacity == 0) return false;
+
+        out = &stream;
+        sourceWidth = frameWidth;
+        stopping = false;
+        failed = false;
+        framesWritten = 0;
+        pool.assign(capacity, std::vector<uint32_t>());
+        for (auto& frame : pool) frame.resize(static_cast<size_t>(frameWidth) * frameHeight);
+
+        char header[96];
+        snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+        *out << header;
+
+        worker = std::thread([this]() { Run(); });
+        return true;
+    }
+
+    // Свободный буфер кадра (frameWidth x frameHeight, 0xXXRRGGBB); ждёт, пока поток
+    // записи не освободит один из буферов пула
+    std::vector<uint32_t> AcquireFrame()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        freeReady.wait(lock, [this]() { return !pool.empty(); });
+        std::vector<uint32_t> frame = std::move(pool.back());
+        pool.pop_back();
+        return frame;
+    }
+
+    // Постановка заполненного кадра в очередь записи
+    void SubmitFrame(std::vector<uint32_t>&& frame)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(frame));
+        }
+        queueReady.notify_one();
+    }
+
+    // Дописывает оставшиеся кадры и останавливает поток; false - ошибка записи
+    bool Finish()
+    {
+        if (!worker.joinable()) return !failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queueReady.notify_one();
+        worker.join();
+
+        pool.clear();
+        out->flush();
+        return !failed && static_cast<bool>(*out);
+    }
+
+    size_t FramesWritten() const { return framesWritten; }
+
+private:
+    void Run()
+    {
+        std::vector<uint8_t> planes(static_cast<size_t>(width) * height * 3 / 2);
+
+        for (;;) {
+            std::vector<uint32_t> frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queueReady.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                frame = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            ConvertFrame(frame.data(), planes.data());
+            if (!failed) {
+                out->write("FRAME\n", 6);
+                out->write(reinterpret_cast<const char*>(planes.data()), static_cast<std::streamsize>(planes.size()));
+                if (!*out) failed = true;
+                framesWritten++;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pool.push_back(std::move(frame));
+            }
+            freeReady.notify_one();
+        }
+    }
+
+    // RGB -> Y для каждого пикселя, Cb и Cr - по среднему цвету квадрата 2x2
+    void ConvertFrame(const uint32_t* pixels, uint8_t* planes) const
+    {
+        uint8_t* yPlane = planes;
+        uint8_t* cbPlane = yPlane + static_cast<size_t>(width) * height;
+        uint8_t* crPlane = cbPlane + static_cast<size_t>(width / 2) * (height / 2);
+
+        for (int y = 0; y < height; y += 2) {
+            const uint32_t* row0 = pixels + static_cast<size_t>(y) * sourceWidth;
+            const uint32_t* row1 = row0 + sourceWidth;
+            uint8_t* y0 = yPlane + static_cast<size_t>(y) * width;
+            uint8_t* y1 = y0 + width;
+            uint8_t* cb = cbPlane + static_cast<size_t>(y / 2) * (width / 2);
+            uint8_t* cr = crPlane + static_cast<size_t>(y / 2) * (width / 2);
+
+            for (int x = 0; x < width; x += 2) {
+                const uint32_t quad[4] = { row0[x], row0[x + 1], row1[x], row1[x + 1] };
+                uint8_t* luma[4] = { y0 + x, y0 + x + 1, y1 + x, y1 + x + 1 };
+                int sumR = 0, sumG = 0, sumB = 0;
+                for (int i = 0; i < 4; i++) {
+                    int r = (quad[i] >> 16) & 0xFF, g = (quad[i] >> 8) & 0xFF, b = quad[i] & 0xFF;
+                    *luma[i] = static_cast<uint8_t>((77 * r + 150 * g + 29 * b + 128) >> 8);
+                    sumR += r;
+                    sumG += g;
+                    sumB += b;
+                }
+                // Коэффициенты умножены на 256, сумма четырёх пикселей - ещё на 4
+                cb[x / 2] = static_cast<uint8_t>(128 + ((-43 * sumR - 85 * sumG + 128 * sumB + 512) >> 10));
+                cr[x / 2] = static_cast<uint8_t>(128 + ((128 * sumR - 107 * sumG - 21 * sumB + 512) >> 10));
+            }
+        }
+    }
+
+    std::ostream* out;
+    int width, height;         // размеры видео (чётные)
+    int sourceWidth;           // длина строки кадра
+    bool stopping;
+    bool failed;
+    size_t framesWritten;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable queueReady;
+    std::condition_variable freeReady;
+    std::deque<std::vector<uint32_t>> queue;
+    std::vector<std::vector<uint32_t>> pool;
+};
@@ -0,0 +1,38 @@
+﻿// BenchRandom.h: общий генератор случайных чисел замеров и проверок - без окна и без GDI
+//
+// xorshift32 (Марсалья): последовательность задаётся только зерном и одинакова на любой
+// платформе и с любой стандартной библиотекой, поэтому синтетические документы и нагрузки
+// воспроизводятся точно. Один генератор на все замеры и проверки, а не копия в каждой.
+
+#pragma once
+
+#include <cstdint>
+
+struct BenchRandom {
+    uint32_t state;
+
+    explicit BenchRandom(uint32_t seed) : state(seed ? seed : 1) {}
+
+    uint32_t Next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // Целое из [0, limit)
+    int Below(int limit) { return static_cast<int>(Next() % static_cast<uint32_t>(limit)); }
+
+    // Целое из [low, high]
+    int Range(int low, int high)
+    {
+        return low + static_cast<int>(Next() % static_cast<uint32_t>(high - low + 1));
+    }
+
+    // Число из [0, 1) с 24 значащими битами
+    double Unit() { return (Next() >> 8) / 16777216.0; }
+
+    // Число из [low, high)
+    double Uniform(double low, double high) { return low + (high - low) * Unit(); }
+};
@@ -0,0 +1,189 @@
+﻿// Проверка градиентной заливки GradientFill.h - без окна и без GDI
+//
+// Случайные линейные и радиальные градиенты (в том числе вырожденные, короткие и
+// с концами далеко за холстом 4K) заполняются GradientSpan с любым началом и длиной
+// отрезка и сверяются с расчётом в double: каждый канал не дальше MAX_LEVEL_DELTA уровня.
+// Отдельные выборки GradientPixel должны совпадать с отрезками бит в бит, а пиксели
+// вне отрезка - остаться нетронутыми. Затем замер заливки всего холста 4K:
+// GradientSpan против попиксельного расчёта в double и memset того же объёма.
+// Генератор случайных чисел общий с замерами (BenchRandom.h):
+//   g++ -O2 -std=c++17 GradientFillCheck.cpp -o gradient-fill-check
+//
+// Код возврата 0 - все проверки прошли, 1 - найдено расхождение.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <chrono>
+
+#include "../SimplePaint/GradientFill.h"
+#include "BenchRandom.h"
+
+const int MAX_LEVEL_DELTA = 1;
+const int CANVAS_WIDTH = 3840, CANVAS_HEIGHT = 2160;
+
+int failures = 0;
+
+void Fail(const char* what, int index)
+{
+    if (failures < 20) printf("FAIL: %s (%d)\n", what, index);
+    failures++;
+}
+
+// Пиксель градиента в центре пикселя (x, y), расчёт в double
+uint32_t ReferencePixel(const Gradient& gradient, int x, int y)
+{
+    double ax = double(gradient.x1) - gradient.x0, ay = double(gradient.y1) - gradient.y0;
+    double length2 = ax * ax + ay * ay;
+    double dx = x + 0.5 - gradient.x0, dy = y + 0.5 - gradient.y0;
+
+    double t = 0.0;
+    if (length2 > 0.0) {
+        t = gradient.kind == GRADIENT_RADIAL ? std::sqrt((dx * dx + dy * dy) / length2) : (dx * ax + dy * ay) / length2;
+    }
+    t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+
+    uint32_t pixel = 0xFF000000u;
+    for (int shift = 0; shift <= 16; shift += 8) {
+        double from = (gradient.from >> shift) & 0xFF, to = (gradient.to >> shift) & 0xFF;
+        pixel |= static_cast<uint32_t>(std::floor(from + (to - from) * t + 0.5)) << shift;
+    }
+    return pixel;
+}
+
+int LevelDelta(uint32_t a, uint32_t b)
+{
+    int delta = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int d = std::abs(static_cast<int>((a >> shift) & 0xFF) - static_cast<int>((b >> shift) & 0xFF));
+        if (d > delta) delta = d;
+    }
+    return delta;
+}
+
+Gradient RandomGradient(BenchRandom& random, int n)
+{
+    Gradient gradient;
+    gradient.kind = n % 2 ? GRADIENT_RADIAL : GRADIENT_LINEAR;
+    gradient.from = random.Next() & 0x00FFFFFF;
+    gradient.to = random.Next() & 0x00FFFFFF;
+
+    // Концы - целые координаты, как у объектов редактора
+    gradient.x0 = static_cast<float>(random.Range(-500, CANVAS_WIDTH + 500));
+    gradient.y0 = static_cast<float>(random.Range(-500, CANVAS_HEIGHT + 500));
+    switch (n % 8 / 2) {
+    case 0:     // вырожденный: начало совпало с концом
+        gradient.x1 = gradient.x0;
+        gradient.y1 = gradient.y0;
+        break;
+    case 1:     // короткий: переход на нескольких пикселях
+        gradient.x1 = gradient.x0 + random.Range(-3, 3);
+        gradient.y1 = gradient.y0 + random.Range(-3, 3);
+        break;
+    default:
+        gradient.x1 = static_cast<float>(random.Range(-500, CANVAS_WIDTH + 500));
+        gradient.y1 = static_cast<float>(random.Range(-500, CANVAS_HEIGHT + 500));
+        break;
+    }
+    return gradient;
+}
+
+void CheckSpans(BenchRandom& random)
+{
+    const int GUARD = 8;
+    std::vector<uint32_t> row(CANVAS_WIDTH + 2 * GUARD);
+    size_t checked = 0, offByOne = 0;
+    int worst = 0;
+
+    for (int n = 0; n < 4000; n++) {
+        Gradient gradient = RandomGradient(random, n);
+        for (int line = 0; line < 4; line++) {
+            int y = random.Below(CANVAS_HEIGHT);
+            int left = random.Below(CANVAS_WIDTH);
+            int right = left + random.Below((line == 0 ? CANVAS_WIDTH : 40) + 1);
+            if (right > CANVAS_WIDTH) right = CANVAS_WIDTH;
+
+            for (uint32_t& pixel : row) pixel = 0x12345678;
+            uint32_t* canvasRow = row.data() + GUARD;
+            GradientSpan(gradient, y, left, right, canvasRow);
+
+            for (int x = -GUARD; x < CANVAS_WIDTH + GUARD; x++) {
+                if (x < left || x >= right) {
+                    if (canvasRow[x] != 0x12345678) Fail("pixel outside the span was written", n);
+                    continue;
+                }
+                int delta = LevelDelta(canvasRow[x], ReferencePixel(gradient, x, y));
+                checked++;
+                if (delta > worst) worst = delta;
+                if (delta > 0) offByOne++;
+                if (delta > MAX_LEVEL_DELTA) Fail(gradient.kind == GRADIENT_RADIAL ? "radial level" : "linear level", n);
+                if (canvasRow[x] != GradientPixel(gradient, x + 0.5f, y + 0.5f)) Fail("GradientPixel differs from GradientSpan", n);
+            }
+        }
+    }
+    printf("  %zu pixels, %zu off by one level (%.3f%%), max delta %d\n",
+        checked, offByOne, 100.0 * offByOne / checked, worst);
+}
+
+double ElapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Весь холст 4K строками: GradientSpan, расчёт в double и memset. Лучшее из repeat
+void TimeCanvas(const char* name, const Gradient& gradient)
+{
+    const int repeat = 10;
+    std::vector<uint32_t> canvas(static_cast<size_t>(CANVAS_WIDTH) * CANVAS_HEIGHT);
+    double spanMs = 0, referenceMs = 0, memsetMs = 0;
+
+    for (int r = 0; r < repeat; r++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int y = 0; y < CANVAS_HEIGHT; y++) {
+            GradientSpan(gradient, y, 0, CANVAS_WIDTH, &canvas[static_cast<size_t>(y) * CANVAS_WIDTH]);
+        }
+        double ms = ElapsedMs(start);
+        if (r == 0 || ms < spanMs) spanMs = ms;
+
+        if (r < 2) {
+            start = std::chrono::steady_clock::now();
+            for (int y = 0; y < CANVAS_HEIGHT; y++) {
+                uint32_t* row = &canvas[static_cast<size_t>(y) * CANVAS_WIDTH];
+                for (int x = 0; x < CANVAS_WIDTH; x++) row[x] = ReferencePixel(gradient, x, y);
+            }
+            ms = ElapsedMs(start);
+            if (r == 0 || ms < referenceMs) referenceMs = ms;
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (int y = 0; y < CANVAS_HEIGHT; y++) {
+            std::memset(&canvas[static_cast<size_t>(y) * CANVAS_WIDTH], 0, CANVAS_WIDTH * sizeof(uint32_t));
+        }
+        ms = ElapsedMs(start);
+        if (r == 0 || ms < memsetMs) memsetMs = ms;
+    }
+
+    printf("  %s: GradientSpan %.2f ms, double per pixel %.2f ms (x%.1f), memset %.2f ms\n",
+        name, spanMs, referenceMs, spanMs > 0 ? referenceMs / spanMs : 0.0, memsetMs);
+}
+
+int main()
+{
+    BenchRandom random(20240612);
+
+    printf("spans against the double reference:\n");
+    CheckSpans(random);
+
+    printf("%dx%d canvas:\n", CANVAS_WIDTH, CANVAS_HEIGHT);
+    TimeCanvas("linear", { GRADIENT_LINEAR, 0.0f, 0.0f, 3840.0f, 2160.0f, 0x102030, 0xF0E0D0 });
+    TimeCanvas("radial", { GRADIENT_RADIAL, 1920.0f, 1080.0f, 3840.0f, 2160.0f, 0x102030, 0xF0E0D0 });
+
+    if (failures) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,331 @@
+﻿// Проверка построчной закраски ScanlineFill.h - без окна и без GDI
+//
+// Случайные многоугольники (выпуклые, звёзды, самопересекающиеся, с вершинами на
+// центрах пикселей) растеризуются ScanPolygon по обоим правилам и сверяются попиксельно
+// с прямой проверкой центра пикселя на попадание в многоугольник (в double). Рёбра
+// в 16.16 накапливают ошибку шага, поэтому расхождение прощается, только если центр
+// пикселя лежит ближе SCAN_TOLERANCE к пересечению с каким-то ребром, и таких пикселей
+// должно быть не больше MAX_EDGE_MISMATCH от проверенных. Эллипсы и прямоугольники
+// сверяются так же, FillSpan - с поэлементным заполнением при любом выравнивании.
+// Затем замер: закраска больших фигур на холсте 4K против memset по тем же отрезкам.
+// Генератор случайных чисел общий с замерами (BenchRandom.h):
+//   g++ -O2 -std=c++17 ScanlineFillCheck.cpp -o scanline-fill-check
+//
+// Код возврата 0 - все проверки прошли, 1 - найдено расхождение.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <chrono>
+
+#include "../SimplePaint/ScanlineFill.h"
+#include "BenchRandom.h"
+
+const double SCAN_TOLERANCE = 1.0 / 64;     // пикселя, допуск пересечения с ребром
+const double MAX_EDGE_MISMATCH = 1e-4;      // доля проверенных пикселей
+
+int failures = 0;
+
+void Fail(const char* what, int index)
+{
+    if (failures < 20) printf("FAIL: %s (%d)\n", what, index);
+    failures++;
+}
+
+// Отрезки фигуры в байтовом растре: 1 - пиксель закрашен одним отрезком; заодно
+// проверяется, что отрезки лежат в clip, идут по строкам сверху вниз и не перекрываются
+struct SpanRaster {
+    MaskRect clip;
+    int width, height;
+    std::vector<uint8_t> cells;
+    int lastRow;
+    bool valid;
+
+    explicit SpanRaster(const MaskRect& clip)
+        : clip(clip), width(clip.right - clip.left), height(clip.bottom - clip.top),
+        cells(static_cast<size_t>(width) * height, 0), lastRow(clip.top), valid(true)
+    {
+    }
+
+    void Add(int y, int left, int right)
+    {
+        if (y < lastRow || y < clip.top || y >= clip.bottom || left < clip.left || right > clip.right || left >= right) {
+            valid = false;
+            return;
+        }
+        lastRow = y;
+        uint8_t* row = &cells[static_cast<size_t>(y - clip.top) * width - clip.left];
+        for (int x = left; x < right; x++) {
+            if (row[x]++) valid = false;
+        }
+    }
+
+    bool At(int x, int y) const { return cells[static_cast<size_t>(y - clip.top) * width + (x - clip.left)] != 0; }
+};
+
+// Центр пикселя (px, py) внутри многоугольника: пересечения рёбер со строкой py левее
+// или на px, рёбра полуоткрыты снизу - как у ScanPolygon. nearEdge - пересечение ближе
+// SCAN_TOLERANCE (результат ScanPolygon здесь может честно отличаться)
+bool InsidePolygon(const std::vector<ScanPoint>& points, FillRule rule, double px, double py, bool& nearEdge)
+{
+    int winding = 0;
+    nearEdge = false;
+    for (size_t i = 0; i < points.size(); i++) {
+        double ax = points[i].x / double(SCAN_ONE), ay = points[i].y / double(SCAN_ONE);
+        const ScanPoint& next = points[(i + 1) % points.size()];
+        double bx = next.x / double(SCAN_ONE), by = next.y / double(SCAN_ONE);
+        int direction = 1;
+        if (ay > by) {
+            std::swap(ax, bx);
+            std::swap(ay, by);
+            direction = -1;
+        }
+        if (py < ay || py >= by) continue;
+
+        double x = ax + (bx - ax) * (py - ay) / (by - ay);
+        if (std::fabs(x - px) < SCAN_TOLERANCE) nearEdge = true;
+        if (x <= px) winding += direction;
+    }
+    return rule == FILL_EVEN_ODD ? (winding & 1) != 0 : winding != 0;
+}
+
+// Случайный многоугольник в рамке size x size со сдвигом (offset, offset)
+std::vector<ScanPoint> RandomPolygon(BenchRandom& random, int kind, int size, int offset)
+{
+    std::vector<ScanPoint> points;
+    auto fixed = [](double v) { return static_cast<int32_t>(std::lround(v * SCAN_ONE)); };
+    double center = offset + size / 2.0;
+
+    if (kind == 0 || kind == 1) {
+        // Выпуклый (по кругу) или звезда (чередование радиусов)
+        int count = 3 + random.Below(30);
+        for (int i = 0; i < count; i++) {
+            double angle = 6.283185307179586 * (i + random.Unit() * 0.5) / count;
+            double radius = size / 2.0 * (kind == 1 && (i & 1) ? 0.3 + 0.3 * random.Unit() : 0.9 + 0.1 * random.Unit());
+            points.push_back({ fixed(center + radius * std::cos(angle)), fixed(center + radius * std::sin(angle)) });
+        }
+    }
+    else if (kind == 2) {
+        // Самопересекающийся: вершины где угодно в рамке
+        int count = 3 + random.Below(40);
+        for (int i = 0; i < count; i++) {
+            points.push_back({ fixed(offset + random.Unit() * size), fixed(offset + random.Unit() * size) });
+        }
+    }
+    else {
+        // Вершины в центрах пикселей и на их границах: рёбра проходят прямо через центры
+        int count = 3 + random.Below(12);
+        for (int i = 0; i < count; i++) {
+            points.push_back({ (offset + random.Below(size)) * SCAN_ONE + random.Below(2) * SCAN_HALF,
+                (offset + random.Below(size)) * SCAN_ONE + random.Below(2) * SCAN_HALF });
+        }
+    }
+    return points;
+}
+
+void CheckPolygons(BenchRandom& random)
+{
+    size_t checked = 0, nearEdge = 0, tolerated = 0;
+    for (int n = 0; n < 3000; n++) {
+        int kind = n % 4;
+        int size = 8 + random.Below(n < 2800 ? 120 : 900);
+        int offset = random.Below(40) - 20;
+        std::vector<ScanPoint> points = RandomPolygon(random, kind, size, offset);
+        FillRule rule = random.Below(2) ? FILL_NON_ZERO : FILL_EVEN_ODD;
+
+        // Обрезка: то вся фигура с запасом, то её часть
+        MaskRect clip = { offset - 4, offset - 4, offset + size + 4, offset + size + 4 };
+        if (random.Below(3) == 0) {
+            clip.left += random.Below(size / 2 + 1);
+            clip.top += random.Below(size / 2 + 1);
+            clip.right -= random.Below(size / 2 + 1);
+            clip.bottom -= random.Below(size / 2 + 1);
+        }
+
+        SpanRaster raster(clip);
+        ScanPolygon(points.data(), points.size(), rule, clip, [&](int y, int left, int right) { raster.Add(y, left, right); });
+        if (!raster.valid) {
+            Fail("polygon spans outside clip, out of order or overlapping", n);
+            continue;
+        }
+
+        for (int y = clip.top; y < clip.bottom; y++) {
+            for (int x = clip.left; x < clip.right; x++) {
+                bool near;
+                bool inside = InsidePolygon(points, rule, x + 0.5, y + 0.5, near);
+                checked++;
+                if (near) nearEdge++;
+                if (inside == raster.At(x, y)) continue;
+                if (near) tolerated++;
+                else Fail(rule == FILL_EVEN_ODD ? "even-odd pixel" : "non-zero pixel", n);
+            }
+        }
+    }
+
+    printf("  %zu pixels, %zu within %.4f px of an edge, %zu of them differ (%.5f%%)\n",
+        checked, nearEdge, SCAN_TOLERANCE, tolerated, 100.0 * tolerated / checked);
+    if (tolerated > checked * MAX_EDGE_MISMATCH) Fail("too many edge mismatches", static_cast<int>(tolerated));
+}
+
+void CheckEllipses(BenchRandom& random)
+{
+    size_t checked = 0, tolerated = 0;
+    for (int n = 0; n < 2000; n++) {
+        int left = random.Below(60) - 30, top = random.Below(60) - 30;
+        int right = left + random.Below(n < 1900 ? 150 : 1200), bottom = top + random.Below(150);
+        MaskRect clip = { left - 3 + random.Below(20), top - 3 + random.Below(20), right + 3 - random.Below(20), bottom + 3 - random.Below(20) };
+        if (clip.left >= clip.right || clip.top >= clip.bottom) continue;
+
+        SpanRaster raster(clip);
+        ScanEllipse(left, top, right, bottom, clip, [&](int y, int l, int r) { raster.Add(y, l, r); });
+        if (!raster.valid) {
+            Fail("ellipse spans outside clip, out of order or overlapping", n);
+            continue;
+        }
+
+        double cx = (left + right) / 2.0, cy = (top + bottom) / 2.0;
+        double rx = (right - left) / 2.0, ry = (bottom - top) / 2.0;
+        for (int y = clip.top; y < clip.bottom; y++) {
+            for (int x = clip.left; x < clip.right; x++) {
+                bool inside = false, near = false;
+                if (rx > 0 && ry > 0) {
+                    double dx = (x + 0.5 - cx) / rx, dy = (y + 0.5 - cy) / ry;
+                    double d = dx * dx + dy * dy;
+                    inside = d < 1.0;
+                    near = std::fabs(d - 1.0) < 1e-9 || std::fabs(std::fabs(x + 0.5 - cx) - rx * std::sqrt(std::fabs(1.0 - dy * dy))) < 1e-9;
+                }
+                checked++;
+                if (inside == raster.At(x, y)) continue;
+                if (near) tolerated++;
+                else Fail("ellipse pixel", n);
+            }
+        }
+    }
+    printf("  %zu pixels, %zu boundary ties\n", checked, tolerated);
+}
+
+void CheckRectangles(BenchRandom& random)
+{
+    for (int n = 0; n < 1000; n++) {
+        int left = random.Below(100) - 50, top = random.Below(100) - 50;
+        int right = left + random.Below(120) - 10, bottom = top + random.Below(120) - 10;
+        MaskRect clip = { random.Below(40) - 40, random.Below(40) - 40, random.Below(80) + 1, random.Below(80) + 1 };
+
+        SpanRaster raster(clip);
+        ScanRectangle(left, top, right, bottom, clip, [&](int y, int l, int r) { raster.Add(y, l, r); });
+        if (!raster.valid) {
+            Fail("rectangle spans outside clip, out of order or overlapping", n);
+            continue;
+        }
+        for (int y = clip.top; y < clip.bottom; y++) {
+            for (int x = clip.left; x < clip.right; x++) {
+                bool inside = x >= left && x < right && y >= top && y < bottom;
+                if (inside != raster.At(x, y)) Fail("rectangle pixel", n);
+            }
+        }
+    }
+}
+
+// FillSpan при любом выравнивании начала и длине: пиксели вне [left, right) не трогаются
+void CheckFillSpan(BenchRandom& random)
+{
+    std::vector<uint32_t> row(256), expected(256);
+    for (int n = 0; n < 20000; n++) {
+        for (size_t i = 0; i < row.size(); i++) row[i] = expected[i] = random.Next();
+        int left = random.Below(40), right = left + random.Below(200);
+        uint32_t value = random.Next();
+        for (int x = left; x < right; x++) expected[x] = value;
+
+        FillSpan(row.data(), left, right, value);
+        if (row != expected) Fail("FillSpan", n);
+    }
+}
+
+double ElapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Закраска фигуры на холсте 4K: ScanPolygon/ScanEllipse с FillSpan, затем FillSpan и
+// memset по заранее собранным отрезкам. Лучшее из repeat.
+template <typename Scan>
+void TimeShape(const char* name, Scan scan)
+{
+    const int width = 3840, height = 2160, repeat = 20;
+    std::vector<uint32_t> canvas(static_cast<size_t>(width) * height);
+    MaskRect clip = { 0, 0, width, height };
+
+    struct Span { int y, left, right; };
+    std::vector<Span> spans;
+    scan(clip, [&](int y, int left, int right) { spans.push_back({ y, left, right }); });
+    size_t pixels = 0;
+    for (const Span& span : spans) pixels += span.right - span.left;
+
+    double scanMs = 0, fillMs = 0, memsetMs = 0;
+    for (int r = 0; r < repeat; r++) {
+        auto start = std::chrono::steady_clock::now();
+        scan(clip, [&](int y, int left, int right) { FillSpan(&canvas[static_cast<size_t>(y) * width], left, right, 0xFF336699); });
+        double ms = ElapsedMs(start);
+        if (r == 0 || ms < scanMs) scanMs = ms;
+
+        start = std::chrono::steady_clock::now();
+        for (const Span& span : spans) FillSpan(&canvas[static_cast<size_t>(span.y) * width], span.left, span.right, 0xFF336699);
+        ms = ElapsedMs(start);
+        if (r == 0 || ms < fillMs) fillMs = ms;
+
+        start = std::chrono::steady_clock::now();
+        for (const Span& span : spans) {
+            std::memset(&canvas[static_cast<size_t>(span.y) * width + span.left], 0, (span.right - span.left) * sizeof(uint32_t));
+        }
+        ms = ElapsedMs(start);
+        if (r == 0 || ms < memsetMs) memsetMs = ms;
+    }
+
+    printf("  %s: %zu spans, %.1f Mpixels; scan+fill %.2f ms, fill %.2f ms, memset %.2f ms (x%.2f of memset)\n",
+        name, spans.size(), pixels / 1e6, scanMs, fillMs, memsetMs, memsetMs > 0 ? scanMs / memsetMs : 0.0);
+}
+
+void TimeFills(BenchRandom& random)
+{
+    std::vector<ScanPoint> star = RandomPolygon(random, 1, 2100, 870);
+    std::vector<ScanPoint> scribble = RandomPolygon(random, 2, 2100, 870);
+    for (int i = 0; i < 200; i++) {
+        scribble.push_back({ (870 + random.Below(2100)) * SCAN_ONE, (30 + random.Below(2100)) * SCAN_ONE });
+    }
+
+    TimeShape("ellipse 3840x2160", [&](const MaskRect& clip, auto span) { ScanEllipse(0, 0, 3840, 2160, clip, span); });
+    TimeShape("star polygon", [&](const MaskRect& clip, auto span) {
+        ScanPolygon(star.data(), star.size(), FILL_NON_ZERO, clip, span);
+    });
+    TimeShape("self-intersecting polygon, even-odd", [&](const MaskRect& clip, auto span) {
+        ScanPolygon(scribble.data(), scribble.size(), FILL_EVEN_ODD, clip, span);
+    });
+}
+
+int main()
+{
+    BenchRandom random(20240611);
+
+    printf("polygons against point-in-polygon:\n");
+    CheckPolygons(random);
+
+    printf("ellipses against the implicit equation:\n");
+    CheckEllipses(random);
+
+    printf("rectangles and FillSpan:\n");
+    CheckRectangles(random);
+    CheckFillSpan(random);
+    printf("  done\n");
+
+    printf("4K fills against memset over the same spans:\n");
+    TimeFills(random);
+
+    if (failures) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,212 @@
+﻿// Консольный рендерер документов SimplePaint (.spd) - без окна и без GDI
+//
+// Растеризует документ в любом масштабе (миниатюры, печать) и пишет BMP.
+// Собирается и на Linux-сервере без дисплея:
+//   g++ -O2 -std=c++17 -pthread SimplePaintRender.cpp -o simplepaint-render
+//
+// Использование:
+//   simplepaint-render <документ.spd> <результат.bmp> [--scale S] [--width W]
+//                      [--supersample N] [--tile N] [--threads N]
+// Значения параметров проверяются: результат должен помещаться в BMP (файл меньше 2 ГБ),
+// суперсэмплинг - не больше RENDER_MAX_SUPERSAMPLE, плитка и число потоков - положительные.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fstream>
+#include <chrono>
+#include <cerrno>
+#include <new>
+
+#include "../SimplePaint/SoftRaster.h"
+
+const int64_t BMP_HEADER_BYTES = 14 + 40;
+const int64_t BMP_MAX_FILE_BYTES = 0x7FFFFFFF;   // размер файла в заголовке читают как int32
+const int MAX_THREADS = 1024;
+
+// Байт пикселей 24-битного BMP (строка выравнивается до 4 байт)
+int64_t BmpDataSize(int64_t width, int64_t height)
+{
+    return ((width * 3 + 3) & ~int64_t(3)) * height;
+}
+
+// Запись 24-битного BMP (строки снизу вверх, выравнивание строки до 4 байт)
+bool WriteBmp(const char* path, const RenderedImage& image)
+{
+    if (BmpDataSize(image.width, image.height) > BMP_MAX_FILE_BYTES - BMP_HEADER_BYTES) return false;
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+
+    uint32_t rowBytes = (static_cast<uint32_t>(image.width) * 3 + 3) & ~3u;
+    uint32_t dataSize = static_cast<uint32_t>(BmpDataSize(image.width, image.height));
+
+    auto put16 = [&](uint16_t value) {
+        char bytes[2] = { static_cast<char>(value & 0xFF), static_cast<char>(value >> 8) };
+        out.write(bytes, 2);
+    };
+    auto put32 = [&](uint32_t value) {
+        put16(static_cast<uint16_t>(value & 0xFFFF));
+        put16(static_cast<uint16_t>(value >> 16));
+    };
+
+    // BITMAPFILEHEADER + BITMAPINFOHEADER
+    out.write("BM", 2);
+    put32(static_cast<uint32_t>(BMP_HEADER_BYTES) + dataSize);
+    put32(0);
+    put32(static_cast<uint32_t>(BMP_HEADER_BYTES));
+    put32(40);
+    put32(static_cast<uint32_t>(image.width));
+    put32(static_cast<uint32_t>(image.height));
+    put16(1);
+    put16(24);
+    put32(0);
+    put32(dataSize);
+    put32(2835);
+    put32(2835);
+    put32(0);
+    put32(0);
+
+    std::vector<char> row(rowBytes, 0);
+    for (int y = image.height - 1; y >= 0; y--) {
+        const uint32_t* pixels = &image.pixels[static_cast<size_t>(y) * image.width];
+        for (int x = 0; x < image.width; x++) {
+            row[x * 3 + 0] = static_cast<char>(pixels[x] & 0xFF);
+            row[x * 3 + 1] = static_cast<char>((pixels[x] >> 8) & 0xFF);
+            row[x * 3 + 2] = static_cast<char>((pixels[x] >> 16) & 0xFF);
+        }
+        out.write(row.data(), rowBytes);
+    }
+    return static_cast<bool>(out);
+}
+
+void PrintUsage()
+{
+    std::fprintf(stderr,
+        "usage: simplepaint-render <document.spd> <output.bmp> [options]\n"
+        "  --scale S        output pixels per canvas pixel (default 1)\n"
+        "  --width W        output width in pixels (overrides --scale)\n"
+        "  --supersample N  N x N samples per pixel, 1..%d (default 1)\n"
+        "  --tile N         tile size in output pixels, 16..%d (default 256)\n"
+        "  --threads N      worker threads, 1..%d (default: all cores)\n"
+        "The output BMP must stay under 2 GiB.\n",
+        RENDER_MAX_SUPERSAMPLE, RENDER_MAX_TILE, MAX_THREADS);
+}
+
+// Целое в [minValue, maxValue] без лишних символов
+bool ParseInt(const char* text, long minValue, long maxValue, int& value)
+{
+    char* end;
+    errno = 0;
+    long parsed = std::strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < minValue || parsed > maxValue) return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+// Конечное положительное число без лишних символов
+bool ParseScale(const char* text, double& value)
+{
+    char* end;
+    double parsed = std::strtod(text, &end);
+    if (end == text || *end != '\0' || !(parsed > 0) || !std::isfinite(parsed)) return false;
+    value = parsed;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        PrintUsage();
+        return 2;
+    }
+
+    const char* inputPath = argv[1];
+    const char* outputPath = argv[2];
+    RenderOptions options;
+    int width = 0;
+
+    for (int i = 3; i < argc; i++) {
+        const char* name = argv[i];
+        const char* value = i + 1 < argc ? argv[++i] : nullptr;
+        bool valid;
+        if (!value) {
+            PrintUsage();
+            return 2;
+        }
+        else if (std::strcmp(name, "--scale") == 0) {
+            valid = ParseScale(value, options.scale);
+        }
+        else if (std::strcmp(name, "--width") == 0) {
+            valid = ParseInt(value, 1, INT32_MAX, width);
+        }
+        else if (std::strcmp(name, "--supersample") == 0) {
+            valid = ParseInt(value, 1, RENDER_MAX_SUPERSAMPLE, options.supersample);
+        }
+        else if (std::strcmp(name, "--tile") == 0) {
+            valid = ParseInt(value, 16, RENDER_MAX_TILE, options.tileSize);
+        }
+        else if (std::strcmp(name, "--threads") == 0) {
+            valid = ParseInt(value, 1, MAX_THREADS, options.threads);
+        }
+        else {
+            PrintUsage();
+            return 2;
+        }
+        if (!valid) {
+            std::fprintf(stderr, "invalid value for %s: %s\n", name, value);
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    std::ifstream in(inputPath, std::ios::binary);
+    PaintDocument doc;
+    if (!in || !LoadDocument(in, doc)) {
+        std::fprintf(stderr, "cannot read document %s\n", inputPath);
+        return 1;
+    }
+
+    if (width > 0 && doc.width > 0) {
+        options.scale = static_cast<double>(width) / doc.width;
+    }
+    int64_t outputWidth, outputHeight;
+    if (!RenderedSize(doc, options.scale, outputWidth, outputHeight) ||
+        BmpDataSize(outputWidth, outputHeight) > BMP_MAX_FILE_BYTES - BMP_HEADER_BYTES) {
+        std::fprintf(stderr, "output of %gx the %dx%d canvas does not fit a BMP under 2 GiB\n",
+            options.scale, doc.width, doc.height);
+        return 2;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    RenderStats stats;
+    RenderedImage image;
+    try {
+        image = RenderDocument(doc, options, &stats);
+    }
+    catch (const std::bad_alloc&) {
+        std::fprintf(stderr, "not enough memory for a %lldx%lld image\n",
+            static_cast<long long>(outputWidth), static_cast<long long>(outputHeight));
+        return 1;
+    }
+    auto rendered = std::chrono::steady_clock::now();
+
+    if (!WriteBmp(outputPath, image)) {
+        std::fprintf(stderr, "cannot write %s\n", outputPath);
+        return 1;
+    }
+    auto written = std::chrono::steady_clock::now();
+
+    size_t objects = 0;
+    for (const auto& layer : doc.layers) objects += layer.objects.size();
+
+    double renderMs = std::chrono::duration<double, std::milli>(rendered - start).count();
+    double writeMs = std::chrono::duration<double, std::milli>(written - rendered).count();
+    std::printf("%s: %dx%d, %zu layers, %zu objects -> %dx%d (x%g, %dx%d samples)\n",
+        inputPath, doc.width, doc.height, doc.layers.size(), objects,
+        image.width, image.height, options.scale, options.supersample, options.supersample);
+    std::printf("render %.1f ms (%lld tiles, %d threads, %zu tile/object tests), write %.1f ms\n",
+        renderMs, static_cast<long long>(stats.tiles), stats.threads, stats.objectTests, writeMs);
+    return 0;
+}
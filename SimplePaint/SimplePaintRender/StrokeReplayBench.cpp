@@ -0,0 +1,384 @@
+﻿// Замер упрощения штрихов (StrokeSimplify.h): сколько точек остаётся и насколько
+// быстрее переигрывается документ - без окна и без GDI
+//
+// Штрихи карандаша и ластика собираются в цепочки так же, как SimplifyCommittedStroke:
+// сегменты одного вида, у которых начало совпадает с концом предыдущего. Цепочки
+// упрощаются с допуском StrokeTolerance(толщина), после чего исходный и упрощённый
+// документы переигрываются программным растеризатором (SoftRaster.h) в один поток.
+// Без документа используются синтетические штрихи с фиксированным зерном, поэтому
+// число точек воспроизводится точно, а время зависит только от машины:
+//   g++ -O2 -std=c++17 -pthread StrokeReplayBench.cpp -o stroke-replay-bench
+//
+// Расхождение считается двумя мерами. Сдвиг края: каждая цепочка до и после упрощения
+// рисуется отдельно, чтобы её не заслоняли другие штрихи, и для каждого пикселя штриха,
+// которого нет в другой отрисовке, ищется ближайший пиксель штриха в ней (расстояние
+// Хаусдорфа между штрихами). Наибольшее расстояние не должно превышать --max-shift (по умолчанию 1 пиксель: допуск упрощения не больше 0.75,
+// остальное - округление до пикселей). Разница каналов считается по сглаженной отрисовке
+// всего документа (--supersample) и только выводится: сдвиг края на долю пикселя меняет
+// покрытие на ту же долю, а не на один уровень.
+//
+// Использование:
+//   stroke-replay-bench [документ.spd] [--strokes N] [--seed S] [--repeat R]
+//                       [--max-shift D] [--supersample N]
+// Код возврата 1 - край какой-то цепочки сдвинулся дальше --max-shift.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <fstream>
+#include <chrono>
+
+#include "../SimplePaint/SoftRaster.h"
+#include "../SimplePaint/StrokeSimplify.h"
+#include "BenchRandom.h"
+
+DocObject MakeSegment(int type, int thickness, uint32_t color, const StrokePoint& a, const StrokePoint& b)
+{
+    DocObject obj = {};
+    obj.type = type;
+    obj.startX = a.x;
+    obj.startY = a.y;
+    obj.endX = b.x;
+    obj.endY = b.y;
+    obj.thickness = thickness;
+    obj.color = color;
+    return obj;
+}
+
+// Штрихи рукой: позиции мыши на каждом WM_MOUSEMOVE с плавно меняющимися скоростью
+// и направлением; повторы одной и той же точки не порождают сегментов
+PaintDocument SyntheticDocument(int strokes, uint32_t seed)
+{
+    BenchRandom random(seed);
+    PaintDocument doc;
+    doc.width = 1280;
+    doc.height = 800;
+    doc.layers.resize(1);
+    doc.layers[0].visible = true;
+    doc.layers[0].opacity = 255;
+
+    for (int s = 0; s < strokes; s++) {
+        int type = random.Next() % 8 == 0 ? DOC_ERASER : DOC_PENCIL;
+        int thickness = 1 + static_cast<int>(random.Next() % 8);
+        uint32_t color = random.Next() & 0x00FFFFFF;
+
+        double x = random.Uniform(100, doc.width - 100);
+        double y = random.Uniform(100, doc.height - 100);
+        double heading = random.Uniform(0, 6.2831853);
+        double turn = 0, speed = random.Uniform(1, 6);
+        int events = 40 + static_cast<int>(random.Next() % 400);
+
+        StrokePoint last = { static_cast<int>(std::lround(x)), static_cast<int>(std::lround(y)) };
+        for (int e = 0; e < events; e++) {
+            turn += random.Uniform(-0.02, 0.02);
+            if (turn > 0.12) turn = 0.12;
+            if (turn < -0.12) turn = -0.12;
+            speed += random.Uniform(-0.6, 0.6);
+            if (speed < 0.3) speed = 0.3;
+            if (speed > 14) speed = 14;
+
+            heading += turn;
+            x += speed * std::cos(heading) + random.Uniform(-0.4, 0.4);
+            y += speed * std::sin(heading) + random.Uniform(-0.4, 0.4);
+            if (x < 0 || y < 0 || x >= doc.width || y >= doc.height) break;
+
+            StrokePoint point = { static_cast<int>(std::lround(x)), static_cast<int>(std::lround(y)) };
+            if (point.x == last.x && point.y == last.y) continue;
+            doc.layers[0].objects.push_back(MakeSegment(type, thickness, color, last, point));
+            last = point;
+        }
+    }
+    return doc;
+}
+
+bool ContinuesStroke(const DocObject& prev, const DocObject& obj)
+{
+    return obj.type == prev.type && obj.thickness == prev.thickness && obj.color == prev.color &&
+        obj.clipped == prev.clipped && obj.clipMask == prev.clipMask &&
+        obj.startX == prev.endX && obj.startY == prev.endY;
+}
+
+// Цепочка в слое layer: объекты [begin, end) исходного документа и
+// [simplifiedBegin, simplifiedEnd) упрощённого
+struct ChainRange {
+    size_t layer;
+    size_t begin, end;
+    size_t simplifiedBegin, simplifiedEnd;
+};
+
+// Документ, в котором каждая цепочка сегментов карандаша и ластика упрощена
+PaintDocument SimplifyDocument(const PaintDocument& doc, size_t& pointsBefore, size_t& pointsAfter,
+    std::vector<ChainRange>& chains)
+{
+    PaintDocument result = doc;
+    pointsBefore = pointsAfter = 0;
+    chains.clear();
+
+    for (size_t l = 0; l < doc.layers.size(); l++) {
+        const std::vector<DocObject>& objects = doc.layers[l].objects;
+        std::vector<DocObject>& simplifiedObjects = result.layers[l].objects;
+        simplifiedObjects.clear();
+
+        for (size_t i = 0; i < objects.size();) {
+            const DocObject& proto = objects[i];
+            if (proto.type != DOC_PENCIL && proto.type != DOC_ERASER) {
+                simplifiedObjects.push_back(proto);
+                i++;
+                continue;
+            }
+
+            std::vector<StrokePoint> points;
+            points.push_back({ proto.startX, proto.startY });
+            size_t end = i;
+            do {
+                points.push_back({ objects[end].endX, objects[end].endY });
+                end++;
+            } while (end < objects.size() && ContinuesStroke(objects[end - 1], objects[end]));
+
+            std::vector<StrokePoint> simplified = SimplifyStroke(points, StrokeTolerance(proto.thickness));
+            size_t simplifiedBegin = simplifiedObjects.size();
+            for (size_t k = 1; k < simplified.size(); k++) {
+                DocObject segment = proto;
+                segment.startX = simplified[k - 1].x;
+                segment.startY = simplified[k - 1].y;
+                segment.endX = simplified[k].x;
+                segment.endY = simplified[k].y;
+                simplifiedObjects.push_back(segment);
+            }
+
+            pointsBefore += points.size();
+            pointsAfter += simplified.size();
+            chains.push_back({ l, i, end, simplifiedBegin, simplifiedObjects.size() });
+            i = end;
+        }
+    }
+    return result;
+}
+
+// Лучшее время из repeat переигрываний
+double ReplayMs(const PaintDocument& doc, int repeat, RenderedImage& image)
+{
+    RenderOptions options;
+    options.threads = 1;
+
+    double best = 0;
+    for (int r = 0; r < repeat; r++) {
+        auto start = std::chrono::steady_clock::now();
+        image = RenderDocument(doc, options);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (r == 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+const int SHIFT_SEARCH = 4;   // радиус поиска сдвинутого края, пикселей
+
+const uint32_t SHIFT_INK = 0xFF000000;   // цвет цепочки при отдельной отрисовке
+
+// Расстояние от (x, y) до ближайшего пикселя штриха в image; если такого нет
+// в радиусе SHIFT_SEARCH - SHIFT_SEARCH + 1
+double NearestInk(const RenderedImage& image, int x, int y)
+{
+    int best = (SHIFT_SEARCH + 1) * (SHIFT_SEARCH + 1);
+    for (int dy = -SHIFT_SEARCH; dy <= SHIFT_SEARCH; dy++) {
+        int py = y + dy;
+        if (py < 0 || py >= image.height) continue;
+        for (int dx = -SHIFT_SEARCH; dx <= SHIFT_SEARCH; dx++) {
+            int px = x + dx;
+            if (px < 0 || px >= image.width || dx * dx + dy * dy >= best) continue;
+            if (image.pixels[static_cast<size_t>(py) * image.width + px] == SHIFT_INK) best = dx * dx + dy * dy;
+        }
+    }
+    return std::sqrt(static_cast<double>(best));
+}
+
+// Наибольший сдвиг края цепочки: исходные и упрощённые сегменты рисуются карандашом
+// цвета SHIFT_INK без обрезки на своём холсте по габариту цепочки, без сглаживания
+double ChainShift(const DocObject* original, size_t originalCount, const DocObject* simplified, size_t simplifiedCount)
+{
+    int left = original[0].startX, top = original[0].startY, right = left, bottom = top, thickness = 1;
+    for (size_t i = 0; i < originalCount; i++) {
+        left = std::min(left, std::min(original[i].startX, original[i].endX));
+        top = std::min(top, std::min(original[i].startY, original[i].endY));
+        right = std::max(right, std::max(original[i].startX, original[i].endX));
+        bottom = std::max(bottom, std::max(original[i].startY, original[i].endY));
+        thickness = std::max(thickness, original[i].thickness);
+    }
+    int margin = thickness + SHIFT_SEARCH + 2;
+
+    PaintDocument doc;
+    doc.width = right - left + 2 * margin;
+    doc.height = bottom - top + 2 * margin;
+    doc.layers.push_back({ u"", true, 255, {} });
+
+    RenderOptions options;
+    options.threads = 1;
+    auto render = [&](const DocObject* objects, size_t count) {
+        doc.layers[0].objects.clear();
+        for (size_t i = 0; i < count; i++) {
+            DocObject obj = objects[i];
+            obj.type = DOC_PENCIL;
+            obj.color = 0;            // SHIFT_INK
+            obj.clipped = false;
+            obj.startX += margin - left;
+            obj.startY += margin - top;
+            obj.endX += margin - left;
+            obj.endY += margin - top;
+            doc.layers[0].objects.push_back(obj);
+        }
+        return RenderDocument(doc, options);
+    };
+    RenderedImage before = render(original, originalCount);
+    RenderedImage after = render(simplified, simplifiedCount);
+
+    double maxShift = 0;
+    for (int y = 0; y < before.height; y++) {
+        for (int x = 0; x < before.width; x++) {
+            size_t i = static_cast<size_t>(y) * before.width + x;
+            if (before.pixels[i] == after.pixels[i]) continue;
+            double shift = before.pixels[i] == SHIFT_INK ? NearestInk(after, x, y) : NearestInk(before, x, y);
+            if (shift > maxShift) maxShift = shift;
+        }
+    }
+    return maxShift;
+}
+
+// Наибольшая разница одного канала
+int MaxChannelDelta(const RenderedImage& a, const RenderedImage& b)
+{
+    int maxDelta = 0;
+    for (size_t i = 0; i < a.pixels.size(); i++) {
+        for (int shift = 0; shift < 24; shift += 8) {
+            int delta = std::abs(static_cast<int>((a.pixels[i] >> shift) & 0xFF) -
+                static_cast<int>((b.pixels[i] >> shift) & 0xFF));
+            if (delta > maxDelta) maxDelta = delta;
+        }
+    }
+    return maxDelta;
+}
+
+size_t CountObjects(const PaintDocument& doc)
+{
+    size_t objects = 0;
+    for (const auto& layer : doc.layers) objects += layer.objects.size();
+    return objects;
+}
+
+void PrintUsage()
+{
+    std::fprintf(stderr, "usage: stroke-replay-bench [document.spd] [--strokes N] [--seed S] [--repeat R]\n"
+        "                           [--max-shift D] [--supersample N]\n"
+        "  --max-shift D    largest allowed edge shift in pixels (default 1)\n"
+        "  --supersample N  N x N samples for the channel delta, 1..%d (default 4)\n",
+        RENDER_MAX_SUPERSAMPLE);
+}
+
+int main(int argc, char** argv)
+{
+    const char* inputPath = nullptr;
+    int strokes = 400;
+    uint32_t seed = 2024;
+    int repeat = 5;
+    double maxAllowedShift = 1.0;
+    int supersample = 4;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--strokes") == 0 && hasValue) {
+            strokes = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--seed") == 0 && hasValue) {
+            seed = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (std::strcmp(argv[i], "--repeat") == 0 && hasValue) {
+            repeat = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--max-shift") == 0 && hasValue) {
+            maxAllowedShift = std::atof(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--supersample") == 0 && hasValue) {
+            supersample = std::atoi(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && !inputPath) {
+            inputPath = argv[i];
+        }
+        else {
+            PrintUsage();
+            return 2;
+        }
+    }
+    if (strokes <= 0 || repeat <= 0 || !(maxAllowedShift >= 0) ||
+        supersample < 1 || supersample > RENDER_MAX_SUPERSAMPLE) {
+        PrintUsage();
+        return 2;
+    }
+
+    PaintDocument doc;
+    if (inputPath) {
+        std::ifstream in(inputPath, std::ios::binary);
+        if (!in || !LoadDocument(in, doc)) {
+            std::fprintf(stderr, "cannot read document %s\n", inputPath);
+            return 1;
+        }
+        std::printf("%s: %dx%d, %zu objects\n", inputPath, doc.width, doc.height, CountObjects(doc));
+    }
+    else {
+        doc = SyntheticDocument(strokes, seed);
+        std::printf("synthetic: %d strokes, seed %u, %dx%d, %zu objects\n",
+            strokes, seed, doc.width, doc.height, CountObjects(doc));
+    }
+
+    size_t pointsBefore, pointsAfter;
+    std::vector<ChainRange> chains;
+    PaintDocument simplified = SimplifyDocument(doc, pointsBefore, pointsAfter, chains);
+    if (chains.empty()) {
+        std::printf("no pencil or eraser strokes\n");
+        return 0;
+    }
+
+    RenderedImage original, replayed;
+    double originalMs = ReplayMs(doc, repeat, original);
+    double simplifiedMs = ReplayMs(simplified, repeat, replayed);
+
+    size_t differing = 0;
+    for (size_t i = 0; i < original.pixels.size(); i++) {
+        if (original.pixels[i] != replayed.pixels[i]) differing++;
+    }
+
+    double maxShift = 0;
+    for (const ChainRange& chain : chains) {
+        const std::vector<DocObject>& objects = doc.layers[chain.layer].objects;
+        const std::vector<DocObject>& simplifiedObjects = simplified.layers[chain.layer].objects;
+        maxShift = std::max(maxShift, ChainShift(&objects[chain.begin], chain.end - chain.begin,
+            &simplifiedObjects[chain.simplifiedBegin], chain.simplifiedEnd - chain.simplifiedBegin));
+    }
+
+    RenderOptions smooth;
+    smooth.supersample = supersample;
+    int channelDelta = MaxChannelDelta(RenderDocument(doc, smooth), RenderDocument(simplified, smooth));
+
+    std::printf("strokes %zu, points %zu -> %zu (%.1f%% kept, x%.2f fewer)\n",
+        chains.size(), pointsBefore, pointsAfter, 100.0 * pointsAfter / pointsBefore,
+        static_cast<double>(pointsBefore) / pointsAfter);
+    std::printf("objects %zu -> %zu\n", CountObjects(doc), CountObjects(simplified));
+    std::printf("replay %.1f ms -> %.1f ms (x%.2f, best of %d, 1 thread)\n",
+        originalMs, simplifiedMs, simplifiedMs > 0 ? originalMs / simplifiedMs : 0.0, repeat);
+    std::printf("pixels differing: %zu of %zu (%.3f%%)\n",
+        differing, original.pixels.size(), 100.0 * differing / original.pixels.size());
+    std::printf("max channel delta: %d (%dx%d samples, %.1f of %d coverage levels)\n",
+        channelDelta, supersample, supersample, channelDelta * supersample * supersample / 255.0,
+        supersample * supersample);
+    if (maxShift > SHIFT_SEARCH) {
+        std::printf("max edge shift: more than %d px (bound %g px)\n", SHIFT_SEARCH, maxAllowedShift);
+    }
+    else {
+        std::printf("max edge shift: %.2f px (bound %g px)\n", maxShift, maxAllowedShift);
+    }
+    if (maxShift > maxAllowedShift) {
+        std::printf("FAIL: stroke edges moved more than %g px\n", maxAllowedShift);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,376 @@
+﻿// Замер переигровки надписей через атлас глифов (GlyphAtlas.h) - без окна, GDI и шрифтов
+//
+// Вместо GetGlyphOutline покрытие глифов берётся из заранее построенной таблицы: для
+// каждого размера и символа несколько сглаженных штрихов со своим зерном. Промах атласа
+// копирует покрытие из таблицы и засчитывается как один вызов растеризатора шрифта -
+// в редакторе это GetGlyphOutline. Документ из множества коротких подписей разных
+// размеров (как на карте или схеме; --sizes - сколько разных размеров) переигрывается
+// тремя способами:
+//   atlas  - как в редакторе: LayoutText через GlyphAtlas и BlendGlyph в растр;
+//   direct - BlendGlyph прямо из таблицы, без атласа (нижняя граница стоимости);
+//   label  - покрытие всей надписи одним растром, как в .spd для консольного рендерера.
+// Первые два способа должны дать побитно одинаковый растр, иначе код возврата 1.
+//   g++ -O2 -std=c++17 TextReplayBench.cpp -o text-replay-bench
+//
+// Использование:
+//   text-replay-bench [--labels N] [--sizes N] [--seed S] [--repeat R] [--atlas N] [--atlas-height H]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#include "../SimplePaint/GlyphAtlas.h"
+#include "BenchRandom.h"
+
+const int CANVAS_WIDTH = 1920;
+const int CANVAS_HEIGHT = 1080;
+const int EDITOR_ATLAS_SIZE = 512;          // GLYPH_ATLAS_SIZE редактора
+const int EDITOR_ATLAS_MAX_HEIGHT = 8192;   // GLYPH_ATLAS_MAX_HEIGHT редактора
+const int MAX_THICKNESS = 50;       // верх ползунка толщины редактора
+
+// Символы подписей: кириллица, латиница, цифры и пробел
+const char16_t* const ALPHABET =
+    u"абвгдеёжзийклмнопрстуфхцчшщъыьэюяАБВГДЕЖЗИЙКЛМНОПРСТУФХЦЧШЩЭЮЯ"
+    u"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ";
+
+// Размер шрифта в пикселях по толщине, как TextPixelSize редактора
+int TextPixelSize(int thickness)
+{
+    return 10 + thickness * 2;
+}
+
+// Таблица покрытий: глиф символа ch размера size строится один раз
+class GlyphStore {
+public:
+    const GlyphBitmap& Get(int size, char16_t ch)
+    {
+        uint64_t key = (static_cast<uint64_t>(size) << 32) | ch;
+        auto found = glyphs.find(key);
+        if (found != glyphs.end()) return found->second;
+        return glyphs.emplace(key, Build(size, ch)).first->second;
+    }
+
+    size_t Count() const { return glyphs.size(); }
+
+    size_t CoverageBytes() const
+    {
+        size_t bytes = 0;
+        for (const auto& glyph : glyphs) bytes += glyph.second.coverage.size();
+        return bytes;
+    }
+
+private:
+    // Два-четыре штриха толщиной size / 10 в рамке глифа, 4 x 4 выборки на пиксель
+    static GlyphBitmap Build(int size, char16_t ch)
+    {
+        GlyphBitmap bitmap;
+        bitmap.advance = size * 3 / 5;
+        if (ch == u' ') return bitmap;
+
+        BenchRandom random(static_cast<uint32_t>(size) * 65537u + ch);
+        bool tall = random.Below(3) == 0;
+        bitmap.width = size / 2 + random.Below(size / 4 + 1);
+        bitmap.height = tall ? size * 3 / 4 : size / 2 + random.Below(size / 6 + 1);
+        bitmap.bearingX = size / 20;
+        bitmap.bearingY = tall ? size * 3 / 4 : bitmap.height;
+        bitmap.advance = bitmap.width + size / 8;
+
+        struct Stroke { double x0, y0, x1, y1; };
+        std::vector<Stroke> strokes(2 + random.Below(3));
+        for (Stroke& stroke : strokes) {
+            stroke = { random.Uniform(0, bitmap.width), random.Uniform(0, bitmap.height),
+                random.Uniform(0, bitmap.width), random.Uniform(0, bitmap.height) };
+        }
+        double radius = size / 20.0 + 0.5;
+
+        bitmap.coverage.assign(static_cast<size_t>(bitmap.width) * bitmap.height, 0);
+        for (int y = 0; y < bitmap.height; y++) {
+            for (int x = 0; x < bitmap.width; x++) {
+                int inside = 0;
+                for (int sy = 0; sy < 4; sy++) {
+                    for (int sx = 0; sx < 4; sx++) {
+                        double px = x + (sx + 0.5) / 4, py = y + (sy + 0.5) / 4;
+                        for (const Stroke& stroke : strokes) {
+                            double dx = stroke.x1 - stroke.x0, dy = stroke.y1 - stroke.y0;
+                            double length = dx * dx + dy * dy;
+                            double t = length > 0 ? ((px - stroke.x0) * dx + (py - stroke.y0) * dy) / length : 0;
+                            t = t < 0 ? 0 : t > 1 ? 1 : t;
+                            double ex = stroke.x0 + t * dx - px, ey = stroke.y0 + t * dy - py;
+                            if (ex * ex + ey * ey <= radius * radius) {
+                                inside++;
+                                break;
+                            }
+                        }
+                    }
+                }
+                bitmap.coverage[static_cast<size_t>(y) * bitmap.width + x] = static_cast<uint8_t>((inside * 255 + 8) / 16);
+            }
+        }
+        return bitmap;
+    }
+
+    std::unordered_map<uint64_t, GlyphBitmap> glyphs;
+};
+
+struct Label {
+    std::u16string text;
+    int x, y;
+    int size;
+    uint32_t color;           // непрозрачный PARGB
+};
+
+// Подписи по 3-12 символов размеров sizeCount разных толщин 1..50 (ползунок редактора); мелкие размеры
+// встречаются чаще крупных
+std::vector<Label> SyntheticLabels(int count, int sizeCount, uint32_t seed)
+{
+    BenchRandom random(seed);
+    size_t alphabetSize = std::char_traits<char16_t>::length(ALPHABET);
+
+    std::vector<int> thicknesses;
+    for (int t = 1; t <= MAX_THICKNESS; t++) thicknesses.push_back(t);
+    for (int i = MAX_THICKNESS - 1; i > 0; i--) std::swap(thicknesses[i], thicknesses[random.Below(i + 1)]);
+    thicknesses.resize(sizeCount);
+    std::sort(thicknesses.begin(), thicknesses.end());
+
+    std::vector<Label> labels(count);
+    for (Label& label : labels) {
+        int length = 3 + random.Below(10);
+        for (int i = 0; i < length; i++) label.text.push_back(ALPHABET[random.Below(static_cast<int>(alphabetSize))]);
+        label.size = TextPixelSize(thicknesses[random.Below(1 + random.Below(sizeCount))]);
+        label.x = random.Below(CANVAS_WIDTH) - 40;
+        label.y = random.Below(CANVAS_HEIGHT) - 20;
+        label.color = 0xFF000000 | (random.Next() & 0x00FFFFFF);
+    }
+    return labels;
+}
+
+// Раскладка по базовой линии, как LayoutText редактора: верх строки в (x, y)
+template <typename Find, typename Visit>
+void Layout(const Label& label, Find find, Visit visit)
+{
+    int penX = label.x;
+    int baseline = label.y + label.size * 3 / 4;
+    for (char16_t ch : label.text) {
+        GlyphInfo glyph;
+        find(ch, glyph);
+        visit(glyph, penX + glyph.bearingX, baseline - glyph.bearingY);
+        penX += glyph.advance;
+    }
+}
+
+// Покрытие надписи одним растром по габариту глифов (как RasterizeTextCoverage)
+struct LabelCoverage {
+    int left = 0, top = 0, width = 0, height = 0;
+    std::vector<uint8_t> coverage;
+};
+
+LabelCoverage BuildLabelCoverage(const Label& label, GlyphStore& store)
+{
+    auto find = [&](char16_t ch, GlyphInfo& info) {
+        const GlyphBitmap& glyph = store.Get(label.size, ch);
+        info = { glyph.width, glyph.height, glyph.bearingX, glyph.bearingY, glyph.advance,
+            glyph.coverage.empty() ? nullptr : glyph.coverage.data(), static_cast<size_t>(glyph.width) };
+    };
+
+    LabelCoverage result;
+    bool empty = true;
+    int right = 0, bottom = 0;
+    Layout(label, find, [&](const GlyphInfo& glyph, int left, int top) {
+        if (!glyph.coverage) return;
+        if (empty || left < result.left) result.left = left;
+        if (empty || top < result.top) result.top = top;
+        if (empty || left + glyph.width > right) right = left + glyph.width;
+        if (empty || top + glyph.height > bottom) bottom = top + glyph.height;
+        empty = false;
+    });
+    if (empty) return result;
+
+    result.width = right - result.left;
+    result.height = bottom - result.top;
+    result.coverage.assign(static_cast<size_t>(result.width) * result.height, 0);
+    Layout(label, find, [&](const GlyphInfo& glyph, int left, int top) {
+        if (!glyph.coverage) return;
+        for (int y = 0; y < glyph.height; y++) {
+            const uint8_t* source = glyph.coverage + static_cast<size_t>(y) * glyph.stride;
+            uint8_t* target = &result.coverage[static_cast<size_t>(top - result.top + y) * result.width + (left - result.left)];
+            for (int x = 0; x < glyph.width; x++) {
+                target[x] = static_cast<uint8_t>(target[x] + Div255(source[x] * (255u - target[x])));
+            }
+        }
+    });
+    return result;
+}
+
+double ElapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void PrintUsage()
+{
+    std::fprintf(stderr,
+        "usage: text-replay-bench [--labels N] [--sizes N] [--seed S] [--repeat R] [--atlas N] [--atlas-height H]\n"
+        "  --labels N  labels in the document (default 20000)\n"
+        "  --sizes N   distinct font sizes, 1..%d (default 4)\n"
+        "  --seed S    label generator seed (default 1)\n"
+        "  --repeat R  replay passes, best time is reported (default 5)\n"
+        "  --atlas N   initial atlas side in pixels (default %d, as in the editor)\n"
+        "  --atlas-height H  height the atlas may grow to (default %d, as in the editor)\n",
+        MAX_THICKNESS, EDITOR_ATLAS_SIZE, EDITOR_ATLAS_MAX_HEIGHT);
+}
+
+int main(int argc, char** argv)
+{
+    int labelCount = 20000;
+    int sizeCount = 4;
+    uint32_t seed = 1;
+    int repeat = 5;
+    int atlasSize = EDITOR_ATLAS_SIZE;
+    int atlasMaxHeight = EDITOR_ATLAS_MAX_HEIGHT;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--labels") == 0 && hasValue) {
+            labelCount = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--sizes") == 0 && hasValue) {
+            sizeCount = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--seed") == 0 && hasValue) {
+            seed = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (std::strcmp(argv[i], "--repeat") == 0 && hasValue) {
+            repeat = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--atlas") == 0 && hasValue) {
+            atlasSize = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--atlas-height") == 0 && hasValue) {
+            atlasMaxHeight = std::atoi(argv[++i]);
+        }
+        else {
+            PrintUsage();
+            return 2;
+        }
+    }
+    if (labelCount <= 0 || sizeCount < 1 || sizeCount > MAX_THICKNESS || repeat <= 0 || atlasSize < 8 || atlasSize > 8192 ||
+        atlasMaxHeight < atlasSize || atlasMaxHeight > 65536) {
+        PrintUsage();
+        return 2;
+    }
+
+    std::vector<Label> labels = SyntheticLabels(labelCount, sizeCount, seed);
+    GlyphStore store;
+    size_t glyphsPerPass = 0;
+    for (const Label& label : labels) {
+        glyphsPerPass += label.text.size();
+        for (char16_t ch : label.text) store.Get(label.size, ch);
+    }
+    std::printf("synthetic: %d labels, seed %u, %zu glyphs per pass, %zu distinct glyphs (%zu KB of coverage)\n",
+        labelCount, seed, glyphsPerPass, store.Count(), store.CoverageBytes() / 1024);
+
+    std::vector<int> sizes;
+    for (const Label& label : labels) sizes.push_back(label.size);
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+    std::printf("font sizes:");
+    for (int size : sizes) std::printf(" %d", size);
+    std::printf(" px\n");
+
+    MaskRect clip = { 0, 0, CANVAS_WIDTH, CANVAS_HEIGHT };
+    size_t pixelCount = static_cast<size_t>(CANVAS_WIDTH) * CANVAS_HEIGHT;
+    std::vector<uint32_t> atlasCanvas(pixelCount), directCanvas(pixelCount), labelCanvas(pixelCount);
+
+    // atlas: как в редакторе, промах копирует покрытие из таблицы
+    GlyphAtlas atlas(atlasSize, atlasSize, atlasMaxHeight);
+    size_t rasterized = 0;
+    double atlasMs = 0, firstPassMisses = 0;
+    for (int r = 0; r < repeat; r++) {
+        std::fill(atlasCanvas.begin(), atlasCanvas.end(), 0xFFFFFFFFu);
+        size_t missesBefore = atlas.Misses();
+        auto start = std::chrono::steady_clock::now();
+        for (const Label& label : labels) {
+            auto find = [&](char16_t ch, GlyphInfo& info) {
+                atlas.Find(static_cast<uint32_t>(label.size), ch, [&](GlyphBitmap& bitmap) {
+                    bitmap = store.Get(label.size, ch);
+                    rasterized++;
+                }, info);
+            };
+            Layout(label, find, [&](const GlyphInfo& glyph, int left, int top) {
+                BlendGlyph(atlasCanvas.data(), CANVAS_WIDTH, clip, left, top, glyph, label.color, false);
+            });
+        }
+        double ms = ElapsedMs(start);
+        if (r == 0) firstPassMisses = static_cast<double>(atlas.Misses() - missesBefore);
+        if (r == 0 || ms < atlasMs) atlasMs = ms;
+    }
+    double steadyMisses = static_cast<double>(atlas.Misses() - firstPassMisses) / (repeat > 1 ? repeat - 1 : 1);
+
+    // direct: покрытие прямо из таблицы
+    double directMs = 0;
+    for (int r = 0; r < repeat; r++) {
+        std::fill(directCanvas.begin(), directCanvas.end(), 0xFFFFFFFFu);
+        auto start = std::chrono::steady_clock::now();
+        for (const Label& label : labels) {
+            auto find = [&](char16_t ch, GlyphInfo& info) {
+                const GlyphBitmap& glyph = store.Get(label.size, ch);
+                info = { glyph.width, glyph.height, glyph.bearingX, glyph.bearingY, glyph.advance,
+                    glyph.coverage.empty() ? nullptr : glyph.coverage.data(), static_cast<size_t>(glyph.width) };
+            };
+            Layout(label, find, [&](const GlyphInfo& glyph, int left, int top) {
+                BlendGlyph(directCanvas.data(), CANVAS_WIDTH, clip, left, top, glyph, label.color, false);
+            });
+        }
+        double ms = ElapsedMs(start);
+        if (r == 0 || ms < directMs) directMs = ms;
+    }
+
+    // label: покрытие надписей целиком, как в документе
+    std::vector<LabelCoverage> coverages;
+    coverages.reserve(labels.size());
+    size_t labelBytes = 0;
+    for (const Label& label : labels) {
+        coverages.push_back(BuildLabelCoverage(label, store));
+        labelBytes += coverages.back().coverage.size();
+    }
+    double labelMs = 0;
+    for (int r = 0; r < repeat; r++) {
+        std::fill(labelCanvas.begin(), labelCanvas.end(), 0xFFFFFFFFu);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < labels.size(); i++) {
+            const LabelCoverage& coverage = coverages[i];
+            GlyphInfo info = { coverage.width, coverage.height, 0, 0, 0,
+                coverage.coverage.empty() ? nullptr : coverage.coverage.data(), static_cast<size_t>(coverage.width) };
+            BlendGlyph(labelCanvas.data(), CANVAS_WIDTH, clip, coverage.left, coverage.top, info, labels[i].color, false);
+        }
+        double ms = ElapsedMs(start);
+        if (r == 0 || ms < labelMs) labelMs = ms;
+    }
+
+    size_t differing = 0;
+    for (size_t i = 0; i < pixelCount; i++) {
+        if (atlasCanvas[i] != directCanvas[i]) differing++;
+    }
+
+    std::printf("atlas %dx%d (up to %d): %zu hits, %zu misses, %zu evictions, %zu glyphs resident, %zu KB\n",
+        atlas.Width(), atlas.Height(), atlas.MaxHeight(), atlas.Hits(), atlas.Misses(), atlas.Evictions(), atlas.GlyphCount(),
+        atlas.MemoryBytes() / 1024);
+    std::printf("rasterizer calls per pass: %.0f first, %.1f after warm-up (%.2f%% of glyphs)\n",
+        firstPassMisses, steadyMisses, 100.0 * steadyMisses / glyphsPerPass);
+    std::printf("replay atlas  %.1f ms (%.1f Mglyphs/s, best of %d)\n",
+        atlasMs, glyphsPerPass / atlasMs / 1000.0, repeat);
+    std::printf("replay direct %.1f ms (%.1f Mglyphs/s, no atlas lookups)\n",
+        directMs, glyphsPerPass / directMs / 1000.0);
+    std::printf("replay label  %.1f ms (whole-label coverage, %zu KB stored)\n", labelMs, labelBytes / 1024);
+    if (differing != 0) {
+        std::printf("FAIL: atlas and direct replays differ in %zu pixels\n", differing);
+        return 1;
+    }
+    std::printf("atlas and direct replays are identical\n");
+    return 0;
+}
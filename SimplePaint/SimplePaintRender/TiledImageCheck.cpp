@@ -0,0 +1,221 @@
+﻿// Проверка кодека плиток и кэша TiledImage - без окна и без GDI
+//
+// Сжимает и распаковывает плитки разного вида (шум, заливка, полосы, редкие точки)
+// и сравнивает результат побитно; затем читает и пишет изображение через TileCache
+// с бюджетом в несколько плиток и сверяет каждый пиксель с линейной копией.
+// Генератор случайных чисел общий с замерами (BenchRandom.h), данные одинаковы на любой платформе:
+//   g++ -O2 -std=c++17 TiledImageCheck.cpp -o tiled-image-check
+//
+// Код возврата 0 - все проверки прошли, 1 - найдено расхождение.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "../SimplePaint/TiledImage.h"
+#include "BenchRandom.h"
+
+int failures = 0;
+
+void Fail(const char* what, int index)
+{
+    if (failures < 20) printf("FAIL: %s (%d)\n", what, index);
+    failures++;
+}
+
+// Сжатие, распаковка и побитное сравнение одной плитки
+void CheckTileRoundTrip(const char* name, const PixelTile& tile)
+{
+    std::vector<uint8_t> packed;
+    PackTile(tile, packed);
+
+    PixelTile unpacked;
+    for (int i = 0; i < TILE_PIXELS; i++) unpacked.pixels[i] = 0xDEADBEEF;
+    if (!UnpackTile(packed, unpacked)) {
+        Fail(name, -1);
+        return;
+    }
+
+    for (int i = 0; i < TILE_PIXELS; i++) {
+        if (unpacked.pixels[i] != tile.pixels[i]) {
+            Fail(name, i);
+            return;
+        }
+    }
+
+    printf("  %s: %zu bytes (%.1f%%)\n", name, packed.size(), 100.0 * packed.size() / sizeof(PixelTile));
+}
+
+void CheckTiles(BenchRandom& random)
+{
+    PixelTile tile;
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = random.Next();
+    CheckTileRoundTrip("noise", tile);
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = random.Next() & 0x00030303;
+    CheckTileRoundTrip("noise, 64 colors", tile);
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = 0x00FFFFFF;
+    CheckTileRoundTrip("flat", tile);
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = 0;
+    CheckTileRoundTrip("zeros", tile);
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = (i / TILE_SIZE) % 3 ? 0x00FF0000 : 0x000000FF;
+    CheckTileRoundTrip("row stripes", tile);
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = (i % TILE_SIZE) % 5 < 2 ? 0x0000FF00 : 0x00FFFFFF;
+    CheckTileRoundTrip("column stripes", tile);
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = ((i % TILE_SIZE) + (i / TILE_SIZE)) % 7 ? 0x00FFFFFF : 0;
+    CheckTileRoundTrip("diagonals", tile);
+
+    for (int i = 0; i < TILE_PIXELS; i++) tile.pixels[i] = 0x00FFFFFF;
+    for (int n = 0; n < 40; n++) tile.pixels[random.Below(TILE_PIXELS)] = random.Next() & 0x00FFFFFF;
+    CheckTileRoundTrip("sparse dots", tile);
+
+    // Повторы на больших смещениях: одна строка шума, скопированная через строку
+    for (int x = 0; x < TILE_SIZE; x++) tile.pixels[x] = random.Next();
+    for (int y = 1; y < TILE_SIZE; y++) {
+        for (int x = 0; x < TILE_SIZE; x++) {
+            tile.pixels[y * TILE_SIZE + x] = y % 2 ? random.Next() : tile.pixels[x];
+        }
+    }
+    CheckTileRoundTrip("repeated rows", tile);
+
+    // Случайная смесь серий и шума разной длины
+    for (int pass = 0; pass < 200; pass++) {
+        uint32_t value = random.Next();
+        for (int i = 0; i < TILE_PIXELS;) {
+            int run = 1 + random.Below(random.Below(4) ? 3 : 300);
+            bool noise = random.Below(2) != 0;
+            for (int k = 0; k < run && i < TILE_PIXELS; k++, i++) {
+                tile.pixels[i] = noise ? random.Next() : value;
+            }
+            if (random.Below(3) == 0) value = random.Next();
+        }
+
+        std::vector<uint8_t> packed;
+        PackTile(tile, packed);
+        PixelTile unpacked;
+        if (!UnpackTile(packed, unpacked) || memcmp(unpacked.pixels, tile.pixels, sizeof(tile.pixels)) != 0) {
+            Fail("runs and noise", pass);
+        }
+    }
+}
+
+// Изображение с кэшем на несколько плиток против линейной копии тех же пикселей
+void CheckCachedImage(BenchRandom& random)
+{
+    const int width = 7 * TILE_SIZE + 13;
+    const int height = 5 * TILE_SIZE + 29;
+    const uint32_t background = 0x00FFFFFF;
+
+    TileCache cache(3 * sizeof(PixelTile));
+    TiledImage image(width, height, background);
+    image.AttachCache(&cache);
+    std::vector<uint32_t> reference(static_cast<size_t>(width) * height, background);
+
+    // Прямоугольники разного вида: заливка, полосы, шум, редкие точки
+    std::vector<uint32_t> block;
+    for (int n = 0; n < 300; n++) {
+        int w = 1 + random.Below(150);
+        int h = 1 + random.Below(150);
+        int x = random.Below(width + 40) - 20;
+        int y = random.Below(height + 40) - 20;
+        int kind = random.Below(4);
+        uint32_t color = random.Next() & 0x00FFFFFF;
+
+        block.assign(static_cast<size_t>(w) * h, background);
+        for (int row = 0; row < h; row++) {
+            for (int col = 0; col < w; col++) {
+                uint32_t& value = block[static_cast<size_t>(row) * w + col];
+                if (kind == 0) value = color;
+                else if (kind == 1) value = row % 4 < 2 ? color : 0;
+                else if (kind == 2) value = random.Next() & 0x00FFFFFF;
+                else if (random.Below(50) == 0) value = color;
+            }
+        }
+
+        image.WriteRect(x, y, w, h, block.data(), w);
+        for (int row = 0; row < h; row++) {
+            for (int col = 0; col < w; col++) {
+                int px = x + col, py = y + row;
+                if (px < 0 || py < 0 || px >= width || py >= height) continue;
+                reference[static_cast<size_t>(py) * width + px] = block[static_cast<size_t>(row) * w + col];
+            }
+        }
+
+        // Отдельные пиксели между прямоугольниками: чтение и запись сжатых плиток вразнобой
+        for (int k = 0; k < 20; k++) {
+            int px = random.Below(width), py = random.Below(height);
+            if (image.Pixel(px, py) != reference[static_cast<size_t>(py) * width + px]) Fail("Pixel", n);
+            uint32_t value = random.Next() & 0x00FFFFFF;
+            image.SetPixel(px, py, value);
+            reference[static_cast<size_t>(py) * width + px] = value;
+        }
+
+        if (cache.ResidentBytes() > cache.Budget() + sizeof(PixelTile)) Fail("cache budget", n);
+    }
+
+    // Полное чтение и чтение окнами, пересекающими границы плиток
+    std::vector<uint32_t> readBack(static_cast<size_t>(width) * height, 0);
+    image.ReadRect(0, 0, width, height, readBack.data(), width);
+    for (size_t i = 0; i < readBack.size(); i++) {
+        if (readBack[i] != reference[i]) {
+            Fail("ReadRect full", static_cast<int>(i));
+            break;
+        }
+    }
+
+    for (int n = 0; n < 100; n++) {
+        int w = 1 + random.Below(100);
+        int h = 1 + random.Below(100);
+        int x = random.Below(width - w + 1);
+        int y = random.Below(height - h + 1);
+        std::vector<uint32_t> window(static_cast<size_t>(w) * h, 0);
+        image.ReadRect(x, y, w, h, window.data(), w);
+        for (int row = 0; row < h; row++) {
+            for (int col = 0; col < w; col++) {
+                if (window[static_cast<size_t>(row) * w + col] != reference[static_cast<size_t>(y + row) * width + x + col]) {
+                    Fail("ReadRect window", n);
+                    row = h;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Копия для другого потока и запись в исходник после неё
+    TiledImage detached = image.DetachedCopy();
+    image.SetPixel(0, 0, 0x00123456);
+    if (detached.Pixel(0, 0) != reference[0]) Fail("DetachedCopy", 0);
+    reference[0] = 0x00123456;
+    if (image.Pixel(0, 0) != reference[0]) Fail("write after DetachedCopy", 0);
+
+    if (cache.Compressions() == 0 || cache.Decompressions() == 0) Fail("cache never compressed", 0);
+
+    printf("  cache: %zu resident tiles, %zu packed (%zu bytes), %zu compressions, %zu decompressions\n",
+        cache.ResidentTiles(), cache.CompressedTiles(), cache.CompressedBytes(),
+        cache.Compressions(), cache.Decompressions());
+}
+
+int main()
+{
+    BenchRandom random(20240607);
+
+    printf("tiles:\n");
+    CheckTiles(random);
+
+    printf("image through TileCache:\n");
+    CheckCachedImage(random);
+
+    if (failures) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}